@@ -0,0 +1,213 @@
+/*
+ * Barcode lookup benchmark on the mapper's own index.
+ *
+ * The index (BarcodeIndex in the --indexType layout and the bloom filter) is built by BarcodePositionMap,
+ * either from a real mask (--mask) or from a synthetic .bin list. Queries go through
+ * BarcodeProcessor::locate like read1 barcodes do in a mapping run, one processor per thread.
+ *
+ * workloads:
+ *   exact  barcodes as they are in the mask
+ *   n      one base replaced by N
+ *   mis1   one base substituted
+ *   mis2   two bases substituted
+ * --hitRate of the queries are derived from barcodes in the mask, the rest from random barcodes.
+ * The processors of a workload allow the mismatches it needs (exact 0, n and mis1 1, mis2 2),
+ * so the misses of exact queries are not timed through the mismatch search.
+ * --mismatch gives all processors the same max mismatch, as in a mapping run.
+ *
+ * make bench && ./bench/lookupBench --barcodes 50000000 --thread 16
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <random>
+#include <mutex>
+#include <omp.h>
+#include <sys/time.h>
+#include "cmdline.h"
+#include "util.h"
+#include "options.h"
+#include "read.h"
+#include "barcodePositionMap.h"
+#include "barcodeProcessor.h"
+
+mutex logmtx;
+
+static double benchTime() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1000000;
+}
+
+static const char *WORKLOADS[] = {"exact", "n", "mis1", "mis2"};
+//max mismatch of the processors of each workload
+static const int WORKLOAD_MISMATCH[] = {0, 1, 1, 2};
+static const int WORKLOAD_NUM = 4;
+
+//random barcodes at random positions of a chip, written as a .bin mask
+static string writeSyntheticMask(long barcodeNum, int barcodeLen, uint64 seed) {
+    char path[] = "/tmp/lookupBench_XXXXXX.bin";
+    int fd = mkstemps(path, 4);
+    if (fd < 0) {
+        error_exit("can not create a temporary mask file");
+    }
+    close(fd);
+    ofstream writer(path, ios::out | ios::binary);
+    mt19937_64 gen(seed);
+    uint64 keyMask = barcodeLen >= 32 ? ~0ull : (1ull << (barcodeLen * 2)) - 1;
+    uint64 polyTInt = getPolyTint(barcodeLen);
+    vector<bpmap_key_value> buf;
+    buf.reserve(1 << 16);
+    for (long i = 0; i < barcodeNum; i++) {
+        bpmap_key_value entry;
+        do {
+            entry.key = gen() & keyMask;
+        } while (entry.key == polyTInt);
+        entry.value.x = gen() % 30000;
+        entry.value.y = gen() % 30000;
+        buf.push_back(entry);
+        if (buf.size() == buf.capacity() || i == barcodeNum - 1) {
+            writer.write((char *) buf.data(), buf.size() * sizeof(bpmap_key_value));
+            buf.clear();
+        }
+    }
+    writer.close();
+    return path;
+}
+
+static void buildQueries(vector<Read *> &queries, int workload, long queryNum, double hitRate,
+                         BarcodeIndex *index, uint64 indexSize, int barcodeLen, uint64 seed) {
+    mt19937_64 gen(seed);
+    uniform_real_distribution<double> coin(0.0, 1.0);
+    uint64 keyMask = barcodeLen >= 32 ? ~0ull : (1ull << (barcodeLen * 2)) - 1;
+    string quality(barcodeLen, 'F');
+    queries.reserve(queryNum);
+    for (long i = 0; i < queryNum; i++) {
+        uint64 key = coin(gen) < hitRate ? index->record(gen() % indexSize).key : gen() & keyMask;
+        string seq = seqDecode(key, barcodeLen);
+        if (workload == 1) {
+            seq[gen() % barcodeLen] = 'N';
+        } else if (workload >= 2) {
+            int first = gen() % barcodeLen;
+            for (int e = 0; e < workload - 1; e++) {
+                int pos = e == 0 ? first : (first + 1 + gen() % (barcodeLen - 1)) % barcodeLen;
+                char base = seq[pos];
+                while (seq[pos] == base) seq[pos] = ATCG_BASES[gen() & 3];
+            }
+        }
+        queries.push_back(new Read("q", seq, "+", quality));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    cmdline::parser cmd;
+    cmd.add<string>("mask", 'i', "mask file (.h5 / .bin / text) to build the index from, random barcodes if not given.",
+                    false, "");
+    cmd.add<long>("barcodes", 'n', "number of random barcodes when no mask is given.", false, 10000000);
+    cmd.add<int>("barcodeLen", 'l', "barcode length.", false, 25);
+    cmd.add<int>("thread", 'w', "number of lookup threads.", false, 4);
+    cmd.add<long>("queries", 'q', "queries per thread and workload.", false, 2000000);
+    cmd.add<double>("hitRate", 'r', "fraction of queries derived from barcodes in the mask.", false, 0.8);
+    cmd.add<int>("mismatch", 'm',
+                 "max mismatch of the processors of every workload, as --mismatch of the mapper. -1 gives each workload the mismatch it needs.",
+                 false, -1);
+    cmd.add<string>("workloads", 0, "comma separated workloads out of exact,n,mis1,mis2.", false, "exact,n,mis1,mis2");
+    cmd.add<unsigned long>("seed", 0, "random seed.", false, 1);
+    cmd.add<string>("indexType", 0, "index layout, compact, mphf or list, as --indexType of the mapper.", false, "compact");
+    cmd.parse_check(argc, argv);
+
+    Options opt;
+    opt.barcodeLen = cmd.get<int>("barcodeLen");
+    opt.barcodeStart = 0;
+    opt.barcodeSegment = 1;
+    opt.rc = 0;
+    opt.thread = cmd.get<int>("thread");
+    opt.myRank = 0;
+    opt.numPro = 1;
+    opt.transBarcodeToPos.barcodeRead = 1;
+    opt.transBarcodeToPos.umiStart = -1;
+    opt.transBarcodeToPos.umiLen = 0;
+    int mismatch = cmd.get<int>("mismatch");
+    //the index does not depend on the mismatch, it is set per workload below
+    opt.transBarcodeToPos.mismatch = max(0, mismatch);
+    opt.indexType = BarcodeIndex::parseType(cmd.get<string>("indexType"));
+    int threadNum = max(1, opt.thread);
+    long queryNum = cmd.get<long>("queries");
+    double hitRate = cmd.get<double>("hitRate");
+    uint64 seed = cmd.get<unsigned long>("seed");
+    vector<string> workloads;
+    split(cmd.get<string>("workloads"), workloads, ",");
+
+    string maskFile = cmd.get<string>("mask");
+    bool synthetic = maskFile.empty();
+    if (synthetic) {
+        maskFile = writeSyntheticMask(cmd.get<long>("barcodes"), opt.barcodeLen, seed);
+    }
+    opt.in = maskFile;
+    opt.transBarcodeToPos.in = maskFile;
+    double t0 = benchTime();
+    BarcodePositionMap *bpmap = new BarcodePositionMap(&opt);
+    printf("index: %u barcodes, built in %.2f s\n", bpmap->indexSize, benchTime() - t0);
+    if (synthetic) {
+        unlink(maskFile.c_str());
+    }
+    if (bpmap->indexSize == 0) {
+        error_exit("no barcode in the index");
+    }
+    printf("threads %d, queries %ld per thread, hit rate %.2f\n", threadNum, queryNum, hitRate);
+
+    for (int w = 0; w < workloads.size(); w++) {
+        int workload = -1;
+        for (int i = 0; i < WORKLOAD_NUM; i++) {
+            if (workloads[w] == WORKLOADS[i]) workload = i;
+        }
+        if (workload < 0) {
+            error_exit("unknown workload: " + workloads[w]);
+        }
+        Options workloadOpt = opt;
+        workloadOpt.transBarcodeToPos.mismatch = mismatch < 0 ? WORKLOAD_MISMATCH[workload] : mismatch;
+        if (workloadOpt.transBarcodeToPos.mismatch < WORKLOAD_MISMATCH[workload]) {
+            printf("%-6s skipped, needs a larger --mismatch\n", WORKLOADS[workload]);
+            continue;
+        }
+        vector<vector<Read *>> queries(threadNum);
+        vector<BarcodeProcessor *> processors(threadNum);
+        vector<long> found(threadNum, 0);
+        vector<double> cost(threadNum, 0);
+#pragma omp parallel for num_threads(threadNum)
+        for (int t = 0; t < threadNum; t++) {
+            buildQueries(queries[t], workload, queryNum, hitRate, bpmap->getIndex(), bpmap->indexSize,
+                         opt.barcodeLen, seed * 1000003 + w * 1009 + t);
+            processors[t] = new BarcodeProcessor(&workloadOpt, bpmap->getIndex(), bpmap->getBloomFilter());
+        }
+        double wall = benchTime();
+#pragma omp parallel num_threads(threadNum)
+        {
+            int t = omp_get_thread_num();
+            Position1 position;
+            bool mapped;
+            pair<string, string> umi;
+            bool hasUmi;
+            double start = benchTime();
+            for (long i = 0; i < queryNum; i++) {
+                processors[t]->locate(queries[t][i], NULL, position, mapped, umi, hasUmi);
+                if (mapped) found[t]++;
+            }
+            cost[t] = benchTime() - start;
+        }
+        wall = benchTime() - wall;
+        long foundSum = 0;
+        double threadRate = 0;
+        for (int t = 0; t < threadNum; t++) {
+            foundSum += found[t];
+            threadRate += queryNum / cost[t];
+            for (long i = 0; i < queryNum; i++) delete queries[t][i];
+            delete processors[t];
+        }
+        printf("%-6s mismatch %d  found %6.2f%%  total %8.3f Mq/s  per thread %8.3f Mq/s\n", WORKLOADS[workload],
+               workloadOpt.transBarcodeToPos.mismatch, 100.0 * foundSum / (queryNum * threadNum),
+               queryNum * threadNum / wall / 1e6, threadRate / threadNum / 1e6);
+    }
+    delete bpmap;
+    return 0;
+}
@@ -0,0 +1,74 @@
+#!/bin/bash
+# End-to-end mapping benchmark on synthetic data, runs action 1 for every rank and thread count
+# and appends reads/sec and peak RSS to results.tsv in the work dir.
+#
+# usage: bench/run_bench.sh [workDir]
+# environment:
+#   RANKS="1 2"        mpi process counts
+#   THREADS="4 8 16"   --thread values
+#   READS=4000000 ROWS=2000 COLS=2000 GZ=1 MISMATCH=1
+#   MAP_RATE=0.8 ERROR_RATE=0.01 N_RATE=0.01   synthData --mapRate, --errorRate and --nRate
+#   MAP_ARGS=""        extra mapper options, e.g. "--usePugz --pugzThread 2"
+#   BIN=./ST_BarcodeMap-0.0.1 SYNTH=./bench/synthData
+
+set -e
+WORK=${1:-bench_work}
+BIN=${BIN:-./ST_BarcodeMap-0.0.1}
+SYNTH=${SYNTH:-./bench/synthData}
+RANKS=${RANKS:-"1"}
+THREADS=${THREADS:-"4 8"}
+READS=${READS:-4000000}
+ROWS=${ROWS:-2000}
+COLS=${COLS:-2000}
+GZ=${GZ:-1}
+MISMATCH=${MISMATCH:-1}
+MAP_RATE=${MAP_RATE:-0.8}
+ERROR_RATE=${ERROR_RATE:-0.01}
+N_RATE=${N_RATE:-0.01}
+MAP_ARGS=${MAP_ARGS:-""}
+
+if [ ! -x "$BIN" ] || [ ! -x "$SYNTH" ]; then
+    echo "build the mapper and the bench tools first: make && make bench" >&2
+    exit 1
+fi
+if [ ! -x /usr/bin/time ]; then
+    echo "/usr/bin/time is needed to measure peak RSS" >&2
+    exit 1
+fi
+
+mkdir -p "$WORK"
+SUFFIX=""
+if [ "$GZ" = "1" ]; then
+    SUFFIX=".gz"
+fi
+MASK=$WORK/mask_${ROWS}x${COLS}.h5
+READ_TAG=${READS}_${MAP_RATE}_${ERROR_RATE}_${N_RATE}
+IN1=$WORK/r1_${READ_TAG}.fq$SUFFIX
+IN2=$WORK/r2_${READ_TAG}.fq$SUFFIX
+#the data only depends on the size and rate options, reuse it between runs
+if [ ! -f "$MASK" ] || [ ! -f "$IN1" ] || [ ! -f "$IN2" ]; then
+    "$SYNTH" --mask "$MASK" --out1 "$IN1" --out2 "$IN2" --rows "$ROWS" --cols "$COLS" --reads "$READS" \
+        --mapRate "$MAP_RATE" --errorRate "$ERROR_RATE" --nRate "$N_RATE" --thread "$(nproc)"
+fi
+
+RESULT=$WORK/results.tsv
+if [ ! -f "$RESULT" ]; then
+    echo -e "date\tranks\tthreads\treads\tseconds\treads_per_sec\tpeak_rss_mb\targs" > "$RESULT"
+fi
+for ranks in $RANKS; do
+    for threads in $THREADS; do
+        OUT=$WORK/out_${ranks}_${threads}.fq
+        start=$(date +%s.%N)
+        #peak RSS is the largest single process, mpirun reports the maximum of its children
+        /usr/bin/time -f "%M" -o "$WORK/rss.txt" mpirun -n "$ranks" "$BIN" --action 1 --in "$MASK" \
+            --in1 "$IN1" --in2 "$IN2" --out "$OUT" --thread "$threads" --mismatch "$MISMATCH" $MAP_ARGS \
+            > "$WORK/log_${ranks}_${threads}.txt" 2>&1
+        end=$(date +%s.%N)
+        seconds=$(echo "$end - $start" | bc -l)
+        rss=$(tail -n 1 "$WORK/rss.txt")
+        rate=$(echo "$READS / $seconds" | bc -l)
+        printf "%s\t%d\t%d\t%d\t%.2f\t%.0f\t%.1f\t%s\n" "$(date +%F_%T)" "$ranks" "$threads" "$READS" "$seconds" \
+            "$rate" "$(echo "$rss / 1024" | bc -l)" "$MAP_ARGS" | tee -a "$RESULT"
+        rm -f "$OUT"*
+    done
+done
@@ -0,0 +1,188 @@
+/*
+ * Synthetic chip mask and paired fastq for end-to-end benchmarks.
+ *
+ * The mask is a --rows x --cols chip with one random barcode per DNB, written by ChipMaskHDF5 in the
+ * bpMatrix_1 / dnbInfo layout the mapper loads. Read1 is barcode + umi + polyT like stereo-seq read1,
+ * read2 is random cDNA. Reads are generated in fixed blocks with per block seeds, so the output does not
+ * depend on --thread.
+ *
+ *   --mapRate    fraction of reads whose barcode comes from the mask
+ *   --errorRate  per base substitution rate inside the barcode
+ *   --nRate      fraction of reads with one N in the barcode
+ *
+ * make bench && ./bench/synthData --mask chip.h5 --out1 r1.fq.gz --out2 r2.fq.gz --reads 10000000
+ */
+#include <stdio.h>
+#include <random>
+#include <mutex>
+#include <zlib.h>
+#include <omp.h>
+#include "cmdline.h"
+#include "util.h"
+#include "chipMaskHDF5.h"
+
+mutex logmtx;
+
+#define SYNTH_BLOCK_READS (1 << 16)
+
+class FastqOut {
+public:
+    FastqOut(string path, int level) {
+        mGz = NULL;
+        mFile = NULL;
+        if (ends_with(path, ".gz")) {
+            mGz = gzopen(path.c_str(), ("wb" + to_string(level)).c_str());
+            if (mGz) gzbuffer(mGz, 1 << 20);
+        } else {
+            mFile = fopen(path.c_str(), "wb");
+        }
+        if (mGz == NULL && mFile == NULL) {
+            error_exit("can not write " + path);
+        }
+    }
+
+    ~FastqOut() {
+        if (mGz) gzclose(mGz);
+        if (mFile) fclose(mFile);
+    }
+
+    void write(string &data) {
+        if (mGz) {
+            gzwrite(mGz, data.data(), data.size());
+        } else {
+            fwrite(data.data(), 1, data.size(), mFile);
+        }
+    }
+
+private:
+    gzFile mGz;
+    FILE *mFile;
+};
+
+static void randomBases(mt19937_64 &gen, string &out, int len) {
+    for (int i = 0; i < len; i++) out.push_back(ATCG_BASES[gen() & 3]);
+}
+
+int main(int argc, char *argv[]) {
+    cmdline::parser cmd;
+    cmd.add<string>("mask", 'i', "h5 mask to write.", true, "");
+    cmd.add<string>("out1", 'I', "read1 fastq to write, gzip if it ends with .gz.", true, "");
+    cmd.add<string>("out2", 0, "read2 fastq to write, gzip if it ends with .gz.", true, "");
+    cmd.add<uint32_t>("rows", 0, "chip rows.", false, 2000);
+    cmd.add<uint32_t>("cols", 0, "chip cols.", false, 2000);
+    cmd.add<uint32_t>("rowStart", 0, "row offset of the chip.", false, 100);
+    cmd.add<uint32_t>("colStart", 0, "col offset of the chip.", false, 100);
+    cmd.add<int>("barcodeLen", 'l', "barcode length.", false, 25);
+    cmd.add<int>("umiLen", 0, "umi length, the umi follows the barcode in read1.", false, 10);
+    cmd.add<int>("read1Len", 0, "read1 length.", false, 50);
+    cmd.add<int>("read2Len", 0, "read2 length.", false, 100);
+    cmd.add<long>("reads", 'n', "number of read pairs.", false, 4000000);
+    cmd.add<double>("mapRate", 0, "fraction of reads whose barcode comes from the mask.", false, 0.8);
+    cmd.add<double>("errorRate", 0, "substitution rate per barcode base.", false, 0.01);
+    cmd.add<double>("nRate", 0, "fraction of reads with one N in the barcode.", false, 0.01);
+    cmd.add<int>("compression", 'z', "gzip level of the fastq files.", false, 1);
+    cmd.add<int>("thread", 'w', "number of threads.", false, 4);
+    cmd.add<unsigned long>("seed", 0, "random seed.", false, 1);
+    cmd.parse_check(argc, argv);
+
+    uint32 rows = cmd.get<uint32_t>("rows");
+    uint32 cols = cmd.get<uint32_t>("cols");
+    int barcodeLen = cmd.get<int>("barcodeLen");
+    int umiLen = cmd.get<int>("umiLen");
+    int read1Len = max(cmd.get<int>("read1Len"), barcodeLen + umiLen);
+    int read2Len = cmd.get<int>("read2Len");
+    long readNum = cmd.get<long>("reads");
+    double mapRate = cmd.get<double>("mapRate");
+    double errorRate = cmd.get<double>("errorRate");
+    double nRate = cmd.get<double>("nRate");
+    int threadNum = max(1, cmd.get<int>("thread"));
+    uint64 seed = cmd.get<unsigned long>("seed");
+    if (barcodeLen < 1 || barcodeLen > 32) {
+        error_exit("barcodeLen must be 1 ~ 32");
+    }
+
+    //mask, one barcode per DNB
+    uint64 keyMask = barcodeLen == 32 ? ~0ull : (1ull << (barcodeLen * 2)) - 1;
+    uint64 polyTInt = getPolyTint(barcodeLen);
+    slideRange sliderange;
+    sliderange.rowStart = cmd.get<uint32_t>("rowStart");
+    sliderange.colStart = cmd.get<uint32_t>("colStart");
+    sliderange.rowEnd = sliderange.rowStart + rows - 1;
+    sliderange.colEnd = sliderange.colStart + cols - 1;
+    vector<uint64> keys((uint64) rows * cols);
+    vector<bpmap_key_value> bpList(keys.size());
+    mt19937_64 maskGen(seed);
+    for (uint64 i = 0; i < keys.size(); i++) {
+        do {
+            keys[i] = maskGen() & keyMask;
+        } while (keys[i] == 0 || keys[i] == polyTInt);
+        bpList[i].key = keys[i];
+        bpList[i].value.x = sliderange.colStart + i % cols;
+        bpList[i].value.y = sliderange.rowStart + i / cols;
+    }
+    ChipMaskHDF5 chipMaskH5(cmd.get<string>("mask"));
+    chipMaskH5.creatFile();
+    if (chipMaskH5.writeDataSet("SYNTHETIC", sliderange, bpList, barcodeLen, 1, 500, 6, threadNum) < 0) {
+        error_exit("can not write mask " + cmd.get<string>("mask"));
+    }
+    vector<bpmap_key_value>().swap(bpList);
+    printf("mask: %u x %u DNBs, barcode length %d\n", rows, cols, barcodeLen);
+
+    //fastq, blocks are generated in parallel and written in order
+    FastqOut out1(cmd.get<string>("out1"), cmd.get<int>("compression"));
+    FastqOut out2(cmd.get<string>("out2"), cmd.get<int>("compression"));
+    long blockNum = (readNum + SYNTH_BLOCK_READS - 1) / SYNTH_BLOCK_READS;
+    vector<string> text1(threadNum), text2(threadNum);
+    string polyT(read1Len, 'T');
+    string quality1(read1Len, 'F'), quality2(read2Len, 'F');
+    long fromMask = 0;
+    for (long batch = 0; batch < blockNum; batch += threadNum) {
+        int batchSize = min((long) threadNum, blockNum - batch);
+#pragma omp parallel for num_threads(threadNum) reduction(+:fromMask)
+        for (int t = 0; t < batchSize; t++) {
+            long block = batch + t;
+            mt19937_64 gen(seed * 0x9e3779b97f4a7c15ull + block);
+            uniform_real_distribution<double> coin(0.0, 1.0);
+            string &r1 = text1[t];
+            string &r2 = text2[t];
+            r1.clear();
+            r2.clear();
+            long first = block * SYNTH_BLOCK_READS;
+            long last = min(readNum, first + SYNTH_BLOCK_READS);
+            string barcode;
+            for (long i = first; i < last; i++) {
+                uint64 key;
+                if (coin(gen) < mapRate) {
+                    key = keys[gen() % keys.size()];
+                    fromMask++;
+                } else {
+                    key = gen() & keyMask;
+                }
+                barcode = seqDecode(key, barcodeLen);
+                for (int b = 0; b < barcodeLen; b++) {
+                    if (errorRate > 0 && coin(gen) < errorRate) {
+                        char base = barcode[b];
+                        while (barcode[b] == base) barcode[b] = ATCG_BASES[gen() & 3];
+                    }
+                }
+                if (nRate > 0 && coin(gen) < nRate) {
+                    barcode[gen() % barcodeLen] = 'N';
+                }
+                string name = "@SYN:" + to_string(i);
+                r1 += name + "/1\n" + barcode;
+                randomBases(gen, r1, umiLen);
+                r1.append(polyT, 0, read1Len - barcodeLen - umiLen);
+                r1 += "\n+\n" + quality1 + "\n";
+                r2 += name + "/2\n";
+                randomBases(gen, r2, read2Len);
+                r2 += "\n+\n" + quality2 + "\n";
+            }
+        }
+        for (int t = 0; t < batchSize; t++) {
+            out1.write(text1[t]);
+            out2.write(text2[t]);
+        }
+    }
+    printf("fastq: %ld read pairs, %ld with a mask barcode\n", readNum, fromMask);
+    return 0;
+}
@@ -2,6 +2,8 @@
 #define ASSERT_HPP
 
 #include <cstdio>
+#include <stdexcept>
+#include <string>
 
 #include "common.hpp"
 
@@ -9,15 +11,17 @@
 #    define assert(expr) (likely((expr)) ? static_cast<void>(0) : __builtin_unreachable())
 #else
 #    define assert(expr)                                                                                               \
-        (likely((expr)) ? static_cast<void>(0) : __assert_fail(#expr, __FILE__, __LINE__, __PRETTY_FUNCTION__))
+        (likely((expr)) ? static_cast<void>(0) : pugz_assert_fail(#expr, __FILE__, __LINE__, __PRETTY_FUNCTION__))
 #endif
 
+// Throws instead of aborting: the decoder threads hand the exception to the caller, so a broken
+// input fails the mapping server job that reads it instead of the whole server
 [[noreturn]] inline __attribute__((noinline)) void
-__assert_fail(const char* assertion, const char* file, unsigned int line, const char* function) noexcept
+pugz_assert_fail(const char* assertion, const char* file, unsigned int line, const char* function)
 {
     std::fprintf(stderr, "%s:%u: Assertion '%s' failed in '%s'.\n", file, line, assertion, function);
     std::fflush(stderr);
-    std::abort();
+    throw std::logic_error(std::string("pugz can not decode the input, assertion failed: ") + assertion);
 }
 
 /// Allows to bias branch weight based on template parameter
@@ -53,6 +53,7 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <chrono>
 
 #include "common/exceptions.hpp"
 #include "memory.hpp"
@@ -912,11 +913,14 @@ public:
     DeflateThread(const InputStream &input_stream, ConsumerInterface &consumer)
             : DeflateParser(input_stream), _consumer(consumer) {}
 
+    /// Once the flag is set the waits on other threads give up, a failing thread of the pool sets it
+    void set_cancel_flag(const std::atomic<bool> *cancelled) { _cancelled = cancelled; }
+
     // Return the context and the position of the next block in the stream
     std::pair<locked_span<uint8_t>, size_t> get_context() {
         auto lock = std::unique_lock<std::mutex>(_mut);
-        while (_state == state_t::RUNNING)
-            _cond.wait(lock);
+        while (_state == state_t::RUNNING && !cancelled())
+            wait_on(lock);
 
         if (_state == state_t::BORROWED_CONTEXT) {
             span<uint8_t> context;
@@ -927,7 +931,7 @@ public:
             PRINT_DEBUG("%p give context for block %lu\n", (void *) this, _stoped_at);
             return {locked_span<uint8_t>{context, std::move(lock)}, _stoped_at};
         } else {
-            assert(_state == state_t::FAIL);
+            assert(_state == state_t::FAIL || cancelled());
             return {locked_span<uint8_t>{}, unset_stop_pos};
         }
     }
@@ -974,8 +978,8 @@ protected:
     void wait_for_context_borrow() {
         auto lock = std::unique_lock<std::mutex>(_mut);
         bool was_borrowed = _state == state_t::BORROWED_CONTEXT;
-        while (_state == state_t::BORROWED_CONTEXT)
-            _cond.wait(lock);
+        while (_state == state_t::BORROWED_CONTEXT && !cancelled())
+            wait_on(lock);
 
         if (was_borrowed) PRINT_DEBUG("%p get context borrow back\n", (void *) this);
     }
@@ -1001,13 +1005,18 @@ protected:
     void fail() {
         PRINT_DEBUG("%p failed\n", (void *) this);
         auto lock = std::unique_lock<std::mutex>(_mut);
-        while (_state == state_t::BORROWED_CONTEXT)
-            _cond.wait(lock);
+        while (_state == state_t::BORROWED_CONTEXT && !cancelled())
+            wait_on(lock);
 
         _state = state_t::FAIL;
         _cond.notify_all();
     }
 
+    bool cancelled() const { return _cancelled != nullptr && _cancelled->load(std::memory_order_acquire); }
+
+    // The flag is not signalled through _cond, so the waits wake up now and then to look at it
+    void wait_on(std::unique_lock<std::mutex> &lock) { _cond.wait_for(lock, std::chrono::milliseconds(10)); }
+
     template<typename T>
     void throw_gzip_error(T msg) {
         fail();
@@ -1061,6 +1070,7 @@ private:
         RUNNING, BORROWED_CONTEXT, FAIL
     };
     state_t _state = state_t::RUNNING;
+    const std::atomic<bool> *_cancelled = nullptr;
 };
 
 constexpr size_t DeflateThread::unset_stop_pos;
@@ -1254,10 +1264,17 @@ class ConsumerSync {
 public:
     using lock_t = std::unique_lock<std::mutex>;
 
+    /// Once the flag is set a chunk waiting for its turn gives up
+    void set_cancel_flag(const std::atomic<bool> *cancelled) { _cancelled = cancelled; }
+
     void wait(ConsumerInterface &consumer) {
         lock_t lock{_mut};
-        while (_section_idx != consumer.section_idx() || _chunk_idx != consumer.chunk_idx())
-            _cond.wait(lock);
+        while (_section_idx != consumer.section_idx() || _chunk_idx != consumer.chunk_idx()) {
+            // The chunks before this one may have failed and will never notify
+            if (_cancelled != nullptr && _cancelled->load(std::memory_order_acquire))
+                throw gzip_error("decompression was cancelled");
+            _cond.wait_for(lock, std::chrono::milliseconds(10));
+        }
         lock.release();
     }
 
@@ -1278,6 +1295,7 @@ private:
 
     unsigned _section_idx = 0;
     unsigned _chunk_idx = 0;
+    const std::atomic<bool> *_cancelled = nullptr;
 };
 
 template<typename Consumer>
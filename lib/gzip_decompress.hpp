@@ -36,6 +36,7 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <functional>
 
 #include "deflate_decompress.hpp" //FIXME
 
@@ -63,6 +64,25 @@ libdeflate_gzip_decompress(const byte* in, size_t in_nbytes, unsigned nthreads,
     std::condition_variable ready;
     std::mutex              ready_mtx;
     std::exception_ptr      exception;
+    // Set by the first failing thread, the others stop waiting for its context or its turn to output
+    std::atomic<bool>       cancelled = {false};
+    if (sync != nullptr) sync->set_cancel_flag(&cancelled);
+
+    // A thread keeps its DeflateThread until all threads are done: after a failure the others can
+    // still be looking at its context, normally the context hand-over keeps it alive
+    size_t nfinished = 0;
+    struct FinishBarrier
+    {
+        std::function<void()> wait;
+        ~FinishBarrier() { wait(); }
+    };
+    auto wait_all_finished = [&]() {
+        std::unique_lock<std::mutex> lock{ready_mtx};
+        nfinished++;
+        ready.notify_all();
+        while (nfinished != nthreads)
+            ready.wait(lock);
+    };
 
     threads.reserve(nthreads);
 
@@ -96,6 +116,8 @@ libdeflate_gzip_decompress(const byte* in, size_t in_nbytes, unsigned nthreads,
                 ConsumerWrapper<Consumer> consumer_wrapper{consumer, sync};
                 consumer_wrapper.set_chunk_idx(0, nthreads == 1);
                 DeflateThread deflate_thread(in_stream, consumer_wrapper);
+                deflate_thread.set_cancel_flag(&cancelled);
+                FinishBarrier finish_barrier{wait_all_finished};
                 PRINT_DEBUG("chunk 0 is %p\n", (void*)&deflate_thread);
 
                 {
@@ -104,8 +126,10 @@ libdeflate_gzip_decompress(const byte* in, size_t in_nbytes, unsigned nthreads,
                     nready++;
                     ready.notify_all();
 
-                    while (nready != nthreads)
+                    // A chunk failing early resets nready, the others must not wait for it
+                    while (nready != nthreads && !cancelled)
                         ready.wait(lock);
+                    if (cancelled) return;
                 }
                 PRINT_DEBUG("chunk 0 is pre ok\n");
 
@@ -131,16 +155,24 @@ libdeflate_gzip_decompress(const byte* in, size_t in_nbytes, unsigned nthreads,
                         size_t resume_bitpos;
                         { // Synchronization point
                             auto ctx = prev_chunk.get_context();
+                            if (ctx.second == DeflateThread::unset_stop_pos)
+                                throw gzip_error("decompression was cancelled");
                             deflate_thread.set_initial_context(ctx.first);
                             resume_bitpos = ctx.second;
                         }
 
-                        // Unmmap the section previously decompressed (free RSS, usefull for large files)
+                        // Drop the pages of the section previously decompressed (free RSS, usefull for large files).
+                        // The range stays mapped: the caller unmaps the whole input afterwards, and a hole here
+                        // could meanwhile be reused by another mapping that the caller would then unmap
                         const byte* unmap_end
                           = details::round_down<details::huge_page_size>(in_stream.data.begin() + resume_bitpos / 8);
-                        sys::check_ret(munmap(const_cast<byte*>(last_unmapped), size_t(unmap_end - last_unmapped)),
-                                       "munmap");
-                        last_unmapped = unmap_end;
+                        if (unmap_end > last_unmapped) {
+                            sys::check_ret(madvise(const_cast<byte*>(last_unmapped),
+                                                   size_t(unmap_end - last_unmapped),
+                                                   MADV_DONTNEED),
+                                           "madvise");
+                            last_unmapped = unmap_end;
+                        }
 
                         PRINT_DEBUG("%p chunk 0 of section %u: [%lu<=%lu, %lu[\n",
                                     (void*)&deflate_thread,
@@ -158,10 +190,12 @@ libdeflate_gzip_decompress(const byte* in, size_t in_nbytes, unsigned nthreads,
 
                 } catch (...) {
                     std::unique_lock<std::mutex> lock{ready_mtx};
+                    cancelled = true;
                     if (!exception) {
                         exception = std::current_exception();
                         nready    = 0; // Stop the thread pool
                     }
+                    ready.notify_all();
                     return;
                 }
 
@@ -172,6 +206,8 @@ libdeflate_gzip_decompress(const byte* in, size_t in_nbytes, unsigned nthreads,
                 ConsumerWrapper<Consumer> consumer_wrapper{consumer, sync};
                 consumer_wrapper.set_chunk_idx(chunk_idx, chunk_idx == nthreads - 1);
                 DeflateThreadRandomAccess deflate_thread{in_stream, consumer_wrapper};
+                deflate_thread.set_cancel_flag(&cancelled);
+                FinishBarrier finish_barrier{wait_all_finished};
                 PRINT_DEBUG("chunk %u is %p\n", chunk_idx, (void*)&deflate_thread);
                 {
                     std::unique_lock<std::mutex> lock{ready_mtx};
@@ -179,8 +215,9 @@ libdeflate_gzip_decompress(const byte* in, size_t in_nbytes, unsigned nthreads,
                     nready++;
                     ready.notify_all();
 
-                    while (nready != nthreads)
+                    while (nready != nthreads && !cancelled)
                         ready.wait(lock);
+                    if (cancelled) return;
 
                     deflate_thread.set_upstream(deflate_threads[chunk_idx - 1]);
                 }
@@ -214,10 +251,12 @@ libdeflate_gzip_decompress(const byte* in, size_t in_nbytes, unsigned nthreads,
                         deflate_thread.get_context();
                 } catch (...) {
                     std::unique_lock<std::mutex> lock{ready_mtx};
+                    cancelled = true;
                     if (!exception) {
                         exception = std::current_exception();
                         nready    = 0; // Stop the thread pool
                     }
+                    ready.notify_all();
                     return;
                 }
             });
@@ -16,6 +16,7 @@
 
 #include <vector>
 #include <map>
+#include <cstring>
 
 #include "Buffer.h"
 #include "FastqStream.h"
@@ -161,7 +162,10 @@ namespace dsrc {
             while (true) {
                 Read *read = new Read("", "", "", "");
                 read->mName = getLine(chunk, pos_);
-                if (read->mName.empty()) break;//dsrc guarantees that read are completed!
+                if (read->mName.empty()) {
+                    delete read;
+                    break;//dsrc guarantees that read are completed!
+                }
                 //std::cerr << name << std::endl;
 
                 read->mSeq.mStr = getLine(chunk, pos_);
@@ -186,6 +190,86 @@ namespace dsrc {
             return seq_count;
         }
 
+        static inline char *nextLine(char *p, char *end, int &len) {
+            char *e = (char *) memchr(p, '\n', end - p);
+            if (e == NULL) e = end;
+            len = e - p;
+            if (len > 0 && p[len - 1] == '\r') len--;
+            return e + 1;
+        }
+
+        int chunkFormatPrefix(FastqDataChunk *&chunk, std::vector<Read *> &data, int prefixLen) {
+            //same record boundaries as chunkFormat, but copy only the prefix of sequence and quality
+            int seq_count = 0;
+            char *p = (char *) chunk->data.Pointer();
+            char *end = p + chunk->size + 1;
+            int len;
+            while (p < end) {
+                //name
+                p = nextLine(p, end, len);
+                if (len == 0 || p >= end) break;
+                //sequence
+                char *seq = p;
+                p = nextLine(p, end, len);
+                int seqLen = len < prefixLen ? len : prefixLen;
+                if (p >= end) break;
+                //strand
+                p = nextLine(p, end, len);
+                if (p >= end) break;
+                //quality
+                char *qual = p;
+                p = nextLine(p, end, len);
+                int qualLen = len < prefixLen ? len : prefixLen;
+                Read *read = new Read("", "", "", "");
+                read->mSeq.mStr.assign(seq, seqLen);
+                read->mQuality.assign(qual, qualLen);
+                data.push_back(read);
+                seq_count++;
+            }
+            return seq_count;
+        }
+
+        int chunkRecordStarts(FastqDataChunk *&chunk, std::vector<int> &starts) {
+            int seq_count = 0;
+            char *data = (char *) chunk->data.Pointer();
+            char *p = data;
+            char *end = p + chunk->size + 1;
+            int len;
+            while (p < end) {
+                char *start = p;
+                p = nextLine(p, end, len);
+                if (len == 0 || p >= end) break;
+                p = nextLine(p, end, len);
+                if (p >= end) break;
+                p = nextLine(p, end, len);
+                if (p >= end) break;
+                p = nextLine(p, end, len);
+                starts.push_back(start - data);
+                seq_count++;
+            }
+            return seq_count;
+        }
+
+        Read *formatRecordAt(FastqDataChunk *&chunk, int start) {
+            char *p = (char *) chunk->data.Pointer() + start;
+            char *end = (char *) chunk->data.Pointer() + chunk->size + 1;
+            int len;
+            Read *read = new Read("", "", "", "");
+            char *line = p;
+            p = nextLine(p, end, len);
+            read->mName.assign(line, len);
+            line = p;
+            p = nextLine(p, end, len);
+            read->mSeq.mStr.assign(line, len);
+            line = p;
+            p = nextLine(p, end, len);
+            read->mStrand.assign(line, len);
+            line = p;
+            p = nextLine(p, end, len);
+            read->mQuality.assign(line, len);
+            return read;
+        }
+
         int pairedChunkFormat(FastqDataChunk *&chunk, std::vector<ReadPair *> &data, bool mHasQuality) {
             //format a whole chunk and return number of reads
             int seq_count = 0;
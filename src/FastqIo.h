@@ -49,13 +49,6 @@ namespace dsrc {
                 return n;
             }
 
-            int64
-            Read(byte *memory_, uint64 size_, moodycamel::ReaderWriterQueue<std::pair<char *, int>> *q,
-                 atomic_int *done, pair<char *, int> &lastInfo, int num) {
-                int64 n = fileReader.Read(memory_, size_, q, done, lastInfo, num);
-                return n;
-            }
-
 
         private:
 
@@ -66,6 +59,15 @@ namespace dsrc {
 
         int chunkFormat(FastqDataChunk *&chunk, std::vector<Read *> &, bool);
 
+//only keep the first prefixLen bases and qualities, name and strand are skipped
+        int chunkFormatPrefix(FastqDataChunk *&chunk, std::vector<Read *> &, int prefixLen);
+
+//offsets of the records in a chunk, records are not formatted
+        int chunkRecordStarts(FastqDataChunk *&chunk, std::vector<int> &starts);
+
+//format the record starting at offset start
+        Read *formatRecordAt(FastqDataChunk *&chunk, int start);
+
 //single pe file 
         int pairedChunkFormat(FastqDataChunk *&chunk, std::vector<ReadPair *> &, bool mHasQuality);
 
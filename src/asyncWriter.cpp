@@ -0,0 +1,247 @@
+#include "asyncWriter.h"
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include "util.h"
+
+AsyncFileWriter::AsyncFileWriter(string filename, int ioDepth, bool directIO, size_t blockSize) {
+    mFilename = filename;
+    //with one block every full block is written before the next write starts
+    mIoDepth = ioDepth;
+    mDirectIO = false;
+    mFailed = false;
+    mClosed = false;
+    mFileOffset = 0;
+    mCurrent = -1;
+    mInFlight = 0;
+    mUseUring = false;
+    mStop = false;
+    mBlockSize = (blockSize + ASYNC_WRITE_ALIGN - 1) / ASYNC_WRITE_ALIGN * ASYNC_WRITE_ALIGN;
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    mFd = -1;
+#ifdef O_DIRECT
+    if (directIO) {
+        mFd = open(mFilename.c_str(), flags | O_DIRECT, 0644);
+        if (mFd >= 0) mDirectIO = true;
+#ifdef PRINT_INFO
+        else printf("O_DIRECT is not supported for %s, use buffered io\n", mFilename.c_str());
+#endif
+    }
+#endif
+    if (mFd < 0) mFd = open(mFilename.c_str(), flags, 0644);
+    if (mFd < 0) {
+        error_exit("can not open " + mFilename + " : " + strerror(errno));
+    }
+
+    mBlocks.resize(mIoDepth);
+    for (int i = 0; i < mIoDepth; i++) {
+        void *p = NULL;
+        if (posix_memalign(&p, ASYNC_WRITE_ALIGN, mBlockSize) != 0) {
+            //error_exit throws in a server job, which never runs the destructor
+            for (int j = 0; j < i; j++) free(mBlocks[j].buf);
+            ::close(mFd);
+            error_exit("can not allocate the output blocks of " + mFilename);
+        }
+        mBlocks[i].buf = (char *) p;
+        mBlocks[i].len = 0;
+        mBlocks[i].offset = 0;
+        mFreeBlocks.push_back(i);
+    }
+
+#ifdef USE_IO_URING
+    if (io_uring_queue_init(mIoDepth, &mRing, 0) == 0) {
+        mUseUring = true;
+    }
+#endif
+    if (!mUseUring) {
+        int workers = mIoDepth < 4 ? mIoDepth : 4;
+        for (int i = 0; i < workers; i++) {
+            mWorkers.push_back(new thread(&AsyncFileWriter::pwriteTask, this));
+        }
+    }
+#ifdef PRINT_INFO
+    printf("async writer for %s : %s, depth %d, block %zu, direct %d\n", mFilename.c_str(), backendName(),
+           mIoDepth, mBlockSize, mDirectIO);
+#endif
+    mCurrent = acquireBlock();
+}
+
+AsyncFileWriter::~AsyncFileWriter() {
+    close();
+    for (int i = 0; i < mBlocks.size(); i++) {
+        free(mBlocks[i].buf);
+    }
+}
+
+const char *AsyncFileWriter::backendName() {
+    return mUseUring ? "io_uring" : "pwrite";
+}
+
+bool AsyncFileWriter::write(const char *data, size_t size) {
+    if (mClosed) return false;
+    while (size > 0) {
+        Block &blk = mBlocks[mCurrent];
+        size_t n = mBlockSize - blk.len;
+        if (n > size) n = size;
+        memcpy(blk.buf + blk.len, data, n);
+        blk.len += n;
+        data += n;
+        size -= n;
+        if (blk.len == mBlockSize) {
+            submitCurrent();
+            mCurrent = acquireBlock();
+        }
+    }
+    return !mFailed;
+}
+
+void AsyncFileWriter::submitCurrent() {
+    Block &blk = mBlocks[mCurrent];
+    blk.offset = mFileOffset;
+    mFileOffset += blk.len;
+    submit(mCurrent);
+    mCurrent = -1;
+}
+
+void AsyncFileWriter::submit(int blockId) {
+#ifdef USE_IO_URING
+    if (mUseUring) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&mRing);
+        while (sqe == NULL) {
+            reapUring(true);
+            sqe = io_uring_get_sqe(&mRing);
+        }
+        Block &blk = mBlocks[blockId];
+        io_uring_prep_write(sqe, mFd, blk.buf, blk.len, blk.offset);
+        io_uring_sqe_set_data(sqe, (void *) (uintptr_t) blockId);
+        mInFlight++;
+        io_uring_submit(&mRing);
+        return;
+    }
+#endif
+    unique_lock<mutex> lock(mtx);
+    mJobs.push_back(blockId);
+    mInFlight++;
+    mJobCv.notify_one();
+}
+
+int AsyncFileWriter::acquireBlock() {
+#ifdef USE_IO_URING
+    if (mUseUring) {
+        reapUring(false);
+        while (mFreeBlocks.empty()) reapUring(true);
+        int id = mFreeBlocks.back();
+        mFreeBlocks.pop_back();
+        return id;
+    }
+#endif
+    unique_lock<mutex> lock(mtx);
+    while (mFreeBlocks.empty()) mDoneCv.wait(lock);
+    int id = mFreeBlocks.back();
+    mFreeBlocks.pop_back();
+    return id;
+}
+
+void AsyncFileWriter::releaseBlock(int blockId, long res) {
+    if (res < 0) {
+        printf("gg, async write to %s failed : %s\n", mFilename.c_str(), strerror((int) -res));
+        mFailed = true;
+    }
+    mBlocks[blockId].len = 0;
+    mFreeBlocks.push_back(blockId);
+    mInFlight--;
+}
+
+#ifdef USE_IO_URING
+void AsyncFileWriter::reapUring(bool wait) {
+    struct io_uring_cqe *cqe;
+    int ret = wait ? io_uring_wait_cqe(&mRing, &cqe) : io_uring_peek_cqe(&mRing, &cqe);
+    while (ret == 0 && cqe != NULL) {
+        int id = (int) (uintptr_t) io_uring_cqe_get_data(cqe);
+        long res = cqe->res;
+        io_uring_cqe_seen(&mRing, cqe);
+        Block &blk = mBlocks[id];
+        if (res >= 0 && (size_t) res < blk.len) {
+            //short write, finish the rest synchronously
+            if (!writeFully(blk.buf + res, blk.len - res, blk.offset + res)) res = -EIO;
+        }
+        releaseBlock(id, res);
+        ret = io_uring_peek_cqe(&mRing, &cqe);
+    }
+}
+#endif
+
+bool AsyncFileWriter::writeFully(const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(mFd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+void AsyncFileWriter::pwriteTask() {
+    while (true) {
+        unique_lock<mutex> lock(mtx);
+        while (mJobs.empty() && !mStop) mJobCv.wait(lock);
+        if (mJobs.empty()) break;
+        int id = mJobs.front();
+        mJobs.pop_front();
+        lock.unlock();
+        Block &blk = mBlocks[id];
+        long res = writeFully(blk.buf, blk.len, blk.offset) ? 0 : -errno;
+        lock.lock();
+        releaseBlock(id, res);
+        mDoneCv.notify_all();
+    }
+}
+
+bool AsyncFileWriter::close() {
+    if (mClosed) return !mFailed;
+    mClosed = true;
+
+    //wait all blocks in flight
+#ifdef USE_IO_URING
+    if (mUseUring) {
+        while (mInFlight > 0) reapUring(true);
+        io_uring_queue_exit(&mRing);
+    }
+#endif
+    if (!mUseUring) {
+        unique_lock<mutex> lock(mtx);
+        while (mInFlight > 0) mDoneCv.wait(lock);
+        mStop = true;
+        mJobCv.notify_all();
+        lock.unlock();
+        for (int i = 0; i < mWorkers.size(); i++) {
+            mWorkers[i]->join();
+            delete mWorkers[i];
+        }
+        mWorkers.clear();
+    }
+
+    //the tail is usually not aligned, so write it without O_DIRECT
+    if (mCurrent >= 0 && mBlocks[mCurrent].len > 0) {
+#ifdef O_DIRECT
+        if (mDirectIO) {
+            int flags = fcntl(mFd, F_GETFL);
+            fcntl(mFd, F_SETFL, flags & ~O_DIRECT);
+        }
+#endif
+        if (!writeFully(mBlocks[mCurrent].buf, mBlocks[mCurrent].len, mFileOffset)) {
+            printf("gg, async write to %s failed : %s\n", mFilename.c_str(), strerror(errno));
+            mFailed = true;
+        }
+        mFileOffset += mBlocks[mCurrent].len;
+        mBlocks[mCurrent].len = 0;
+    }
+    ::close(mFd);
+    mFd = -1;
+    return !mFailed;
+}
@@ -0,0 +1,101 @@
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef USE_IO_URING
+#include <liburing.h>
+#endif
+
+using namespace std;
+
+#define ASYNC_WRITE_BLOCK_SIZE (1 << 22)
+#define ASYNC_WRITE_ALIGN 4096
+
+/*
+ * Asynchronous file output. Data is copied into a small pool of aligned
+ * staging blocks, every full block is submitted as one large write at its
+ * final file offset and the caller only waits when all blocks are in flight.
+ * Writes go through io_uring when built with USE_IO_URING and the kernel
+ * supports it, otherwise through a few pwrite threads.
+ */
+class AsyncFileWriter {
+public:
+    AsyncFileWriter(string filename, int ioDepth = 8, bool directIO = false,
+                    size_t blockSize = ASYNC_WRITE_BLOCK_SIZE);
+
+    ~AsyncFileWriter();
+
+    bool write(const char *data, size_t size);
+
+    bool close();
+
+    bool isOpen() { return mFd >= 0; }
+
+    bool failed() { return mFailed; }
+
+    const char *backendName();
+
+private:
+    struct Block {
+        char *buf;
+        size_t len;
+        off_t offset;
+    };
+
+    void submitCurrent();
+
+    void submit(int blockId);
+
+    int acquireBlock();
+
+    void releaseBlock(int blockId, long res);
+
+    void pwriteTask();
+
+    bool writeFully(const char *buf, size_t len, off_t offset);
+
+#ifdef USE_IO_URING
+    void reapUring(bool wait);
+#endif
+
+private:
+    string mFilename;
+    int mFd;
+    int mIoDepth;
+    bool mDirectIO;
+    atomic_bool mFailed;
+    bool mClosed;
+    size_t mBlockSize;
+    off_t mFileOffset;
+
+    vector<Block> mBlocks;
+    vector<int> mFreeBlocks;
+    int mCurrent;
+    int mInFlight;
+
+    bool mUseUring;
+#ifdef USE_IO_URING
+    struct io_uring mRing;
+#endif
+
+    //pwrite fallback
+    vector<thread *> mWorkers;
+    deque<int> mJobs;
+    bool mStop;
+    mutex mtx;
+    condition_variable mJobCv;
+    condition_variable mDoneCv;
+};
+
+#endif
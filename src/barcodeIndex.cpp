@@ -0,0 +1,414 @@
+#include "barcodeIndex.h"
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <omp.h>
+#include "hugePages.h"
+#include "numaTopology.h"
+#include "util.h"
+
+//bits needed for v, at least one
+static int bitsOf(uint64 v) {
+    int bits = 1;
+    while (bits < 64 && (v >> bits) != 0) bits++;
+    return bits;
+}
+
+//bits of the key type
+template<class Key>
+static int keyTypeBits() {
+    return sizeof(Key) * 8;
+}
+
+//INDEX_KEY_MUL * inverse is 1 modulo 2^128 (so 2^64 too), every newton step doubles the correct low bits
+template<class Key>
+static Key keyMulInverse() {
+    Key inverse = INDEX_KEY_MUL;
+    for (int i = 0; i < 6; i++) {
+        inverse *= 2 - INDEX_KEY_MUL * inverse;
+    }
+    return inverse;
+}
+
+//low keyBits set
+template<class Key>
+static Key keyMaskOf(int keyBits) {
+    return keyBits == keyTypeBits<Key>() ? ~(Key) 0 : ((Key) 1 << keyBits) - 1;
+}
+
+//bytes of one loaded record
+static long recordBytes(int keyBits) {
+    return keyBits > 64 ? sizeof(bpmap_wide_key_value) : sizeof(bpmap_key_value);
+}
+
+template<class Key>
+BasicBarcodeIndex<Key>::BasicBarcodeIndex() {
+    mType = INDEX_LIST;
+    mSize = 0;
+    mMapMod = MOD;
+    mHead = NULL;
+    mNxt = NULL;
+    mRecords = NULL;
+    mOffsets = NULL;
+    mEntries = NULL;
+    mBucketBits = 0;
+    mStride = 1;
+    mKeyMask = 0;
+    mQuotientBits = 0;
+    mQuotientMask = 0;
+    mQuotientShift = 0;
+    mPositionMask = 0;
+    mYBits = 0;
+    mYMask = 0;
+    mLevels = 0;
+    mBits = NULL;
+    mBitWords = 0;
+    mRanks = NULL;
+    mPlaced = 0;
+    mLeftKeys = NULL;
+    mLeftNum = 0;
+}
+
+template<class Key>
+BasicBarcodeIndex<Key>::~BasicBarcodeIndex() {
+    HugePages::free(mHead);
+    HugePages::free(mNxt);
+    HugePages::free(mRecords);
+    HugePages::free(mOffsets);
+    HugePages::free(mEntries);
+    HugePages::free(mBits);
+    HugePages::free(mRanks);
+    HugePages::free(mLeftKeys);
+}
+
+template<class Key>
+int BasicBarcodeIndex<Key>::parseType(string type) {
+    if (type == "list") return INDEX_LIST;
+    if (type == "compact") return INDEX_COMPACT;
+    if (type == "mphf") return INDEX_MPHF;
+    error_exit("indexType should be compact, mphf or list: " + type);
+    return INDEX_LIST;
+}
+
+//about 2 barcodes per bucket, most lookups miss and scan a whole bucket
+template<class Key>
+int BasicBarcodeIndex<Key>::bucketBitsFor(uint64 records, int keyBits) {
+    int bits = 1;
+    while (bits < min(keyBits - 1, 31) && (2ull << bits) < records) bits++;
+    return bits;
+}
+
+template<class Key>
+long BasicBarcodeIndex<Key>::lookupBytes(int type, uint64 records, uint32 mapMod, int keyBits) {
+    if (type == INDEX_LIST) {
+        return records * (recordBytes(keyBits) + sizeof(int)) + (long) mapMod * sizeof(int);
+    }
+    //x and y of the largest chips take 16 bits each
+    if (type == INDEX_MPHF) {
+        //about 3.3 bits per barcode over all levels, and their ranks
+        int words = keyBits + 32 <= 64 ? 1 : keyBits <= 64 ? 2 : 3;
+        return records * words * sizeof(uint64) + records / 2;
+    }
+    int bucketBits = bucketBitsFor(records, keyBits);
+    int quotientBits = keyBits - bucketBits;
+    int words = quotientBits + 32 <= 64 ? 1 : quotientBits <= 64 ? 2 : 3;
+    return records * words * sizeof(uint64) + ((1ll << bucketBits) + 1) * sizeof(uint32);
+}
+
+template<class Key>
+long BasicBarcodeIndex<Key>::buildBytes(int type, uint64 records, int keyBits) {
+    if (type == INDEX_COMPACT) {
+        //the records and their bucket order
+        return records * (recordBytes(keyBits) + sizeof(uint32));
+    }
+    if (type == INDEX_MPHF) {
+        //the records and the barcodes left for this level and the next
+        return records * (recordBytes(keyBits) + 2 * sizeof(uint32));
+    }
+    return 0;
+}
+
+//bits of the widest key, and the largest x and y
+template<class Key>
+static void recordRange(const BarcodeRecord<Key> *records, uint32 size, int threads, int &keyBits, uint32 &maxX,
+                        uint32 &maxY) {
+    //the key bits are or-ed in two halves, the high one stays 0 with uint64 keys
+    uint64 lowKeys = 0, highKeys = 0;
+    uint32 lmaxX = 0, lmaxY = 0;
+#pragma omp parallel for num_threads(threads) reduction(|:lowKeys, highKeys) reduction(max:lmaxX, lmaxY)
+    for (uint32 i = 0; i < size; i++) {
+        lowKeys |= (uint64) records[i].key;
+        highKeys |= (uint64) (records[i].key >> 32 >> 32);
+        lmaxX = max(lmaxX, records[i].value.x);
+        lmaxY = max(lmaxY, records[i].value.y);
+    }
+    keyBits = highKeys != 0 ? 64 + bitsOf(highKeys) : bitsOf(lowKeys);
+    maxX = lmaxX;
+    maxY = lmaxY;
+}
+
+template<class Key>
+void BasicBarcodeIndex<Key>::setPacking(int storedBits, uint32 maxX, uint32 maxY) {
+    int xBits = bitsOf(maxX);
+    mYBits = bitsOf(maxY);
+    mYMask = (1ull << mYBits) - 1;
+    int positionBits = xBits + mYBits;
+    mStride = storedBits + positionBits <= 64 ? 1 : storedBits <= 64 ? 2 : 3;
+    mQuotientShift = mStride == 1 ? positionBits : 0;
+    mPositionMask = mStride == 1 ? (1ull << positionBits) - 1 : ~0ull;
+}
+
+template<class Key>
+void BasicBarcodeIndex<Key>::putEntry(uint64 *entry, Key stored, uint64 position) {
+    if (mStride == 1) {
+        entry[0] = (uint64) stored << mQuotientShift | position;
+        return;
+    }
+    entry[0] = (uint64) stored;
+    if (mStride == 3) entry[1] = (uint64) (stored >> 32 >> 32);
+    entry[mStride - 1] = position;
+}
+
+template<class Key>
+void BasicBarcodeIndex<Key>::adoptList(int *head, int *nxt, BarcodeRecord<Key> *records, uint32 size,
+                                       uint32 mapMod) {
+    mType = INDEX_LIST;
+    mSize = size;
+    mMapMod = mapMod;
+    mHead = head;
+    mNxt = nxt;
+    mRecords = records;
+}
+
+template<class Key>
+void BasicBarcodeIndex<Key>::buildCompact(const BarcodeRecord<Key> *records, uint32 size, int keyBits, int threads) {
+    mType = INDEX_COMPACT;
+    mSize = size;
+    int recordKeyBits;
+    uint32 maxX, maxY;
+    recordRange(records, size, threads, recordKeyBits, maxX, maxY);
+    keyBits = min(keyTypeBits<Key>(), max(keyBits, recordKeyBits));
+    mKeyMask = keyMaskOf<Key>(keyBits);
+    mBucketBits = bucketBitsFor(size, keyBits);
+    mQuotientBits = keyBits - mBucketBits;
+    mQuotientMask = keyMaskOf<Key>(mQuotientBits);
+    setPacking(mQuotientBits, maxX, maxY);
+
+    uint64 buckets = 1ull << mBucketBits;
+    mOffsets = HugePages::allocArray<uint32>(buckets + 1);
+    mEntries = HugePages::allocArray<uint64>((uint64) max(size, (uint32) 1) * mStride);
+    //count per bucket, then slots are handed out from the bucket ends down, which leaves the starts behind
+#pragma omp parallel for num_threads(threads)
+    for (uint32 i = 0; i < size; i++) {
+        uint64 bucket = (uint64) ((records[i].key * INDEX_KEY_MUL & mKeyMask) >> mQuotientBits);
+        __atomic_fetch_add(&mOffsets[bucket], 1, __ATOMIC_RELAXED);
+    }
+    uint32 filled = 0;
+    for (uint64 b = 0; b < buckets; b++) {
+        filled += mOffsets[b];
+        mOffsets[b] = filled;
+    }
+    mOffsets[buckets] = size;
+    uint32 *order = HugePages::allocArray<uint32>(max(size, (uint32) 1));
+#pragma omp parallel for num_threads(threads)
+    for (uint32 i = 0; i < size; i++) {
+        uint64 bucket = (uint64) ((records[i].key * INDEX_KEY_MUL & mKeyMask) >> mQuotientBits);
+        order[__atomic_sub_fetch(&mOffsets[bucket], 1, __ATOMIC_RELAXED)] = i;
+    }
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 65536)
+    for (uint64 b = 0; b < buckets; b++) {
+        uint32 start = mOffsets[b];
+        uint32 end = mOffsets[b + 1];
+        //later records first, as the chains of the list layout have them, so duplicated barcodes resolve the same
+        sort(order + start, order + end, greater<uint32>());
+        for (uint32 j = start; j < end; j++) {
+            const BarcodeRecord<Key> &record = records[order[j]];
+            Key quotient = record.key * INDEX_KEY_MUL & mQuotientMask;
+            uint64 position = ((uint64) record.value.x << mYBits) | record.value.y;
+            putEntry(mEntries + (uint64) j * mStride, quotient, position);
+        }
+    }
+    HugePages::free(order);
+}
+
+template<class Key>
+void BasicBarcodeIndex<Key>::buildMphf(const BarcodeRecord<Key> *records, uint32 size, int keyBits, int threads) {
+    mType = INDEX_MPHF;
+    int recordKeyBits;
+    uint32 maxX, maxY;
+    recordRange(records, size, threads, recordKeyBits, maxX, maxY);
+    keyBits = min(keyTypeBits<Key>(), max(keyBits, recordKeyBits));
+    mKeyMask = keyMaskOf<Key>(keyBits);
+    setPacking(keyBits, maxX, maxY);
+
+    vector<uint32> remaining(size);
+    for (uint32 i = 0; i < size; i++) remaining[i] = i;
+    vector<uint64> bits;
+    mLevels = 0;
+    while (!remaining.empty() && mLevels < MPHF_MAX_LEVELS) {
+        int level = mLevels;
+        uint64 levelWords = ((uint64) MPHF_GAMMA * remaining.size() + 63) / 64;
+        mLevelStart[level] = bits.size() * 64;
+        mLevelBits[level] = levelWords * 64;
+        mLevels++;
+        bits.resize(bits.size() + levelWords, 0);
+        uint64 *levelArray = &bits[mLevelStart[level] / 64];
+        vector<uint64> collided(levelWords, 0);
+        //a bit hit twice is cleared at the end, its barcodes try the next level
+#pragma omp parallel for num_threads(threads)
+        for (uint64 i = 0; i < remaining.size(); i++) {
+            uint64 p = mphfBit(records[remaining[i]].key, level);
+            uint64 bit = 1ull << (p & 63);
+            if (__atomic_fetch_or(&levelArray[p >> 6], bit, __ATOMIC_RELAXED) & bit) {
+                __atomic_fetch_or(&collided[p >> 6], bit, __ATOMIC_RELAXED);
+            }
+        }
+#pragma omp parallel for num_threads(threads)
+        for (uint64 w = 0; w < levelWords; w++) {
+            levelArray[w] &= ~collided[w];
+        }
+        vector<uint32> next;
+#pragma omp parallel num_threads(threads)
+        {
+            vector<uint32> part;
+#pragma omp for nowait
+            for (uint64 i = 0; i < remaining.size(); i++) {
+                uint64 p = mphfBit(records[remaining[i]].key, level);
+                if (collided[p >> 6] >> (p & 63) & 1) part.push_back(remaining[i]);
+            }
+#pragma omp critical
+            next.insert(next.end(), part.begin(), part.end());
+        }
+        remaining.swap(next);
+    }
+    mBitWords = max(bits.size(), (size_t) 1);
+    mBits = HugePages::allocArray<uint64>(mBitWords);
+    if (!bits.empty()) memcpy(mBits, &bits[0], bits.size() * sizeof(uint64));
+    vector<uint64>().swap(bits);
+    uint64 blocks = (mBitWords + 7) / 8;
+    mRanks = HugePages::allocArray<uint32>(blocks);
+#pragma omp parallel for num_threads(threads)
+    for (uint64 b = 0; b < blocks; b++) {
+        uint32 count = 0;
+        for (uint64 w = b * 8; w < min(b * 8 + 8, mBitWords); w++) count += __builtin_popcountll(mBits[w]);
+        mRanks[b] = count;
+    }
+    mPlaced = 0;
+    for (uint64 b = 0; b < blocks; b++) {
+        uint32 count = mRanks[b];
+        mRanks[b] = mPlaced;
+        mPlaced += count;
+    }
+
+    //barcodes colliding on every level, duplicated ones among them, go to the overflow array
+    vector<pair<Key, uint32>> left(remaining.size());
+    for (size_t i = 0; i < remaining.size(); i++) {
+        left[i] = make_pair(records[remaining[i]].key, remaining[i]);
+    }
+    //later records first, as the chains of the list layout have them
+    sort(left.begin(), left.end(), [](const pair<Key, uint32> &a, const pair<Key, uint32> &b) {
+        return a.first != b.first ? a.first < b.first : a.second > b.second;
+    });
+    vector<uint32> leftRecords;
+    mLeftKeys = HugePages::allocArray<Key>(max(left.size(), (size_t) 1));
+    mLeftNum = 0;
+    for (size_t i = 0; i < left.size(); i++) {
+        if (i > 0 && left[i].first == left[i - 1].first) continue;
+        mLeftKeys[mLeftNum++] = left[i].first;
+        leftRecords.push_back(left[i].second);
+    }
+    mSize = mPlaced + mLeftNum;
+    mEntries = HugePages::allocArray<uint64>(max(mSize, (uint32) 1) * (uint64) mStride);
+    uint64 total = (uint64) size + leftRecords.size();
+#pragma omp parallel for num_threads(threads)
+    for (uint64 i = 0; i < total; i++) {
+        uint64 slot;
+        const BarcodeRecord<Key> *record;
+        if (i < size) {
+            record = &records[i];
+            slot = mphfSlot(record->key);
+            //overflow barcodes are written once below, with their last record
+            if (slot >= mPlaced) continue;
+        } else {
+            slot = mPlaced + (i - size);
+            record = &records[leftRecords[i - size]];
+        }
+        uint64 position = ((uint64) record->value.x << mYBits) | record->value.y;
+        putEntry(mEntries + slot * mStride, record->key, position);
+    }
+}
+
+template<class Key>
+BasicBarcodeIndex<Key> *BasicBarcodeIndex<Key>::copy() const {
+    BasicBarcodeIndex *index = new BasicBarcodeIndex(*this);
+    uint64 entries = max(mSize, (uint32) 1);
+    if (mType == INDEX_LIST) {
+        index->mHead = HugePages::allocArray<int>(mMapMod);
+        memcpy(index->mHead, mHead, (uint64) mMapMod * sizeof(int));
+        index->mNxt = HugePages::allocArray<int>(entries);
+        memcpy(index->mNxt, mNxt, entries * sizeof(int));
+        index->mRecords = HugePages::allocArray<BarcodeRecord<Key>>(entries);
+        memcpy(index->mRecords, mRecords, entries * sizeof(BarcodeRecord<Key>));
+        return index;
+    }
+    if (mType == INDEX_COMPACT) {
+        uint64 offsets = (1ull << mBucketBits) + 1;
+        index->mOffsets = HugePages::allocArray<uint32>(offsets);
+        memcpy(index->mOffsets, mOffsets, offsets * sizeof(uint32));
+    } else {
+        index->mBits = HugePages::allocArray<uint64>(mBitWords);
+        memcpy(index->mBits, mBits, mBitWords * sizeof(uint64));
+        uint64 blocks = (mBitWords + 7) / 8;
+        index->mRanks = HugePages::allocArray<uint32>(blocks);
+        memcpy(index->mRanks, mRanks, blocks * sizeof(uint32));
+        index->mLeftKeys = HugePages::allocArray<Key>(max(mLeftNum, (uint64) 1));
+        memcpy(index->mLeftKeys, mLeftKeys, mLeftNum * sizeof(Key));
+    }
+    index->mEntries = HugePages::allocArray<uint64>(entries * mStride);
+    memcpy(index->mEntries, mEntries, entries * mStride * sizeof(uint64));
+    return index;
+}
+
+template<class Key>
+void BasicBarcodeIndex<Key>::interleave() {
+    uint64 entries = max(mSize, (uint32) 1);
+    if (mType == INDEX_LIST) {
+        NumaTopology::interleave(mHead, (uint64) mMapMod * sizeof(int));
+        NumaTopology::interleave(mNxt, entries * sizeof(int));
+        NumaTopology::interleave(mRecords, entries * sizeof(BarcodeRecord<Key>));
+        return;
+    }
+    if (mType == INDEX_COMPACT) {
+        NumaTopology::interleave(mOffsets, ((1ull << mBucketBits) + 1) * sizeof(uint32));
+    } else {
+        NumaTopology::interleave(mBits, mBitWords * sizeof(uint64));
+        NumaTopology::interleave(mRanks, (mBitWords + 7) / 8 * sizeof(uint32));
+    }
+    NumaTopology::interleave(mEntries, entries * mStride * sizeof(uint64));
+}
+
+template<class Key>
+BarcodeRecord<Key> BasicBarcodeIndex<Key>::record(uint32 i) const {
+    if (mType == INDEX_LIST) {
+        return mRecords[i];
+    }
+    const uint64 *entry = mEntries + (uint64) i * mStride;
+    Key quotient = storedOf(entry);
+    uint64 packed = entry[mStride - 1] & mPositionMask;
+    BarcodeRecord<Key> record;
+    if (mType == INDEX_MPHF) {
+        record.key = quotient;
+    } else {
+        //the bucket is the last one starting at or before i
+        const uint32 *next = upper_bound(mOffsets, mOffsets + (1ull << mBucketBits) + 1, i);
+        Key bucket = next - mOffsets - 1;
+        record.key = ((bucket << mQuotientBits) | quotient) * keyMulInverse<Key>() & mKeyMask;
+    }
+    record.value.x = packed >> mYBits;
+    record.value.y = packed & mYMask;
+    return record;
+}
+
+template class BasicBarcodeIndex<uint64>;
+template class BasicBarcodeIndex<uint128>;
@@ -0,0 +1,223 @@
+#ifndef BARCODEINDEX_H
+#define BARCODEINDEX_H
+
+#include <string>
+#include <algorithm>
+#include "common.h"
+
+using namespace std;
+
+//layout of the barcode -> position index, --indexType
+//bucket chains of full records, bpmap_head / bpmap_nxt / position_all
+#define INDEX_LIST 0
+//quotiented keys packed with x and y into one word per barcode, buckets are ranges of it
+#define INDEX_COMPACT 1
+//minimal perfect hash over the barcodes, the slot it gives holds the full key and x and y
+#define INDEX_MPHF 2
+
+//bits per remaining barcode on every level of the perfect hash
+#define MPHF_GAMMA 2
+//barcodes still colliding after the last level are kept in a sorted overflow array
+#define MPHF_MAX_LEVELS 32
+#define MPHF_NONE (~0ull)
+
+//odd, so multiplying by it is a bijection on the key bits
+#define INDEX_KEY_MUL 0x9e3779b97f4a7c15ull
+
+//64 bits of a key to hash, the bases after the first 32 of a uint128 key are folded in
+inline uint64 keyHash(uint64 key) {
+    return key;
+}
+
+inline uint64 keyHash(uint128 key) {
+    return (uint64) key ^ (uint64) (key >> 64) * INDEX_KEY_MUL;
+}
+
+/*
+ * Read only index the barcode processors look barcodes up in. The list layout keeps
+ * the 16 byte records and the chains the loaders build (20 bytes per barcode plus
+ * 4 bytes per bucket). The compact one drops what the bucket already tells: keys are
+ * mixed with a multiplication, the high bits choose one of about barcodes / 2 buckets
+ * and only the low bits (the quotient) are kept, next to x and y in the bits the chip
+ * needs. Most masks fit one uint64 per barcode, a bucket is a few adjacent words, so
+ * a lookup reads the offsets and one cache line instead of following a chain.
+ * Keys or positions too wide for one word use two.
+ *
+ * The mphf layout is a BBHash style minimal perfect hash: every level is a bit array
+ * of MPHF_GAMMA bits per barcode left, a barcode alone at its hashed bit keeps it and
+ * its slot is the rank of that bit, colliding ones go on to the next level. Most
+ * barcodes are placed on the first level, so a lookup is usually one hash, one bit
+ * array line and the slot, which holds the full key to reject barcodes not in the mask.
+ *
+ * Key is uint64 for barcodes up to NARROW_BARCODE_LEN bases and uint128 for longer
+ * ones. Wide keys keep the same layouts, a quotient or key over 64 bits takes two
+ * words in front of the position word.
+ */
+template<class Key>
+class BasicBarcodeIndex {
+public:
+    BasicBarcodeIndex();
+
+    ~BasicBarcodeIndex();
+
+    //list layout over the arrays of a loader, the index frees them
+    void adoptList(int *head, int *nxt, BarcodeRecord<Key> *records, uint32 size, uint32 mapMod);
+
+    //compact layout of records, keys are at most keyBits wide, the records are not kept
+    void buildCompact(const BarcodeRecord<Key> *records, uint32 size, int keyBits, int threads);
+
+    //mphf layout of records, duplicated barcodes keep their last record
+    void buildMphf(const BarcodeRecord<Key> *records, uint32 size, int keyBits, int threads);
+
+    //the same index in new arrays, allocated by the calling thread
+    BasicBarcodeIndex *copy() const;
+
+    //spreads the arrays over all numa nodes
+    void interleave();
+
+    uint32 size() const { return mSize; }
+
+    //barcode and position of entry i, for dumping and sampling, not for lookups
+    BarcodeRecord<Key> record(uint32 i) const;
+
+    //bytes of the lookup arrays of an index of records barcodes
+    static long lookupBytes(int type, uint64 records, uint32 mapMod, int keyBits);
+
+    //bytes held only while the index is built, the loaded records included
+    static long buildBytes(int type, uint64 records, int keyBits);
+
+    //list, compact or mphf
+    static int parseType(string type);
+
+    //position of key, false when it is not in the index
+    inline bool find(Key key, Position1 &position) const {
+        if (mType == INDEX_LIST) {
+            uint64 hash = keyHash(key);
+            uint32 bucket = mMapMod == MOD ? hash % MOD : hash % mMapMod;
+            for (int i = mHead[bucket]; i != -1; i = mNxt[i]) {
+                if (mRecords[i].key == key) {
+                    position = mRecords[i].value;
+                    return true;
+                }
+            }
+            return false;
+        }
+        if (key & ~mKeyMask) return false;
+        const uint64 *entry;
+        const uint64 *end;
+        Key stored;
+        if (mType == INDEX_COMPACT) {
+            Key mixed = key * INDEX_KEY_MUL & mKeyMask;
+            uint64 bucket = (uint64) (mixed >> mQuotientBits);
+            stored = mixed & mQuotientMask;
+            entry = mEntries + (uint64) mOffsets[bucket] * mStride;
+            end = mEntries + (uint64) mOffsets[bucket + 1] * mStride;
+        } else {
+            uint64 slot = mphfSlot(key);
+            if (slot == MPHF_NONE) return false;
+            stored = key;
+            entry = mEntries + slot * mStride;
+            end = entry + mStride;
+        }
+        for (; entry < end; entry += mStride) {
+            if (storedOf(entry) == stored) {
+                uint64 packed = entry[mStride - 1] & mPositionMask;
+                position.x = packed >> mYBits;
+                position.y = packed & mYMask;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static int bucketBitsFor(uint64 records, int keyBits);
+
+    //widths of the packed words, storedBits of the key are kept next to x and y
+    void setPacking(int storedBits, uint32 maxX, uint32 maxY);
+
+    //quotient (the whole key with mphf) of an entry
+    inline Key storedOf(const uint64 *entry) const {
+        Key stored = entry[0] >> mQuotientShift;
+        //only wide keys can have a quotient over 64 bits, the test is gone for uint64 keys
+        if (sizeof(Key) > sizeof(uint64) && mStride == 3) stored |= (Key) entry[1] << 32 << 32;
+        return stored;
+    }
+
+    void putEntry(uint64 *entry, Key stored, uint64 position);
+
+    static inline uint64 mphfHash(Key key, int level) {
+        uint64 h = keyHash(key) + (level + 1) * INDEX_KEY_MUL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+        return h ^ (h >> 31);
+    }
+
+    //bit of key on level, relative to the level start
+    inline uint64 mphfBit(Key key, int level) const {
+        return (uint64) (((unsigned __int128) mphfHash(key, level) * mLevelBits[level]) >> 64);
+    }
+
+    //set bits before bit p of all levels
+    inline uint64 mphfRank(uint64 p) const {
+        uint64 word = p >> 6;
+        uint64 rank = mRanks[p >> 9];
+        for (uint64 w = word & ~7ull; w < word; w++) {
+            rank += __builtin_popcountll(mBits[w]);
+        }
+        return rank + __builtin_popcountll(mBits[word] & ((1ull << (p & 63)) - 1));
+    }
+
+    //slot of key, MPHF_NONE when it can not be in the index
+    inline uint64 mphfSlot(Key key) const {
+        for (int level = 0; level < mLevels; level++) {
+            uint64 p = mLevelStart[level] + mphfBit(key, level);
+            if (mBits[p >> 6] >> (p & 63) & 1) return mphfRank(p);
+        }
+        const Key *left = lower_bound(mLeftKeys, mLeftKeys + mLeftNum, key);
+        if (left == mLeftKeys + mLeftNum || *left != key) return MPHF_NONE;
+        return mPlaced + (left - mLeftKeys);
+    }
+
+    int mType;
+    uint32 mSize;
+
+    //list layout
+    uint32 mMapMod;
+    int *mHead;
+    int *mNxt;
+    BarcodeRecord<Key> *mRecords;
+
+    //compact layout, bucket b holds entries [mOffsets[b], mOffsets[b + 1])
+    uint32 *mOffsets;
+    uint64 *mEntries;
+    int mBucketBits;
+    //words per entry, 2 when quotient and position do not fit one, 3 when the quotient alone does not
+    int mStride;
+    Key mKeyMask;
+    int mQuotientBits;
+    Key mQuotientMask;
+    //quotient (the whole key with mphf) position in the first word, 0 with more words
+    int mQuotientShift;
+    uint64 mPositionMask;
+    int mYBits;
+    uint64 mYMask;
+
+    //mphf layout, the bit arrays of all levels one after the other
+    int mLevels;
+    uint64 mLevelStart[MPHF_MAX_LEVELS];
+    uint64 mLevelBits[MPHF_MAX_LEVELS];
+    uint64 *mBits;
+    uint64 mBitWords;
+    //set bits before every 512 bit block
+    uint32 *mRanks;
+    //barcodes placed on the levels, the overflow ones follow them
+    uint64 mPlaced;
+    Key *mLeftKeys;
+    uint64 mLeftNum;
+};
+
+typedef BasicBarcodeIndex<uint64> BarcodeIndex;
+typedef BasicBarcodeIndex<uint128> WideBarcodeIndex;
+
+#endif
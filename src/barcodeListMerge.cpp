@@ -1,4 +1,5 @@
 #include "barcodeListMerge.h"
+#include <queue>
 
 BarcodeListMerge::BarcodeListMerge(Options *opt) {
     mOptions = opt;
@@ -12,6 +13,14 @@ BarcodeListMerge::~BarcodeListMerge() {
 }
 
 void BarcodeListMerge::mergeBarcodeLists() {
+    bool allSorted = !dnbMapFiles.empty() && !ends_with(mergedDnbMapFile, ".bin");
+    for (auto dnbFile = dnbMapFiles.begin(); dnbFile != dnbMapFiles.end(); dnbFile++) {
+        if (!ends_with(*dnbFile, ".dnb")) allSorted = false;
+    }
+    if (allSorted) {
+        streamMergeDnbLists();
+        return;
+    }
     unordered_map<uint64, int> dnbMap;
     unordered_map<uint64, int> dnbMap_tmp;
     ifstream inDnb;
@@ -27,6 +36,13 @@ void BarcodeListMerge::mergeBarcodeLists() {
                 dnbMap_tmp[it.first] = it.second;
             }
             addBarcodeList(dnbMap_tmp);
+        } else if (ends_with(*dnbFile, ".dnb")) {
+            DnbCountReader dnbReader(*dnbFile);
+            uint64 encodePos;
+            uint32 count;
+            while (dnbReader.next(encodePos, count)) {
+                mergedDnbMap[encodePos] += count;
+            }
         } else {
             inDnb.open(dnbFile->c_str());
             int x;
@@ -50,6 +66,64 @@ void BarcodeListMerge::mergeBarcodeLists() {
     dumpMergedBarcodeList(mergedDnbMapFile);
 }
 
+void BarcodeListMerge::streamMergeDnbLists() {
+    int fileNum = dnbMapFiles.size();
+    vector<DnbCountReader *> readers(fileNum);
+    //(position, count, input index), smallest position on top
+    typedef pair<uint64, pair<uint32, int>> HeapItem;
+    priority_queue<HeapItem, vector<HeapItem>, greater<HeapItem>> heap;
+    uint64 encodePos;
+    uint32 count;
+    for (int i = 0; i < fileNum; i++) {
+        readers[i] = new DnbCountReader(dnbMapFiles[i]);
+        if (readers[i]->next(encodePos, count)) {
+            heap.push(make_pair(encodePos, make_pair(count, i)));
+        }
+    }
+
+    bool dnbOut = ends_with(mergedDnbMapFile, ".dnb");
+    DnbCountWriter *dnbWriter = NULL;
+    ofstream outDnb;
+    if (dnbOut) {
+        dnbWriter = new DnbCountWriter(mergedDnbMapFile);
+    } else {
+        outDnb.open(mergedDnbMapFile);
+    }
+    uint64 mergedNum = 0;
+    while (!heap.empty()) {
+        uint64 pos = heap.top().first;
+        uint64 total = 0;
+        while (!heap.empty() && heap.top().first == pos) {
+            HeapItem item = heap.top();
+            heap.pop();
+            total += item.second.first;
+            int i = item.second.second;
+            if (readers[i]->next(encodePos, count)) {
+                heap.push(make_pair(encodePos, make_pair(count, i)));
+            }
+        }
+        if (total > 0xFFFFFFFF) total = 0xFFFFFFFF;
+        if (dnbOut) {
+            dnbWriter->add(pos, total);
+        } else {
+            outDnb << (uint32) (pos >> 32) << "\t" << (uint32) (pos & 0x00000000FFFFFFFF) << "\t" << total << "\n";
+        }
+        mergedNum++;
+    }
+    if (dnbOut) {
+        dnbWriter->close();
+        delete dnbWriter;
+    } else {
+        outDnb.close();
+    }
+    for (int i = 0; i < fileNum; i++) {
+        delete readers[i];
+    }
+    if (mOptions->verbose) {
+        loginfo("merged " + to_string(fileNum) + " dnb lists, " + to_string(mergedNum) + " positions");
+    }
+}
+
 void BarcodeListMerge::addBarcodeList(unordered_map<uint64, int> &dnbMap) {
     unordered_map<uint64, int>::iterator mergedDnbIter;
     for (auto dnbIter = dnbMap.begin(); dnbIter != dnbMap.end(); dnbIter++) {
@@ -64,6 +138,20 @@ void BarcodeListMerge::addBarcodeList(unordered_map<uint64, int> &dnbMap) {
 }
 
 void BarcodeListMerge::dumpMergedBarcodeList(string &outfile) {
+    if (ends_with(outfile, ".dnb")) {
+        vector<pair<uint64, uint32>> dnbs;
+        dnbs.reserve(mergedDnbMap.size());
+        for (auto &it: mergedDnbMap) {
+            dnbs.push_back(make_pair(it.first, (uint32) it.second));
+        }
+        sort(dnbs.begin(), dnbs.end());
+        DnbCountWriter dnbWriter(outfile);
+        for (auto &it: dnbs) {
+            dnbWriter.add(it.first, it.second);
+        }
+        dnbWriter.close();
+        return;
+    }
     ofstream outDnb;
     unordered_map<uint64, int> mergedDnbMap_tmp;
     for (auto it :mergedDnbMap) {
@@ -10,6 +10,7 @@
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/serialization/unordered_map.hpp>
 #include "options.h"
+#include "dnbCountFile.h"
 
 using namespace std;
 
@@ -19,6 +20,8 @@ public:
     ~BarcodeListMerge();
     void mergeBarcodeLists();
 private:
+    //k-way merge of sorted .dnb inputs, memory does not grow with the list size
+    void streamMergeDnbLists();
     void addBarcodeList(unordered_map<uint64, int>& dnbMap);
     void dumpMergedBarcodeList(string& outfile);
 private:
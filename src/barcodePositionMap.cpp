@@ -1,4 +1,12 @@
 #include "barcodePositionMap.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
+#include <thread>
+#include "numaTopology.h"
+#include "hugePages.h"
 
 BarcodePositionMap::BarcodePositionMap(Options *opt) {
     mOptions = opt;
@@ -6,6 +14,14 @@ BarcodePositionMap::BarcodePositionMap(Options *opt) {
     barcodeStart = opt->barcodeStart;
     barcodeLen = opt->barcodeLen;
     segment = opt->barcodeSegment;
+    bpmap_head = NULL;
+    bpmap_nxt = NULL;
+    position_all = NULL;
+    barcodeIndex = NULL;
+    widePositions = NULL;
+    wideIndex = NULL;
+    bloomFilter = NULL;
+    dims1 = 0;
     split(opt->in, inMasks, ",");
     loadbpmap();
 }
@@ -15,29 +31,87 @@ BarcodePositionMap::~BarcodePositionMap() {
 //    unordered_map<uint64, Position1>().swap(bpmap);
     dupBarcode.clear();
     set<uint64>().swap(dupBarcode);
+    if (barcodeIndex) delete barcodeIndex;
+    if (wideIndex) delete wideIndex;
+    if (bloomFilter) delete bloomFilter;
+    for (size_t i = 1; i < nodeCopies.size(); i++) {
+        delete nodeCopies[i].index;
+        delete nodeCopies[i].wideIndex;
+        delete nodeCopies[i].bloomFilter;
+    }
 }
 
 void BarcodePositionMap::rangeRefresh(Position1 &position) {
     if (position.x < minX) {
         minX = position.x;
-    } else if (position.x > maxX) {
+    }
+    if (position.x > maxX) {
         maxX = position.x;
     }
     if (position.y < minY) {
         minY = position.y;
-    } else if (position.y > maxY) {
+    }
+    if (position.y > maxY) {
         maxY = position.y;
     }
 }
 
 long BarcodePositionMap::getBarcodeTypes() {
-    return bpmap.size();
+    return barcodeIndex || wideIndex ? indexSize : bpmap.size();
 }
 
 void BarcodePositionMap::dumpbpmap(string &mapOutFile) {
     time_t start = time(NULL);
     cout << "##########dump barcodeToPosition map begin..." << endl;
-    if (ends_with(mapOutFile, ".bin")) {
+    if (wideIndex != NULL) {
+        //.bin records and h5 datasets hold one uint64 per barcode
+        if (ends_with(mapOutFile, ".bin") || ends_with(mapOutFile, "h5") || ends_with(mapOutFile, "hdf5")) {
+            error_exit("barcodes longer than " + to_string(NARROW_BARCODE_LEN) + " bases can only be dumped as text");
+        }
+        ofstream writer(mapOutFile);
+        for (uint32 i = 0; i < indexSize; i++) {
+            bpmap_wide_key_value record = wideIndex->record(i);
+            writer << seqDecode(record.key, barcodeLen) << "\t" << record.value.x << "\t" << record.value.y << "\n";
+        }
+        writer.close();
+    } else if (barcodeIndex != NULL) {
+        //the mask was loaded into the barcode index, bpmap is empty
+        if (ends_with(mapOutFile, ".bin")) {
+            ofstream writer(mapOutFile, ios::out | ios::binary);
+            vector<bpmap_key_value> records;
+            records.reserve(1 << 16);
+            for (uint32 i = 0; i < indexSize; i++) {
+                records.push_back(barcodeIndex->record(i));
+                if (records.size() == records.capacity() || i + 1 == indexSize) {
+                    writer.write((char *) &records[0], records.size() * sizeof(bpmap_key_value));
+                    records.clear();
+                }
+            }
+            writer.close();
+        } else if (ends_with(mapOutFile, "h5") || ends_with(mapOutFile, "hdf5")) {
+            ChipMaskHDF5 chipMaskH5(mapOutFile);
+            chipMaskH5.creatFile();
+            uint8_t segment = mOptions->barcodeSegment;
+            if (mOptions->rc == 2) {
+                segment *= 2;
+            }
+            slideRange sliderange{minX, maxX, minY, maxY};
+            vector<bpmap_key_value> bpList(indexSize);
+            for (uint32 i = 0; i < indexSize; i++) {
+                bpList[i] = barcodeIndex->record(i);
+            }
+            chipMaskH5.writeDataSet(mOptions->chipID, sliderange, bpList, barcodeLen, segment, slidePitch,
+                                    mOptions->compression, mOptions->thread, mOptions->maskShuffle);
+        } else {
+            ofstream writer(mapOutFile);
+            for (uint32 i = 0; i < indexSize; i++) {
+                bpmap_key_value record = barcodeIndex->record(i);
+                writer << seqDecode(record.key, barcodeLen) << "\t" << record.value.x << "\t" << record.value.y
+                       << "\n";
+            }
+            writer.close();
+        }
+    } else if (ends_with(mapOutFile, ".bin")) {
         unordered_map<uint64, Position1>::iterator mapIter = bpmap.begin();
         bpmap.reserve(bpmap.size());
         ofstream writer(mapOutFile, ios::out | ios::binary);
@@ -45,8 +119,8 @@ void BarcodePositionMap::dumpbpmap(string &mapOutFile) {
         //oa << bpmap;
         while (mapIter != bpmap.end()) {
             writer.write((char *) &mapIter->first, sizeof(uint64));
-            writer.write((char *) &mapIter->second, sizeof(uint32));
-            writer.write((char *) &mapIter->second, sizeof(uint32));
+            writer.write((char *) &mapIter->second.x, sizeof(uint32));
+            writer.write((char *) &mapIter->second.y, sizeof(uint32));
             mapIter++;
         }
         writer.close();
@@ -59,7 +133,7 @@ void BarcodePositionMap::dumpbpmap(string &mapOutFile) {
         }
         slideRange sliderange{minX, maxX, minY, maxY};
         chipMaskH5.writeDataSet(mOptions->chipID, sliderange, bpmap, barcodeLen, segment, slidePitch,
-                                mOptions->compression);
+                                mOptions->compression, mOptions->thread, mOptions->maskShuffle);
     } else {
         ofstream writer(mapOutFile);
         unordered_map<uint64, Position1>::iterator mapIter = bpmap.begin();
@@ -77,74 +151,58 @@ void BarcodePositionMap::loadbpmap() {
     time_t start = time(NULL);
     string barcodePositionMapFile = inMasks.at(0);
     if (!file_exists(barcodePositionMapFile)) {
-        cerr << "barcodePositionMapFile does not exists: " << barcodePositionMapFile << endl;
-        exit(1);
+        error_exit("barcodePositionMapFile does not exists: " + barcodePositionMapFile);
     }
     uint32 mapSize = 0;
 
     if (mOptions->myRank == 0)
         cout << "###############load barcodeToPosition map begin..." << endl;
     //cout << "###############barcode map file: " << barcodePositionMapFile << endl;
-    if (ends_with(barcodePositionMapFile, ".bin")) {
-        ifstream mapReader(barcodePositionMapFile, ios::in | ios::binary);
-        if (!mapReader.is_open()) {
-            throw invalid_argument("Could not open the file: " + barcodePositionMapFile);
-        }
-        //boost::archive::binary_iarchive ia(mapReader);
-        //ia >> bpmap;
-        uint64 barcodeInt;
-        Position1 position;
-        while (!mapReader.eof()) {
-            mapReader.read((char *) &barcodeInt, sizeof(barcodeInt));
-            mapReader.read((char *) &position.x, sizeof(position.x));
-            mapReader.read((char *) &position.y, sizeof(position.y));
-            bpmap[barcodeInt] = position;
-            rangeRefresh(position);
-        }
-        mapReader.close();
+    bool wide = barcodeLen > NARROW_BARCODE_LEN;
+    if (wide && (ends_with(barcodePositionMapFile, ".bin") || ends_with(barcodePositionMapFile, "h5") ||
+                 ends_with(barcodePositionMapFile, "hdf5"))) {
+        //both formats store one uint64 per barcode
+        error_exit("barcodes longer than " + to_string(NARROW_BARCODE_LEN) + " bases need a text mask");
+    }
+    if (wide) {
+        mapSize = loadTextIndex(barcodePositionMapFile, widePositions);
+        buildIndex(widePositions, mapSize);
+    } else if (ends_with(barcodePositionMapFile, ".bin")) {
+        mapSize = loadBinIndex(barcodePositionMapFile);
+        buildIndex(position_all, mapSize);
     } else if (ends_with(barcodePositionMapFile, "h5") || ends_with(barcodePositionMapFile, "hdf5")) {
         ChipMaskHDF5 chipMaskH5(barcodePositionMapFile);
         chipMaskH5.openFile();
 //        chipMaskH5.readDataSet(hashNum, hashHead, hashMap, dims1, bloomFilter);
+        //the compact index is built from the records, it needs no chains
+        uint32 mapMod = mOptions->indexType == INDEX_LIST ? mOptions->mapMod : 0;
         chipMaskH5.readDataSetHashListOneArrayWithBloomFilter(mapSize, bpmap_head, bpmap_nxt, position_all,
-                                                              bloomFilter);
-    } else {
-        uint64 barcodeInt;
-        Position1 position;
-        string line;
-        ifstream mapReader(barcodePositionMapFile);
-        while (std::getline(mapReader, line)) {
-            if (line.empty()) {
-                cerr << "barcodePositionMap file read finished." << endl;
-                break;
-            }
-            vector<string> splitLine;
-            //std::getline(mapReader, line);
-            split(line, splitLine, "\t");
-            //position.fov_c = fovCol;
-            //position.fov_r = fovRow;
-            if (splitLine.size() < 3) {
-                break;
-            } else if (splitLine.size() == 3) {
-                position.x = std::stoi(splitLine[1]);
-                position.y = std::stoi(splitLine[2]);
-            } else {
-                position.x = std::stoi(splitLine[3]);
-                position.y = std::stoi(splitLine[4]);
-            }
-            barcodeInt = seqEncode(splitLine[0].c_str(), barcodeStart, barcodeLen);
-            bpmap[barcodeInt] = position;
-            rangeRefresh(position);
-            //cout << "barcode: " << barcodeInt << " position: " << position.x << " " << position.y <<endl;
+                                                              bloomFilter, mapMod, mOptions->bloomBits);
+        //positions in the h5 mask are absolute cells of the dataset grid
+        if (chipMaskH5.maskRows > 0 && chipMaskH5.maskCols > 0) {
+            minX = 0;
+            maxX = chipMaskH5.maskCols - 1;
+            minY = 0;
+            maxY = chipMaskH5.maskRows - 1;
+            dims1 = chipMaskH5.maskCols;
         }
-        //cout << "bpmap load suceessfully." << endl;
-        mapReader.close();
+    } else {
+        mapSize = loadTextIndex(barcodePositionMapFile, position_all);
+        buildIndex(position_all, mapSize);
     }
+    indexSize = mapSize;
+    if (wide) {
+        finishIndex(widePositions, mapSize, wideIndex);
+    } else {
+        finishIndex(position_all, mapSize, barcodeIndex);
+    }
+    placeOnNodes();
     if (mOptions->myRank == 0) {
         cout << "###############load barcodeToPosition map finished, time used: " << time(NULL) - start << " seconds"
              << endl;
         cout << resetiosflags(ios::fixed) << setprecision(2);
         cout << "getBarcodePositionMap_uniqBarcodeTypes: " << mapSize << endl;
+        loginfo(HugePages::report());
     }
 }
 
@@ -168,3 +226,249 @@ int BarcodePositionMap::GetDims1() const {
 BloomFilter *BarcodePositionMap::GetBloomFilter() const {
     return bloomFilter;
 }
+
+uint32 BarcodePositionMap::loadBinIndex(string &mapFile) {
+    int fd = open(mapFile.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        error_exit("Could not open the file: " + mapFile);
+    }
+    //records are barcode(uint64) x(uint32) y(uint32), the same layout as bpmap_key_value
+    uint64 entryNum = st.st_size / sizeof(bpmap_key_value);
+    position_all = HugePages::allocArray<bpmap_key_value>(entryNum > 0 ? entryNum : 1);
+    if (entryNum == 0) {
+        close(fd);
+        return 0;
+    }
+    void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(fd);
+        error_exit("Could not mmap the file: " + mapFile);
+    }
+    madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+    const bpmap_key_value *records = (const bpmap_key_value *) mapped;
+    int threadNum = max(1, mOptions->thread);
+#pragma omp parallel num_threads(threadNum)
+    {
+        uint32 lminX = OUTSIDE_DNB_POS_COL, lminY = OUTSIDE_DNB_POS_ROW, lmaxX = 0, lmaxY = 0;
+#pragma omp for
+        for (uint64 i = 0; i < entryNum; i++) {
+            position_all[i] = records[i];
+            lminX = min(lminX, records[i].value.x);
+            lmaxX = max(lmaxX, records[i].value.x);
+            lminY = min(lminY, records[i].value.y);
+            lmaxY = max(lmaxY, records[i].value.y);
+        }
+#pragma omp critical
+        {
+            minX = min(minX, lminX);
+            maxX = max(maxX, lmaxX);
+            minY = min(minY, lminY);
+            maxY = max(maxY, lmaxY);
+        }
+    }
+    munmap(mapped, st.st_size);
+    close(fd);
+    return entryNum;
+}
+
+template<class Key>
+uint32 BarcodePositionMap::loadTextIndex(string &mapFile, BarcodeRecord<Key> *&records) {
+    int fd = open(mapFile.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        error_exit("Could not open the file: " + mapFile);
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        records = HugePages::allocArray<BarcodeRecord<Key>>(1);
+        return 0;
+    }
+    char *text = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) {
+        close(fd);
+        error_exit("Could not mmap the file: " + mapFile);
+    }
+    madvise(text, st.st_size, MADV_SEQUENTIAL);
+    uint64 fileSize = st.st_size;
+    int threadNum = (int) min((uint64) max(1, mOptions->thread), fileSize);
+    vector<vector<BarcodeRecord<Key>>> parts(threadNum);
+
+    //every thread parses the lines starting inside its byte range
+#pragma omp parallel num_threads(threadNum)
+    {
+        int t = omp_get_thread_num();
+        uint64 begin = fileSize * t / threadNum;
+        uint64 end = fileSize * (t + 1) / threadNum;
+        if (t > 0) {
+            while (begin > 0 && begin < fileSize && text[begin - 1] != '\n') begin++;
+        }
+        while (end < fileSize && end > 0 && text[end - 1] != '\n') end++;
+        vector<BarcodeRecord<Key>> &part = parts[t];
+        part.reserve((end - begin) / 32);
+        uint32 lminX = OUTSIDE_DNB_POS_COL, lminY = OUTSIDE_DNB_POS_ROW, lmaxX = 0, lmaxY = 0;
+        uint64 p = begin;
+        while (p < end) {
+            const char *line = text + p;
+            const char *eol = (const char *) memchr(line, '\n', end - p);
+            if (eol == NULL) eol = text + end;
+            p = eol - text + 1;
+            const char *lineEnd = eol;
+            if (lineEnd > line && lineEnd[-1] == '\r') lineEnd--;
+            //barcode \t x \t y, or barcode \t ... \t x \t y in the 5 column format
+            const char *fields[5];
+            int fieldNum = 0;
+            const char *f = line;
+            while (fieldNum < 5 && f <= lineEnd) {
+                fields[fieldNum++] = f;
+                const char *tab = (const char *) memchr(f, '\t', lineEnd - f);
+                if (tab == NULL) break;
+                f = tab + 1;
+            }
+            if (fieldNum < 3 || fieldNum == 4) continue;
+            BarcodeRecord<Key> entry;
+            int xField = fieldNum == 3 ? 1 : 3;
+            entry.value.x = strtoul(fields[xField], NULL, 10);
+            entry.value.y = strtoul(fields[xField + 1], NULL, 10);
+            entry.key = seqEncode<Key>(fields[0], barcodeStart, barcodeLen);
+            part.push_back(entry);
+            lminX = min(lminX, entry.value.x);
+            lmaxX = max(lmaxX, entry.value.x);
+            lminY = min(lminY, entry.value.y);
+            lmaxY = max(lmaxY, entry.value.y);
+        }
+#pragma omp critical
+        {
+            minX = min(minX, lminX);
+            maxX = max(maxX, lmaxX);
+            minY = min(minY, lminY);
+            maxY = max(maxY, lmaxY);
+        }
+    }
+    munmap(text, st.st_size);
+    close(fd);
+
+    vector<uint64> partStart(threadNum + 1, 0);
+    for (int t = 0; t < threadNum; t++) {
+        partStart[t + 1] = partStart[t] + parts[t].size();
+    }
+    uint64 entryNum = partStart[threadNum];
+    records = HugePages::allocArray<BarcodeRecord<Key>>(entryNum > 0 ? entryNum : 1);
+#pragma omp parallel for num_threads(threadNum)
+    for (int t = 0; t < threadNum; t++) {
+        if (!parts[t].empty()) {
+            memcpy(records + partStart[t], &parts[t][0], parts[t].size() * sizeof(BarcodeRecord<Key>));
+        }
+        vector<BarcodeRecord<Key>>().swap(parts[t]);
+    }
+    return entryNum;
+}
+
+//same hash list and bloom filter as the h5 loader, chains are linked with atomic exchange and then put in order
+template<class Key>
+void BarcodePositionMap::buildIndex(BarcodeRecord<Key> *records, uint32 mapSize) {
+    int threadNum = max(1, mOptions->thread);
+    bloomFilter = new BloomFilter(mOptions->bloomBits);
+    if (mOptions->indexType == INDEX_LIST) {
+        uint32 mapMod = mOptions->mapMod;
+        bpmap_head = HugePages::allocArray<int>(mapMod);
+        bpmap_nxt = HugePages::allocArray<int>(mapSize > 0 ? mapSize : 1);
+#pragma omp parallel for num_threads(threadNum)
+        for (int i = 0; i < mapMod; i++) {
+            bpmap_head[i] = -1;
+        }
+#pragma omp parallel for num_threads(threadNum)
+        for (int i = 0; i < (int) mapSize; i++) {
+            uint64 barcodeHash = keyHash(records[i].key);
+            bpmap_nxt[i] = __atomic_exchange_n(&bpmap_head[barcodeHash % mapMod], i, __ATOMIC_RELAXED);
+        }
+        //the exchange order depends on thread timing, every chain is relinked from the last record to the first
+        //so a duplicate barcode resolves to the later record, as in a serial build and the other layouts
+#pragma omp parallel for num_threads(threadNum) schedule(dynamic, 1 << 16)
+        for (int b = 0; b < (int) mapMod; b++) {
+            int sorted = -1;
+            for (int i = bpmap_head[b]; i != -1;) {
+                int next = bpmap_nxt[i];
+                int *link = &sorted;
+                while (*link > i) link = &bpmap_nxt[*link];
+                bpmap_nxt[i] = *link;
+                *link = i;
+                i = next;
+            }
+            bpmap_head[b] = sorted;
+        }
+    }
+#pragma omp parallel for num_threads(threadNum)
+    for (int i = 0; i < (int) mapSize; i++) {
+        //the filter sees the first NARROW_BARCODE_LEN bases of a wide key, lookups query it the same way
+        bloomFilter->push_atomic((uint64) records[i].key);
+    }
+    if (mapSize > 0) {
+        dims1 = maxX + 1;
+    }
+}
+
+template<class Key>
+void BarcodePositionMap::finishIndex(BarcodeRecord<Key> *&records, uint32 mapSize, BasicBarcodeIndex<Key> *&index) {
+    index = new BasicBarcodeIndex<Key>();
+    if (mOptions->indexType == INDEX_LIST) {
+        index->adoptList(bpmap_head, bpmap_nxt, records, mapSize, mOptions->mapMod);
+    } else {
+        if (mOptions->indexType == INDEX_MPHF) {
+            index->buildMphf(records, mapSize, barcodeLen * 2, max(1, mOptions->thread));
+        } else {
+            index->buildCompact(records, mapSize, barcodeLen * 2, max(1, mOptions->thread));
+        }
+        HugePages::free(records);
+    }
+    bpmap_head = NULL;
+    bpmap_nxt = NULL;
+    records = NULL;
+    //the mphf keeps one record of a duplicated barcode
+    indexSize = index->size();
+}
+
+void BarcodePositionMap::placeOnNodes() {
+    int nodes = NumaTopology::nodes();
+    if (mOptions->numaMode == NUMA_OFF || nodes < 2 || (barcodeIndex == NULL && wideIndex == NULL)) return;
+    if (mOptions->numaMode == NUMA_INTERLEAVE) {
+        if (barcodeIndex) barcodeIndex->interleave();
+        if (wideIndex) wideIndex->interleave();
+        NumaTopology::interleave(bloomFilter->hashtable, bloomFilter->size * sizeof(uint64));
+        NumaTopology::interleave(bloomFilter->hashtableClassification, bloomFilter->size * sizeof(uint64));
+        return;
+    }
+    nodeCopies.resize(nodes);
+    nodeCopies[0] = {barcodeIndex, wideIndex, bloomFilter};
+    //every copy is written by a thread on its node, so its pages are placed there on first touch
+    vector<thread> copiers;
+    for (int node = 1; node < nodes; node++) {
+        copiers.push_back(thread(&BarcodePositionMap::copyToNode, this, node));
+    }
+    for (size_t i = 0; i < copiers.size(); i++) {
+        copiers[i].join();
+    }
+    if (mOptions->myRank == 0) {
+        loginfo("barcode index replicated on " + to_string(nodes) + " numa nodes");
+    }
+}
+
+void BarcodePositionMap::copyToNode(int node) {
+    NumaTopology::pinThread(node);
+    NumaIndexCopy &copy = nodeCopies[node];
+    copy.index = barcodeIndex ? barcodeIndex->copy() : NULL;
+    copy.wideIndex = wideIndex ? wideIndex->copy() : NULL;
+    copy.bloomFilter = new BloomFilter(mOptions->bloomBits);
+    memcpy(copy.bloomFilter->hashtable, bloomFilter->hashtable, bloomFilter->size * sizeof(uint64));
+    memcpy(copy.bloomFilter->hashtableClassification, bloomFilter->hashtableClassification,
+           bloomFilter->size * sizeof(uint64));
+}
+
+NumaIndexCopy BarcodePositionMap::getIndexOnNode(int node) {
+    if (nodeCopies.empty()) {
+        return {barcodeIndex, wideIndex, bloomFilter};
+    }
+    return nodeCopies[node % nodeCopies.size()];
+}
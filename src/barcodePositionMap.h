@@ -10,6 +10,7 @@
 #include "chipMaskHDF5.h"
 
 #include "bloomFilter.h"
+#include "barcodeIndex.h"
 #include <unordered_map>
 //#include "robin_hood.h"
 #include <iomanip>
@@ -21,6 +22,13 @@
 
 using namespace std;
 
+//lookup arrays of the index on one numa node, wideIndex instead of index for barcodes over NARROW_BARCODE_LEN
+struct NumaIndexCopy {
+    BarcodeIndex *index;
+    WideBarcodeIndex *wideIndex;
+    BloomFilter *bloomFilter;
+};
+
 class BarcodePositionMap {
 public:
     //BarcodePositionMap(vector<string>& InFile, string MaskFile, int BarcodeStart, int BarcodeLen, int Segment, int TurnFovDegree, bool IsSeq500, int RC, string readidSep = "/");
@@ -33,6 +41,25 @@ public:
 private:
     void rangeRefresh(Position1 &position);
 
+    //.bin and text masks go into the same hash list index as h5 masks
+    uint32 loadBinIndex(string &mapFile);
+
+    //text masks are the only ones with barcodes longer than NARROW_BARCODE_LEN, Key is uint128 for them
+    template<class Key>
+    uint32 loadTextIndex(string &mapFile, BarcodeRecord<Key> *&records);
+
+    template<class Key>
+    void buildIndex(BarcodeRecord<Key> *records, uint32 mapSize);
+
+    //moves the loaded records into index in the --indexType layout
+    template<class Key>
+    void finishIndex(BarcodeRecord<Key> *&records, uint32 mapSize, BasicBarcodeIndex<Key> *&index);
+
+    //interleaves the lookup arrays or copies them to every node, as --numa asks
+    void placeOnNodes();
+
+    void copyToNode(int node);
+
 public:
     long getBarcodeTypes();
 
@@ -53,13 +80,13 @@ public:
     BloomFilter *GetBloomFilter() const;
 
     Position1*                                   getPosition() {return position_index;}
-    int*                                         getHead(){return bpmap_head;}
-    int*                                         getNext(){return bpmap_nxt;}
     uint64*                                      getKey() {return bpmap_key;}
     int*                                         getValue(){return bpmap_value;}
     int*                                         getLen(){return bpmap_len;}
     BloomFilter*                                 getBloomFilter(){return bloomFilter;}
-    bpmap_key_value*                             getPositionAll(){return position_all;}
+    BarcodeIndex*                                getIndex(){return barcodeIndex;}
+    //arrays of the copy on node, the ones above when the index is not replicated
+    NumaIndexCopy                                getIndexOnNode(int node);
 
 public:
     unordered_map<uint64, Position1> bpmap;
@@ -79,6 +106,7 @@ public:
 
     //******************************************//
 
+    //filled by the loaders and handed to barcodeIndex, NULL after loading
     int *bpmap_head;
     int *bpmap_nxt;
     int *bpmap_value;
@@ -87,6 +115,14 @@ public:
     int *bpmap_len;
 
     Position1* position_index;
+    BarcodeIndex *barcodeIndex;
+    //barcodes longer than NARROW_BARCODE_LEN are loaded here instead of position_all and barcodeIndex
+    bpmap_wide_key_value *widePositions;
+    WideBarcodeIndex *wideIndex;
+    //number of barcodes in barcodeIndex
+    uint32 indexSize = 0;
+    //copies for --numa replicate, node 0 uses the arrays above
+    vector<NumaIndexCopy> nodeCopies;
 
 
     Options *mOptions;
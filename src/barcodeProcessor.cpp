@@ -43,30 +43,62 @@ BarcodeProcessor::BarcodeProcessor(Options *opt, int mhashNum, int *mhashHead, n
 //    polyTInt = seqEncode(polyT.c_str(), 0, barcodeLen, mOptions->rc);
 //    misMaskGenerate();
 //}
-BarcodeProcessor::BarcodeProcessor(Options *opt, int *mbpmap_head, int *mbpmap_nxt, bpmap_key_value *mposition_all,
-                                   BloomFilter *mbloomFilter) {
+BarcodeProcessor::BarcodeProcessor(Options *opt, BarcodeIndex *mbarcodeIndex, BloomFilter *mbloomFilter) {
 //    MAPNUM =0;
     mOptions = opt;
-    bpmap_head = mbpmap_head;
-    bpmap_nxt = mbpmap_nxt;
-    position_all = mposition_all;
+    narrowLookup.index = mbarcodeIndex;
     bloomFilter = mbloomFilter;
     mismatch = opt->transBarcodeToPos.mismatch;
     barcodeLen = opt->barcodeLen;
     polyTInt = seqEncode(polyT.c_str(), 0, barcodeLen, mOptions->rc);
-    misMaskGenerateSegment();
+    narrowLookup.polyTInt = polyTInt;
+    misMaskGenerateSegment(narrowLookup);
 //    misMaskGenerate();
 }
 
+BarcodeProcessor::BarcodeProcessor(Options *opt, WideBarcodeIndex *mwideIndex, BloomFilter *mbloomFilter) {
+    mOptions = opt;
+    wideLookup.index = mwideIndex;
+    bloomFilter = mbloomFilter;
+    mismatch = opt->transBarcodeToPos.mismatch;
+    barcodeLen = opt->barcodeLen;
+    string polyTLong(barcodeLen, 'T');
+    wideLookup.polyTInt = seqEncode<uint128>(polyTLong.c_str(), 0, barcodeLen, mOptions->rc);
+    misMaskGenerateSegment(wideLookup);
+}
+
 BarcodeProcessor::BarcodeProcessor() {
 }
 
 BarcodeProcessor::~BarcodeProcessor() {
-
+    //misMaskGenerate mallocs misMask, misMaskGenerateSegment puts the masks in the lookups
+    free(misMask);
+    delete[] misMaskLens;
+    delete[] misMaskClassification;
+    delete[] misMaskLensSegmentL;
+    delete[] narrowLookup.misMask;
+    delete[] narrowLookup.misMaskLensSegmentR;
+    delete[] wideLookup.misMask;
+    delete[] wideLookup.misMaskLensSegmentR;
 }
 
 bool BarcodeProcessor::process(Read *read1, Read *read2) {
+    Position1 position;
+    bool mapped;
+    pair<string, string> umi;
+    bool hasUmi;
+    bool umiPassFilter = locate(read1, read2, position, mapped, umi, hasUmi);
+    if (!mapped) {
+        return false;
+    }
+    annotate(read1, read2, &position, hasUmi ? &umi : NULL);
+    return umiPassFilter;
+}
+
+bool BarcodeProcessor::locate(Read *read1, Read *read2, Position1 &position, bool &mapped,
+                              pair<string, string> &umi, bool &hasUmi) {
     totalReads++;
+    hasUmi = false;
     string barcode;
     string barcodeQ;
     if (mOptions->transBarcodeToPos.barcodeRead == 1) {
@@ -83,15 +115,14 @@ bool BarcodeProcessor::process(Read *read1, Read *read2) {
 
 
 //    int position = getPosition(barcode);
-    Position1 *position = getPositionHashTableOneArrayWithBloomFiler(barcode);
+    mapped = getPositionHashTableOneArrayWithBloomFiler(barcode, position);
 
 
-    if (position != nullptr) {
+    if (mapped) {
         mMapToSlideRead++;
         bool umiPassFilter = true;
         //def umi start 25, umi len 10, umi read 1
         if (mOptions->transBarcodeToPos.umiStart >= 0 && mOptions->transBarcodeToPos.umiLen > 0) {
-            pair<string, string> umi;
             if (mOptions->transBarcodeToPos.umiRead == 1) {
                 //
                 getUMI(read1, umi);
@@ -99,21 +130,10 @@ bool BarcodeProcessor::process(Read *read1, Read *read2) {
                 getUMI(read2, umi, true);
             }
             umiPassFilter = umiStatAndFilter(umi);
-            if (!mOptions->transBarcodeToPos.PEout) {
-                //
-                addPositionToName(read2, position, &umi);
-            } else {
-                addPositionToNames(read1, read2, position, &umi);
-            }
-        } else {
-            if (!mOptions->transBarcodeToPos.PEout) {
-                addPositionToName(read2, position);
-            } else {
-                addPositionToNames(read1, read2, position);
-            }
+            hasUmi = true;
         }
         if (!mOptions->transBarcodeToPos.mappedDNBOutFile.empty())
-            addDNB(encodePosition(position->x, position->y));
+            addDNB(encodePosition(position.x, position.y));
 
         return umiPassFilter;
     }
@@ -121,6 +141,14 @@ bool BarcodeProcessor::process(Read *read1, Read *read2) {
 
 }
 
+void BarcodeProcessor::annotate(Read *read1, Read *read2, Position1 *position, pair<string, string> *umi) {
+    if (!mOptions->transBarcodeToPos.PEout) {
+        addPositionToName(read2, position, umi);
+    } else {
+        addPositionToNames(read1, read2, position, umi);
+    }
+}
+
 void BarcodeProcessor::addPositionToName(Read *r, Position1 *position, pair<string, string> *umi) {
     string position_tag = positionToString(position);
     int readTagPos = r->mName.find("/");
@@ -395,14 +423,15 @@ void BarcodeProcessor::misMaskGenerate() {
     }
 }
 
-void BarcodeProcessor::misMaskGenerateSegment() {
+template<class Key>
+void BarcodeProcessor::misMaskGenerateSegment(KeyLookup<Key> &lookup) {
     misMaskLen = barcodeLen * 3;
-    misMask = new uint64[misMaskLen];
+    lookup.misMask = new Key[misMaskLen];
     int index = 0;
     for (int i = 0; i < barcodeLen; i++) {
-        for (uint64 j = 1; j < 4; j++) {
-            uint64 misMaskInt = j << (i * 2);
-            misMask[index] = misMaskInt;
+        for (Key j = 1; j < 4; j++) {
+            Key misMaskInt = j << (i * 2);
+            lookup.misMask[index] = misMaskInt;
             index++;
         }
     }
@@ -414,20 +443,20 @@ void BarcodeProcessor::misMaskGenerateSegment() {
      */
 
 
-    int ClassificationLen = 16;
+    int ClassificationLen = MISMATCH_SPLIT_BASES;
 
     misMaskClassification = new int[3000];
     misMaskLensSegmentL = new uint64[9 * (barcodeLen * (barcodeLen - 1)) / 2];
-    misMaskLensSegmentR = new uint64[9 * (barcodeLen * (barcodeLen - 1)) / 2];
+    lookup.misMaskLensSegmentR = new Key[9 * (barcodeLen * (barcodeLen - 1)) / 2];
     index = 0;
     int Classificationindex = 0;
     for (int i = 0; i < barcodeLen - 1; i++) {
-        for (uint64 k1 = 1; k1 < 4; k1++) {
+        for (Key k1 = 1; k1 < 4; k1++) {
             for (int j = i + 1; j < barcodeLen; j++) {
-                for (uint64 k2 = 1; k2 < 4; k2++) {
-                    uint64 misMaskInt = (k1 << (i * 2)) | (k2 << (j * 2));
-                    misMaskLensSegmentL[index] = misMaskInt & 0xffffffff;
-                    misMaskLensSegmentR[index] = misMaskInt >> 32;
+                for (Key k2 = 1; k2 < 4; k2++) {
+                    Key misMaskInt = (k1 << (i * 2)) | (k2 << (j * 2));
+                    misMaskLensSegmentL[index] = (uint64) misMaskInt & 0xffffffff;
+                    lookup.misMaskLensSegmentR[index] = misMaskInt >> 32;
                     index++;
                     if (j < ClassificationLen) {
                         misMaskClassification[Classificationindex] = index;
@@ -524,47 +553,33 @@ pair<int, int> BarcodeProcessor::getMisOverlap(uint64 barcodeInt) {
     return {0, -1};
 }
 
-Position1 *BarcodeProcessor::getNOverlapZZ(string &barcodeString, uint8 Nindex) {
+template<class Key>
+bool BarcodeProcessor::getNOverlapZZ(string &barcodeString, uint8 Nindex, const KeyLookup<Key> &lookup,
+                                     Position1 &position) {
     //N has the same encode (11) with G
     int misCount = 0;
-    uint64 barcodeInt = seqEncode(barcodeString.c_str(), 0, barcodeString.length());
-    Position1 *iter = nullptr;
-    Position1 *overlapIter = nullptr;
-
-    uint32 mapKey = barcodeInt % MOD;
-    for (int i = bpmap_head[mapKey]; i != -1; i = bpmap_nxt[i]) {
-//        MAPNUM++;
-        if (position_all[i].key == barcodeInt) {
-            iter = &position_all[i].value;
-        }
-    }
+    Key barcodeInt = seqEncode<Key>(barcodeString.c_str(), 0, barcodeString.length());
+    Position1 iter;
 
-    if (iter != nullptr) {
+    if (lookup.index->find(barcodeInt, iter)) {
         misCount++;
-        overlapIter = iter;
+        position = iter;
     }
-    for (uint64 j = 1; j < 4; j++) {
-        uint64 misBarcodeInt = barcodeInt ^ (j << Nindex * 2);
-        uint32 mapKey = misBarcodeInt % MOD;
-        iter = nullptr;
-        for (int i = bpmap_head[mapKey]; i != -1; i = bpmap_nxt[i]) {
-            if (position_all[i].key == misBarcodeInt) {
-                iter = &position_all[i].value;
-            }
-        }
-        if (iter != nullptr) {
+    for (Key j = 1; j < 4; j++) {
+        Key misBarcodeInt = barcodeInt ^ (j << Nindex * 2);
+        if (lookup.index->find(misBarcodeInt, iter)) {
             misCount++;
             if (misCount > 1) {
-                return nullptr;
+                return false;
             }
-            overlapIter = iter;
+            position = iter;
         }
     }
     if (misCount == 1) {
         overlapReadsWithN++;
-        return overlapIter;
+        return true;
     }
-    return nullptr;
+    return false;
 }
 
 
@@ -608,7 +623,9 @@ int BarcodeProcessor::getNindex(string &barcodeString) {
 }
 
 void BarcodeProcessor::addDNB(uint64 barcodeInt) {
-    if (mDNB.count(barcodeInt) > 0) {
+    if (mDnbCounter != NULL) {
+        mDnbCounter->add(barcodeInt >> 32, barcodeInt & 0x00000000FFFFFFFF);
+    } else if (mDNB.count(barcodeInt) > 0) {
         mDNB[barcodeInt]++;
     } else {
         mDNB[barcodeInt]++;
@@ -677,8 +694,57 @@ bool BarcodeProcessor::umiStatAndFilter(pair<string, string> &umi) {
     }
 }
 
+long BarcodeProcessor::getDNBNum() {
+    if (mDnbCounter != NULL) {
+        return mDnbCounter->size();
+    }
+    return mDNB.size();
+}
+
 void BarcodeProcessor::dumpDNBmap(string &dnbMapFile) {
     ofstream writer;
+    if (ends_with(dnbMapFile, ".dnb")) {
+        vector<pair<uint64, uint32>> dnbs;
+        if (mDnbCounter != NULL) {
+            mDnbCounter->collect(dnbs);
+        } else {
+            dnbs.reserve(mDNB.size());
+            for (auto &it: mDNB) {
+                dnbs.push_back(make_pair(it.first, (uint32) it.second));
+            }
+            sort(dnbs.begin(), dnbs.end());
+        }
+        DnbCountWriter dnbWriter(dnbMapFile);
+        for (auto &it: dnbs) {
+            dnbWriter.add(it.first, it.second);
+        }
+        dnbWriter.close();
+        return;
+    }
+    if (mDnbCounter != NULL) {
+        vector<pair<uint64, uint32>> dnbs;
+        mDnbCounter->collect(dnbs);
+        if (ends_with(dnbMapFile, ".bin")) {
+            //same archive as the map based path, so barcodeListMerge can read it
+            unordered_map<uint64, int> mDNB_tmp;
+            mDNB_tmp.reserve(dnbs.size());
+            for (auto &it: dnbs) {
+                mDNB_tmp[it.first] = it.second;
+            }
+            writer.open(dnbMapFile, ios::out | ios::binary);
+            boost::archive::binary_oarchive oa(writer);
+            oa << mDNB_tmp;
+        } else {
+            writer.open(dnbMapFile);
+            for (auto &it: dnbs) {
+                uint32 x = it.first >> 32;
+                uint32 y = it.first & 0x00000000FFFFFFFF;
+                writer << x << "\t" << y << "\t" << it.second << "\n";
+            }
+        }
+        writer.close();
+        return;
+    }
     unordered_map<uint64, int> mDNB_tmp;
     for (auto it :mDNB) {
         mDNB_tmp[it.first] = it.second;
@@ -701,48 +767,60 @@ void BarcodeProcessor::dumpDNBmap(string &dnbMapFile) {
     writer.close();
 }
 
-Position1 *BarcodeProcessor::getPositionHashTableOneArrayWithBloomFiler(string &barcodeString) {
+bool BarcodeProcessor::getPositionHashTableOneArrayWithBloomFiler(string &barcodeString, Position1 &position) {
+    if (wideLookup.index != NULL) {
+        return getPositionHashTableOneArrayWithBloomFiler(barcodeString, wideLookup, position);
+    }
+    return getPositionHashTableOneArrayWithBloomFiler(barcodeString, narrowLookup, position);
+}
+
+template<class Key>
+bool BarcodeProcessor::getPositionHashTableOneArrayWithBloomFiler(string &barcodeString, const KeyLookup<Key> &lookup,
+                                                                  Position1 &position) {
     int Nindex = getNindex(barcodeString);
     if (Nindex == -1) {
-        uint64 barcodeInt = seqEncode(barcodeString.c_str(), 0, barcodeLen);
-        if (barcodeInt == polyTInt) {
-            return nullptr;
+        Key barcodeInt = seqEncode<Key>(barcodeString.c_str(), 0, barcodeLen);
+        if (barcodeInt == lookup.polyTInt) {
+            return false;
         }
-        return getPositionHashTableOneArrayWithBloomFiler(barcodeInt);
+        return getPositionHashTableOneArrayWithBloomFiler(barcodeInt, lookup, position);
     } else if (Nindex == -2) {
-        return nullptr;
+        return false;
     } else if (mismatch > 0) {
 //        printf("In this !!!!\n");
-        return getNOverlapZZ(barcodeString, Nindex);
+        ProfileTimer mismatchTimer(PROFILE_MISMATCH);
+        return getNOverlapZZ(barcodeString, Nindex, lookup, position);
     }
-    return nullptr;
+    return false;
 }
 
-Position1 *BarcodeProcessor::getPositionHashTableOneArrayWithBloomFiler(uint64 barcodeInt) {
-    uint32 mapKey = barcodeInt % MOD;
-    for (int i = bpmap_head[mapKey]; i != -1; i = bpmap_nxt[i]) {
-//        MAPNUM++;
-        if (position_all[i].key == barcodeInt) {
-            overlapReads++;
-            return &position_all[i].value;
-        }
+template<class Key>
+bool BarcodeProcessor::getPositionHashTableOneArrayWithBloomFiler(Key barcodeInt, const KeyLookup<Key> &lookup,
+                                                                  Position1 &position) {
+    ProfileTimer lookupTimer(PROFILE_LOOKUP);
+    if (lookup.index->find(barcodeInt, position)) {
+        overlapReads++;
+        return true;
     }
 //    cerr << " in this Ok \n" << endl;
+    lookupTimer.stop();
     if (mismatch > 0) {
+        ProfileTimer mismatchTimer(PROFILE_MISMATCH);
         int mis_status;
-        Position1 *result_value;
-        mis_status = getMisOverlapHashTableOneArrayWithBloomFiler(barcodeInt, result_value);
+        mis_status = getMisOverlapHashTableOneArrayWithBloomFiler(barcodeInt, lookup, position);
         if (mis_status == 0) {
             overlapReadsWithMis++;
-            return result_value;
+            return true;
         } else {
-            return nullptr;
+            return false;
         }
     }
-    return nullptr;
+    return false;
 }
 
-int BarcodeProcessor::getMisOverlapHashTableOneArrayWithBloomFiler(uint64 barcodeInt, Position1 *&result_value) {
+template<class Key>
+int BarcodeProcessor::getMisOverlapHashTableOneArrayWithBloomFiler(Key barcodeInt, const KeyLookup<Key> &lookup,
+                                                                  Position1 &result_value) {
 
 //    uint64 misBarcodeInt;
 //    int misCount = 0;
@@ -784,37 +862,27 @@ int BarcodeProcessor::getMisOverlapHashTableOneArrayWithBloomFiler(uint64 barcod
 /*
  *  处理mismatch == 1 的情况
  */
-    for (int i = 0; i < 16 * 3; i++) {
-        uint64 misBarcodeInt = barcodeInt ^ misMask[i];
-        uint32 mapKey = misBarcodeInt % MOD;
+    //the bloom filter is queried with the first NARROW_BARCODE_LEN bases of wide keys, as it was filled
+    int splitMasks = min(MISMATCH_SPLIT_BASES * 3, misMaskLen);
+    for (int i = 0; i < splitMasks; i++) {
+        Key misBarcodeInt = barcodeInt ^ lookup.misMask[i];
 //        MAPNUM++;
-        if (bloomFilter->get_Classification(misBarcodeInt))
-            for (int i = bpmap_head[mapKey]; i != -1; i = bpmap_nxt[i]) {
-//            MAPNUM++;
-                if (position_all[i].key == misBarcodeInt) {
-                    result_value = &position_all[i].value;
-                    misCount++;
-                    if (misCount > 1) {
-                        return -1;
-                    }
-                    break;
-                }
+        if (bloomFilter->get_Classification((uint64) misBarcodeInt) &&
+            lookup.index->find(misBarcodeInt, result_value)) {
+            misCount++;
+            if (misCount > 1) {
+                return -1;
             }
+        }
     }
-    if (bloomFilter->get_Classification(barcodeInt)) {
-        for (int i = 16 * 3; i < misMaskLen; i++) {
-            uint64 misBarcodeInt = barcodeInt ^ misMask[i];
-            uint32 mapKey = misBarcodeInt % MOD;
+    if (bloomFilter->get_Classification((uint64) barcodeInt)) {
+        for (int i = splitMasks; i < misMaskLen; i++) {
+            Key misBarcodeInt = barcodeInt ^ lookup.misMask[i];
 //        MAPNUM++;
-            for (int i = bpmap_head[mapKey]; i != -1; i = bpmap_nxt[i]) {
-//            MAPNUM++;
-                if (position_all[i].key == misBarcodeInt) {
-                    result_value = &position_all[i].value;
-                    misCount++;
-                    if (misCount > 1) {
-                        return -1;
-                    }
-                    break;
+            if (lookup.index->find(misBarcodeInt, result_value)) {
+                misCount++;
+                if (misCount > 1) {
+                    return -1;
                 }
             }
         }
@@ -824,8 +892,8 @@ int BarcodeProcessor::getMisOverlapHashTableOneArrayWithBloomFiler(uint64 barcod
     if (mismatch < 2) return -1;
 
 
-    uint64 mapkey = barcodeInt & 0xffffffff;
-    uint64 mapValue = barcodeInt >> 32;
+    uint64 mapkey = (uint64) barcodeInt & 0xffffffff;
+    Key mapValue = barcodeInt >> 32;
 
 //    cerr << "misMaskClassificationNumber is " << misMaskClassificationNumber << endl;
 
@@ -875,20 +943,16 @@ int BarcodeProcessor::getMisOverlapHashTableOneArrayWithBloomFiler(uint64 barcod
         }
         int MisEnd = i > 0 ? misMaskClassification[i - 1] : 0;
         while (misMaskIndex >= MisEnd) {
-            uint64 misBarcodeInt = mapValue ^ misMaskLensSegmentR[misMaskIndex];
+            Key misBarcodeInt = mapValue ^ lookup.misMaskLensSegmentR[misMaskIndex];
             misBarcodeInt = (misBarcodeInt << 32) | misBarcodeIntKey;
-            if (bloomFilter->get_mod(misBarcodeInt))
+            if (bloomFilter->get_mod((uint64) misBarcodeInt))
 //            if (bloomFilter->get_xor(misBarcodeInt))
             {
 //                MAPNUM++;
-                for (int ii = bpmap_head[misBarcodeInt % MOD]; ii != -1; ii = bpmap_nxt[ii]) {
-                    if (position_all[ii].key == misBarcodeInt) {
-                        result_value = &position_all[ii].value;
-                        misCount++;
-                        if (misCount > 1) {
-                            return -1;
-                        }
-                        break;
+                if (lookup.index->find(misBarcodeInt, result_value)) {
+                    misCount++;
+                    if (misCount > 1) {
+                        return -1;
                     }
                 }
             }
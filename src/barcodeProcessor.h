@@ -13,10 +13,28 @@
 #include "options.h"
 #include "util.h"
 #include "bloomFilter.h"
+#include "dnbCounter.h"
+#include "dnbCountFile.h"
+#include "profiler.h"
 //#include "robin_hood.h"
 
 using namespace std;
 
+//the classification table of the bloom filter is indexed by the low 32 bits of a key, the first 16 bases,
+//masks changing two bases are split there so most candidates are dropped on that half alone
+#define MISMATCH_SPLIT_BASES 16
+
+//index and masks of one key width, uint64 keys up to NARROW_BARCODE_LEN bases, uint128 keys above
+template<class Key>
+struct KeyLookup {
+    BasicBarcodeIndex<Key> *index = NULL;
+    Key polyTInt = 0;
+    //one base changed, 3 masks per base
+    Key *misMask = NULL;
+    //two bases changed, the bases from MISMATCH_SPLIT_BASES on, misMaskLensSegmentL has the ones before
+    Key *misMaskLensSegmentR = NULL;
+};
+
 class BarcodeProcessor {
 public:
     BarcodeProcessor(Options *opt, unordered_map<uint64, Position1> *mbpmap);
@@ -25,8 +43,10 @@ public:
 
 //    BarcodeProcessor(Options *opt, int mhashNum, int *mhashHead, node *mhashMap, uint64 *mBloomFilter);
 
-    BarcodeProcessor(Options *opt, int *mbpmap_head, int *mbpmap_nxt, bpmap_key_value *mposition_all,
-                     BloomFilter *mbloomFilter);
+    BarcodeProcessor(Options *opt, BarcodeIndex *mbarcodeIndex, BloomFilter *mbloomFilter);
+
+    //barcodes longer than NARROW_BARCODE_LEN
+    BarcodeProcessor(Options *opt, WideBarcodeIndex *mwideIndex, BloomFilter *mbloomFilter);
 
     BarcodeProcessor();
 
@@ -34,8 +54,16 @@ public:
 
     bool process(Read *read1, Read *read2);
 
+    //process() in two steps, locate() only touches read2 when the barcode or umi is on read2
+    bool locate(Read *read1, Read *read2, Position1 &position, bool &mapped, pair<string, string> &umi,
+                bool &hasUmi);
+
+    void annotate(Read *read1, Read *read2, Position1 *position, pair<string, string> *umi);
+
     void dumpDNBmap(string &dnbMapFile);
 
+    long getDNBNum();
+
 private:
     void addPositionToName(Read *r, Position1 *position, pair<string, string> *umi = NULL);
 
@@ -59,7 +87,8 @@ private:
 
     void misMaskGenerate();
 
-    void misMaskGenerateSegment();
+    template<class Key>
+    void misMaskGenerateSegment(KeyLookup<Key> &lookup);
 
     string positionToString(int position);
 
@@ -71,7 +100,8 @@ private:
 
     int getNOverlap(string &barcodeString, uint8 Nindex);
 
-    Position1 *getNOverlapZZ(string &barcodeString, uint8 Nindex);
+    template<class Key>
+    bool getNOverlapZZ(string &barcodeString, uint8 Nindex, const KeyLookup<Key> &lookup, Position1 &position);
 
     int getNindex(string &barcodeString);
 
@@ -85,21 +115,29 @@ private:
 
     pair<int, int> queryMap(uint64 barcodeInt);
 
-    int getMisOverlapHashTableOneArrayWithBloomFiler(uint64 barcodeInt, Position1 *&result_value);
+    template<class Key>
+    int getMisOverlapHashTableOneArrayWithBloomFiler(Key barcodeInt, const KeyLookup<Key> &lookup,
+                                                     Position1 &result_value);
+
+    //one branch on the key width per read, the lookups below are compiled for each width
+    bool getPositionHashTableOneArrayWithBloomFiler(string &barcodeString, Position1 &position);
 
-    Position1 *getPositionHashTableOneArrayWithBloomFiler(string &barcodeString);
+    template<class Key>
+    bool getPositionHashTableOneArrayWithBloomFiler(string &barcodeString, const KeyLookup<Key> &lookup,
+                                                    Position1 &position);
 
-    Position1 *getPositionHashTableOneArrayWithBloomFiler(uint64 barcodeInt);
+    template<class Key>
+    bool getPositionHashTableOneArrayWithBloomFiler(Key barcodeInt, const KeyLookup<Key> &lookup,
+                                                    Position1 &position);
 
 
 private:
-    uint64 *misMask;
+    uint64 *misMask = NULL;
     int misMaskLen;
-    int *misMaskLens;
+    int *misMaskLens = NULL;
     int misMaskClassificationNumber;
-    int *misMaskClassification;
-    uint64 *misMaskLensSegmentL;
-    uint64 *misMaskLensSegmentR;
+    int *misMaskClassification = NULL;
+    uint64 *misMaskLensSegmentL = NULL;
     uint64 *misMaskHash;
     const char q10 = '+';
     const char q20 = '5';
@@ -120,12 +158,12 @@ public:
     BloomFilter *bloomFilter;
 
 
-    int *bpmap_head;
-    int *bpmap_nxt;
+    //wideLookup.index is set instead of narrowLookup.index for barcodes over NARROW_BARCODE_LEN
+    KeyLookup<uint64> narrowLookup;
+    KeyLookup<uint128> wideLookup;
     uint64 *bpmap_key;
     int *bpmap_value;
     int *bpmap_len;
-    bpmap_key_value *position_all;
 
 
     long totQuery = 0;
@@ -148,6 +186,8 @@ public:
     long umiNFilterReads = 0;
     long umiPloyAFilterReads = 0;
     unordered_map<uint64, int> mDNB;
+    //shared by all threads when set, mDNB stays empty then
+    DnbCounter *mDnbCounter = NULL;
 
     int mismatch;
     int barcodeLen;
@@ -0,0 +1,120 @@
+#include "barcodeToPositionBatch.h"
+#include <sstream>
+
+double GetTime();
+
+BarcodeToPositionBatch::BarcodeToPositionBatch(Options *opt) {
+    mOptions = opt;
+    mbpmap = NULL;
+    mNextLane = 0;
+    loadLaneList();
+}
+
+BarcodeToPositionBatch::~BarcodeToPositionBatch() {
+    if (mbpmap) {
+        delete mbpmap;
+        mbpmap = NULL;
+    }
+}
+
+void BarcodeToPositionBatch::loadLaneList() {
+    ifstream laneList(mOptions->laneList.c_str());
+    if (!laneList.is_open()) {
+        error_exit("can not open lane list file: " + mOptions->laneList);
+    }
+    string line;
+    while (getline(laneList, line)) {
+        if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+        if (line.empty() || line[0] == '#') continue;
+        //in1 in2 out [barcodeReadsCount]
+        stringstream ss(line);
+        LaneTask lane;
+        ss >> lane.in1 >> lane.in2 >> lane.out >> lane.mappedDNBOutFile;
+        if (lane.out.empty()) {
+            error_exit("wrong line in lane list, expect \"in1 in2 out [barcodeReadsCount]\": " + line);
+        }
+        check_file_valid(lane.in1);
+        check_file_valid(lane.in2);
+        mLanes.push_back(lane);
+    }
+    laneList.close();
+    if (mLanes.empty()) {
+        error_exit("no lane found in " + mOptions->laneList);
+    }
+}
+
+Options *BarcodeToPositionBatch::makeLaneOptions(LaneTask &lane, int laneId, int laneParallel) {
+    Options *laneOpt = new Options(*mOptions);
+    laneOpt->shareThreads(laneParallel);
+    //lanes mapped at the same time are profiled apart
+    if (!laneOpt->profileOut.empty()) {
+        laneOpt->profileOut += ".lane" + to_string(laneId);
+    }
+    laneOpt->transBarcodeToPos.in1 = lane.in1;
+    laneOpt->transBarcodeToPos.in2 = lane.in2;
+    laneOpt->transBarcodeToPos.mappedDNBOutFile = lane.mappedDNBOutFile;
+    string out = lane.out;
+    if (laneOpt->usePigz) {
+        out = out.substr(0, out.find(".gz"));
+    }
+    laneOpt->out = out;
+    laneOpt->transBarcodeToPos.out1 = out;
+    if (laneOpt->usePugz &&
+        (detectInputFormat(lane.in1, true) != INPUT_GZIP || detectInputFormat(lane.in2, true) != INPUT_GZIP)) {
+        laneOpt->usePugz = 0;
+    }
+    return laneOpt;
+}
+
+void BarcodeToPositionBatch::laneTask(int laneParallel) {
+    while (true) {
+        int id = mNextLane++;
+        if (id >= mLanes.size()) break;
+        LaneTask &lane = mLanes[id];
+        double t0 = GetTime();
+        loginfo("start lane " + to_string(id) + ": " + lane.in1 + " " + lane.in2 + " -> " + lane.out);
+        Options *laneOpt = makeLaneOptions(lane, id, laneParallel);
+        BarcodeToPositionMulti *barcodeToPosMulti = new BarcodeToPositionMulti(laneOpt, mbpmap);
+        barcodeToPosMulti->process();
+        delete barcodeToPosMulti;
+        delete laneOpt;
+        loginfo("lane " + to_string(id) + " done, cost " + to_string(GetTime() - t0));
+    }
+}
+
+bool BarcodeToPositionBatch::process() {
+    if (mOptions->numPro > 1) {
+        error_exit("laneList mode runs in a single process, please start it without mpirun -n > 1");
+    }
+    if (mOptions->transBarcodeToPos.PEout) {
+        error_exit("laneList mode does not support PEout");
+    }
+
+    double t0 = GetTime();
+    mbpmap = new BarcodePositionMap(mOptions);
+    mOptions->dims1Size = mbpmap->GetDims1();
+#ifdef PRINT_INFO
+    printf("batch mode load map cost %.4f, %zu lanes\n", GetTime() - t0, mLanes.size());
+#endif
+
+    int laneParallel = mOptions->laneParallel;
+    //pigz keeps its state in globals, only one pigz instance can run at a time
+    if (mOptions->usePigz || mOptions->outGzSpilt) laneParallel = 1;
+    if (laneParallel < 1) laneParallel = 1;
+    if (laneParallel > mLanes.size()) laneParallel = mLanes.size();
+
+    t0 = GetTime();
+    thread **lanes = new thread *[laneParallel];
+    for (int i = 0; i < laneParallel; i++) {
+        lanes[i] = new thread(bind(&BarcodeToPositionBatch::laneTask, this, laneParallel));
+    }
+    for (int i = 0; i < laneParallel; i++) {
+        lanes[i]->join();
+        delete lanes[i];
+    }
+    delete[] lanes;
+#ifdef PRINT_INFO
+    printf("batch mode all lanes done, cost %.4f\n", GetTime() - t0);
+#endif
+    return true;
+}
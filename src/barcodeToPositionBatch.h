@@ -0,0 +1,51 @@
+#ifndef BARCODETOPOSITIONBATCH_H
+#define BARCODETOPOSITIONBATCH_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <functional>
+
+#include "options.h"
+#include "barcodePositionMap.h"
+#include "barcodeToPositionMulti.h"
+
+using namespace std;
+
+struct LaneTask {
+    string in1;
+    string in2;
+    string out;
+    string mappedDNBOutFile;
+};
+
+/*
+ * Map every lane listed in --laneList against one BarcodePositionMap.
+ * The mask index is built once, lanes are run by BarcodeToPositionMulti
+ * with the preloaded map, --laneParallel lanes at a time.
+ */
+class BarcodeToPositionBatch {
+public:
+    BarcodeToPositionBatch(Options *opt);
+
+    ~BarcodeToPositionBatch();
+
+    bool process();
+
+private:
+    void loadLaneList();
+
+    //laneParallel lanes run at the same time and share the threads of the run
+    Options *makeLaneOptions(LaneTask &lane, int laneId, int laneParallel);
+
+    void laneTask(int laneParallel);
+
+private:
+    Options *mOptions;
+    BarcodePositionMap *mbpmap;
+    vector<LaneTask> mLanes;
+    atomic_int mNextLane;
+};
+
+#endif
@@ -12,6 +12,8 @@
 #include <unistd.h>
 #include <utime.h>
 #include "pigz.h"
+#include "pairedChunker.h"
+#include "numaTopology.h"
 
 
 double GetTime() {
@@ -90,6 +92,7 @@ stat_file(struct file_stream *in, stat_t *stbuf, bool allow_hard_links) {
 
 void BarcodeToPositionMulti::getMbpmap() {
     mbpmap = new BarcodePositionMap(mOptions);
+    mOwnMap = true;
 
 }
 
@@ -102,6 +105,15 @@ BarcodeToPositionMulti::BarcodeToPositionMulti(Options *opt) {
     mZipFile = NULL;
     mWriter = NULL;
     mUnmappedWriter = NULL;
+    mbpmap = NULL;
+    fixedFilter = NULL;
+    pugzQueue1 = NULL;
+    pugzQueue2 = NULL;
+    pigzQueue = NULL;
+    pigzLast.first = NULL;
+    pairReader = NULL;
+    mProfiler = NULL;
+    mPigzStage = NULL;
     bool isSeq500 = opt->isSeq500;
 //    mbpmap = new BarcodePositionMap(opt);
 //    printf("test4 val is %d\n", mbpmap->GetHashHead()[109547259]);
@@ -111,12 +123,32 @@ BarcodeToPositionMulti::BarcodeToPositionMulti(Options *opt) {
         fixedFilter = new FixedFilter(opt);
         filterFixedSequence = true;
     }
+    //without fixed sequence filter only the barcode and umi of read1 are used, read2 is the output
+    if (!filterFixedSequence && !mOptions->transBarcodeToPos.PEout) {
+        lightRead1 = true;
+        read1PrefixLen = 0;
+        if (mOptions->transBarcodeToPos.barcodeRead == 1) {
+            read1PrefixLen = mOptions->barcodeStart + mOptions->barcodeLen;
+        }
+        if (mOptions->transBarcodeToPos.umiRead == 1 && mOptions->transBarcodeToPos.umiStart >= 0 &&
+            mOptions->transBarcodeToPos.umiLen > 0) {
+            read1PrefixLen = max(read1PrefixLen,
+                                 mOptions->transBarcodeToPos.umiStart + mOptions->transBarcodeToPos.umiLen);
+        }
+        //unmapped reads are dropped and read2 is not needed to locate the barcode
+        bool umiOnRead2 = mOptions->transBarcodeToPos.umiRead != 1 && mOptions->transBarcodeToPos.umiStart >= 0 &&
+                          mOptions->transBarcodeToPos.umiLen > 0;
+        if (mOptions->transBarcodeToPos.unmappedOutFile.empty() && mOptions->transBarcodeToPos.barcodeRead == 1 &&
+            !umiOnRead2) {
+            barcodeFirst = true;
+        }
+    }
     if (mOptions->usePugz) {
-        pugzQueue1 = new moodycamel::ReaderWriterQueue<pair<char *, int>>(256);
-        pugzQueue2 = new moodycamel::ReaderWriterQueue<pair<char *, int>>(256);
+        pugzQueue1 = new moodycamel::ReaderWriterQueue<pair<char *, int>>(mOptions->queueDepth);
+        pugzQueue2 = new moodycamel::ReaderWriterQueue<pair<char *, int>>(mOptions->queueDepth);
     }
     if (mOptions->usePigz) {
-        pigzQueue = new moodycamel::ReaderWriterQueue<std::pair<int, std::pair<char *, int>>>(256);
+        pigzQueue = new moodycamel::ReaderWriterQueue<std::pair<int, std::pair<char *, int>>>(mOptions->queueDepth);
         pigzLast.first = new char[1 << 24];
         pigzLast.second = 0;
     }
@@ -129,10 +161,31 @@ BarcodeToPositionMulti::BarcodeToPositionMulti(Options *opt) {
 //    cout << "mergeDone " << mergeDone << endl;
 }
 
+BarcodeToPositionMulti::BarcodeToPositionMulti(Options *opt, BarcodePositionMap *bpmap)
+        : BarcodeToPositionMulti(opt) {
+    mbpmap = bpmap;
+}
+
 BarcodeToPositionMulti::~BarcodeToPositionMulti() {
-    //if (fixedFilter) {
-    //	delete fixedFilter;
-    //}
+    //lanes and server jobs build one of these per run in a long lived process
+    if (pairReader)
+        delete pairReader;
+    if (pugzQueue1)
+        delete pugzQueue1;
+    if (pugzQueue2)
+        delete pugzQueue2;
+    if (pigzQueue)
+        delete pigzQueue;
+    if (pigzLast.first)
+        delete[] pigzLast.first;
+    if (fixedFilter)
+        delete fixedFilter;
+    if (mOwnMap && mbpmap)
+        delete mbpmap;
+    if (mProfiler)
+        delete mProfiler;
+    //a server job that failed before process() finished still has its writers
+    closeOutput();
     //unordered_map<uint64, Position*>().swap(misBarcodeMap);
 }
 
@@ -215,49 +268,102 @@ argv p.fq
     memcpy(infos[8], out_file.c_str(), out_file.length());
     infos[8][out_file.length()] = '\0';
 
+    pinStage(NumaTopology::nodes() - 1);
+    //pigz clears the option slots of argv while parsing them
+    char *threadArg = infos[2];
+    char *outArg = infos[8];
+    ProfileTimer compressTimer(PROFILE_COMPRESS);
     main_pigz(cnt, infos, pigzQueue, &writerDone, pigzLast);
+    delete[] threadArg;
+    delete[] outArg;
+    delete[] infos;
 }
 
 bool BarcodeToPositionMulti::process() {
+    try {
+        return runPipeline();
+    } catch (exception &e) {
+        //the producer stops on the job error, so the stages drain before this object can be freed
+        if (mOptions->jobError) mOptions->jobError->set(e.what());
+        joinStages();
+        throw;
+    }
+}
+
+bool BarcodeToPositionMulti::runPipeline() {
     auto t0 = GetTime();
 
     initOutput();
     initPackRepositoey();
+    planGzInput();
 
-    thread *pugzer1;
-    thread *pugzer2;
-    if (mOptions->usePugz) {
-        pugzer1 = new thread(bind(&BarcodeToPositionMulti::pugzTask1, this));
-        pugzer2 = new thread(bind(&BarcodeToPositionMulti::pugzTask2, this));
+    //stage timers and queue depths of this run, one json per rank
+    if (!mOptions->profileOut.empty() || mOptions->verbose) {
+        string profileOut = mOptions->profileOut;
+        if (!profileOut.empty() && mOptions->numPro > 1) {
+            profileOut += "." + to_string(mOptions->myRank);
+        }
+        mProfiler = new Profiler(profileOut, mOptions->myRank, mOptions->verbose);
+    }
+    if (mProfiler) {
+        if (mUsePugz) {
+            mProfiler->addGauge("pugzQueue1", [this]() { return (long) pugzQueue1->size_approx(); });
+            mProfiler->addGauge("pugzQueue2", [this]() { return (long) pugzQueue2->size_approx(); });
+        }
+        mProfiler->addGauge("mRepo", [this]() { return (long) (mRepo.writePos - mRepo.readPos); });
+        if (mOptions->usePigz) {
+            mProfiler->addGauge("pigzQueue", [this]() { return (long) pigzQueue->size_approx(); });
+        }
+        if (mWriter) {
+            mProfiler->addGauge("writer", [this]() {
+                return (long) (mWriter->GetMInputCounter() - mWriter->GetMOutputCounter());
+            });
+        }
     }
 
-
-    thread *getMbp;
-    getMbp = new thread(bind(&BarcodeToPositionMulti::getMbpmap, this));
+    thread *pugzer1 = NULL;
+    thread *pugzer2 = NULL;
+    if (mUsePugz) {
+        pugzer1 = startStage(bind(&BarcodeToPositionMulti::pugzTask1, this), [this]() { pugz1Done = 1; });
+        pugzer2 = startStage(bind(&BarcodeToPositionMulti::pugzTask2, this), [this]() { pugz2Done = 1; });
+    }
 
 
-    getMbp->join();
+    if (mbpmap == NULL) {
+        thread *getMbp;
+        getMbp = new thread(bind(&BarcodeToPositionMulti::getMbpmap, this));
+        getMbp->join();
+        delete getMbp;
+    }
 #ifdef PRINT_INFO
     printf("processor %d get map thread done,cost %.4f\n", mOptions->myRank, GetTime() - t0);
 #endif
     t0 = GetTime();
 
     thread *producer;
-    producer = new thread(bind(&BarcodeToPositionMulti::producerTask, this));
+    producer = startStage(bind(&BarcodeToPositionMulti::producerTask, this), [this]() {
+        mProduceFinished = true;
+        producerDone = 1;
+    });
 
     mOptions->dims1Size = mbpmap->GetDims1();
 
 
+    DnbCounter *dnbCounter = NULL;
+    if (!mOptions->transBarcodeToPos.mappedDNBOutFile.empty()) {
+        dnbCounter = new DnbCounter(mbpmap->minX, mbpmap->maxX, mbpmap->minY, mbpmap->maxY,
+                                    mOptions->dnbLayout);
+    }
     Result **results = new Result *[mOptions->thread];
-    BarcodeProcessor **barcodeProcessors = new BarcodeProcessor *[mOptions->thread];
+    //consumers are spread over the numa nodes, each looks up in the index of its node
+    int numaNodes = mOptions->numaMode == NUMA_OFF ? 1 : NumaTopology::nodes();
     for (int t = 0; t < mOptions->thread; t++) {
         results[t] = new Result(mOptions, true);
 //        results[t]->setBarcodeProcessor(mbpmap->GetHashNum(), mbpmap->GetHashHead(), mbpmap->GetHashMap(),
 //                                        mbpmap->GetBloomFilter());
-        results[t]->setBarcodeProcessorHashTableOneArrayWithBloomFilter(mbpmap->getHead(), mbpmap->getNext(),
-                                                                        mbpmap->getPositionAll(),
-                                                                        mbpmap->getBloomFilter());
-
+        NumaIndexCopy index = mbpmap->getIndexOnNode(t % numaNodes);
+        results[t]->setBarcodeProcessorHashTableOneArrayWithBloomFilter(index);
+        results[t]->mBarcodeProcessor->mDnbCounter = dnbCounter;
     }
 #ifdef PRINT_INFO
     printf("processor %d get results done,cost %.4f\n", mOptions->myRank, GetTime() - t0);
@@ -270,7 +376,11 @@ bool BarcodeToPositionMulti::process() {
 #endif
     thread **threads = new thread *[mOptions->thread];
     for (int t = 0; t < threadsNowNumber; t++) {
-        threads[t] = new thread(bind(&BarcodeToPositionMulti::consumerTask, this, results[t]));
+        threads[t] = startStage(bind(&BarcodeToPositionMulti::consumerTaskOnNode, this, results[t], t % numaNodes),
+                                [this]() {
+                                    mFinishedThreads++;
+                                    finishConsumers();
+                                });
     }
 
 
@@ -278,24 +388,39 @@ bool BarcodeToPositionMulti::process() {
     thread *unMappedWriterThread = NULL;
     thread *mergeThread = NULL;
     if (mWriter) {
-        writerThread = new thread(bind(&BarcodeToPositionMulti::writeTask, this, mWriter));
+        writerThread = startStage(bind(&BarcodeToPositionMulti::writeTask, this, mWriter), [this]() {
+            while (!mWriter->isCompleted()) mWriter->discard();
+        });
         if (mOptions->outGzSpilt == 0 && mOptions->numPro > 1 && mOptions->myRank == 0) {
             mergeThread = new thread(bind(&BarcodeToPositionMulti::mergeWrite, this));
         }
     }
     if (mUnmappedWriter) {
-        unMappedWriterThread = new thread(bind(&BarcodeToPositionMulti::writeTask, this, mUnmappedWriter));
+        unMappedWriterThread = startStage(bind(&BarcodeToPositionMulti::writeTask, this, mUnmappedWriter), [this]() {
+            while (!mUnmappedWriter->isCompleted()) mUnmappedWriter->discard();
+        });
     }
 
-    thread *pigzThread;
+    thread *pigzThread = NULL;
+    auto dropPigz = [this]() {
+        pair<int, pair<char *, int>> now;
+        while (!writerDone || pigzQueue->size_approx() > 0) {
+            if (pigzQueue->try_dequeue(now)) {
+                delete[] now.second.first;
+            } else {
+                usleep(100);
+            }
+        }
+    };
     if (mOptions->outGzSpilt) {
-        pigzThread = new thread(bind(&BarcodeToPositionMulti::pigzWrite, this));
+        pigzThread = startStage(bind(&BarcodeToPositionMulti::pigzWrite, this), dropPigz);
     } else {
         if (mOptions->usePigz && mOptions->myRank == 0) {
-            pigzThread = new thread(bind(&BarcodeToPositionMulti::pigzWrite, this));
+            pigzThread = startStage(bind(&BarcodeToPositionMulti::pigzWrite, this), dropPigz);
         }
     }
-    if (mOptions->usePugz) {
+    mPigzStage = pigzThread;
+    if (mUsePugz) {
         pugzer1->join();
         pugzer2->join();
     }
@@ -346,6 +471,8 @@ bool BarcodeToPositionMulti::process() {
     }
     if (unMappedWriterThread)
         unMappedWriterThread->join();
+    if (mProfiler)
+        mProfiler->stop();
 
 
     if (mOptions->verbose)
@@ -394,9 +521,7 @@ bool BarcodeToPositionMulti::process() {
             newResList.push_back(finalResult);
             for (int ii = 1; ii < mOptions->numPro; ii++) {
                 Result *resultTmp = new Result(mOptions, true);
-                resultTmp->setBarcodeProcessorHashTableOneArrayWithBloomFilter(mbpmap->getHead(), mbpmap->getNext(),
-                                                                               mbpmap->getPositionAll(),
-                                                                               mbpmap->getBloomFilter());
+                resultTmp->setBarcodeProcessorHashTableOneArrayWithBloomFilter(mbpmap->getIndexOnNode(0));
                 MPI_Recv(&(resultTmp->mTotalRead), 1, MPI_LONG_LONG, ii, 1, mOptions->communicator,
                          MPI_STATUS_IGNORE);
                 MPI_Recv(&(resultTmp->mFxiedFilterRead), 1, MPI_LONG_LONG, ii, 1, mOptions->communicator,
@@ -467,6 +592,9 @@ bool BarcodeToPositionMulti::process() {
             }
             finalResult = Result::merge(newResList);
             finalResult->print();
+            for (int ii = 0; ii < newResList.size(); ii++) {
+                delete newResList[ii];
+            }
 #ifdef PRINT_INFO
 
             printf("========================================================================\n");
@@ -508,11 +636,16 @@ bool BarcodeToPositionMulti::process() {
 
     cout << resetiosflags(ios::fixed) << setprecision(2);
     if (!mOptions->transBarcodeToPos.mappedDNBOutFile.empty()) {
-        cout << "mapped_dnbs: " << finalResult->mBarcodeProcessor->mDNB.size() << endl;
+        cout << "mapped_dnbs: " << finalResult->mBarcodeProcessor->getDNBNum() << endl;
         finalResult->dumpDNBs(mOptions->transBarcodeToPos.mappedDNBOutFile);
     }
+    delete finalResult;
+    if (dnbCounter)
+        delete dnbCounter;
 
     //clean up
+    mStages.clear();
+    mPigzStage = NULL;
     for (int t = 0; t < mOptions->thread; t++) {
         delete threads[t];
         threads[t] = NULL;
@@ -522,11 +655,21 @@ bool BarcodeToPositionMulti::process() {
 
     delete[] threads;
     delete[] results;
+    destroyPackRepository();
 
     if (writerThread)
         delete writerThread;
     if (unMappedWriterThread)
         delete unMappedWriterThread;
+    if (mergeThread)
+        delete mergeThread;
+    if (pigzThread)
+        delete pigzThread;
+    if (pugzer1)
+        delete pugzer1;
+    if (pugzer2)
+        delete pugzer2;
+    delete producer;
 
     closeOutput();
 #ifdef PRINT_INFO
@@ -539,7 +682,7 @@ bool BarcodeToPositionMulti::process() {
 void BarcodeToPositionMulti::initOutput() {
     mWriter = new WriterThread(mOptions->out, mOptions, mOptions->compression);
     if (!mOptions->transBarcodeToPos.unmappedOutFile.empty()) {
-        mUnmappedWriter = new WriterThread(mOptions->transBarcodeToPos.unmappedOutFile, mOptions->compression);
+        mUnmappedWriter = new WriterThread(mOptions->transBarcodeToPos.unmappedOutFile, mOptions, mOptions->compression);
     }
 }
 
@@ -559,6 +702,7 @@ bool BarcodeToPositionMulti::processPairEnd(ReadPairPack *pack, Result *result)
     string unmappedOut;
     bool hasPosition;
     bool fixedFiltered;
+    uint64 formatTicks = 0;
     for (int p = 0; p < pack->count; p++) {
         result->mTotalRead++;
         ReadPair *pair = pack->data[p];
@@ -573,13 +717,16 @@ bool BarcodeToPositionMulti::processPairEnd(ReadPairPack *pack, Result *result)
         }
         hasPosition = result->mBarcodeProcessor->process(or1, or2);
 //        hasPosition = 1;
+        uint64 formatStart = Profiler::now();
         if (hasPosition) {
             outstr += or2->toString();
         } else if (mUnmappedWriter) {
             unmappedOut += or2->toString();
         }
+        formatTicks += Profiler::now() - formatStart;
         delete pair;
     }
+    Profiler::add(PROFILE_FORMAT, formatTicks, pack->count);
     mOutputMtx.lock();
     if (mUnmappedWriter && !unmappedOut.empty()) {
         //write reads that can't be mapped to the slide
@@ -599,20 +746,65 @@ bool BarcodeToPositionMulti::processPairEnd(ReadPairPack *pack, Result *result)
     return true;
 }
 
+bool BarcodeToPositionMulti::processBarcodeFirst(ReadPack *leftPack, dsrc::fq::FastqDataChunk *rightChunk,
+                                                 vector<int> &rightStarts, Result *result) {
+    int count = leftPack->count < rightStarts.size() ? leftPack->count : rightStarts.size();
+    BarcodeProcessor *barcodeProcessor = result->mBarcodeProcessor;
+
+    //pass 1, resolve the barcodes of read1
+    vector<Position1> positions(count);
+    vector<char> mapped(count, 0);
+    vector<pair<string, string>> umis(count);
+    vector<char> hasUmi(count, 0);
+    for (int i = 0; i < count; i++) {
+        result->mTotalRead++;
+        bool found;
+        bool umiFound;
+        mapped[i] = barcodeProcessor->locate(leftPack->data[i], NULL, positions[i], found, umis[i], umiFound);
+        hasUmi[i] = umiFound;
+    }
+    for (int i = 0; i < leftPack->count; i++) {
+        delete leftPack->data[i];
+    }
+
+    //pass 2, format read2 for mapped pairs only
+    ProfileTimer formatTimer(PROFILE_FORMAT, count);
+    string outstr;
+    for (int i = 0; i < count; i++) {
+        if (!mapped[i]) continue;
+        Read *or2 = dsrc::fq::formatRecordAt(rightChunk, rightStarts[i]);
+        barcodeProcessor->annotate(NULL, or2, &positions[i], hasUmi[i] ? &umis[i] : NULL);
+        outstr += or2->toString();
+        delete or2;
+    }
+    formatTimer.stop();
+    if (mWriter && !outstr.empty()) {
+        char *data = new char[outstr.size()];
+        memcpy(data, outstr.c_str(), outstr.size());
+        mOutputMtx.lock();
+        mWriter->input(data, outstr.size());
+        mOutputMtx.unlock();
+    }
+    return true;
+}
+
 void BarcodeToPositionMulti::initPackRepositoey() {
-    mRepo.packBuffer = new ChunkPair *[PACK_NUM_LIMIT];
-    memset(mRepo.packBuffer, 0, sizeof(ReadPairPack *) * PACK_NUM_LIMIT);
+    //a pack holds fastq pool chunks until it is consumed, so no more than the pool size can be queued
+    mRepoSize = 2;
+    while (mRepoSize < mOptions->fastqPoolParts) mRepoSize <<= 1;
+    mRepo.packBuffer = new ChunkPair *[mRepoSize];
+    memset(mRepo.packBuffer, 0, sizeof(ChunkPair *) * mRepoSize);
     mRepo.writePos = 0;
     mRepo.readPos = 0;
 }
 
 void BarcodeToPositionMulti::destroyPackRepository() {
-    delete mRepo.packBuffer;
+    delete[] mRepo.packBuffer;
     mRepo.packBuffer = NULL;
 }
 
 void BarcodeToPositionMulti::producePack(ChunkPair *pack) {
-    mRepo.packBuffer[mRepo.writePos] = pack;
+    mRepo.packBuffer[mRepo.writePos & (mRepoSize - 1)] = pack;
     mRepo.writePos++;
 }
 
@@ -625,6 +817,7 @@ void BarcodeToPositionMulti::consumePack(Result *result) {
     ReadPairPack *data = new ReadPairPack;
     ReadPack *leftPack = new ReadPack;
     ReadPack *rightPack = new ReadPack;
+    ProfileTimer waitTimer(PROFILE_WAIT);
     mInputMutx.lock();
     int cnt = 0;
     while (mRepo.writePos <= mRepo.readPos) {
@@ -632,18 +825,51 @@ void BarcodeToPositionMulti::consumePack(Result *result) {
         cnt++;
         if (mProduceFinished) {
             mInputMutx.unlock();
+            delete data;
+            delete leftPack;
+            delete rightPack;
             return;
         }
     }
 //    printf("P wait C %d times\n", cnt);
-    chunkpair = mRepo.packBuffer[mRepo.readPos];
+    chunkpair = mRepo.packBuffer[mRepo.readPos & (mRepoSize - 1)];
     mRepo.readPos++;
     mInputMutx.unlock();
+    waitTimer.stop();
     result->costWait += GetTime() - t;
 
 
+    if (barcodeFirst) {
+        t = GetTime();
+        ProfileTimer parseTimer(PROFILE_PARSE);
+        leftPack->count = dsrc::fq::chunkFormatPrefix(chunkpair->leftpart, leftPack->data, read1PrefixLen);
+        vector<int> rightStarts;
+        dsrc::fq::chunkRecordStarts(chunkpair->rightpart, rightStarts);
+        parseTimer.setItems(leftPack->count);
+        parseTimer.stop();
+        result->costFormat += GetTime() - t;
+
+        t = GetTime();
+        processBarcodeFirst(leftPack, chunkpair->rightpart, rightStarts, result);
+        pairReader->fastqPool_left->Release(chunkpair->leftpart);
+        pairReader->fastqPool_right->Release(chunkpair->rightpart);
+        delete chunkpair;
+        result->costPE += GetTime() - t;
+
+        delete data;
+        delete leftPack;
+        delete rightPack;
+        result->costAll += GetTime() - tt;
+        return;
+    }
+
     t = GetTime();
-    leftPack->count = dsrc::fq::chunkFormat(chunkpair->leftpart, leftPack->data, true);
+    ProfileTimer parseTimer(PROFILE_PARSE);
+    if (lightRead1) {
+        leftPack->count = dsrc::fq::chunkFormatPrefix(chunkpair->leftpart, leftPack->data, read1PrefixLen);
+    } else {
+        leftPack->count = dsrc::fq::chunkFormat(chunkpair->leftpart, leftPack->data, true);
+    }
     rightPack->count = dsrc::fq::chunkFormat(chunkpair->rightpart, rightPack->data, true);
     result->costFormat += GetTime() - t;
 
@@ -655,6 +881,9 @@ void BarcodeToPositionMulti::consumePack(Result *result) {
     }
     pairReader->fastqPool_left->Release(chunkpair->leftpart);
     pairReader->fastqPool_right->Release(chunkpair->rightpart);
+    delete chunkpair;
+    parseTimer.setItems(data->count);
+    parseTimer.stop();
     result->costNew += GetTime() - t;
 
 
@@ -674,6 +903,8 @@ void BarcodeToPositionMulti::pugzTask1() {
 
     printf("now use pugz0 to decompress(%d threads)\n", mOptions->pugzThread);
 #endif
+    //the pugz threads started below stay on the node of this one
+    pinStage(0);
     double t0 = GetTime();
     struct file_stream in;
     stat_t stbuf;
@@ -682,21 +913,18 @@ void BarcodeToPositionMulti::pugzTask1() {
 
     ret = xopen_for_read(mOptions->transBarcodeToPos.in1.c_str(), true, &in);
     if (ret != 0) {
-        printf("gg on xopen_for_read\n");
-        exit(0);
+        error_exit("pugz can not open " + mOptions->transBarcodeToPos.in1);
     }
 
     ret = stat_file(&in, &stbuf, true);
     if (ret != 0) {
-        printf("gg on stat_file\n");
-        exit(0);
+        error_exit("pugz can not stat " + mOptions->transBarcodeToPos.in1);
     }
     /* TODO: need a streaming-friendly solution */
     ret = map_file_contents(&in, size_t(stbuf.st_size));
 
     if (ret != 0) {
-        printf("gg on map_file_contents\n");
-        exit(0);
+        error_exit("pugz can not map " + mOptions->transBarcodeToPos.in1);
     }
 
     in_p = static_cast<const byte *>(in.mmap_mem);
@@ -707,14 +935,22 @@ void BarcodeToPositionMulti::pugzTask1() {
     output.num = 1;
     output.pDone = &producerDone;
     ConsumerSync sync{};
-    libdeflate_gzip_decompress(in_p, in.mmap_size, mOptions->pugzThread, output, &sync);
+    ProfileTimer decompressTimer(PROFILE_DECOMPRESS, in.mmap_size);
+    try {
+        libdeflate_gzip_decompress(in_p, in.mmap_size, mOptions->pugzThread, output, &sync);
+    } catch (...) {
+        //a broken input fails the stage, its mapping is released first
+        xclose(&in);
+        throw;
+    }
+    decompressTimer.stop();
 
     pugz1Done = 1;
 #ifdef PRINT_INFO
 
     std::cout << "pugz0 done, cost " << GetTime() - t0 << std::endl;
 #endif
-//    xclose(&in);
+    xclose(&in);
 }
 
 void BarcodeToPositionMulti::pugzTask2() {
@@ -722,6 +958,7 @@ void BarcodeToPositionMulti::pugzTask2() {
 
     printf("now use pugz1 to decompress(%d threads)\n", mOptions->pugzThread);
 #endif
+    pinStage(1);
     double t0 = GetTime();
     struct file_stream in;
     stat_t stbuf;
@@ -730,21 +967,18 @@ void BarcodeToPositionMulti::pugzTask2() {
 
     ret = xopen_for_read(mOptions->transBarcodeToPos.in2.c_str(), true, &in);
     if (ret != 0) {
-        printf("gg on xopen_for_read\n");
-        exit(0);
+        error_exit("pugz can not open " + mOptions->transBarcodeToPos.in2);
     }
 
     ret = stat_file(&in, &stbuf, true);
     if (ret != 0) {
-        printf("gg on stat_file\n");
-        exit(0);
+        error_exit("pugz can not stat " + mOptions->transBarcodeToPos.in2);
     }
     /* TODO: need a streaming-friendly solution */
     ret = map_file_contents(&in, size_t(stbuf.st_size));
 
     if (ret != 0) {
-        printf("gg on map_file_contents\n");
-        exit(0);
+        error_exit("pugz can not map " + mOptions->transBarcodeToPos.in2);
     }
 
     in_p = static_cast<const byte *>(in.mmap_mem);
@@ -754,46 +988,105 @@ void BarcodeToPositionMulti::pugzTask2() {
     output.num = 2;
     output.pDone = &producerDone;
     ConsumerSync sync{};
-    libdeflate_gzip_decompress(in_p, in.mmap_size, mOptions->pugzThread, output, &sync);
+    ProfileTimer decompressTimer(PROFILE_DECOMPRESS, in.mmap_size);
+    try {
+        libdeflate_gzip_decompress(in_p, in.mmap_size, mOptions->pugzThread, output, &sync);
+    } catch (...) {
+        //a broken input fails the stage, its mapping is released first
+        xclose(&in);
+        throw;
+    }
+    decompressTimer.stop();
     pugz2Done = 1;
 #ifdef PRINT_INFO
 
     std::cout << "pugz1 done, cost " << GetTime() - t0 << std::endl;
 #endif
-//    xclose(&in);
+    xclose(&in);
 }
 
 #define whoNumber 3
 
+void BarcodeToPositionMulti::initTurns(int *mps) {
+    if (mOptions->numPro == 1) {
+        for (int i = 0; i < whoNumber; i++) {
+            mps[i] = 0;
+        }
+    } else {
+        mps[0] = 0;
+        mps[1] = 1;
+        mps[2] = 1;
+//        mps[3] = 1 ;
+//        mps[4] = 1 ;
+//        mps[5] = 1 ;
+//        mps[6] = 1 ;
+
+    }
+}
+
+void BarcodeToPositionMulti::planGzInput() {
+    mUsePugz = mOptions->usePugz;
+    mGzRange = GzReadRange();
+    mGzRange.threads = max(1, mOptions->decodeThread);
+    string in1 = mOptions->transBarcodeToPos.in1;
+    string in2 = mOptions->transBarcodeToPos.in2;
+    //bgzf is block parallel on its own, zstd and plain input have nothing to index
+    if (!mOptions->gzIndex || detectInputFormat(in1) != INPUT_GZIP || detectInputFormat(in2) != INPUT_GZIP) return;
+    GzIndex index1, index2;
+    int indexed = index1.load(in1) && index2.load(in2) ? 1 : 0;
+    if (mOptions->numPro > 1) {
+        MPI_Allreduce(MPI_IN_PLACE, &indexed, 1, MPI_INT, MPI_MIN, mOptions->communicator);
+    }
+    //both ways decode through GzReadAhead, pugz output can not be indexed
+    mUsePugz = false;
+    if (!indexed) {
+        //rank 0 writes the sidecars, every rank still reads the whole files
+        mGzRange.buildIndex = mOptions->myRank == 0;
+        if (mOptions->myRank == 0) {
+            loginfo("building gz indexes of " + in1 + " and " + in2);
+        }
+        return;
+    }
+    //every rank decodes the records of its share of the chunk rotation
+    int mps[whoNumber];
+    initTurns(mps);
+    int before = 0, mine = 0;
+    for (int i = 0; i < whoNumber; i++) {
+        if (mps[i] < mOptions->myRank) before++;
+        if (mps[i] == mOptions->myRank) mine++;
+    }
+    uint64 records = min(index1.getRecords(), index2.getRecords());
+    mGzRange.useIndex = true;
+    mGzRange.first = records * before / whoNumber;
+    mGzRange.end = records * (before + mine) / whoNumber;
+#ifdef PRINT_INFO
+    printf("processor %d reads records %llu - %llu of %llu through gz indexes, %d threads\n", mOptions->myRank,
+           mGzRange.first, mGzRange.end, records, mGzRange.threads);
+#endif
+}
+
 void BarcodeToPositionMulti::producerTask() {
     double t0 = GetTime();
+    pinStage(0);
     if (mOptions->verbose)
         loginfo("start to load data");
     long lastReported = 0;
     int slept = 0;
     long readNum = 0;
     bool splitSizeReEvaluated = false;
-    pairReader = new FastqChunkReaderPair(mOptions->transBarcodeToPos.in1, mOptions->transBarcodeToPos.in2, true, 0, 0);
+    pairReader = new FastqChunkReaderPair(mOptions->transBarcodeToPos.in1, mOptions->transBarcodeToPos.in2, true, 0, 0,
+                                          mOptions->fastqPoolParts, mGzRange);
 
     ChunkPair *chunk_pair;
-    pair<char *, int> last1;
-    pair<char *, int> last2;
     int cnt = 0;
     int whoTurn = 0;
     int mps[whoNumber];
-    if (mOptions->numPro == 1) {
+    initTurns(mps);
+    //a rank that decodes only its own records keeps every chunk it reads
+    if (mGzRange.useIndex) {
         for (int i = 0; i < whoNumber; i++) {
-            mps[i] = 0;
+            mps[i] = mOptions->myRank;
         }
-    } else {
-        mps[0] = 0;
-        mps[1] = 1;
-        mps[2] = 1;
-//        mps[3] = 1 ;
-//        mps[4] = 1 ;
-//        mps[5] = 1 ;
-//        mps[6] = 1 ;
-
     }
 #ifdef PRINT_INFO
 
@@ -804,16 +1097,14 @@ void BarcodeToPositionMulti::producerTask() {
 #endif
     long long p1Sum = 0;
     long long p2Sum = 0;
-    if (mOptions->usePugz) {
-        //TODO is this enough?
-        last1.first = new char[1 << 20];
-        last1.second = 0;
-        last2.first = new char[1 << 20];
-        last2.second = 0;
-
-
-        while ((chunk_pair = pairReader->readNextChunkPair(pugzQueue1, pugzQueue2, &pugz1Done, &pugz2Done,
-                                                           last1, last2)) != NULL) {
+    if (mUsePugz) {
+        //both pugz outputs are cut at the same records as they come out of the queues
+        PairedChunker chunker(pairReader->fastqPool_left, pairReader->fastqPool_right, pugzQueue1, pugzQueue2,
+                              &pugz1Done, &pugz2Done);
+        uint64 readStart = Profiler::now();
+        while ((chunk_pair = chunker.next()) != NULL) {
+            Profiler::add(PROFILE_READ, Profiler::now() - readStart,
+                          chunk_pair->leftpart->size + chunk_pair->rightpart->size);
             //cerr << (char*)chunk_pair->leftpart->data.Pointer();
             if (mOptions->verbose)
                 loginfo("producer read one chunk");
@@ -830,20 +1121,26 @@ void BarcodeToPositionMulti::producerTask() {
             } else {
                 pairReader->fastqPool_left->Release(chunk_pair->leftpart);
                 pairReader->fastqPool_right->Release(chunk_pair->rightpart);
+                delete chunk_pair;
             }
             whoTurn++;
             whoTurn %= whoNumber;
-            while (mRepo.writePos - mRepo.readPos > PACK_IN_MEM_LIMIT) {
+            while (mRepo.writePos - mRepo.readPos >= mRepoSize && !jobFailed()) {
 //                printf("producer wait consumer\n");
 //                cout << "producer wait consumer" << endl;
                 slept++;
                 usleep(100);
             }
-
+            //a failed server job stops reading, the consumers drain what is queued
+            if (jobFailed()) break;
+            readStart = Profiler::now();
         }
 
     } else {
+        uint64 readStart = Profiler::now();
         while ((chunk_pair = pairReader->readNextChunkPair()) != NULL) {
+            Profiler::add(PROFILE_READ, Profiler::now() - readStart,
+                          chunk_pair->leftpart->size + chunk_pair->rightpart->size);
             //cerr << (char*)chunk_pair->leftpart->data.Pointer();
             if (mOptions->verbose)
                 loginfo("producer read one chunk");
@@ -857,17 +1154,19 @@ void BarcodeToPositionMulti::producerTask() {
             } else {
                 pairReader->fastqPool_left->Release(chunk_pair->leftpart);
                 pairReader->fastqPool_right->Release(chunk_pair->rightpart);
+                delete chunk_pair;
             }
             whoTurn++;
             whoTurn %= whoNumber;
-            while (mRepo.writePos - mRepo.readPos > PACK_IN_MEM_LIMIT) {
+            while (mRepo.writePos - mRepo.readPos >= mRepoSize && !jobFailed()) {
 #ifdef PRINT_INFO
                 printf("producer waiting...\n");
 #endif
                 slept++;
                 usleep(100);
             }
-
+            if (jobFailed()) break;
+            readStart = Profiler::now();
         }
     }
 #ifdef PRINT_INFO
@@ -885,6 +1184,17 @@ void BarcodeToPositionMulti::producerTask() {
 }
 
 
+void BarcodeToPositionMulti::pinStage(int node) {
+    if (mOptions->numaMode != NUMA_OFF) {
+        NumaTopology::pinThread(node);
+    }
+}
+
+void BarcodeToPositionMulti::consumerTaskOnNode(Result *result, int node) {
+    pinStage(node);
+    consumerTask(result);
+}
+
 void BarcodeToPositionMulti::consumerTask(Result *result) {
     //cout << "in consumerTask " << endl;
     while (true) {
@@ -919,17 +1229,63 @@ void BarcodeToPositionMulti::consumerTask(Result *result) {
     }
 
 
+    finishConsumers();
+
+    if (mOptions->verbose) {
+        string msg = "finished one thread";
+        loginfo(msg);
+    }
+}
+
+void BarcodeToPositionMulti::finishConsumers() {
     if (mFinishedThreads == mOptions->thread) {
         if (mWriter)
             mWriter->setInputCompleted();
         if (mUnmappedWriter)
             mUnmappedWriter->setInputCompleted();
     }
+}
 
-    if (mOptions->verbose) {
-        string msg = "finished one thread";
-        loginfo(msg);
+thread *BarcodeToPositionMulti::startStage(function<void()> task, function<void()> onError) {
+    JobError *jobError = mOptions->jobError;
+    Profiler *profiler = mProfiler;
+    thread *stage = new thread([task, onError, jobError, profiler]() {
+        Profiler::current() = profiler;
+        if (jobError == NULL) {
+            task();
+            return;
+        }
+        jobErrorSink() = jobError;
+        try {
+            task();
+        } catch (exception &e) {
+            jobError->set(e.what());
+            onError();
+        } catch (...) {
+            jobError->set("unknown error in a mapping stage");
+            onError();
+        }
+    });
+    mStages.push_back(stage);
+    return stage;
+}
+
+void BarcodeToPositionMulti::joinStages() {
+    //pigz ends on writerDone, which is only set once the writers are joined
+    for (thread *stage : mStages) {
+        if (stage != mPigzStage && stage->joinable()) stage->join();
     }
+    writerDone = 1;
+    if (mPigzStage && mPigzStage->joinable()) mPigzStage->join();
+    for (thread *stage : mStages) {
+        delete stage;
+    }
+    mStages.clear();
+    mPigzStage = NULL;
+}
+
+bool BarcodeToPositionMulti::jobFailed() {
+    return mOptions->jobError != NULL && mOptions->jobError->failed;
 }
 
 
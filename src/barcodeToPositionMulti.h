@@ -17,6 +17,7 @@
 #include "result.h"
 #include "readerwriterqueue.h"
 #include "atomicops.h"
+#include "profiler.h"
 
 using namespace std;
 
@@ -47,17 +48,26 @@ class BarcodeToPositionMulti {
 public:
     BarcodeToPositionMulti(Options *opt);
 
+    //use a map that is already loaded, it is not owned by this object
+    BarcodeToPositionMulti(Options *opt, BarcodePositionMap *bpmap);
+
     ~BarcodeToPositionMulti();
 
+    //in a server job a failure after the stages started joins them before the exception leaves
     bool process();
 
 private:
+    bool runPipeline();
+
     void initOutput();
 
     void closeOutput();
 
     bool processPairEnd(ReadPairPack *pack, Result *result);
 
+    bool processBarcodeFirst(ReadPack *leftPack, dsrc::fq::FastqDataChunk *rightChunk, vector<int> &rightStarts,
+                             Result *result);
+
     void initPackRepositoey();
 
     void destroyPackRepository();
@@ -72,10 +82,22 @@ private:
 
     void pugzTask2();
 
+    //chunk rotation over the mpi ranks, turn i of every whoNumber chunks goes to rank mps[i]
+    void initTurns(int *mps);
+
+    //picks the gz decoder with --gzIndex, all ranks take the same way
+    void planGzInput();
+
     void producerTask();
 
     void consumerTask(Result *result);
 
+    //consumerTask on one numa node, it reads the index copy of that node
+    void consumerTaskOnNode(Result *result, int node);
+
+    //pins the calling stage thread to node with --numa
+    void pinStage(int node);
+
     void writeTask(WriterThread *config);
 
     void getMbpmap();
@@ -84,6 +106,19 @@ private:
 
     void mergeWrite();
 
+    //starts a stage thread, in a server job a failed stage records the job error and runs
+    //onError, which ends the stage like a finished one so the other stages drain
+    thread *startStage(function<void()> task, function<void()> onError);
+
+    //joins the stages still running after runPipeline() threw and frees them
+    void joinStages();
+
+    //an error was recorded for the server job of this run
+    bool jobFailed();
+
+    //the last consumer to finish completes the writers
+    void finishConsumers();
+
 public:
     Options *mOptions;
     BarcodePositionMap *mbpmap;
@@ -112,6 +147,8 @@ public:
 
 private:
     ReadPairRepository mRepo;
+    //slots of the mRepo ring, a power of two
+    long mRepoSize;
     atomic_bool mProduceFinished;
     atomic_int mFinishedThreads;
     std::mutex mOutputMtx;
@@ -121,6 +158,21 @@ private:
     WriterThread *mWriter;
     WriterThread *mUnmappedWriter;
     bool filterFixedSequence = false;
+    //read1 is only parsed up to the barcode/umi fields
+    bool lightRead1 = false;
+    int read1PrefixLen = 0;
+    //resolve read1 barcodes first, read2 records are only formatted for mapped pairs
+    bool barcodeFirst = false;
+    //pugz is skipped when the inputs are read through their gz indexes
+    bool mUsePugz = false;
+    GzReadRange mGzRange;
+    //the map was loaded by getMbpmap, not passed in
+    bool mOwnMap = false;
+    //stage timers of this run, NULL when it is not profiled
+    Profiler *mProfiler;
+    //threads started by startStage, in start order, until runPipeline() frees them
+    vector<thread *> mStages;
+    thread *mPigzStage;
 
 
     FastqChunkReaderPair *pairReader;
@@ -34,11 +34,13 @@ bool BarcodeToPositionMultiPE::process()
 	initPackRepositoey();
 	std::thread producer(std::bind(&BarcodeToPositionMultiPE::producerTask, this));
 
+	mOptions->dims1Size = mbpmap->GetDims1();
 	Result** results = new Result*[mOptions->thread];
 	BarcodeProcessor** barcodeProcessors = new BarcodeProcessor*[mOptions->thread];
 	for (int t = 0; t < mOptions->thread; t++) {
 		results[t] = new Result(mOptions, true);
-		results[t]->setBarcodeProcessor(mbpmap->getBpmap());
+		//every mask format is loaded into the hash list index now
+		results[t]->setBarcodeProcessorHashTableOneArrayWithBloomFilter(mbpmap->getIndexOnNode(0));
 	}
 
 	std::thread** threads = new thread * [mOptions->thread];
@@ -88,7 +90,7 @@ bool BarcodeToPositionMultiPE::process()
 	
 	cout << resetiosflags(ios::fixed) << setprecision(2);
 	if (!mOptions->transBarcodeToPos.mappedDNBOutFile.empty()) {
-		cout << "mapped_dnbs: " << finalResult->mBarcodeProcessor->mDNB.size() << endl;
+		cout << "mapped_dnbs: " << finalResult->mBarcodeProcessor->getDNBNum() << endl;
 		finalResult->dumpDNBs(mOptions->transBarcodeToPos.mappedDNBOutFile);
 	}
 	
@@ -118,11 +120,11 @@ bool BarcodeToPositionMultiPE::process()
 }
 
 void BarcodeToPositionMultiPE::initOutput() {
-	mWriter1 = new WriterThread(mOptions->transBarcodeToPos.out1, mOptions->compression);
-	mWriter2 = new WriterThread(mOptions->transBarcodeToPos.out2, mOptions->compression);
+	mWriter1 = new WriterThread(mOptions->transBarcodeToPos.out1, mOptions, mOptions->compression);
+	mWriter2 = new WriterThread(mOptions->transBarcodeToPos.out2, mOptions, mOptions->compression);
 	if (!mOptions->transBarcodeToPos.unmappedOutFile.empty() && !mOptions->transBarcodeToPos.unmappedOutFile2.empty()) {
-		mUnmappedWriter1 = new WriterThread(mOptions->transBarcodeToPos.unmappedOutFile, mOptions->compression);
-		mUnmappedWriter2 = new WriterThread(mOptions->transBarcodeToPos.unmappedOutFile2, mOptions->compression);
+		mUnmappedWriter1 = new WriterThread(mOptions->transBarcodeToPos.unmappedOutFile, mOptions, mOptions->compression);
+		mUnmappedWriter2 = new WriterThread(mOptions->transBarcodeToPos.unmappedOutFile2, mOptions, mOptions->compression);
 	}
 }
 
@@ -3,14 +3,25 @@
 //
 
 #include "bloomFilter.h"
+#include <algorithm>
+#include "hugePages.h"
 
-BloomFilter::BloomFilter(){
-//    hashtable = new uint64[HashTableMax];
-    hashtable = (uint64*)malloc(HashTableMax*sizeof(uint64));
-    hashtableClassification = (uint64*)malloc(HashTableMax*sizeof(uint64));
-    memset(hashtable,0,sizeof(uint64)*HashTableMax);
-    memset(hashtableClassification,0,sizeof(uint64)*HashTableMax);
-//    std::cout << "size is " << HashTableMax << std::endl;
+BloomFilter::BloomFilter(int logBits){
+    logBits = std::max(6, std::min(logBits, BLOOM_MAX_BITS));
+    bitMask = (1ull<<logBits)-1;
+    size = 1ull<<(logBits-6);
+//    hashtable = new uint64[size];
+    //every lookup probes both tables at random, they are the first to gain from huge pages
+    hashtable = HugePages::allocArray<uint64>(size);
+    hashtableClassification = HugePages::allocArray<uint64>(size);
+    memset(hashtable,0,sizeof(uint64)*size);
+    memset(hashtableClassification,0,sizeof(uint64)*size);
+//    std::cout << "size is " << size << std::endl;
+}
+
+BloomFilter::~BloomFilter(){
+    HugePages::free(hashtable);
+    HugePages::free(hashtableClassification);
 }
 
 bool BloomFilter::push(uint64 key){
@@ -21,6 +32,20 @@ bool BloomFilter::push(uint64 key){
     return false;
 }
 
+void BloomFilter::push_atomic(uint64 key){
+    uint32 a = key&0xffffffff;
+    a = (a ^ 61) ^ (a >> 16);
+    a = a + (a << 3);
+    a = a ^ (a >> 4);
+    a = a * 0x27d4eb2d;
+    a = a ^ (a >> 15);
+    a = (a>>6)&0x3fff;
+    uint32 mapkey = ((key >> 32)|(a << 18))&bitMask;
+    __atomic_fetch_or(&hashtable[mapkey>>6], 1ull<<(mapkey&0x3f), __ATOMIC_RELAXED);
+    uint64 classKey = key&bitMask;
+    __atomic_fetch_or(&hashtableClassification[classKey>>6], 1ull<<(classKey&0x3f), __ATOMIC_RELAXED);
+}
+
 bool BloomFilter::get(uint64 key){
     bool fg = true;
 //    fg = fg&&get_mod(key);
@@ -38,7 +63,7 @@ bool BloomFilter::push_mod(uint64 key) {
     a = a ^ (a >> 15);
     a = (a>>6)&0x3fff;
     // 6 74
-    uint32 mapkey = (key >> 32)|(a << 18);
+    uint32 mapkey = ((key >> 32)|(a << 18))&bitMask;
     hashtable[mapkey>>6] |= (1ll<<(mapkey&0x3f));
     return false;
 }
@@ -51,12 +76,12 @@ bool BloomFilter::get_mod(uint64 key) {
     a = a * 0x27d4eb2d;
     a = a ^ (a >> 15);
     a = (a>>6)&0x3fff;
-    uint32 mapkey = (key >> 32)|(a << 18);
+    uint32 mapkey = ((key >> 32)|(a << 18))&bitMask;
     return hashtable[mapkey>>6]&(1ll<<(mapkey&0x3f));
 }
 
 bool BloomFilter::push_xor(uint64 key) {
-    uint32 mapkey = (key>>32)^(key&0xffffffff);
+    uint32 mapkey = ((key>>32)^(key&0xffffffff))&bitMask;
 //    uint32 mapkey = (key>>18)&0xffffffff;// 神奇 ，效果很棒，过滤完100亿
     hashtable[(mapkey>>6)]|=(1ll<<(mapkey&0x3f));
 //    std::cout << "map is ok!!!" << '\n';
@@ -64,18 +89,18 @@ bool BloomFilter::push_xor(uint64 key) {
 }
 
 bool BloomFilter::get_xor(uint64 key) {
-    uint32 mapkey = (key>>32)^(key&0xffffffff);
+    uint32 mapkey = ((key>>32)^(key&0xffffffff))&bitMask;
 //    uint32 mapkey = (key>>18)&0xffffffff;
     return hashtable[mapkey>>6]&(1ll<<(mapkey&0x3f));
 }
 
 bool BloomFilter::push_Classification(uint64 key){
-    uint64 mapkey = key&0xffffffff;
+    uint64 mapkey = key&bitMask;
     hashtableClassification[mapkey>>6] |= (1ll<<(mapkey&0x3f));
     return false;
 }
 bool BloomFilter::get_Classification(uint64 key){
-    uint64 mapkey = key&0xffffffff;
+    uint64 mapkey = key&bitMask;
     return hashtableClassification[mapkey>>6]&(1ll<<(mapkey&0x3f));
 }
 
@@ -87,7 +112,7 @@ bool BloomFilter::push_wang(uint64 key){
     key = (key + (key << 2)) + (key << 4); // key * 21
     key = key ^ (key >> 28);
     key = key + (key << 31);
-    uint32 mapkey = key&0xffffffff;
+    uint32 mapkey = key&bitMask;
     hashtable[mapkey>>6] |= (1ll<<(mapkey&0x3f));
     return false;
 }
@@ -99,6 +124,6 @@ bool BloomFilter::get_wang(uint64 key){
     key = (key + (key << 2)) + (key << 4); // key * 21
     key = key ^ (key >> 28);
     key = key + (key << 31);
-    uint32 mapkey = key&0xffffffff;
+    uint32 mapkey = key&bitMask;
     return hashtable[mapkey>>6]&(1ll<<(mapkey&0x3f));
 }
\ No newline at end of file
@@ -10,7 +10,9 @@
 #include <iostream>
 class BloomFilter {
 public:
-    BloomFilter();
+    //each of the two tables has 2^logBits bits, 32 covers the whole 32 bit key space
+    BloomFilter(int logBits = BLOOM_MAX_BITS);
+    ~BloomFilter();
     bool push(uint64 key);
     bool get(uint64 key);
     bool push_mod(uint64 key);
@@ -25,14 +27,16 @@ public:
     bool push_wang(uint64 key);
     bool get_wang(uint64 key);
 
+    //push() for index builds that fill the filter from many threads
+    void push_atomic(uint64 key);
+
 public:
 
     uint64* hashtable;
     uint64* hashtableClassification;
     uint64 size;
-
-
-    const static uint32 HashTableMax = 1ll<<26;
+    //keys are folded into tables smaller than 2^32 bits, which only adds false positives
+    uint64 bitMask;
 
 
 
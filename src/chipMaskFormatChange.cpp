@@ -1,84 +1,171 @@
 #include "chipMaskFormatChange.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
+
+//slot buffers are reused between batches up to this capacity
+#define FORMAT_CHANGE_BUFFER_KEEP (1 << 26)
 
 ChipMaskFormatChange::ChipMaskFormatChange(Options* opt){
     mOptions = opt;
+    bpmap = NULL;
 }
 
 ChipMaskFormatChange::~ChipMaskFormatChange(){
-
+    if (bpmap) delete bpmap;
 }
 
 void ChipMaskFormatChange::change(){
-	bpmap = new BarcodePositionMap(mOptions);
-	bpmap->dumpbpmap(mOptions->out);
+    string &in = mOptions->in;
+    string &out = mOptions->out;
+    bool inH5 = ends_with(in, "h5") || ends_with(in, "hdf5");
+    bool outH5 = ends_with(out, "h5") || ends_with(out, "hdf5");
+    if (in.find(',') == string::npos && inH5 && !outH5) {
+        H5ToBin();
+    } else if (in.find(',') == string::npos && ends_with(in, ".bin") && outH5) {
+        binToH5();
+    } else {
+        bpmap = new BarcodePositionMap(mOptions);
+        bpmap->dumpbpmap(out);
+    }
+}
+
+static inline void appendUint(string &buf, uint32 value) {
+    char digits[10];
+    int len = 0;
+    do {
+        digits[len++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    while (len > 0) buf.push_back(digits[--len]);
 }
 
 void ChipMaskFormatChange::H5ToBin(){
-	hid_t fileID = H5Fopen(mOptions->in.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
-    herr_t status;
-	//open dataset with datasetName
-    int index = 1;
-    std::string datasetName = DATASETNAME + std::to_string(index);
-    hid_t datasetID = H5Dopen2(fileID, datasetName.c_str(), H5P_DEFAULT);
-    //read attribute of the dataset
+    time_t start = time(NULL);
+    cout << "##########dump barcodeToPosition map begin..." << endl;
+    ChipMaskHDF5 chipMaskH5(mOptions->in);
+    chipMaskH5.openFile();
+    if (chipMaskH5.fileID < 0) {
+        error_exit("can not open mask file: " + mOptions->in);
+    }
+    hsize_t dims[RANK];
     uint32 attributeValues[ATTRIBUTEDIM];
-    hid_t attributeID = H5Aopen_by_name(fileID, datasetName.c_str(), ATTRIBUTENAME, H5P_DEFAULT, H5P_DEFAULT);
-    status = H5Aread(attributeID, H5T_NATIVE_UINT32, &attributeValues[0]);
+    hid_t datasetID = chipMaskH5.openDataSet(dims, attributeValues);
     uint32 rowOffset = attributeValues[0];
     uint32 colOffset = attributeValues[1];
-    cout << "row offset: " << rowOffset << "\tcol offset: "<< colOffset << endl;
-
-    hid_t dspaceID = H5Dget_space(datasetID);
-    hid_t dtype_id = H5Dget_type(datasetID);
-    hid_t plistID = H5Dget_create_plist(datasetID);
-    int rank = H5Sget_simple_extent_ndims(dspaceID);
-    hsize_t dims[rank];
-    status = H5Sget_simple_extent_dims(dspaceID, dims, NULL);
+    int barcodeLen = attributeValues[2] > 0 ? attributeValues[2] : mOptions->barcodeLen;
+    cout << "row offset: " << rowOffset << "\tcol offset: " << colOffset << endl;
 
-    uint64 matrixLen = 1;
-    for (int i = 0 ; i<rank; i++){
-        matrixLen *= dims[i];
+    bool binary = ends_with(mOptions->out, ".bin");
+    ofstream writer(mOptions->out, ios::out | ios::binary);
+    if (!writer.is_open()) {
+        error_exit("can not write mask file: " + mOptions->out);
     }
+    int threadNum = max(1, mOptions->thread);
+    vector<string> buffers(threadNum);
+    vector<uint64> counts(threadNum, 0);
+    uint64 barcodeNum = 0;
+    //every chunk is formatted into the buffer of its batch slot, the slots are written in chunk order
+    chipMaskH5.streamChunks(datasetID, dims, threadNum,
+                            [&](int slot, const hsize_t *offset, const hsize_t *extent, const hsize_t *cdims,
+                                const uint64 *chunk) {
+                                string &buf = buffers[slot];
+                                buf.clear();
+                                counts[slot] = 0;
+                                for (hsize_t r = 0; r < extent[0]; r++) {
+                                    for (hsize_t c = 0; c < extent[1]; c++) {
+                                        const uint64 *barcodes = chunk + (r * cdims[1] + c) * cdims[2];
+                                        Position1 position = {(uint32) (offset[1] + c + colOffset),
+                                                              (uint32) (offset[0] + r + rowOffset)};
+                                        for (hsize_t s = 0; s < extent[2]; s++) {
+                                            uint64 barcodeInt = barcodes[s];
+                                            if (barcodeInt == 0) {
+                                                continue;
+                                            }
+                                            counts[slot]++;
+                                            if (binary) {
+                                                buf.append((char *) &barcodeInt, sizeof(barcodeInt));
+                                                buf.append((char *) &position, sizeof(position));
+                                                continue;
+                                            }
+                                            for (int i = 0; i < barcodeLen; i++) {
+                                                buf.push_back(ATCG_BASES[(barcodeInt >> (i * 2)) & 3]);
+                                            }
+                                            buf.push_back('\t');
+                                            appendUint(buf, position.x);
+                                            buf.push_back('\t');
+                                            appendUint(buf, position.y);
+                                            buf.push_back('\n');
+                                        }
+                                    }
+                                }
+                            },
+                            [&](int batchSize) {
+                                for (int t = 0; t < batchSize; t++) {
+                                    writer.write(buffers[t].data(), buffers[t].size());
+                                    barcodeNum += counts[t];
+                                    if (buffers[t].capacity() > FORMAT_CHANGE_BUFFER_KEEP) {
+                                        string().swap(buffers[t]);
+                                    }
+                                }
+                            });
+    H5Dclose(datasetID);
+    H5Fclose(chipMaskH5.fileID);
+    writer.close();
+    if (writer.fail()) {
+        error_exit("write mask file failed: " + mOptions->out);
+    }
+    cout << "barcode number: " << barcodeNum << endl;
+    cout << "##########dump barcodeToPosition map finished, time used: " << time(NULL) - start << " seconds" << endl;
+}
 
-    int segment = 1;
-    if (rank>=3){
-        segment = dims[2];
+void ChipMaskFormatChange::binToH5(){
+    time_t start = time(NULL);
+    cout << "##########dump barcodeToPosition map begin..." << endl;
+    int fd = open(mOptions->in.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        error_exit("can not open mask file: " + mOptions->in);
+    }
+    uint64 recordNum = st.st_size / sizeof(bpmap_key_value);
+    if (recordNum == 0) {
+        close(fd);
+        error_exit("no barcode in mask file: " + mOptions->in);
+    }
+    void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(fd);
+        error_exit("can not mmap mask file: " + mOptions->in);
     }
+    const bpmap_key_value *records = (const bpmap_key_value *) mapped;
+    int threadNum = max(1, mOptions->thread);
+    uint32 minX = OUTSIDE_DNB_POS_COL, minY = OUTSIDE_DNB_POS_ROW, maxX = 0, maxY = 0;
+#pragma omp parallel for num_threads(threadNum) reduction(min:minX, minY) reduction(max:maxX, maxY)
+    for (uint64 i = 0; i < recordNum; i++) {
+        minX = min(minX, records[i].value.x);
+        maxX = max(maxX, records[i].value.x);
+        minY = min(minY, records[i].value.y);
+        maxY = max(maxY, records[i].value.y);
+    }
+    cout << "slide range: " << minX << "-" << maxX << " x " << minY << "-" << maxY << endl;
 
-    uint64* bpMatrix_buffer = new uint64[matrixLen]();
-    status = H5Dread(datasetID, H5T_NATIVE_UINT64, H5S_ALL, H5S_ALL, H5P_DEFAULT, bpMatrix_buffer);
-    status = H5Aclose(attributeID);
-    status = H5Dclose(datasetID);
-    status = H5Fclose(fileID);
-    
-	ofstream writer(mOptions->out, ios::out | ios::binary);
-    
-    for (uint32 r = 0; r < dims[0]; r++){
-                
-        for (uint32 c = 0; c< dims[1]; c++){
-            Position1 position = {c + colOffset, r + rowOffset};
-            if (rank >= 3 ){               
-                segment = dims[2];
-                for (int s = 0; s<segment; s++){
-                    uint64 barcodeInt = bpMatrix_buffer[r*dims[1]*segment + c*segment + s];
-                    if (barcodeInt == 0){
-                        continue;
-                    }
-                    writer.write((char*)&barcodeInt, sizeof(barcodeInt));
-					writer.write((char*)&position.x, sizeof(position.x));
-					writer.write((char*)&position.y, sizeof(position.y));
-                }
-            }else{
-                uint64 barcodeInt = bpMatrix_buffer[r*dims[1]+c];
-                if (barcodeInt == 0){
-                    continue;
-                }
-                writer.write((char*)&barcodeInt, sizeof(barcodeInt));
-				writer.write((char*)&position.x, sizeof(position.x));
-				writer.write((char*)&position.y, sizeof(position.y));
-            }           
-        }
+    ChipMaskHDF5 chipMaskH5(mOptions->out);
+    chipMaskH5.creatFile();
+    uint8_t segment = mOptions->barcodeSegment;
+    if (mOptions->rc == 2) {
+        segment *= 2;
+    }
+    slideRange sliderange{minX, maxX, minY, maxY};
+    herr_t status = chipMaskH5.writeDataSet(mOptions->chipID, sliderange, records, recordNum, mOptions->barcodeLen,
+                                            segment, slidePitch, mOptions->compression, threadNum,
+                                            mOptions->maskShuffle);
+    munmap(mapped, st.st_size);
+    close(fd);
+    if (status < 0) {
+        error_exit("write mask file failed: " + mOptions->out);
     }
-    writer.close();  
+    cout << "barcode number: " << recordNum << endl;
+    cout << "##########dump barcodeToPosition map finished, time used: " << time(NULL) - start << " seconds" << endl;
 }
-
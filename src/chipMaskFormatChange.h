@@ -24,10 +24,14 @@ public:
     ~ChipMaskFormatChange();
 
     void change();
+    //h5 mask to a .bin or text barcode list, streamed chunk by chunk
     void H5ToBin();
+    //.bin barcode list to an h5 mask, the records stay in the mapped file and no barcode map is built
+    void binToH5();
 public:
     Options* mOptions;
     BarcodePositionMap* bpmap;
+    int slidePitch = 500;
 };
 
 #endif // ! CHIPMASKFORMATCHANGE_H
\ No newline at end of file
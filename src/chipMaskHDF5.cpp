@@ -1,6 +1,7 @@
 #include "chipMaskHDF5.h"
 #include <sys/time.h>
 #include <omp.h>
+#include "hugePages.h"
 
 
 double HD5GetTime() {
@@ -30,94 +31,43 @@ void ChipMaskHDF5::openFile() {
     //    fileID = H5Fopen(fileName.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
     //    round-- ;
     //}
+    if (fileID < 0) {
+        error_exit("can not open hdf5 mask file: " + fileName);
+    }
 }
 
 herr_t ChipMaskHDF5::writeDataSet(std::string chipID, slideRange &sliderange,
                                   unordered_map<uint64, Position1> &bpMap,
                                   uint32_t barcodeLen, uint8_t segment, uint32_t slidePitch, uint compressionLevel,
-                                  int index) {
-    //generate dataSet space
-    hid_t dataspaceID;
+                                  int threadNum, bool shuffle, int index) {
     hsize_t dims[RANK];
     dims[0] = sliderange.rowEnd - sliderange.rowStart + 1;
     dims[1] = sliderange.colEnd - sliderange.colStart + 1;
     dims[2] = segment;
-    dataspaceID = H5Screate_simple(RANK, dims, NULL);
-    hsize_t memDims[1] = {dims[0] * dims[1] * dims[2]};
-    hid_t memdataspaceID = H5Screate_simple(1, memDims, NULL);
-    //transfer bpMap to bpMatrix
-    bpMatrix = new uint64 **[dims[0]];
-    uint64 *bpMatrix_buffer = new uint64[dims[0] * dims[1] * dims[2]];
-    for (int i = 0; i < dims[0]; i++) {
-        bpMatrix[i] = new uint64 *[dims[1]];
-        for (int j = 0; j < dims[1]; j++) {
-            bpMatrix[i][j] = bpMatrix_buffer + i * dims[1] * dims[2] + j * dims[2];
-        }
+    //bucket barcodes by chunk row band, only one band of the matrix is built at a time
+    vector<uint64> bandStart;
+    countBands(bandStart, dims[0]);
+    for (auto mapIter = bpMap.begin(); mapIter != bpMap.end(); mapIter++) {
+        if (!inRange(sliderange, mapIter->second)) continue;
+        bandStart[(mapIter->second.y - sliderange.rowStart) / CDIM0 + 1]++;
     }
-    uint64 *barcodes;
+    for (size_t b = 1; b < bandStart.size(); b++) bandStart[b] += bandStart[b - 1];
+    vector<bpmap_key_value> banded(bandStart.back());
+    vector<uint64> bandPos(bandStart.begin(), bandStart.end() - 1);
     for (auto mapIter = bpMap.begin(); mapIter != bpMap.end(); mapIter++) {
-        int row = mapIter->second.y - sliderange.rowStart;
-        int col = mapIter->second.x - sliderange.colStart;
-        barcodes = bpMatrix[row][col];
-        for (int i = 0; i < segment; i++) {
-            if (barcodes[i] == 0) {
-                barcodes[i] = mapIter->first;
-                //cout << mapIter->second.y-sliderange.rowStart << " : " << mapIter->second.x-sliderange.colStart << " : " << mapIter->first << endl;
-                break;
-            }
-        }
-        //cout << mapIter->second.y-sliderange.rowStart << " : " << mapIter->second.x-sliderange.colStart << " : " << mapIter->first << endl;
+        if (!inRange(sliderange, mapIter->second)) continue;
+        bpmap_key_value &entry = banded[bandPos[(mapIter->second.y - sliderange.rowStart) / CDIM0]++];
+        entry.key = mapIter->first;
+        entry.value = mapIter->second;
     }
 
-    //define dataSet chunk, compression need chunking data
-    hid_t plistID;
-    //create property list of dataSet generation
-    plistID = H5Pcreate(H5P_DATASET_CREATE);
-
-    hsize_t cdims[RANK] = {CDIM0, CDIM1, segment};
-    herr_t status;
-    status = H5Pset_chunk(plistID, RANK, cdims);
-    status = H5Pset_deflate(plistID, compressionLevel);
-
-    //create dataset
-    hid_t datasetID;
-    std::string datasetName = DATASETNAME + std::to_string(index);
-    datasetID = H5Dcreate2(fileID, datasetName.c_str(), H5T_NATIVE_UINT64, dataspaceID, H5P_DEFAULT, plistID,
-                           H5P_DEFAULT);
-
-    //create dataset attribute [rowShift, colShift, barcodeLength, slidePitch]
-    uint32 attributeValues[ATTRIBUTEDIM] = {sliderange.rowStart, sliderange.colStart, barcodeLen, slidePitch};
-    //create attribute to store dnb infomation
-    hsize_t dimsA[1] = {ATTRIBUTEDIM};
-    hid_t attributeSpace = H5Screate_simple(1, dimsA, NULL);
-    hid_t attributeID = H5Acreate(datasetID, ATTRIBUTENAME, H5T_NATIVE_UINT32, attributeSpace, H5P_DEFAULT,
-                                  H5P_DEFAULT);
-
-    //create attribute to sotre chip id
-    hid_t attributeSpace1 = H5Screate(H5S_SCALAR);
-    hid_t attributeID1 = H5Acreate(datasetID, ATTRIBUTENAME1, H5T_NATIVE_CHAR, attributeSpace1, H5P_DEFAULT,
-                                   H5P_DEFAULT);
-
-    //write attribute
-    status = H5Awrite(attributeID, H5T_NATIVE_INT, &attributeValues[0]);
-    status = H5Awrite(attributeID1, H5T_NATIVE_CHAR, chipID.c_str());
-
-    //close attribute
-    status = H5Sclose(attributeSpace);
-    status = H5Sclose(attributeSpace1);
-    status = H5Aclose(attributeID);
-    status = H5Aclose(attributeID1);
-
-    //write matrix data to hdf5 file dataset
-    status = H5Dwrite(datasetID, H5T_NATIVE_UINT64, memdataspaceID, dataspaceID, H5P_DEFAULT, &bpMatrix_buffer[0]);
-    status = H5Sclose(dataspaceID);
-    status = H5Dclose(datasetID);
-    status = H5Pclose(plistID);
-    status = H5Fclose(fileID);
-
-    delete[] bpMatrix;
-    delete[] bpMatrix_buffer;
-    return status;
+    hid_t datasetID = createDataSet(chipID, sliderange, dims, barcodeLen, slidePitch, compressionLevel, shuffle, index);
+    herr_t status = writeBands(datasetID, dims, compressionLevel, threadNum, shuffle,
+                               [&](int b, uint64 *band, hsize_t row0) {
+                                   placeBand(band, banded.data() + bandStart[b], bandStart[b + 1] - bandStart[b],
+                                             sliderange, row0, dims);
+                               });
+    return closeWritten(datasetID, status);
 }
 
 
@@ -415,9 +365,17 @@ void ChipMaskHDF5::readDataSet(int &hashNum, int *&hashHead, node *&hashMap, int
 
 
 
+//the three index threads of the h5 loader each pass every chunk once, the last one frees it
+static inline void releaseChunk(uint64 **buffer, int *chunkUsers, int chunkIndex) {
+    if (__atomic_add_fetch(&chunkUsers[chunkIndex], 1, __ATOMIC_ACQ_REL) == 3) {
+        delete[] buffer[chunkIndex];
+        buffer[chunkIndex] = NULL;
+    }
+}
+
 void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, int *&bpmap_head, int *&bpmap_nxt,
                                                               bpmap_key_value *&position_all, BloomFilter *&bloomFilter,
-                                                              int index) {
+                                                              uint32 mapMod, int bloomBits, int index) {
 
     auto t0 = HD5GetTime();
     herr_t status;
@@ -439,6 +397,11 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
     hid_t dtype_id = H5Dget_type(datasetID);
 
     hid_t plistID = H5Dget_create_plist(datasetID);
+    //masks written with --maskShuffle have the shuffle filter in front of deflate
+    unsigned int filterFlags;
+    size_t filterCdNum = 0;
+    bool shuffled = H5Pget_nfilters(plistID) > 1 &&
+                    H5Pget_filter2(plistID, 0, &filterFlags, &filterCdNum, NULL, 0, NULL, NULL) == H5Z_FILTER_SHUFFLE;
 
     int rank = H5Sget_simple_extent_ndims(dspaceID);
 
@@ -450,6 +413,8 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
     for (int i = 0; i < rank; i++) {
         matrixLen *= dims[i];
     }
+    maskRows = dims[0];
+    maskCols = dims[1];
 
     int segment = 1;
     if (rank >= 3) {
@@ -474,51 +439,39 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
     status = H5Sselect_all(dspaceID);
     hsize_t nchunks;
     status = H5Dget_num_chunks(datasetID, dspaceID, &nchunks);
-    size_t chunk_dims[rank];
-    int flag = 0;
-    for (int r = 0; r < rank; r++) {
-        if (dims[r] == 1) {
-            flag++;
-            chunk_dims[r] = 1;
-        } else {
-            chunk_dims[r] = 0;
-        }
-
-    }
-    hsize_t offset_next[rank];
-    for (int cid = 1; cid < nchunks; cid++) {
-        H5Dget_chunk_info(datasetID, dspaceID, cid, offset_next, NULL, NULL, NULL);
-        for (int r = 0; r < rank; r++) {
-            if (!chunk_dims[r] && offset_next[r]) {
-                chunk_dims[r] = offset_next[r];
-                flag++;
-            }
-        }
-        if (flag >= rank) {
-            break;
-        }
+    //take the chunk shape from the creation property list, inferring it from chunk offsets fails when a dimension has a single chunk
+    hsize_t chunk_dims[rank];
+    if (H5Pget_chunk(plistID, rank, chunk_dims) != rank) {
+        error_exit("mask dataset is not chunked: " + fileName);
     }
 
     hsize_t chunk_len = 1;
     for (int r = 0; r < rank; r++) {
         chunk_len *= chunk_dims[r];
     }
+    //chunk buffers are allocated by the reader and freed by the last of the three index threads,
+    //the reader stays at most CHUNK_LOAD_WINDOW chunks ahead so only a window of the matrix is in memory
     uint64 **compressed_buffer = new uint64 *[nchunks];
     uint64 **buffer = new uint64 *[nchunks];
+    int *chunk_users = new int[nchunks];
     hsize_t **offset = new hsize_t *[nchunks];
     for (int i = 0; i < nchunks; i++) {
-        compressed_buffer[i] = new uint64[chunk_len];
-        buffer[i] = new uint64[chunk_len];
+        compressed_buffer[i] = NULL;
+        buffer[i] = NULL;
+        chunk_users[i] = 0;
         offset[i] = new hsize_t[rank];
     }
     hsize_t *chunk_size = new hsize_t[nchunks];
 
 
     uint32 bpmap_num = 0;
-    bpmap_head = new int[MOD];
-    bpmap_nxt = new int[dims[0] * dims[1] * dims[2]];
-    position_all = new bpmap_key_value[dims[0] * dims[1] * dims[2]];
-    bloomFilter = new BloomFilter();
+    //without buckets only the records are filled, the compact index is built from them
+    if (mapMod > 0) {
+        bpmap_head = HugePages::allocArray<int>(mapMod);
+        bpmap_nxt = HugePages::allocArray<int>(dims[0] * dims[1] * dims[2]);
+    }
+    position_all = HugePages::allocArray<bpmap_key_value>(dims[0] * dims[1] * dims[2]);
+    bloomFilter = new BloomFilter(bloomBits);
 
 //    bloomFilter ->push(462212724823577);
     //int *mapKeyNum = new int[MOD];
@@ -527,7 +480,7 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
     //}
 
 #pragma omp parallel for num_threads(16)
-    for (int i = 0; i < MOD; i++) {
+    for (int i = 0; i < mapMod; i++) {
         bpmap_head[i] = -1;
     }
 
@@ -538,7 +491,7 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
     t0 = HD5GetTime();
 
     int chunk_num = 0;
-    int now_chunk[4];
+    int now_chunk[4] = {0, 0, 0, 0};
     bool is_complete_hdf5 = false;
 #pragma omp parallel num_threads(4)
     {
@@ -546,6 +499,13 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
         if (num_id == 0) {
             libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
             for (int chunk_index = 0; chunk_index < nchunks; chunk_index++) {
+                while (chunk_index - min(__atomic_load_n(&now_chunk[1], __ATOMIC_ACQUIRE),
+                                         min(__atomic_load_n(&now_chunk[2], __ATOMIC_ACQUIRE),
+                                             __atomic_load_n(&now_chunk[3], __ATOMIC_ACQUIRE))) >= CHUNK_LOAD_WINDOW) {
+                    usleep(10);
+                }
+                compressed_buffer[chunk_index] = new uint64[chunk_len];
+                buffer[chunk_index] = new uint64[chunk_len];
                 uint32_t filter = 0;
                 size_t actual_out = 0;
                 H5Dget_chunk_info(datasetID, dspaceID, chunk_index, offset[chunk_index], &filter, NULL,
@@ -556,7 +516,14 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
                 int dstatus = libdeflate_zlib_decompress(decompressor, (void *) compressed_buffer[chunk_index],
                                                          chunk_size[chunk_index], (void *) buffer[chunk_index],
                                                          chunk_len * sizeof(uint64), &actual_out);
-                chunk_num++;
+                if (shuffled) {
+                    //the compressed buffer is free now, unshuffle into it and swap
+                    unshuffleChunk(buffer[chunk_index], compressed_buffer[chunk_index], chunk_len);
+                    swap(buffer[chunk_index], compressed_buffer[chunk_index]);
+                }
+                delete[] compressed_buffer[chunk_index];
+                compressed_buffer[chunk_index] = NULL;
+                __atomic_store_n(&chunk_num, chunk_num + 1, __ATOMIC_RELEASE);
             }
 #ifdef PRINT_INFO
 
@@ -575,7 +542,7 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
 
             while (now_chunk[1] < nchunks) {
 //                printf("num id is %d  now chunk is %d  chunk num is %d  nchunks is %d\n",num_id,now_chunk[num_id],chunk_num,nchunks);
-                while (now_chunk[1] < chunk_num) {
+                while (now_chunk[1] < __atomic_load_n(&chunk_num, __ATOMIC_ACQUIRE)) {
 
                     for (int y = offset[now_chunk[1]][0];
                          y < min(offset[now_chunk[1]][0] + chunk_dims[0], dims[0]); y++) {
@@ -587,16 +554,19 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
                             if (barcodeInt == 0) {
                                 continue;
                             }
-                            uint32 mapKey = barcodeInt % MOD;
                             position_all[bpmap_num].key = barcodeInt;
                             position_all[bpmap_num].value = position;
-                            bpmap_nxt[bpmap_num] = bpmap_head[mapKey];
-                            bpmap_head[mapKey] = bpmap_num;
+                            if (mapMod > 0) {
+                                uint32 mapKey = barcodeInt % mapMod;
+                                bpmap_nxt[bpmap_num] = bpmap_head[mapKey];
+                                bpmap_head[mapKey] = bpmap_num;
+                            }
                             bpmap_num++;
                         }
                     }
 
-                    now_chunk[1]++;
+                    releaseChunk(buffer, chunk_users, now_chunk[1]);
+                    __atomic_store_n(&now_chunk[1], now_chunk[1] + 1, __ATOMIC_RELEASE);
 
                 }
                 usleep(10);
@@ -607,7 +577,7 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
             now_chunk[2] = 0;
             while (now_chunk[2] < nchunks) {
 //                printf("num id is %d  now chunk is %d  chunk num is %d  nchunks is %d\n",num_id,now_chunk[num_id],chunk_num,nchunks);
-                while (now_chunk[2] < chunk_num) {
+                while (now_chunk[2] < __atomic_load_n(&chunk_num, __ATOMIC_ACQUIRE)) {
 
                     for (int y = offset[now_chunk[2]][0];
                          y < min(offset[now_chunk[2]][0] + chunk_dims[0], dims[0]); y++) {
@@ -627,11 +597,12 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
                             a = a ^ (a >> 15);
                             a = (a >> 6) & 0x3fff;
                             // 6 74
-                            uint32 mapkey = (barcodeInt >> 32) | (a << 18);
+                            uint32 mapkey = ((barcodeInt >> 32) | (a << 18)) & bloomFilter->bitMask;
                             bloomFilter->hashtable[mapkey >> 6] |= (1ll << (mapkey & 0x3f));
                         }
                     }
-                    now_chunk[2]++;
+                    releaseChunk(buffer, chunk_users, now_chunk[2]);
+                    __atomic_store_n(&now_chunk[2], now_chunk[2] + 1, __ATOMIC_RELEASE);
 
                 }
                 usleep(10);
@@ -644,7 +615,7 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
             now_chunk[3] = 0;
             while (now_chunk[3] < nchunks) {
 //                printf("num id is %d  now chunk is %d  chunk num is %d  nchunks is %d\n",num_id,now_chunk[num_id],chunk_num,nchunks);
-                while (now_chunk[3] < chunk_num) {
+                while (now_chunk[3] < __atomic_load_n(&chunk_num, __ATOMIC_ACQUIRE)) {
 
                     for (int y = offset[now_chunk[3]][0];
                          y < min(offset[now_chunk[3]][0] + chunk_dims[0], dims[0]); y++) {
@@ -656,11 +627,12 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
                             if (barcodeInt == 0) {
                                 continue;
                             }
-                            uint32 mapkey = barcodeInt & 0xffffffff;
+                            uint32 mapkey = barcodeInt & bloomFilter->bitMask;
                             bloomFilter->hashtableClassification[mapkey >> 6] |= (1ll << (mapkey & 0x3f));
                         }
                     }
-                    now_chunk[3]++;
+                    releaseChunk(buffer, chunk_users, now_chunk[3]);
+                    __atomic_store_n(&now_chunk[3], now_chunk[3] + 1, __ATOMIC_RELEASE);
 
                 }
                 usleep(10);
@@ -670,6 +642,14 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
 
     }
     mapSize = bpmap_num;
+    for (int i = 0; i < nchunks; i++) {
+        delete[] offset[i];
+    }
+    delete[] compressed_buffer;
+    delete[] buffer;
+    delete[] chunk_users;
+    delete[] offset;
+    delete[] chunk_size;
 
 
 //        for(int chunk_index=0;chunk_index<nchunks;chunk_index++){
@@ -831,3 +811,472 @@ void ChipMaskHDF5::readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, i
 //    delete[] bpMatrix_buffer;
     //delete[] bpMatrix;
 }
+
+hid_t ChipMaskHDF5::createDataSet(std::string &chipID, slideRange &sliderange, hsize_t *dims, uint32_t barcodeLen,
+                                  uint32_t slidePitch, uint compressionLevel, bool shuffle, int index) {
+    hid_t dataspaceID = H5Screate_simple(RANK, dims, NULL);
+    hid_t plistID = H5Pcreate(H5P_DATASET_CREATE);
+    //hdf5 rejects chunks larger than a fixed size dataset, small chips are a single chunk
+    hsize_t cdims[RANK] = {min((hsize_t) CDIM0, dims[0]), min((hsize_t) CDIM1, dims[1]), dims[2]};
+    herr_t status;
+    status = H5Pset_chunk(plistID, RANK, cdims);
+    //filters run in the order they are set, shuffle before deflate
+    if (shuffle) {
+        status = H5Pset_shuffle(plistID);
+    }
+    status = H5Pset_deflate(plistID, compressionLevel);
+
+    std::string datasetName = DATASETNAME + std::to_string(index);
+    hid_t datasetID = H5Dcreate2(fileID, datasetName.c_str(), H5T_NATIVE_UINT64, dataspaceID, H5P_DEFAULT, plistID,
+                                 H5P_DEFAULT);
+
+    //create dataset attribute [rowShift, colShift, barcodeLength, slidePitch]
+    uint32 attributeValues[ATTRIBUTEDIM] = {sliderange.rowStart, sliderange.colStart, barcodeLen, slidePitch};
+    hsize_t dimsA[1] = {ATTRIBUTEDIM};
+    hid_t attributeSpace = H5Screate_simple(1, dimsA, NULL);
+    hid_t attributeID = H5Acreate(datasetID, ATTRIBUTENAME, H5T_NATIVE_UINT32, attributeSpace, H5P_DEFAULT,
+                                  H5P_DEFAULT);
+    hid_t attributeSpace1 = H5Screate(H5S_SCALAR);
+    hid_t attributeID1 = H5Acreate(datasetID, ATTRIBUTENAME1, H5T_NATIVE_CHAR, attributeSpace1, H5P_DEFAULT,
+                                   H5P_DEFAULT);
+    status = H5Awrite(attributeID, H5T_NATIVE_INT, &attributeValues[0]);
+    status = H5Awrite(attributeID1, H5T_NATIVE_CHAR, chipID.c_str());
+    status = H5Sclose(attributeSpace);
+    status = H5Sclose(attributeSpace1);
+    status = H5Aclose(attributeID);
+    status = H5Aclose(attributeID1);
+    status = H5Sclose(dataspaceID);
+    status = H5Pclose(plistID);
+    return datasetID;
+}
+
+void ChipMaskHDF5::countBands(vector<uint64> &bandStart, hsize_t rows) {
+    bandStart.assign((rows + CDIM0 - 1) / CDIM0 + 1, 0);
+}
+
+bool ChipMaskHDF5::inRange(slideRange &sliderange, Position1 &position) {
+    return position.x >= sliderange.colStart && position.x <= sliderange.colEnd &&
+           position.y >= sliderange.rowStart && position.y <= sliderange.rowEnd;
+}
+
+//same byte layout as the hdf5 shuffle filter with 8 byte elements
+void ChipMaskHDF5::shuffleChunk(const uint64 *in, uint64 *out, size_t len) {
+    const uint8 *src = (const uint8 *) in;
+    uint8 *dst = (uint8 *) out;
+    for (int j = 0; j < sizeof(uint64); j++) {
+        uint8 *plane = dst + j * len;
+        for (size_t i = 0; i < len; i++) {
+            plane[i] = src[i * sizeof(uint64) + j];
+        }
+    }
+}
+
+void ChipMaskHDF5::unshuffleChunk(const uint64 *in, uint64 *out, size_t len) {
+    const uint8 *src = (const uint8 *) in;
+    uint8 *dst = (uint8 *) out;
+    for (int j = 0; j < sizeof(uint64); j++) {
+        const uint8 *plane = src + j * len;
+        for (size_t i = 0; i < len; i++) {
+            dst[i * sizeof(uint64) + j] = plane[i];
+        }
+    }
+}
+
+//barcodes take the first free segment of their cell in record order
+void ChipMaskHDF5::placeBand(uint64 *band, const bpmap_key_value *records, uint64 recordNum,
+                             slideRange &sliderange, hsize_t row0, hsize_t *dims) {
+    for (uint64 i = 0; i < recordNum; i++) {
+        uint64 row = records[i].value.y - sliderange.rowStart - row0;
+        uint64 col = records[i].value.x - sliderange.colStart;
+        uint64 *barcodes = band + (row * dims[1] + col) * dims[2];
+        for (int s = 0; s < dims[2]; s++) {
+            if (barcodes[s] == 0) {
+                barcodes[s] = records[i].key;
+                break;
+            }
+        }
+    }
+}
+
+herr_t ChipMaskHDF5::writeBands(hid_t datasetID, hsize_t *dims, uint compressionLevel, int threadNum, bool shuffle,
+                                const BandFiller &fillBand) {
+    hsize_t cdims[RANK] = {min((hsize_t) CDIM0, dims[0]), min((hsize_t) CDIM1, dims[1]), dims[2]};
+    int bandNum = (dims[0] + CDIM0 - 1) / CDIM0;
+    int chunkCols = (dims[1] + CDIM1 - 1) / CDIM1;
+    size_t chunkLen = cdims[0] * cdims[1] * cdims[2];
+    if (threadNum < 1) threadNum = 1;
+    if (threadNum > chunkCols) threadNum = chunkCols;
+
+    uint64 *band = new uint64[CDIM0 * dims[1] * dims[2]];
+    libdeflate_compressor **compressors = new libdeflate_compressor *[threadNum];
+    uint64 **chunkBuf = new uint64 *[threadNum];
+    uint64 **shuffleBuf = new uint64 *[threadNum];
+    char **compressedBuf = new char *[threadNum];
+    size_t *compressedSize = new size_t[threadNum];
+    size_t compressedBound = 0;
+    for (int t = 0; t < threadNum; t++) {
+        compressors[t] = libdeflate_alloc_compressor(compressionLevel);
+        chunkBuf[t] = new uint64[chunkLen];
+        shuffleBuf[t] = shuffle ? new uint64[chunkLen] : NULL;
+        if (t == 0) compressedBound = libdeflate_zlib_compress_bound(compressors[0], chunkLen * sizeof(uint64));
+        compressedBuf[t] = new char[compressedBound];
+    }
+
+    herr_t status = 0;
+    for (int b = 0; b < bandNum && status >= 0; b++) {
+        hsize_t row0 = (hsize_t) b * CDIM0;
+        hsize_t rows = min((hsize_t) CDIM0, dims[0] - row0);
+        memset(band, 0, rows * dims[1] * dims[2] * sizeof(uint64));
+        fillBand(b, band, row0);
+        //chunks of a band are compressed threadNum at a time and stored in order, hdf5 calls stay on this thread
+        for (int batch = 0; batch < chunkCols && status >= 0; batch += threadNum) {
+            int batchSize = min(threadNum, chunkCols - batch);
+#pragma omp parallel for num_threads(threadNum)
+            for (int t = 0; t < batchSize; t++) {
+                hsize_t col0 = (hsize_t) (batch + t) * CDIM1;
+                hsize_t cols = min((hsize_t) CDIM1, dims[1] - col0);
+                //edge chunks are stored full size, the part outside the dataset is zero
+                if (rows < CDIM0 || cols < CDIM1) {
+                    memset(chunkBuf[t], 0, chunkLen * sizeof(uint64));
+                }
+                for (hsize_t r = 0; r < rows; r++) {
+                    memcpy(chunkBuf[t] + r * cdims[1] * cdims[2], band + (r * dims[1] + col0) * dims[2],
+                           cols * dims[2] * sizeof(uint64));
+                }
+                uint64 *chunk = chunkBuf[t];
+                if (shuffle) {
+                    shuffleChunk(chunkBuf[t], shuffleBuf[t], chunkLen);
+                    chunk = shuffleBuf[t];
+                }
+                compressedSize[t] = libdeflate_zlib_compress(compressors[t], chunk, chunkLen * sizeof(uint64),
+                                                             compressedBuf[t], compressedBound);
+            }
+            for (int t = 0; t < batchSize; t++) {
+                hsize_t offset[RANK] = {row0, (hsize_t) (batch + t) * CDIM1, 0};
+                status = H5Dwrite_chunk(datasetID, H5P_DEFAULT, 0, offset, compressedSize[t], compressedBuf[t]);
+                if (status < 0) break;
+            }
+        }
+    }
+
+    for (int t = 0; t < threadNum; t++) {
+        libdeflate_free_compressor(compressors[t]);
+        delete[] chunkBuf[t];
+        if (shuffleBuf[t]) delete[] shuffleBuf[t];
+        delete[] compressedBuf[t];
+    }
+    delete[] compressors;
+    delete[] chunkBuf;
+    delete[] shuffleBuf;
+    delete[] compressedBuf;
+    delete[] compressedSize;
+    delete[] band;
+    return status;
+}
+
+herr_t ChipMaskHDF5::closeWritten(hid_t datasetID, herr_t status) {
+    if (status < 0) {
+        cerr << "write chunks of " << fileName << " failed" << endl;
+    }
+    //a close failure is reported only when the write itself went through
+    herr_t closeStatus = H5Dclose(datasetID);
+    if (status >= 0) status = closeStatus;
+    closeStatus = H5Fclose(fileID);
+    if (status >= 0) status = closeStatus;
+    if (status < 0) {
+        cerr << "write " << fileName << " failed" << endl;
+    }
+    return status;
+}
+
+herr_t ChipMaskHDF5::writeDataSet(std::string chipID, slideRange &sliderange, vector<bpmap_key_value> &bpList,
+                                  uint32_t barcodeLen, uint8_t segment, uint32_t slidePitch, uint compressionLevel,
+                                  int threadNum, bool shuffle, int index) {
+    hsize_t dims[RANK];
+    dims[0] = sliderange.rowEnd - sliderange.rowStart + 1;
+    dims[1] = sliderange.colEnd - sliderange.colStart + 1;
+    dims[2] = segment;
+    vector<uint64> bandStart;
+    countBands(bandStart, dims[0]);
+    for (size_t i = 0; i < bpList.size(); i++) {
+        if (!inRange(sliderange, bpList[i].value)) continue;
+        bandStart[(bpList[i].value.y - sliderange.rowStart) / CDIM0 + 1]++;
+    }
+    for (size_t b = 1; b < bandStart.size(); b++) bandStart[b] += bandStart[b - 1];
+    {
+        //bpList is reordered by band, the order inside a band is kept
+        vector<bpmap_key_value> banded(bandStart.back());
+        vector<uint64> bandPos(bandStart.begin(), bandStart.end() - 1);
+        for (size_t i = 0; i < bpList.size(); i++) {
+            if (!inRange(sliderange, bpList[i].value)) continue;
+            banded[bandPos[(bpList[i].value.y - sliderange.rowStart) / CDIM0]++] = bpList[i];
+        }
+        bpList.swap(banded);
+    }
+
+    hid_t datasetID = createDataSet(chipID, sliderange, dims, barcodeLen, slidePitch, compressionLevel, shuffle, index);
+    herr_t status = writeBands(datasetID, dims, compressionLevel, threadNum, shuffle,
+                               [&](int b, uint64 *band, hsize_t row0) {
+                                   placeBand(band, bpList.data() + bandStart[b], bandStart[b + 1] - bandStart[b],
+                                             sliderange, row0, dims);
+                               });
+    return closeWritten(datasetID, status);
+}
+
+herr_t ChipMaskHDF5::writeDataSet(std::string chipID, slideRange &sliderange, const bpmap_key_value *records,
+                                  uint64 recordNum, uint32_t barcodeLen, uint8_t segment, uint32_t slidePitch,
+                                  uint compressionLevel, int threadNum, bool shuffle, int index) {
+    hsize_t dims[RANK];
+    dims[0] = sliderange.rowEnd - sliderange.rowStart + 1;
+    dims[1] = sliderange.colEnd - sliderange.colStart + 1;
+    dims[2] = segment;
+    if (threadNum < 1) threadNum = 1;
+    vector<uint64> bandStart;
+    countBands(bandStart, dims[0]);
+    size_t bandNum = bandStart.size() - 1;
+    //counting sort of the record indexes by band, static scheduling hands out the same contiguous
+    //ranges in thread order in both loops, so every band keeps the record order
+    vector<uint64> bandPos(threadNum * bandNum, 0);
+#pragma omp parallel num_threads(threadNum)
+    {
+        uint64 *count = &bandPos[omp_get_thread_num() * bandNum];
+#pragma omp for schedule(static)
+        for (uint64 i = 0; i < recordNum; i++) {
+            Position1 position = records[i].value;
+            if (inRange(sliderange, position)) count[(position.y - sliderange.rowStart) / CDIM0]++;
+        }
+    }
+    uint64 placed = 0;
+    for (size_t b = 0; b < bandNum; b++) {
+        bandStart[b] = placed;
+        for (int t = 0; t < threadNum; t++) {
+            uint64 n = bandPos[t * bandNum + b];
+            bandPos[t * bandNum + b] = placed;
+            placed += n;
+        }
+    }
+    bandStart[bandNum] = placed;
+    vector<uint64> banded(placed);
+#pragma omp parallel num_threads(threadNum)
+    {
+        uint64 *pos = &bandPos[omp_get_thread_num() * bandNum];
+#pragma omp for schedule(static)
+        for (uint64 i = 0; i < recordNum; i++) {
+            Position1 position = records[i].value;
+            if (inRange(sliderange, position)) banded[pos[(position.y - sliderange.rowStart) / CDIM0]++] = i;
+        }
+    }
+
+    hid_t datasetID = createDataSet(chipID, sliderange, dims, barcodeLen, slidePitch, compressionLevel, shuffle, index);
+    herr_t status = writeBands(datasetID, dims, compressionLevel, threadNum, shuffle,
+                               [&](int b, uint64 *band, hsize_t row0) {
+                                   for (uint64 i = bandStart[b]; i < bandStart[b + 1]; i++) {
+                                       placeBand(band, records + banded[i], 1, sliderange, row0, dims);
+                                   }
+                               });
+    return closeWritten(datasetID, status);
+}
+
+hid_t ChipMaskHDF5::openDataSet(hsize_t *dims, uint32 *attributeValues, int index) {
+    herr_t status;
+    std::string datasetName = DATASETNAME + std::to_string(index);
+    hid_t datasetID = H5Dopen2(fileID, datasetName.c_str(), H5P_DEFAULT);
+    if (datasetID < 0) {
+        error_exit("can not open dataset " + datasetName + " in " + fileName);
+    }
+    memset(attributeValues, 0, ATTRIBUTEDIM * sizeof(uint32));
+    if (H5Aexists(datasetID, ATTRIBUTENAME) > 0) {
+        hid_t attributeID = H5Aopen(datasetID, ATTRIBUTENAME, H5P_DEFAULT);
+        hid_t attributeSpace = H5Aget_space(attributeID);
+        hssize_t attributeNum = H5Sget_simple_extent_npoints(attributeSpace);
+        uint32 values[ATTRIBUTEDIM * 2] = {0};
+        if (attributeNum > 0 && attributeNum <= ATTRIBUTEDIM * 2) {
+            status = H5Aread(attributeID, H5T_NATIVE_UINT32, values);
+            memcpy(attributeValues, values, min((hssize_t) ATTRIBUTEDIM, attributeNum) * sizeof(uint32));
+        }
+        H5Sclose(attributeSpace);
+        H5Aclose(attributeID);
+    }
+
+    hid_t dspaceID = H5Dget_space(datasetID);
+    hsize_t fileDims[RANK] = {1, 1, 1};
+    if (H5Sget_simple_extent_ndims(dspaceID) <= RANK) {
+        status = H5Sget_simple_extent_dims(dspaceID, fileDims, NULL);
+    }
+    H5Sclose(dspaceID);
+    for (int r = 0; r < RANK; r++) dims[r] = fileDims[r];
+    maskRows = dims[0];
+    maskCols = dims[1];
+    return datasetID;
+}
+
+void ChipMaskHDF5::streamChunks(hid_t datasetID, hsize_t *dims, int threadNum, const ChunkVisitor &visit,
+                                const BatchDone &done) {
+    herr_t status;
+    hid_t dspaceID = H5Dget_space(datasetID);
+    hid_t plistID = H5Dget_create_plist(datasetID);
+    int rank = H5Sget_simple_extent_ndims(dspaceID);
+    bool chunked = H5Pget_layout(plistID) == H5D_CHUNKED;
+    if (rank < 1 || rank > RANK) {
+        error_exit("mask dataset of rank " + to_string(rank) + " in " + fileName);
+    }
+
+    //direct chunk decoding knows deflate and shuffle followed by deflate
+    int nfilters = H5Pget_nfilters(plistID);
+    int deflateIndex = -1;
+    int shuffleIndex = -1;
+    bool knownFilters = true;
+    for (int f = 0; f < nfilters; f++) {
+        unsigned int flags;
+        size_t cdNum = 0;
+        H5Z_filter_t filter = H5Pget_filter2(plistID, f, &flags, &cdNum, NULL, 0, NULL, NULL);
+        if (filter == H5Z_FILTER_DEFLATE && deflateIndex < 0) {
+            deflateIndex = f;
+        } else if (filter == H5Z_FILTER_SHUFFLE && shuffleIndex < 0 && deflateIndex < 0) {
+            shuffleIndex = f;
+        } else {
+            knownFilters = false;
+        }
+    }
+    bool direct = chunked && rank == RANK && knownFilters;
+
+    hsize_t cdims[RANK] = {CDIM0, CDIM1, dims[2]};
+    if (chunked) {
+        H5Pget_chunk(plistID, rank, cdims);
+    }
+    //a rank 2 mask has one segment per position
+    for (int r = rank; r < RANK; r++) cdims[r] = 1;
+    size_t chunkLen = cdims[0] * cdims[1] * cdims[2];
+    //stored chunks for the direct path, otherwise blocks of chunk size that hdf5 reads and decodes itself
+    vector<hsize_t> offsets;
+    vector<hsize_t> sizes;
+    if (direct) {
+        hsize_t nchunks = 0;
+        status = H5Sselect_all(dspaceID);
+        status = H5Dget_num_chunks(datasetID, dspaceID, &nchunks);
+        offsets.resize(nchunks * RANK);
+        sizes.resize(nchunks);
+        for (hsize_t i = 0; i < nchunks; i++) {
+            H5Dget_chunk_info(datasetID, dspaceID, i, &offsets[i * RANK], NULL, NULL, &sizes[i]);
+        }
+    } else {
+        for (hsize_t r = 0; r < dims[0]; r += cdims[0]) {
+            for (hsize_t c = 0; c < dims[1]; c += cdims[1]) {
+                for (hsize_t s = 0; s < dims[2]; s += cdims[2]) {
+                    offsets.push_back(r);
+                    offsets.push_back(c);
+                    offsets.push_back(s);
+                }
+            }
+        }
+    }
+    size_t chunkNum = offsets.size() / RANK;
+    if (threadNum < 1) threadNum = 1;
+
+    libdeflate_decompressor **decompressors = new libdeflate_decompressor *[threadNum];
+    uint64 **chunkBuf = new uint64 *[threadNum];
+    uint64 **shuffleBuf = new uint64 *[threadNum];
+    char **rawBuf = new char *[threadNum];
+    size_t *rawCap = new size_t[threadNum];
+    uint32_t *filterMask = new uint32_t[threadNum];
+    for (int t = 0; t < threadNum; t++) {
+        decompressors[t] = libdeflate_alloc_decompressor();
+        chunkBuf[t] = new uint64[chunkLen];
+        shuffleBuf[t] = shuffleIndex >= 0 ? new uint64[chunkLen] : NULL;
+        rawCap[t] = direct ? chunkLen * sizeof(uint64) : 0;
+        rawBuf[t] = direct ? new char[rawCap[t]] : NULL;
+    }
+    bool failed = false;
+    //chunks are read threadNum at a time on this thread, then decoded and visited in parallel
+    for (size_t batch = 0; batch < chunkNum && !failed; batch += threadNum) {
+        int batchSize = min((size_t) threadNum, chunkNum - batch);
+        for (int t = 0; t < batchSize && !failed; t++) {
+            hsize_t *offset = &offsets[(batch + t) * RANK];
+            if (direct) {
+                if (sizes[batch + t] > rawCap[t]) {
+                    delete[] rawBuf[t];
+                    rawCap[t] = sizes[batch + t];
+                    rawBuf[t] = new char[rawCap[t]];
+                }
+                if (H5Dread_chunk(datasetID, H5P_DEFAULT, offset, &filterMask[t], rawBuf[t]) < 0) {
+                    failed = true;
+                }
+            } else {
+                hsize_t count[RANK];
+                hsize_t zero[RANK] = {0, 0, 0};
+                for (int r = 0; r < RANK; r++) count[r] = min(cdims[r], dims[r] - offset[r]);
+                memset(chunkBuf[t], 0, chunkLen * sizeof(uint64));
+                //the selections take the first rank entries, the rest are 1
+                hid_t memspaceID = H5Screate_simple(rank, cdims, NULL);
+                status = H5Sselect_hyperslab(memspaceID, H5S_SELECT_SET, zero, NULL, count, NULL);
+                status = H5Sselect_hyperslab(dspaceID, H5S_SELECT_SET, offset, NULL, count, NULL);
+                if (H5Dread(datasetID, H5T_NATIVE_UINT64, memspaceID, dspaceID, H5P_DEFAULT, chunkBuf[t]) < 0) {
+                    failed = true;
+                }
+                H5Sclose(memspaceID);
+            }
+        }
+        if (failed) break;
+#pragma omp parallel for num_threads(threadNum)
+        for (int t = 0; t < batchSize; t++) {
+            hsize_t *offset = &offsets[(batch + t) * RANK];
+            uint64 *chunk = chunkBuf[t];
+            if (direct) {
+                chunk = (uint64 *) rawBuf[t];
+                if (deflateIndex >= 0 && !(filterMask[t] & (1 << deflateIndex))) {
+                    size_t actualOut = 0;
+                    if (libdeflate_zlib_decompress(decompressors[t], rawBuf[t], sizes[batch + t], chunkBuf[t],
+                                                   chunkLen * sizeof(uint64), &actualOut) != LIBDEFLATE_SUCCESS) {
+                        failed = true;
+                        continue;
+                    }
+                    chunk = chunkBuf[t];
+                }
+                if (shuffleIndex >= 0 && !(filterMask[t] & (1 << shuffleIndex))) {
+                    unshuffleChunk(chunk, shuffleBuf[t], chunkLen);
+                    chunk = shuffleBuf[t];
+                }
+            }
+            hsize_t extent[RANK];
+            for (int r = 0; r < RANK; r++) extent[r] = min(cdims[r], dims[r] - offset[r]);
+            visit(t, offset, extent, cdims, chunk);
+        }
+        if (!failed && done) done(batchSize);
+    }
+    for (int t = 0; t < threadNum; t++) {
+        libdeflate_free_decompressor(decompressors[t]);
+        delete[] chunkBuf[t];
+        if (shuffleBuf[t]) delete[] shuffleBuf[t];
+        if (rawBuf[t]) delete[] rawBuf[t];
+    }
+    delete[] decompressors;
+    delete[] chunkBuf;
+    delete[] shuffleBuf;
+    delete[] rawBuf;
+    delete[] rawCap;
+    delete[] filterMask;
+    H5Pclose(plistID);
+    H5Sclose(dspaceID);
+    if (failed) {
+        error_exit("broken chunk in " + fileName);
+    }
+}
+
+uint64 *ChipMaskHDF5::readDataSetParallel(hsize_t *dims, uint32 *attributeValues, int threadNum, int index) {
+    hid_t datasetID = openDataSet(dims, attributeValues, index);
+    uint64 matrixLen = dims[0] * dims[1] * dims[2];
+    //chunks that were never written are not stored, they read as zero
+    uint64 *matrix = new uint64[matrixLen]();
+    streamChunks(datasetID, dims, threadNum,
+                 [&](int, const hsize_t *offset, const hsize_t *extent, const hsize_t *cdims,
+                     const uint64 *chunk) {
+                     for (hsize_t r = 0; r < extent[0]; r++) {
+                         for (hsize_t c = 0; c < extent[1]; c++) {
+                             memcpy(matrix + ((offset[0] + r) * dims[1] + offset[1] + c) * dims[2] + offset[2],
+                                    chunk + (r * cdims[1] + c) * cdims[2], extent[2] * sizeof(uint64));
+                         }
+                     }
+                 }, BatchDone());
+    H5Dclose(datasetID);
+    return matrix;
+}
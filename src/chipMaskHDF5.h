@@ -4,6 +4,7 @@
 #include <iostream>
 #include <hdf5.h>
 #include <unordered_map>
+#include <functional>
 #include "common.h"
 #include <libdeflate.h>
 //#include "robin_hood.h"
@@ -19,10 +20,21 @@
 #define ATTRIBUTEDIM1 2
 #define ATTRIBUTENAME "dnbInfo"
 #define ATTRIBUTENAME1 "chipInfo"
+//decoded chunks the mapping loader keeps ahead of its index threads
+#define CHUNK_LOAD_WINDOW 16
 
 using namespace std;
 //using namespace robin_hood;
 
+//fills the zeroed buffer of one chunk row band, laid out as [row - row0][col][segment]
+typedef function<void(int bandIndex, uint64 *band, hsize_t row0)> BandFiller;
+//gets one decoded chunk laid out as [cdims0][cdims1][cdims2], extent is the part of it inside the dataset,
+//slot is the position of the chunk in its batch and chunks of a batch are visited in parallel
+typedef function<void(int slot, const hsize_t *offset, const hsize_t *extent, const hsize_t *cdims,
+                      const uint64 *chunk)> ChunkVisitor;
+//runs on the calling thread after all chunks of a batch are visited
+typedef function<void(int batchSize)> BatchDone;
+
 class ChipMaskHDF5 {
 public:
     ChipMaskHDF5(std::string FileName);
@@ -31,26 +43,75 @@ public:
 
     void creatFile();
 
+    //the matrix is built one chunk row band at a time, chunks are compressed in parallel with libdeflate
+    //and stored with direct chunk writes, shuffle adds the hdf5 byte shuffle filter before deflate
     herr_t writeDataSet(std::string chipID, slideRange &sliderange, unordered_map<uint64, Position1> &bpMap,
                         uint32_t BarcodeLen, uint8_t segment, uint32_t slidePitch, uint compressionLevel = 6,
-                        int index = 1);
+                        int threadNum = 8, bool shuffle = false, int index = 1);
+
+    herr_t writeDataSet(std::string chipID, slideRange &sliderange, vector<bpmap_key_value> &bpList,
+                        uint32_t BarcodeLen, uint8_t segment, uint32_t slidePitch, uint compressionLevel = 6,
+                        int threadNum = 8, bool shuffle = false, int index = 1);
+
+    //records are bucketed by band through their indexes, so they can stay in a mapped file
+    herr_t writeDataSet(std::string chipID, slideRange &sliderange, const bpmap_key_value *records,
+                        uint64 recordNum, uint32_t BarcodeLen, uint8_t segment, uint32_t slidePitch,
+                        uint compressionLevel = 6, int threadNum = 8, bool shuffle = false, int index = 1);
 
     void openFile();
 
+    //opens the dataset, dims gets its shape as [row][col][segment] and attributeValues its dnbInfo,
+    //a rank 2 mask is reported with segment 1
+    hid_t openDataSet(hsize_t *dims, uint32 *attributeValues, int index = 1);
+
+    //decodes the chunks of an opened dataset threadNum at a time, only one batch of chunks is in memory
+    void streamChunks(hid_t datasetID, hsize_t *dims, int threadNum, const ChunkVisitor &visit,
+                      const BatchDone &done);
+
+    //whole dataset as [row][col][segment], chunks are inflated in parallel, caller deletes the buffer
+    uint64 *readDataSetParallel(hsize_t *dims, uint32 *attributeValues, int threadNum, int index = 1);
+
 //    void readDataSet(unordered_map<uint64, Position1> &bpMap, int index = 1);
 //    void
 //    readDataSet(int &headNum, int *&hashHead, node *&hashMap, int &dims1, BloomFilter *&bloomFilter, int index = 1);
     void
     readDataSet(int &headNum, int *&hashHead, node *&hashMap, int &dims1, uint64 *&bloomFilter, int index = 1);
 
+    //mapMod is the number of hash buckets and bloomBits the log2 size of the bloom filter tables,
+    //with mapMod 0 no bucket chains are built and bpmap_head / bpmap_nxt are left as they are
     void readDataSetHashListOneArrayWithBloomFilter(uint32 &mapSize, int *&bpmap_head, int *&bpmap_nxt,
                                                     bpmap_key_value *&position_all, BloomFilter *&bloomFilter,
+                                                    uint32 mapMod = MOD, int bloomBits = BLOOM_MAX_BITS,
                                                     int index = 1);
 
+    static void shuffleChunk(const uint64 *in, uint64 *out, size_t len);
+
+    static void unshuffleChunk(const uint64 *in, uint64 *out, size_t len);
+
+private:
+    hid_t createDataSet(std::string &chipID, slideRange &sliderange, hsize_t *dims, uint32_t barcodeLen,
+                        uint32_t slidePitch, uint compressionLevel, bool shuffle, int index);
+
+    void countBands(vector<uint64> &bandStart, hsize_t rows);
+
+    bool inRange(slideRange &sliderange, Position1 &position);
+
+    void placeBand(uint64 *band, const bpmap_key_value *records, uint64 recordNum, slideRange &sliderange,
+                   hsize_t row0, hsize_t *dims);
+
+    herr_t writeBands(hid_t datasetID, hsize_t *dims, uint compressionLevel, int threadNum, bool shuffle,
+                      const BandFiller &fillBand);
+
+    //closes the dataset and the file after a write, the first negative status wins
+    herr_t closeWritten(hid_t datasetID, herr_t status);
+
 public:
     std::string fileName;
     hid_t fileID;
     uint64 ***bpMatrix;
+    //grid size of the last dataset read, x is the column and y the row
+    uint32 maskRows = 0;
+    uint32 maskCols = 0;
 };
 
 #endif 
\ No newline at end of file
@@ -1,9 +1,16 @@
 #include "chipMaskMerge.h"
+#include <omp.h>
 
 ChipMaskMerge::ChipMaskMerge(Options* opt){
     mOptions = opt;
     split(opt->in, inMasks, ",");
     outMask = opt->out;
+    barcodeLen = opt->barcodeLen;
+    threadNum = opt->thread < 1 ? 1 : opt->thread;
+    for (int s = 0; s < MASK_MERGE_SHARD_NUM; s++){
+        shardDup[s] = 0;
+        shardOverlap[s] = 0;
+    }
 }
 
 ChipMaskMerge::~ChipMaskMerge(){
@@ -15,119 +22,41 @@ void ChipMaskMerge::maskMerge(){
 	cout << "##########load barcodeToPosition map begin..." << endl;
     for (auto inMask = inMasks.begin(); inMask != inMasks.end(); inMask++){
         if (ends_with(*inMask, ".bin")){
-            ifstream mapReader(inMask->c_str(), ios::in | ios::binary);
-            uint64 barcodeInt;
-		    Position1 position;
-		    while (!mapReader.eof()) {
-			    mapReader.read((char*)&barcodeInt, sizeof(barcodeInt));
-			    mapReader.read((char*)&position.x, sizeof(position.x));
-			    mapReader.read((char*)&position.y, sizeof(position.y));
-                rangeRefresh(position);
-                add(barcodeInt, position);
-            }
+            loadBin(*inMask);
             cout << "slide range: " << minX << "\t" << maxX << "\t" << minY << "\t" << maxY << endl;
         }else if (ends_with(*inMask, ".h5")){
-            hid_t fileID = H5Fopen(inMask->c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
-            herr_t status;
-            //open dataset with datasetName
-            int index = 1;
-            std::string datasetName = DATASETNAME + std::to_string(index);
-            hid_t datasetID = H5Dopen2(fileID, datasetName.c_str(), H5P_DEFAULT);
-            //read attribute of the dataset
-    
-            uint32 attributeValues[ATTRIBUTEDIM];
-            hid_t attributeID = H5Aopen_by_name(fileID, datasetName.c_str(), ATTRIBUTENAME, H5P_DEFAULT, H5P_DEFAULT);
-            status = H5Aread(attributeID, H5T_NATIVE_UINT32, &attributeValues[0]);
-            uint32 rowOffset = attributeValues[0];
-            uint32 colOffset = attributeValues[1];
-            barcodeLen = attributeValues[2];
-            cout << "row offset: " << rowOffset << "\tcol offset: "<< colOffset << endl;
-
-            hid_t dspaceID = H5Dget_space(datasetID);
-            hid_t dtype_id = H5Dget_type(datasetID);
-            hid_t plistID = H5Dget_create_plist(datasetID);
-            int rank = H5Sget_simple_extent_ndims(dspaceID);
-            hsize_t dims[rank];
-            status = H5Sget_simple_extent_dims(dspaceID, dims, NULL);
-
-            uint64 matrixLen = 1;
-            for (int i = 0 ; i<rank; i++){
-                matrixLen *= dims[i];
-            }
-
-            int segment = 1;
-            if (rank>=3){
-                segment = dims[2];
-            }
-
-            uint64* bpMatrix_buffer = new uint64[matrixLen]();
-            status = H5Dread(datasetID, H5T_NATIVE_UINT64, H5S_ALL, H5S_ALL, H5P_DEFAULT, bpMatrix_buffer);
-            status = H5Aclose(attributeID);
-            status = H5Dclose(datasetID);
-            status = H5Fclose(fileID);
-    
-    
-            for (uint32 r = 0; r < dims[0]; r++){
-                
-                for (uint32 c = 0; c< dims[1]; c++){
-                    Position1 position = {c + colOffset, r + rowOffset};
-                    if (rank >= 3 ){               
-                        segment = dims[2];
-                        for (int s = 0; s<segment; s++){
-                            uint64 barcodeInt = bpMatrix_buffer[r*dims[1]*segment + c*segment + s];
-                            if (barcodeInt == 0){
-                                continue;
-                            }
-                            add(barcodeInt, position);
-                        }
-                    }else{
-                        uint64 barcodeInt = bpMatrix_buffer[r*dims[1]+c];
-                        if (barcodeInt == 0){
-                            continue;
-                        }
-                        add(barcodeInt, position);
-                    }           
-                }
-            }
-            Position1 positionR = {dims[1] + colOffset, dims[0] + rowOffset};
-            rangeRefresh(positionR);
-            Position1 positionL = {colOffset, rowOffset};
-            rangeRefresh(positionL);
+            loadH5(*inMask);
         }else{
-            uint64 barcodeInt;
-		    Position1 position;
-		    string line;
-		    ifstream mapReader(inMask->c_str());
-		    while (std::getline(mapReader, line)) {
-			    if(line.empty()){
-				    cerr << "barcodePositionMap file read finished." << endl;
-				    break;
-			    }
-			    vector<string> splitLine;
-			    //std::getline(mapReader, line);
-			    split(line, splitLine, "\t");
-			    //position.fov_c = fovCol;
-			    //position.fov_r = fovRow;
-			    if (splitLine.size() < 3){
-				    break;
-			    }
-			    else if (splitLine.size() == 3){
-				    position.x = std::stoi(splitLine[1]);
-				    position.y = std::stoi(splitLine[2]);
-			    }else {
-				    position.x = std::stoi(splitLine[3]);
-				    position.y = std::stoi(splitLine[4]);
-			    }
-			    barcodeInt = seqEncode(splitLine[0].c_str(), mOptions->barcodeStart, barcodeLen);
-                rangeRefresh(position);
-			    add(barcodeInt, position);
-			    //cout << "barcode: " << barcodeInt << " position: " << position.x << " " << position.y <<endl;
-		    }
+            loadText(*inMask);
 		    cout << "slide range: " << minX << "\t" << maxX << "\t" << minY << "\t" << maxY << endl;
-		    mapReader.close();
         }
     }
-    long uniqueBarcodes = bpmap.size();
+
+    //a barcode only meets its copies inside its own shard, so shards are resolved independently
+    for (int s = 0; s < MASK_MERGE_SHARD_NUM; s++){
+        totalBarcodes += shards[s].size();
+    }
+#pragma omp parallel for num_threads(threadNum) schedule(dynamic)
+    for (int s = 0; s < MASK_MERGE_SHARD_NUM; s++){
+        resolveShard(s);
+    }
+    uint64 shardStart[MASK_MERGE_SHARD_NUM + 1];
+    shardStart[0] = 0;
+    for (int s = 0; s < MASK_MERGE_SHARD_NUM; s++){
+        overlapBarcodes += shardOverlap[s];
+        dupBarcodes += shardDup[s];
+        shardStart[s + 1] = shardStart[s] + shards[s].size();
+    }
+    mergedList.resize(shardStart[MASK_MERGE_SHARD_NUM]);
+#pragma omp parallel for num_threads(threadNum)
+    for (int s = 0; s < MASK_MERGE_SHARD_NUM; s++){
+        if (!shards[s].empty()){
+            memcpy(&mergedList[shardStart[s]], &shards[s][0], shards[s].size() * sizeof(bpmap_key_value));
+        }
+        vector<bpmap_key_value>().swap(shards[s]);
+    }
+
+    long uniqueBarcodes = mergedList.size();
     cout << "##########load barcodeToPosition map finished, time used: " << time(NULL) - start << " seconds" << endl;
     cout << "total barcode number:\t" << totalBarcodes << endl;
     cout << "overlaped barcode number:\t" << overlapBarcodes << endl;
@@ -140,38 +69,198 @@ void ChipMaskMerge::maskMerge(){
     dumpBpmap();
 }
 
-bool ChipMaskMerge::add(uint64 barcodeInt, Position1& position){
-    totalBarcodes++;
-    if (dupBarcode.count(barcodeInt) > 0){
-        dupBarcodes++;
-        return false;
-    }
-    unordered_map<uint64, Position1>::iterator dupBarcodeFind = bpmap.find(barcodeInt);
-    if (dupBarcodeFind != bpmap.end()){
-        if (dupBarcodeFind->second.x == position.x && dupBarcodeFind->second.y == position.y){
-            overlapBarcodes++;
-            return false;
+void ChipMaskMerge::loadBin(string& maskFile){
+    ifstream mapReader(maskFile.c_str(), ios::in | ios::binary | ios::ate);
+    if (!mapReader.is_open()){
+        error_exit("can not open mask file: " + maskFile);
+    }
+    //records are barcode(uint64) x(uint32) y(uint32), the same layout as bpmap_key_value
+    uint64 entryNum = (uint64) mapReader.tellg() / sizeof(bpmap_key_value);
+    vector<bpmap_key_value> entries(entryNum);
+    mapReader.seekg(0);
+    if (entryNum > 0){
+        mapReader.read((char*)&entries[0], entryNum * sizeof(bpmap_key_value));
+    }
+    mapReader.close();
+    for (uint64 i = 0; i < entryNum; i++){
+        rangeRefresh(entries[i].value);
+    }
+    partition(entries.empty() ? NULL : &entries[0], entryNum);
+}
+
+void ChipMaskMerge::loadH5(string& maskFile){
+    ChipMaskHDF5 chipMaskH5(maskFile);
+    chipMaskH5.openFile();
+    hsize_t dims[RANK];
+    uint32 attributeValues[ATTRIBUTEDIM];
+    uint64* bpMatrix_buffer = chipMaskH5.readDataSetParallel(dims, attributeValues, threadNum);
+    H5Fclose(chipMaskH5.fileID);
+    uint32 rowOffset = attributeValues[0];
+    uint32 colOffset = attributeValues[1];
+    barcodeLen = attributeValues[2];
+    cout << "row offset: " << rowOffset << "\tcol offset: "<< colOffset << endl;
+
+    partitionMatrix(bpMatrix_buffer, dims, rowOffset, colOffset);
+    delete[] bpMatrix_buffer;
+
+    Position1 positionR = {(uint32) dims[1] + colOffset, (uint32) dims[0] + rowOffset};
+    rangeRefresh(positionR);
+    Position1 positionL = {colOffset, rowOffset};
+    rangeRefresh(positionL);
+}
+
+void ChipMaskMerge::loadText(string& maskFile){
+    vector<bpmap_key_value> entries;
+    bpmap_key_value entry;
+    string line;
+    ifstream mapReader(maskFile.c_str());
+    while (std::getline(mapReader, line)) {
+        if(line.empty()){
+            cerr << "barcodePositionMap file read finished." << endl;
+            break;
+        }
+        vector<string> splitLine;
+        split(line, splitLine, "\t");
+        if (splitLine.size() < 3){
+            break;
+        }
+        else if (splitLine.size() == 3){
+            entry.value.x = std::stoi(splitLine[1]);
+            entry.value.y = std::stoi(splitLine[2]);
+        }else {
+            entry.value.x = std::stoi(splitLine[3]);
+            entry.value.y = std::stoi(splitLine[4]);
+        }
+        entry.key = seqEncode(splitLine[0].c_str(), mOptions->barcodeStart, barcodeLen);
+        rangeRefresh(entry.value);
+        entries.push_back(entry);
+    }
+    mapReader.close();
+    partition(entries.empty() ? NULL : &entries[0], entries.size());
+}
+
+void ChipMaskMerge::partition(bpmap_key_value* entries, uint64 entryNum){
+    vector<vector<bpmap_key_value>> local(threadNum * MASK_MERGE_SHARD_NUM);
+#pragma omp parallel num_threads(threadNum)
+    {
+        int t = omp_get_thread_num();
+        uint64 begin = entryNum * t / threadNum;
+        uint64 end = entryNum * (t + 1) / threadNum;
+        vector<bpmap_key_value>* myShards = &local[t * MASK_MERGE_SHARD_NUM];
+        for (uint64 i = begin; i < end; i++){
+            myShards[shardOf(entries[i].key)].push_back(entries[i]);
+        }
+    }
+    //thread t holds the t-th slice of the input, appending in thread order keeps the input order
+#pragma omp parallel for num_threads(threadNum)
+    for (int s = 0; s < MASK_MERGE_SHARD_NUM; s++){
+        for (int t = 0; t < threadNum; t++){
+            vector<bpmap_key_value>& piece = local[t * MASK_MERGE_SHARD_NUM + s];
+            shards[s].insert(shards[s].end(), piece.begin(), piece.end());
+            vector<bpmap_key_value>().swap(piece);
+        }
+    }
+}
+
+void ChipMaskMerge::partitionMatrix(uint64* matrix, hsize_t* dims, uint32 rowOffset, uint32 colOffset){
+    vector<vector<bpmap_key_value>> local(threadNum * MASK_MERGE_SHARD_NUM);
+#pragma omp parallel num_threads(threadNum)
+    {
+        int t = omp_get_thread_num();
+        uint64 rowBegin = dims[0] * t / threadNum;
+        uint64 rowEnd = dims[0] * (t + 1) / threadNum;
+        vector<bpmap_key_value>* myShards = &local[t * MASK_MERGE_SHARD_NUM];
+        bpmap_key_value entry;
+        for (uint64 r = rowBegin; r < rowEnd; r++){
+            for (uint64 c = 0; c < dims[1]; c++){
+                uint64* barcodes = matrix + (r * dims[1] + c) * dims[2];
+                entry.value.x = c + colOffset;
+                entry.value.y = r + rowOffset;
+                for (int s = 0; s < dims[2]; s++){
+                    if (barcodes[s] == 0){
+                        continue;
+                    }
+                    entry.key = barcodes[s];
+                    myShards[shardOf(entry.key)].push_back(entry);
+                }
+            }
+        }
+    }
+#pragma omp parallel for num_threads(threadNum)
+    for (int s = 0; s < MASK_MERGE_SHARD_NUM; s++){
+        for (int t = 0; t < threadNum; t++){
+            vector<bpmap_key_value>& piece = local[t * MASK_MERGE_SHARD_NUM + s];
+            shards[s].insert(shards[s].end(), piece.begin(), piece.end());
+            vector<bpmap_key_value>().swap(piece);
+        }
+    }
+}
+
+/*
+ * Same rules as adding the barcodes one by one in input order:
+ * the first copy is kept, a later copy at the same position is an overlap,
+ * a copy at another position marks the barcode duplicated (2 for the first conflict,
+ * 1 for every copy after that) and drops it.
+ */
+void ChipMaskMerge::resolveShard(int shard){
+    vector<bpmap_key_value>& entries = shards[shard];
+    uint64 entryNum = entries.size();
+    if (entryNum == 0) return;
+    uint64 capacity = 16;
+    while (capacity < entryNum * 2) capacity <<= 1;
+    uint64 mask = capacity - 1;
+    //slot holds index + 1 of the first copy, 0 is empty
+    uint32* slots = new uint32[capacity]();
+    //0 dropped, 1 kept, 2 duplicated
+    uint8* state = new uint8[entryNum]();
+    long dup = 0;
+    long overlap = 0;
+    for (uint64 i = 0; i < entryNum; i++){
+        uint64 h = entries[i].key * 0x9E3779B97F4A7C15ULL;
+        uint64 slot = (h >> 20) & mask;
+        while (slots[slot] != 0 && entries[slots[slot] - 1].key != entries[i].key){
+            slot = (slot + 1) & mask;
+        }
+        if (slots[slot] == 0){
+            slots[slot] = i + 1;
+            state[i] = 1;
+            continue;
+        }
+        uint64 first = slots[slot] - 1;
+        if (state[first] == 2){
+            dup++;
+        }else if (entries[first].value.x == entries[i].value.x && entries[first].value.y == entries[i].value.y){
+            overlap++;
         }else{
-            dupBarcodes += 2;
-            dupBarcode.insert(barcodeInt);
-            bpmap.erase(barcodeInt);
-            return false;
+            dup += 2;
+            state[first] = 2;
+        }
+    }
+    uint64 kept = 0;
+    for (uint64 i = 0; i < entryNum; i++){
+        if (state[i] == 1){
+            entries[kept++] = entries[i];
         }
-    }else{
-        bpmap[barcodeInt] = position;
-        return true;
     }
+    entries.resize(kept);
+    vector<bpmap_key_value>(entries).swap(entries);
+    delete[] slots;
+    delete[] state;
+    shardDup[shard] = dup;
+    shardOverlap[shard] = overlap;
 }
 
 void ChipMaskMerge::rangeRefresh(Position1& position){
 	if (position.x < minX){
 		minX  = position.x;
-	}else if (position.x > maxX){
+	}
+	if (position.x > maxX){
 		maxX = position.x;
 	}
 	if (position.y < minY){
 		minY = position.y;
-	}else if (position.y > maxY){
+	}
+	if (position.y > maxY){
 		maxY = position.y;
 	}
 }
@@ -180,16 +269,9 @@ void ChipMaskMerge::dumpBpmap(){
     time_t start = time(NULL);
 	cout << "##########dump barcodeToPosition map begin..." << endl;
 	if (ends_with(outMask, ".bin")) {
-        unordered_map<uint64, Position1>::iterator mapIter = bpmap.begin();
-		bpmap.reserve(bpmap.size());
 		ofstream writer(outMask, ios::out | ios::binary);
-		//boost::archive::binary_oarchive oa(writer);
-		//oa << bpmap;
-		while (mapIter != bpmap.end()) {
-			writer.write((char*)&mapIter->first, sizeof(uint64));
-			writer.write((char*)&mapIter->second, sizeof(uint32));
-			writer.write((char*)&mapIter->second, sizeof(uint32));
-			mapIter++;
+		if (!mergedList.empty()){
+			writer.write((char*)&mergedList[0], mergedList.size() * sizeof(bpmap_key_value));
 		}
 		writer.close();
 	}else if (ends_with(outMask, "h5") || ends_with(outMask, "hdf5")){
@@ -200,14 +282,12 @@ void ChipMaskMerge::dumpBpmap(){
 			segment *= 2;
 		}
         slideRange sliderange{minX, maxX, minY, maxY};
-		chipMaskH5.writeDataSet(mOptions->chipID, sliderange, bpmap, barcodeLen, segment, slidePitch, mOptions->compression);
+		chipMaskH5.writeDataSet(mOptions->chipID, sliderange, mergedList, barcodeLen, segment, slidePitch, mOptions->compression, threadNum, mOptions->maskShuffle);
 	}
 	else {
 		ofstream writer(outMask);
-        unordered_map<uint64, Position1>::iterator mapIter = bpmap.begin();
-		while (mapIter != bpmap.end()) {
-			writer << seqDecode(mapIter->first, barcodeLen) << "\t" << mapIter->second.x << "\t" << mapIter->second.y << endl;
-			mapIter++;
+		for (uint64 i = 0; i < mergedList.size(); i++) {
+			writer << seqDecode(mergedList[i].key, barcodeLen) << "\t" << mergedList[i].value.x << "\t" << mergedList[i].value.y << "\n";
 		}
 		writer.close();
 	}
@@ -19,21 +19,39 @@
 
 using namespace std;
 
+//barcodes are split into this many shards by hash, each shard is resolved by one thread
+#define MASK_MERGE_SHARD_NUM 256
+
 class ChipMaskMerge{
 public:
     ChipMaskMerge(Options* opt);
     ~ChipMaskMerge();
     void maskMerge();
 private:
+    void loadBin(string& maskFile);
+    void loadH5(string& maskFile);
+    void loadText(string& maskFile);
+    //append barcodes of one mask to the shards, order inside a shard follows the input order
+    void partition(bpmap_key_value* entries, uint64 entryNum);
+    void partitionMatrix(uint64* matrix, hsize_t* dims, uint32 rowOffset, uint32 colOffset);
+    void resolveShard(int shard);
     void dumpBpmap();
-    bool add(uint64 barcodeInt, Position1& position);
     void rangeRefresh(Position1& position);
+    static inline int shardOf(uint64 barcodeInt){
+        barcodeInt ^= barcodeInt >> 29;
+        barcodeInt *= 0xbf58476d1ce4e5b9ULL;
+        barcodeInt ^= barcodeInt >> 32;
+        return barcodeInt & (MASK_MERGE_SHARD_NUM - 1);
+    }
 public:
     Options* mOptions;
     vector<std::string> inMasks;
     std::string outMask;
-    unordered_map<uint64, Position1> bpmap;
-    set<uint64> dupBarcode;
+    vector<bpmap_key_value> shards[MASK_MERGE_SHARD_NUM];
+    long shardDup[MASK_MERGE_SHARD_NUM];
+    long shardOverlap[MASK_MERGE_SHARD_NUM];
+    vector<bpmap_key_value> mergedList;
+    int threadNum;
     long dupBarcodes = 0;
     long overlapBarcodes = 0;
     long totalBarcodes = 0;
@@ -45,4 +63,4 @@ public:
     int slidePitch = 500;
 };
 
-#endif //! CHIPMASKMERGE_H
\ No newline at end of file
+#endif //! CHIPMASKMERGE_H
@@ -34,9 +34,17 @@ static const long long int MAX_BARCODE = 0xffffffffffffffff;
 
 typedef long long ll;
 typedef __int128_t i128;
+typedef unsigned __int128 uint128;
+
+//barcodes up to this many bases are encoded into uint64 keys, longer ones into uint128 keys
+static const int NARROW_BARCODE_LEN = 32;
+static const int MAX_BARCODE_LEN = 64;
 
 #define MOD 1073807359
 
+//log2 bits of a full size bloom filter table
+static const int BLOOM_MAX_BITS = 32;
+
 #pragma pack(2)
 
 
@@ -167,10 +175,15 @@ typedef struct node {
 } node;
 
 
-typedef struct bpmap_key_value {
-    uint64 key;
+//barcode and position of a mask record, Key is uint64 or uint128
+template<class Key>
+struct BarcodeRecord {
+    Key key;
     Position1 value;
-} bpmap_key_value;
+};
+
+typedef BarcodeRecord<uint64> bpmap_key_value;
+typedef BarcodeRecord<uint128> bpmap_wide_key_value;
 
 
 
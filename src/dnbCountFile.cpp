@@ -0,0 +1,131 @@
+#include "dnbCountFile.h"
+#include <string.h>
+
+DnbCountWriter::DnbCountWriter(string fileName) {
+    mFileName = fileName;
+    mOut.open(fileName, ios::out | ios::binary);
+    if (!mOut.is_open()) {
+        error_exit("can not write dnb count file: " + fileName);
+    }
+    mBuf = new char[DNB_FILE_BUFFER_SIZE];
+    mBufLen = 0;
+    mLast = 0;
+    mNum = 0;
+    mClosed = false;
+    mOut.write(DNB_FILE_MAGIC, DNB_FILE_MAGIC_LEN);
+    //entry number is patched in close()
+    mOut.write((char *) &mNum, sizeof(mNum));
+}
+
+DnbCountWriter::~DnbCountWriter() {
+    //a failed close has already been reported, and a destructor must not throw it again
+    try {
+        close();
+    } catch (...) {
+    }
+    delete[] mBuf;
+}
+
+void DnbCountWriter::add(uint64 position, uint32 count) {
+    if (mNum > 0 && position <= mLast) {
+        error_exit("dnb positions are not sorted when writing " + mFileName);
+    }
+    if (mBufLen + 16 > DNB_FILE_BUFFER_SIZE) {
+        flush();
+    }
+    uint64 delta = position - mLast;
+    while (delta >= 0x80) {
+        mBuf[mBufLen++] = (char) (delta | 0x80);
+        delta >>= 7;
+    }
+    mBuf[mBufLen++] = (char) delta;
+    while (count >= 0x80) {
+        mBuf[mBufLen++] = (char) (count | 0x80);
+        count >>= 7;
+    }
+    mBuf[mBufLen++] = (char) count;
+    mLast = position;
+    mNum++;
+}
+
+void DnbCountWriter::flush() {
+    mOut.write(mBuf, mBufLen);
+    mBufLen = 0;
+    if (!mOut) {
+        error_exit("can not write dnb count file: " + mFileName);
+    }
+}
+
+void DnbCountWriter::close() {
+    if (mClosed) return;
+    mClosed = true;
+    flush();
+    mOut.seekp(DNB_FILE_MAGIC_LEN);
+    mOut.write((char *) &mNum, sizeof(mNum));
+    mOut.close();
+    //the entry number in the header is only right if the rewrite and the close went through
+    if (!mOut) {
+        error_exit("can not write the header of dnb count file: " + mFileName);
+    }
+}
+
+DnbCountReader::DnbCountReader(string fileName) {
+    mFileName = fileName;
+    mIn.open(fileName, ios::in | ios::binary);
+    if (!mIn.is_open()) {
+        error_exit("can not open dnb count file: " + fileName);
+    }
+    char magic[DNB_FILE_MAGIC_LEN];
+    mIn.read(magic, DNB_FILE_MAGIC_LEN);
+    mIn.read((char *) &mNum, sizeof(mNum));
+    if (!mIn || memcmp(magic, DNB_FILE_MAGIC, DNB_FILE_MAGIC_LEN) != 0) {
+        error_exit("not a dnb count file: " + fileName);
+    }
+    mBuf = new char[DNB_FILE_BUFFER_SIZE];
+    mBufLen = 0;
+    mBufPos = 0;
+    mLast = 0;
+    mRead = 0;
+}
+
+DnbCountReader::~DnbCountReader() {
+    mIn.close();
+    delete[] mBuf;
+}
+
+bool DnbCountReader::fill() {
+    int left = mBufLen - mBufPos;
+    memmove(mBuf, mBuf + mBufPos, left);
+    mIn.read(mBuf + left, DNB_FILE_BUFFER_SIZE - left);
+    mBufLen = left + mIn.gcount();
+    mBufPos = 0;
+    return mBufLen > 0;
+}
+
+bool DnbCountReader::readVarint(uint64 &value) {
+    value = 0;
+    int shift = 0;
+    while (true) {
+        if (mBufPos >= mBufLen && !fill()) {
+            return false;
+        }
+        uint8 b = mBuf[mBufPos++];
+        value |= (uint64) (b & 0x7f) << shift;
+        if (b < 0x80) return true;
+        shift += 7;
+        if (shift > 63) return false;
+    }
+}
+
+bool DnbCountReader::next(uint64 &position, uint32 &count) {
+    if (mRead >= mNum) return false;
+    uint64 delta, cnt;
+    if (!readVarint(delta) || !readVarint(cnt)) {
+        error_exit("dnb count file is truncated: " + mFileName);
+    }
+    mLast += delta;
+    position = mLast;
+    count = cnt;
+    mRead++;
+    return true;
+}
@@ -0,0 +1,70 @@
+#ifndef DNBCOUNTFILE_H
+#define DNBCOUNTFILE_H
+
+#include <string>
+#include <fstream>
+#include "util.h"
+
+using namespace std;
+
+/*
+ * Compact DNB count list (.dnb):
+ *     "RBMDNB1\n" | uint64 entry number | entries
+ * Entries are sorted by encoded position (x << 32 | y). Each entry is the
+ * varint delta of the position to the previous one followed by the varint count.
+ */
+#define DNB_FILE_MAGIC "RBMDNB1\n"
+#define DNB_FILE_MAGIC_LEN 8
+#define DNB_FILE_BUFFER_SIZE (1 << 20)
+
+class DnbCountWriter {
+public:
+    DnbCountWriter(string fileName);
+
+    ~DnbCountWriter();
+
+    //positions must come in ascending order
+    void add(uint64 position, uint32 count);
+
+    void close();
+
+private:
+    void flush();
+
+private:
+    string mFileName;
+    ofstream mOut;
+    char *mBuf;
+    int mBufLen;
+    uint64 mLast;
+    uint64 mNum;
+    bool mClosed;
+};
+
+class DnbCountReader {
+public:
+    DnbCountReader(string fileName);
+
+    ~DnbCountReader();
+
+    bool next(uint64 &position, uint32 &count);
+
+    uint64 getNum() { return mNum; }
+
+private:
+    bool fill();
+
+    bool readVarint(uint64 &value);
+
+private:
+    string mFileName;
+    ifstream mIn;
+    char *mBuf;
+    int mBufLen;
+    int mBufPos;
+    uint64 mLast;
+    uint64 mNum;
+    uint64 mRead;
+};
+
+#endif
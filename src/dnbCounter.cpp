@@ -0,0 +1,158 @@
+#include "dnbCounter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "util.h"
+
+static inline uint64 dnbMix(uint64 key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+DnbCounter::DnbCounter(uint32 minX, uint32 maxX, uint32 minY, uint32 maxY, int layout) {
+    mMinX = minX;
+    mMaxX = maxX;
+    mMinY = minY;
+    mMaxY = maxY;
+    mLayout = layout;
+    mDense = NULL;
+    mWidth = 0;
+    mHeight = 0;
+    mTilesY = 0;
+    mCells = 0;
+    if (maxX >= minX && maxY >= minY) {
+        mWidth = (uint64) maxX - minX + 1;
+        mHeight = (uint64) maxY - minY + 1;
+        if (layout == DNB_LAYOUT_TILE) {
+            mTilesY = (mHeight + DNB_TILE_MASK) >> DNB_TILE_BITS;
+            uint64 tilesX = (mWidth + DNB_TILE_MASK) >> DNB_TILE_BITS;
+            mCells = tilesX * mTilesY << (2 * DNB_TILE_BITS);
+        } else {
+            mCells = mWidth * mHeight;
+        }
+    }
+    if (mCells > 0 && mCells <= DNB_DENSE_CELL_LIMIT) {
+        //calloc maps zero pages lazily, untouched parts of the chip cost no memory
+        mDense = (uint32 *) calloc(mCells, sizeof(uint32));
+    }
+#ifdef PRINT_INFO
+    printf("dnb counter: grid %u-%u x %u-%u, %s%s\n", minX, maxX, minY, maxY, mDense ? "dense" : "sharded",
+           mDense && layout == DNB_LAYOUT_TILE ? " in tiles" : "");
+#endif
+    mShards = new Shard[DNB_SHARD_NUM];
+    for (int i = 0; i < DNB_SHARD_NUM; i++) {
+        mShards[i].capacity = 1 << 16;
+        mShards[i].used = 0;
+        mShards[i].keys = (uint64 *) calloc(mShards[i].capacity, sizeof(uint64));
+        mShards[i].counts = (uint32 *) calloc(mShards[i].capacity, sizeof(uint32));
+    }
+}
+
+int DnbCounter::parseLayout(string layout) {
+    if (layout == "row") return DNB_LAYOUT_ROW;
+    if (layout == "tile") return DNB_LAYOUT_TILE;
+    error_exit("dnbLayout should be row or tile: " + layout);
+    return DNB_LAYOUT_ROW;
+}
+
+DnbCounter::~DnbCounter() {
+    if (mDense) free(mDense);
+    for (int i = 0; i < DNB_SHARD_NUM; i++) {
+        free(mShards[i].keys);
+        free(mShards[i].counts);
+    }
+    delete[] mShards;
+}
+
+void DnbCounter::addSparse(uint64 key) {
+    uint64 h = dnbMix(key);
+    Shard &shard = mShards[h & (DNB_SHARD_NUM - 1)];
+    uint64 stored = key + 1;
+    lock_guard<mutex> lock(shard.mtx);
+    if ((shard.used + 1) * 10 > shard.capacity * 7) {
+        growShard(shard);
+    }
+    uint64 mask = shard.capacity - 1;
+    uint64 i = (h >> 6) & mask;
+    while (shard.keys[i] != 0 && shard.keys[i] != stored) {
+        i = (i + 1) & mask;
+    }
+    if (shard.keys[i] == 0) {
+        shard.keys[i] = stored;
+        shard.used++;
+    }
+    shard.counts[i]++;
+}
+
+void DnbCounter::growShard(Shard &shard) {
+    uint64 newCapacity = shard.capacity * 2;
+    uint64 *keys = (uint64 *) calloc(newCapacity, sizeof(uint64));
+    uint32 *counts = (uint32 *) calloc(newCapacity, sizeof(uint32));
+    uint64 mask = newCapacity - 1;
+    for (uint64 j = 0; j < shard.capacity; j++) {
+        if (shard.keys[j] == 0) continue;
+        uint64 i = (dnbMix(shard.keys[j] - 1) >> 6) & mask;
+        while (keys[i] != 0) i = (i + 1) & mask;
+        keys[i] = shard.keys[j];
+        counts[i] = shard.counts[j];
+    }
+    free(shard.keys);
+    free(shard.counts);
+    shard.keys = keys;
+    shard.counts = counts;
+    shard.capacity = newCapacity;
+}
+
+long DnbCounter::size() {
+    long num = 0;
+    if (mDense) {
+#pragma omp parallel for reduction(+:num)
+        for (int64 i = 0; i < mCells; i++) {
+            if (mDense[i]) num++;
+        }
+    }
+    for (int s = 0; s < DNB_SHARD_NUM; s++) {
+        num += mShards[s].used;
+    }
+    return num;
+}
+
+void DnbCounter::collect(vector<pair<uint64, uint32>> &out) {
+    if (mDense && mLayout == DNB_LAYOUT_ROW) {
+        //row major over x then y, so the dense part comes out sorted
+        for (uint64 i = 0; i < mCells; i++) {
+            if (mDense[i] == 0) continue;
+            uint64 x = mMinX + i / mHeight;
+            uint64 y = mMinY + i % mHeight;
+            out.push_back(make_pair((x << 32) | y, mDense[i]));
+        }
+    } else if (mDense) {
+        //a row of x crosses one band of tiles, 64 contiguous cells per tile
+        for (uint64 dx = 0; dx < mWidth; dx++) {
+            const uint32 *band = mDense + ((dx >> DNB_TILE_BITS) * mTilesY << (2 * DNB_TILE_BITS));
+            for (uint64 tileY = 0; tileY < mTilesY; tileY++) {
+                const uint32 *row = band + (tileY << (2 * DNB_TILE_BITS)) + ((dx & DNB_TILE_MASK) << DNB_TILE_BITS);
+                for (uint64 dy = 0; dy <= DNB_TILE_MASK; dy++) {
+                    if (row[dy] == 0) continue;
+                    uint64 x = mMinX + dx;
+                    uint64 y = mMinY + (tileY << DNB_TILE_BITS) + dy;
+                    out.push_back(make_pair((x << 32) | y, row[dy]));
+                }
+            }
+        }
+    }
+    size_t denseEnd = out.size();
+    for (int s = 0; s < DNB_SHARD_NUM; s++) {
+        for (uint64 j = 0; j < mShards[s].capacity; j++) {
+            if (mShards[s].keys[j] == 0) continue;
+            out.push_back(make_pair(mShards[s].keys[j] - 1, mShards[s].counts[j]));
+        }
+    }
+    if (out.size() > denseEnd) {
+        sort(out.begin(), out.end());
+    }
+}
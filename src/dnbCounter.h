@@ -0,0 +1,95 @@
+#ifndef DNBCOUNTER_H
+#define DNBCOUNTER_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include "common.h"
+
+using namespace std;
+
+//grids up to this many cells use the dense counter, its pages are only touched where DNBs are mapped
+#define DNB_DENSE_CELL_LIMIT (1ll << 30)
+#define DNB_SHARD_NUM 64
+
+//order of the dense counts, --dnbLayout
+//x major rows of the whole grid height
+#define DNB_LAYOUT_ROW 0
+//square tiles one after the other, rows of a tile are contiguous
+#define DNB_LAYOUT_TILE 1
+//a tile is 64 x 64 cells, 16KB of counts
+#define DNB_TILE_BITS 6
+#define DNB_TILE_MASK ((1ull << DNB_TILE_BITS) - 1)
+
+/*
+ * Reads count per DNB position, shared by all mapping threads.
+ * Positions inside the chip grid [minX, maxX] x [minY, maxY] are counted in a
+ * dense uint32 array with atomic increments. Grids that are too large fall back
+ * to sharded open addressing tables, each guarded by its own mutex.
+ * With the tile layout the cells of a chip region share pages whatever its shape,
+ * so a tissue covering part of the chip only maps pages under it, and scans over a
+ * region read whole tiles instead of a short piece of every row.
+ */
+class DnbCounter {
+public:
+    DnbCounter(uint32 minX, uint32 maxX, uint32 minY, uint32 maxY, int layout = DNB_LAYOUT_ROW);
+
+    ~DnbCounter();
+
+    //row or tile
+    static int parseLayout(string layout);
+
+    inline void add(uint32 x, uint32 y) {
+        if (mDense != NULL && x >= mMinX && x <= mMaxX && y >= mMinY && y <= mMaxY) {
+            __atomic_fetch_add(&mDense[cellOf(x - mMinX, y - mMinY)], 1, __ATOMIC_RELAXED);
+        } else {
+            addSparse(((uint64) x << 32) | y);
+        }
+    }
+
+    //number of positions with at least one read
+    long size();
+
+    bool isDense() { return mDense != NULL; }
+
+    //all (encoded position, count) pairs sorted by encoded position, x << 32 | y
+    void collect(vector<pair<uint64, uint32>> &out);
+
+private:
+    //dense cell of a position relative to the grid origin
+    inline uint64 cellOf(uint64 dx, uint64 dy) {
+        if (mLayout == DNB_LAYOUT_ROW) return dx * mHeight + dy;
+        uint64 tile = (dx >> DNB_TILE_BITS) * mTilesY + (dy >> DNB_TILE_BITS);
+        return tile << (2 * DNB_TILE_BITS) | (dx & DNB_TILE_MASK) << DNB_TILE_BITS | (dy & DNB_TILE_MASK);
+    }
+
+    struct Shard {
+        mutex mtx;
+        //keys are stored as encoded position + 1, 0 marks an empty slot
+        uint64 *keys;
+        uint32 *counts;
+        uint64 capacity;
+        uint64 used;
+    };
+
+    void addSparse(uint64 key);
+
+    void growShard(Shard &shard);
+
+private:
+    uint32 mMinX;
+    uint32 mMaxX;
+    uint32 mMinY;
+    uint32 mMaxY;
+    int mLayout;
+    uint64 mWidth;
+    uint64 mHeight;
+    //tiles along y in the tile layout, the grid is padded to whole tiles
+    uint64 mTilesY;
+    uint64 mCells;
+    uint32 *mDense;
+    Shard *mShards;
+};
+
+#endif
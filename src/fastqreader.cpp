@@ -318,20 +318,20 @@ FastqChunkReaderPair::FastqChunkReaderPair(dsrc::fq::FastqReader *left, dsrc::fq
     }
 
 FastqChunkReaderPair::FastqChunkReaderPair(string leftName, string rightName, bool hasQuality, bool phred64,
-        bool interleaved)
+        bool interleaved, int poolParts, GzReadRange gzRange)
     : swapBuffer_left(SwapBufferSize), swapBuffer_right(SwapBufferSize), bufferSize_left(0), bufferSize_right(0), eof(false),
     usesCrlf(false) {
         mInterleaved = interleaved;
-        fastqPool_left = new dsrc::fq::FastqDataPool(128, SwapBufferSize);
-        fileReader_left = new dsrc::fq::FastqFileReader(leftName);
+        fastqPool_left = new dsrc::fq::FastqDataPool(poolParts, SwapBufferSize);
+        fileReader_left = new dsrc::fq::FastqFileReader(leftName, gzRange);
         mLeft = new dsrc::fq::FastqReader(*fileReader_left, *fastqPool_left);
         if (mInterleaved) {
             mRight = NULL;
             fastqPool_right = NULL;
             fileReader_right = NULL;
         } else {
-            fastqPool_right = new dsrc::fq::FastqDataPool(128, SwapBufferSize);
-            fileReader_right = new dsrc::fq::FastqFileReader(rightName);
+            fastqPool_right = new dsrc::fq::FastqDataPool(poolParts, SwapBufferSize);
+            fileReader_right = new dsrc::fq::FastqFileReader(rightName, gzRange);
             mRight = new dsrc::fq::FastqReader(*fileReader_right, *fastqPool_left);
         }
     }
@@ -364,19 +364,6 @@ ChunkPair *FastqChunkReaderPair::readNextChunkPair() {
     }
 }
 
-ChunkPair *FastqChunkReaderPair::readNextChunkPair(moodycamel::ReaderWriterQueue<std::pair<char *, int>> *q1,
-        moodycamel::ReaderWriterQueue<std::pair<char *, int>> *q2,
-        atomic_int *d1, atomic_int *d2,
-        pair<char *, int> &last1, pair<char *, int> &last2) {
-    if (mInterleaved) {
-        //interleaved code here
-        return NULL;
-
-    } else {
-        //not interleaved
-        return readNextChunkPair_interleaved(q1, q2, d1, d2, last1, last2);
-    }
-}
 //ChunkPair* FastqChunkReaderPair::readNextChunkPair(){
 //ChunkPair* pair = new ChunkPair;
 //dsrc::fq::FastqDataChunk* leftPart = NULL;
@@ -492,7 +479,6 @@ uint64 FastqChunkReaderPair::GetNextRecordPos(dsrc::uchar *data_, uint64 pos_, c
 ChunkPair *FastqChunkReaderPair::readNextChunkPair_interleaved() {
     int eof1=false;
     int eof2=false;
-    ChunkPair *pair = new ChunkPair;
     dsrc::fq::FastqDataChunk *leftPart = NULL;
     fastqPool_left->Acquire(leftPart);
 
@@ -663,175 +649,7 @@ ChunkPair *FastqChunkReaderPair::readNextChunkPair_interleaved() {
         difference = left_line_count - right_line_count;
         if(difference!=0)printf("GG, diff is %d\n",difference); 
     }
-    pair->leftpart = leftPart;
-    pair->rightpart = rightPart;
-    return pair;
-
-}
-
-ChunkPair *
-FastqChunkReaderPair::readNextChunkPair_interleaved(moodycamel::ReaderWriterQueue<std::pair<char *, int>> *q1,
-        moodycamel::ReaderWriterQueue<std::pair<char *, int>> *q2,
-        atomic_int *d1, atomic_int *d2,
-        pair<char *, int> &last1, pair<char *, int> &last2) {
     ChunkPair *pair = new ChunkPair;
-    dsrc::fq::FastqDataChunk *leftPart = NULL;
-    fastqPool_left->Acquire(leftPart);
-    int eof1=false;
-    int eof2=false;
-
-    dsrc::fq::FastqDataChunk *rightPart = NULL;
-    fastqPool_right->Acquire(rightPart);
-
-    int64 left_line_count = 0;
-    int64 right_line_count = 0;
-    int64 chunkEnd_right = 0;
-    int64 chunkEnd = 0;
-    //------read left chunk------//
-    if (eof) {
-        leftPart->size = 0;
-        rightPart->size = 0;
-        //return false;
-        fastqPool_left->Release(leftPart);
-        fastqPool_right->Release(rightPart);
-        return NULL;
-    }
-
-    //flush the data from previous incomplete chunk
-    dsrc::uchar *data = leftPart->data.Pointer();
-    uint64 cbufSize = leftPart->data.Size();
-    leftPart->size = 0;
-    int64 toRead;
-    toRead = cbufSize - bufferSize_left;
-    if (bufferSize_left > 0) {
-        std::copy(swapBuffer_left.Pointer(), swapBuffer_left.Pointer() + bufferSize_left, data);
-        leftPart->size = bufferSize_left;
-        bufferSize_left = 0;
-    }
-    int64 r;
-    r = mLeft->Read(data + leftPart->size, toRead, q1, d1, last1, 1);
-    //    printf("now read once done, read %lld / %lld\n", r, toRead);
-    if (r > 0) {
-        if (r == toRead) {
-            chunkEnd = cbufSize - tmpSwapBufferSize;
-            chunkEnd = GetNextRecordPos(data, chunkEnd, cbufSize);
-            //leftPart->size = chunkEnd - 1;
-            //if(usesCrlf)
-            //	leftPart->size -= 1;
-
-            //std::copy(data + chunkEnd, data + cbufSize, swapBuffer_left.Pointer());
-            //bufferSize_left = cbufSize - chunkEnd;
-        } else {
-            //chunkEnd = r;
-            leftPart->size += r - 1;
-            if (usesCrlf)
-                leftPart->size -= 1;
-            eof1 = true;
-            chunkEnd = leftPart->size+1;
-            cbufSize = leftPart->size+1;
-        }
-    } else {
-        eof1 = true;
-        chunkEnd = leftPart->size+1;
-        cbufSize = leftPart->size+1;
-        if(leftPart->size==0){
-            return NULL;
-        }
-    }
-    //------read left chunk end------//
-
-    //-----------------read right chunk---------------------//
-    dsrc::uchar *data_right = rightPart->data.Pointer();
-    uint64 cbufSize_right = rightPart->data.Size();
-    rightPart->size = 0;
-    toRead = cbufSize_right - bufferSize_right;
-    if (bufferSize_right > 0) {
-        std::copy(swapBuffer_right.Pointer(), swapBuffer_right.Pointer() + bufferSize_right, data_right);
-        rightPart->size = bufferSize_right;
-        bufferSize_right = 0;
-    }
-    r = mRight->Read(data_right + rightPart->size, toRead, q2, d2, last2, 2);
-    //    printf("now read once done, read %lld / %lld\n", r, toRead);
-
-    if (r > 0) {
-        if ( r == toRead) {
-            chunkEnd_right = cbufSize_right - tmpSwapBufferSize;
-            chunkEnd_right = GetNextRecordPos(data_right, chunkEnd_right, cbufSize_right);
-            //leftPart->size = chunkEnd - 1;
-            //if(usesCrlf)
-            //	leftPart->size -= 1;
-
-            //std::copy(data + chunkEnd, data + cbufSize, swapBuffer_left.Pointer());
-            //bufferSize_left = cbufSize - chunkEnd;
-        } else {
-            //chunkEnd_right += r;
-            rightPart->size += r - 1;
-            if (usesCrlf)
-                rightPart->size -= 1;
-            eof2 = true;
-            chunkEnd_right = rightPart->size+1;
-            cbufSize_right = rightPart->size+1;
-
-        }
-    } else {
-        eof2 = true;
-        chunkEnd_right = rightPart->size+1;
-        cbufSize_right = rightPart->size+1;
-        if(rightPart->size==0){
-            return NULL;
-        }
-    }
-    //--------------read right chunk end---------------------//
-    if(eof1 && eof2)eof = true;
-    if(eof1 || eof2)printf("eofs : %d %d %d\n",eof1,eof2,eof);
-    if (!eof) {
-        left_line_count = count_line(data, chunkEnd);
-        right_line_count = count_line(data_right, chunkEnd_right);
-        int64 difference = left_line_count - right_line_count;
-
-        if (difference > 0) {
-            while (chunkEnd >= 0) {
-                if (data[chunkEnd] == '\n') {
-                    difference--;
-                    if (difference == -1) {
-                        chunkEnd++;
-                        break;
-                    }
-                }
-                chunkEnd--;
-            }
-
-        } else if (difference < 0) {
-
-            while (chunkEnd_right >= 0) {
-                if (data_right[chunkEnd_right] == '\n') {
-                    difference++;
-                    if (difference == 1) {
-                        chunkEnd_right++;
-                        break;
-                    }
-                }
-                chunkEnd_right--;
-            }
-        }
-        leftPart->size = chunkEnd - 1;
-        if (usesCrlf)
-            leftPart->size -= 1;
-
-        std::copy(data + chunkEnd, data + cbufSize, swapBuffer_left.Pointer());
-        bufferSize_left = cbufSize - chunkEnd;
-
-        rightPart->size = chunkEnd_right - 1;
-        if (usesCrlf)
-            rightPart->size -= 1;
-        std::copy(data_right + chunkEnd_right, data_right + cbufSize_right, swapBuffer_right.Pointer());
-        bufferSize_right = cbufSize_right - chunkEnd_right;
-        left_line_count = count_line(data, chunkEnd);
-        right_line_count = count_line(data_right, chunkEnd_right);
-        //int64 difference = right_line_count - left_line_count;
-        difference = left_line_count - right_line_count;
-        if(difference!=0)printf("GG, diff is %d\n",difference); 
-    }
     pair->leftpart = leftPart;
     pair->rightpart = rightPart;
     return pair;
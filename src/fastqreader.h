@@ -95,8 +95,10 @@ class FastqChunkReaderPair {
 public:
     FastqChunkReaderPair(dsrc::fq::FastqReader *left, dsrc::fq::FastqReader *right);
 
+    //poolParts is the number of chunks each input keeps in flight, every chunk is SwapBufferSize bytes
+    //gzRange picks the same records of both gz inputs
     FastqChunkReaderPair(string leftName, string rightName, bool hasQuality = true, bool phred64 = false,
-                         bool interleaved = false);
+                         bool interleaved = false, int poolParts = 128, GzReadRange gzRange = GzReadRange());
 
     ~FastqChunkReaderPair();
 
@@ -104,20 +106,10 @@ public:
 
     uint64 GetNextRecordPos(dsrc::uchar *data_, uint64 pos_, const uint64 size_);
 
-    ChunkPair *readNextChunkPair(moodycamel::ReaderWriterQueue<std::pair<char *, int>> *q1,
-                                 moodycamel::ReaderWriterQueue<std::pair<char *, int>> *q2,
-                                 atomic_int *d1, atomic_int *d2,
-                                 pair<char *, int> &last1, pair<char *, int> &last2);
-
     ChunkPair *readNextChunkPair();
 
     ChunkPair *readNextChunkPair_interleaved();
 
-    ChunkPair *readNextChunkPair_interleaved(moodycamel::ReaderWriterQueue<std::pair<char *, int>> *q1,
-                                             moodycamel::ReaderWriterQueue<std::pair<char *, int>> *q2,
-                                             atomic_int *d1, atomic_int *d2,
-                                             pair<char *, int> &last1, pair<char *, int> &last2);
-
 public:
     dsrc::fq::FastqDataPool *fastqPool_left;
     dsrc::fq::FastqFileReader *fileReader_left;
@@ -0,0 +1,290 @@
+#include "gzIndex.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libdeflate.h>
+#include "zlib/zlib.h"
+#include "util.h"
+
+GzIndex::GzIndex() {
+    memset(&mHeader, 0, sizeof(mHeader));
+    mFd = -1;
+    mWindowBase = 0;
+    mScanned = 0;
+    mLines = 0;
+    mLastByte = '\n';
+    mPending = false;
+}
+
+GzIndex::~GzIndex() {
+    for (size_t i = 0; i < mWindows.size(); i++) {
+        delete[] mWindows[i];
+    }
+    if (mFd >= 0) close(mFd);
+}
+
+bool GzIndex::load(string gzFile) {
+    struct stat st;
+    if (stat(gzFile.c_str(), &st) != 0) return false;
+    string sidecarFile = sidecar(gzFile);
+    int fd = open(sidecarFile.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat indexSt;
+    char magic[GZ_INDEX_MAGIC_LEN];
+    GzIndexHeader header;
+    bool ok = fstat(fd, &indexSt) == 0 &&
+              pread(fd, magic, GZ_INDEX_MAGIC_LEN, 0) == GZ_INDEX_MAGIC_LEN &&
+              memcmp(magic, GZ_INDEX_MAGIC, GZ_INDEX_MAGIC_LEN) == 0 &&
+              pread(fd, &header, sizeof(header), GZ_INDEX_MAGIC_LEN) == sizeof(header) &&
+              header.gzSize == (uint64) st.st_size && header.gzMtime == (int64) st.st_mtime && header.num > 0;
+    uint64 pointBase = GZ_INDEX_MAGIC_LEN + sizeof(header);
+    uint64 windowBase = pointBase + header.num * sizeof(GzCheckpoint);
+    ok = ok && (uint64) indexSt.st_size == windowBase + header.num * GZ_INDEX_WINDOW;
+    if (ok) {
+        mPoints.resize(header.num);
+        uint64 bytes = header.num * sizeof(GzCheckpoint);
+        ok = pread(fd, &mPoints[0], bytes, pointBase) == (ssize_t) bytes;
+    }
+    if (!ok) {
+        mPoints.clear();
+        close(fd);
+        return false;
+    }
+    mHeader = header;
+    mFd = fd;
+    mWindowBase = windowBase;
+    return true;
+}
+
+bool GzIndex::due(uint64 out) {
+    return mPoints.empty() || out >= mPoints.back().out + GZ_INDEX_SPAN;
+}
+
+void GzIndex::add(uint64 in, int bits, uint64 out, bool member, const uint8 *window, uint64 windowLen) {
+    GzCheckpoint point;
+    point.in = in;
+    point.bits = bits;
+    point.member = member ? 1 : 0;
+    point.out = out;
+    point.record = out;
+    point.recordIndex = mLines / 4;
+    //a checkpoint inside a record is resolved by scan() at the next record start
+    mPending = mLastByte != '\n' || mLines % 4 != 0;
+    mPoints.push_back(point);
+    uint8 *copy = new uint8[GZ_INDEX_WINDOW];
+    memset(copy, 0, GZ_INDEX_WINDOW);
+    if (!member && windowLen > 0) {
+        memcpy(copy, window, windowLen);
+    }
+    mWindows.push_back(copy);
+}
+
+void GzIndex::scan(const uint8 *data, uint64 len) {
+    const uint8 *p = data;
+    const uint8 *end = data + len;
+    while (p < end) {
+        const uint8 *nl = (const uint8 *) memchr(p, '\n', end - p);
+        if (nl == NULL) break;
+        mLines++;
+        if (mPending && mLines % 4 == 0) {
+            mPoints.back().record = mScanned + (nl + 1 - data);
+            mPoints.back().recordIndex = mLines / 4;
+            mPending = false;
+        }
+        p = nl + 1;
+    }
+    mScanned += len;
+    if (len > 0) mLastByte = data[len - 1];
+}
+
+bool GzIndex::write(string gzFile) {
+    struct stat st;
+    if (mPoints.empty() || stat(gzFile.c_str(), &st) != 0) return false;
+    //a checkpoint in the last record has no record start after it
+    if (mPending) {
+        mPoints.pop_back();
+        delete[] mWindows.back();
+        mWindows.pop_back();
+        mPending = false;
+    }
+    mHeader.gzSize = st.st_size;
+    mHeader.gzMtime = st.st_mtime;
+    mHeader.totalOut = mScanned;
+    mHeader.records = (mLines + (mLastByte != '\n' ? 1 : 0)) / 4;
+    mHeader.num = mPoints.size();
+    string sidecarFile = sidecar(gzFile);
+    string tmpFile = sidecarFile + ".tmp";
+    FILE *out = fopen(tmpFile.c_str(), "wb");
+    if (out == NULL) return false;
+    bool ok = fwrite(GZ_INDEX_MAGIC, 1, GZ_INDEX_MAGIC_LEN, out) == GZ_INDEX_MAGIC_LEN &&
+              fwrite(&mHeader, sizeof(mHeader), 1, out) == 1 &&
+              fwrite(&mPoints[0], sizeof(GzCheckpoint), mPoints.size(), out) == mPoints.size();
+    for (size_t i = 0; ok && i < mWindows.size(); i++) {
+        ok = fwrite(mWindows[i], 1, GZ_INDEX_WINDOW, out) == GZ_INDEX_WINDOW;
+    }
+    ok = fclose(out) == 0 && ok;
+    //readers only ever see a complete sidecar
+    if (!ok || rename(tmpFile.c_str(), sidecarFile.c_str()) != 0) {
+        remove(tmpFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+int GzIndex::find(uint64 recordIndex) {
+    int lo = 0, hi = mPoints.size() - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (mPoints[mid].recordIndex <= recordIndex) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+int GzIndex::findEnd(uint64 recordIndex) {
+    int lo = 0, hi = mPoints.size() - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (mPoints[mid].recordIndex >= recordIndex) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+uint64 GzIndex::segmentSize(int i) {
+    uint64 end = i + 1 < (int) mPoints.size() ? mPoints[i + 1].out : mHeader.totalOut;
+    return end - mPoints[i].out;
+}
+
+bool GzIndex::readWindow(int i, uint8 *window) {
+    return pread(mFd, window, GZ_INDEX_WINDOW, mWindowBase + (uint64) i * GZ_INDEX_WINDOW) == GZ_INDEX_WINDOW;
+}
+
+//length of the gzip member header at p, 0 when it is not one
+static uint64 gzipHeaderLen(const uint8 *p, uint64 len) {
+    if (len < 10 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8) return 0;
+    uint8 flags = p[3];
+    uint64 pos = 10;
+    if (flags & 4) {
+        if (pos + 2 > len) return 0;
+        pos += 2 + (p[pos] | (p[pos + 1] << 8));
+    }
+    for (int field = 8; field <= 16; field <<= 1) {
+        if (!(flags & field)) continue;
+        const uint8 *end = pos < len ? (const uint8 *) memchr(p + pos, 0, len - pos) : NULL;
+        if (end == NULL) return 0;
+        pos = end + 1 - p;
+    }
+    if (flags & 2) pos += 2;
+    return pos <= len ? pos : 0;
+}
+
+uint64 GzIndex::inflateMembers(FILE *file, int i, uint8 *out, uint64 len, uint64 &in) {
+    GzCheckpoint &point = mPoints[i];
+    //only a segment that ends at a member boundary is made of whole members, libdeflate can not
+    //stop inside one, and a segment with a large compressed size is left to zlib
+    bool last = i + 1 == (int) mPoints.size();
+    if (!last && !mPoints[i + 1].member) return 0;
+    uint64 end = last ? mHeader.gzSize : mPoints[i + 1].in;
+    if (end <= point.in || end - point.in > GZ_INDEX_SPAN) return 0;
+    uint64 packedLen = end - point.in;
+    uint8 *packed = new uint8[packedLen];
+    uint64 done = 0;
+    uint64 pos = 0;
+    if (fseeko(file, point.in, SEEK_SET) == 0 && fread(packed, 1, packedLen, file) == packedLen) {
+        libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+        while (done < len) {
+            uint64 header = gzipHeaderLen(packed + pos, packedLen - pos);
+            if (header == 0) break;
+            size_t used = 0;
+            size_t got = 0;
+            if (libdeflate_deflate_decompress_ex(decompressor, packed + pos + header, packedLen - pos - header,
+                                                 out + done, len - done, &used, &got) != LIBDEFLATE_SUCCESS) {
+                break;
+            }
+            uint64 trailer = pos + header + used;
+            if (trailer + 8 > packedLen) break;
+            const uint8 *t = packed + trailer;
+            uint32 crc = t[0] | (t[1] << 8) | (t[2] << 16) | ((uint32) t[3] << 24);
+            if (libdeflate_crc32(0, out + done, got) != crc) break;
+            done += got;
+            pos = trailer + 8;
+        }
+        libdeflate_free_decompressor(decompressor);
+    }
+    delete[] packed;
+    in = point.in + pos;
+    return done;
+}
+
+bool GzIndex::inflateSegment(FILE *file, int i, uint8 *out, uint64 len) {
+    GzCheckpoint &point = mPoints[i];
+    bool raw = point.member == 0;
+    uint64 start = point.in - (point.bits ? 1 : 0);
+    if (!raw) {
+        uint64 done = inflateMembers(file, i, out, len, start);
+        if (done == len) return true;
+        out += done;
+        len -= done;
+    }
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, raw ? -15 : 15 + 32) != Z_OK) return false;
+    bool ok = fseeko(file, start, SEEK_SET) == 0;
+    if (ok && raw) {
+        if (point.bits) {
+            int c = getc(file);
+            ok = c != EOF && inflatePrime(&strm, point.bits, c >> (8 - point.bits)) == Z_OK;
+        }
+        uint64 windowLen = min(point.out, (uint64) GZ_INDEX_WINDOW);
+        if (ok && windowLen > 0) {
+            uint8 *window = new uint8[GZ_INDEX_WINDOW];
+            ok = readWindow(i, window) && inflateSetDictionary(&strm, window, windowLen) == Z_OK;
+            delete[] window;
+        }
+    }
+    uint8 *in = new uint8[GZ_INDEX_IN];
+    //trailer bytes of a raw member, they are not consumed by inflate
+    uint64 skip = 0;
+    strm.next_out = out;
+    strm.avail_out = len;
+    while (ok && strm.avail_out > 0) {
+        if (strm.avail_in == 0) {
+            size_t n = fread(in, 1, GZ_INDEX_IN, file);
+            if (n == 0) {
+                ok = false;
+                break;
+            }
+            strm.next_in = in;
+            strm.avail_in = n;
+        }
+        if (skip > 0) {
+            uint64 n = min(skip, (uint64) strm.avail_in);
+            strm.next_in += n;
+            strm.avail_in -= n;
+            skip -= n;
+            continue;
+        }
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            //the segment goes on in the next member
+            if (raw) {
+                skip = 8;
+                raw = false;
+            }
+            inflateReset2(&strm, 15 + 32);
+        } else if (ret != Z_OK) {
+            ok = false;
+        }
+    }
+    inflateEnd(&strm);
+    delete[] in;
+    return ok;
+}
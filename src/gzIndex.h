@@ -0,0 +1,116 @@
+#ifndef GZINDEX_H
+#define GZINDEX_H
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include "common.h"
+
+using namespace std;
+
+/*
+ * Checkpoint index of a gz file, kept next to it as <file>.gzidx:
+ *     "RBMGZI1\n" | GzIndexHeader | GzCheckpoint * num | 32KB window * num
+ * Like zlib's zran example, a checkpoint is a deflate block boundary together with
+ * the 32KB of output before it, so decoding can start there without the data in
+ * front. The first checkpoint of a member is its gzip header and needs no window.
+ * Every checkpoint also knows the first fastq record after it, so a reader can
+ * start at any record. The gz size and mtime are kept to notice a changed file.
+ * Segments made of whole members are inflated with libdeflate. A segment that starts or
+ * ends inside a member, which is every segment of a single member file, goes through zlib:
+ * libdeflate can neither start from a window nor stop inside a member.
+ */
+#define GZ_INDEX_MAGIC "RBMGZI1\n"
+#define GZ_INDEX_MAGIC_LEN 8
+#define GZ_INDEX_SUFFIX ".gzidx"
+#define GZ_INDEX_WINDOW 32768
+//uncompressed bytes between two checkpoints, one decode thread takes one segment
+#define GZ_INDEX_SPAN (32ll << 20)
+//compressed bytes read from the gz file per fread when decoding a segment
+#define GZ_INDEX_IN (1 << 20)
+
+struct GzIndexHeader {
+    uint64 gzSize;
+    int64 gzMtime;
+    //uncompressed size and fastq records of the whole file
+    uint64 totalOut;
+    uint64 records;
+    uint64 num;
+};
+
+struct GzCheckpoint {
+    //compressed offset of the first whole byte, the low bits of the byte before still belong to the block
+    uint64 in;
+    uint32 bits;
+    //1 for the start of a gzip member
+    uint32 member;
+    //uncompressed offset of the checkpoint
+    uint64 out;
+    //uncompressed offset and number of the first fastq record at or after out
+    uint64 record;
+    uint64 recordIndex;
+};
+
+class GzIndex {
+public:
+    GzIndex();
+
+    ~GzIndex();
+
+    static string sidecar(string gzFile) { return gzFile + GZ_INDEX_SUFFIX; }
+
+    //false when there is no sidecar or it does not match the gz file any more
+    bool load(string gzFile);
+
+    //builder, fed from a sequential decode of the whole file
+    bool due(uint64 out);
+
+    void add(uint64 in, int bits, uint64 out, bool member, const uint8 *window, uint64 windowLen);
+
+    //every decoded byte goes through here in order, it counts the records
+    void scan(const uint8 *data, uint64 len);
+
+    //writes the sidecar through a temporary file, false when it can not be written
+    bool write(string gzFile);
+
+    //reader
+    uint64 getRecords() { return mHeader.records; }
+
+    int getNum() { return mPoints.size(); }
+
+    //last checkpoint at or before record recordIndex
+    int find(uint64 recordIndex);
+
+    //first checkpoint whose segment holds the end of the records before recordIndex
+    int findEnd(uint64 recordIndex);
+
+    GzCheckpoint &point(int i) { return mPoints[i]; }
+
+    //uncompressed bytes from checkpoint i to the next one
+    uint64 segmentSize(int i);
+
+    //decodes segment i of the gz file into out, file is the caller's own handle
+    bool inflateSegment(FILE *file, int i, uint8 *out, uint64 len);
+
+private:
+    //inflates the whole members at the start of segment i with libdeflate, returns the bytes decoded,
+    //in gets the offset of the first member left to zlib
+    uint64 inflateMembers(FILE *file, int i, uint8 *out, uint64 len, uint64 &in);
+
+    bool readWindow(int i, uint8 *window);
+
+private:
+    GzIndexHeader mHeader;
+    vector<GzCheckpoint> mPoints;
+    //built windows, a loaded index reads them from the sidecar when a segment starts
+    vector<uint8 *> mWindows;
+    int mFd;
+    uint64 mWindowBase;
+    //record counting of the builder
+    uint64 mScanned;
+    uint64 mLines;
+    uint8 mLastByte;
+    bool mPending;
+};
+
+#endif
@@ -0,0 +1,609 @@
+#include "gzReadAhead.h"
+#include <string.h>
+#include <libdeflate.h>
+#include "zlib/zlib.h"
+#include "util.h"
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+GzReadAhead::GzReadAhead(string fileName, InputFormat format, GzReadRange range, int parts) {
+    mFileName = fileName;
+    mFile = fopen(fileName.c_str(), "rb");
+    if (mFile == NULL) {
+        error_exit("can not open gz file to read: " + fileName);
+    }
+#ifndef USE_ZSTD
+    if (format == INPUT_ZSTD) {
+        error_exit("zstd input needs a build with zstd=1: " + fileName);
+    }
+#endif
+    mFormat = format;
+    mRange = range;
+    mIndex = NULL;
+    mParts = max(2, parts);
+    mBlocks = NULL;
+    mSizes = NULL;
+    mFilled = 0;
+    mDrained = 0;
+    mPos = 0;
+    mFillPos = 0;
+    mDone = false;
+    mError = false;
+    mStop = false;
+    mStarted = false;
+    mFirstSegment = 0;
+    mLastSegment = -1;
+    mNextSegment = 0;
+    mSkipBytes = 0;
+    mSkipLines = 0;
+    mLineLimit = GZ_ALL_RECORDS;
+    mThreads = NULL;
+    mThreadNum = 0;
+    mPacked = NULL;
+    mPackedLen = NULL;
+    mReady = NULL;
+    mDispatched = 0;
+    mDispatchDone = false;
+    if (range.useIndex) {
+        mIndex = new GzIndex();
+        if (!mIndex->load(fileName)) {
+            error_exit("gz index is missing or out of date: " + GzIndex::sidecar(fileName));
+        }
+        uint64 end = min(range.end, mIndex->getRecords());
+        if (range.first >= end) {
+            mDone = true;
+        } else {
+            mFirstSegment = mIndex->find(range.first);
+            mLastSegment = mIndex->findEnd(end);
+            mNextSegment = mFirstSegment;
+            GzCheckpoint &point = mIndex->point(mFirstSegment);
+            mSkipBytes = point.record - point.out;
+            mSkipLines = (range.first - point.recordIndex) * 4;
+            //a range up to the last record keeps the file end as it is
+            mLineLimit = end == mIndex->getRecords() ? GZ_ALL_RECORDS : (end - range.first) * 4;
+        }
+    } else if (range.buildIndex) {
+        mIndex = new GzIndex();
+    }
+}
+
+GzReadAhead::~GzReadAhead() {
+    if (mThreads) {
+        {
+            lock_guard<mutex> lock(mMtx);
+            mStop = true;
+        }
+        mCond.notify_all();
+        for (int i = 0; i < mThreadNum; i++) {
+            mThreads[i]->join();
+            delete mThreads[i];
+        }
+        delete[] mThreads;
+    }
+    if (mBlocks) {
+        for (int i = 0; i < mParts; i++) {
+            delete[] mBlocks[i];
+        }
+        delete[] mBlocks;
+        delete[] mSizes;
+    }
+    if (mPacked) {
+        for (int i = 0; i < mParts; i++) {
+            delete[] mPacked[i];
+        }
+        delete[] mPacked;
+        delete[] mPackedLen;
+        delete[] mReady;
+    }
+    if (mIndex) delete mIndex;
+    fclose(mFile);
+}
+
+void GzReadAhead::start() {
+    mStarted = true;
+    if (mDone) return;
+    mBlocks = new uint8 *[mParts];
+    for (int i = 0; i < mParts; i++) {
+        mBlocks[i] = new uint8[GZ_READ_AHEAD_BLOCK];
+    }
+    mSizes = new uint64[mParts];
+    if (mRange.useIndex) {
+        mThreadNum = max(1, min(mRange.threads, mLastSegment - mFirstSegment + 1));
+        mThreads = new thread *[mThreadNum];
+        for (int i = 0; i < mThreadNum; i++) {
+            mThreads[i] = new thread(&GzReadAhead::segmentTask, this, i);
+        }
+    } else if (mFormat == INPUT_BGZF && mIndex == NULL) {
+        //one block reader and the inflate workers
+        mPacked = new uint8 *[mParts];
+        for (int i = 0; i < mParts; i++) {
+            mPacked[i] = new uint8[GZ_READ_AHEAD_BLOCK + BGZF_MAX_BLOCK];
+        }
+        mPackedLen = new uint64[mParts];
+        mReady = new int[mParts];
+        memset(mReady, 0, mParts * sizeof(int));
+        mThreadNum = 1 + max(1, mRange.threads);
+        mThreads = new thread *[mThreadNum];
+        mThreads[0] = new thread(&GzReadAhead::bgzfTask, this);
+        for (int i = 1; i < mThreadNum; i++) {
+            mThreads[i] = new thread(&GzReadAhead::bgzfWorker, this);
+        }
+    } else {
+        mThreadNum = 1;
+        mThreads = new thread *[1];
+#ifdef USE_ZSTD
+        if (mFormat == INPUT_ZSTD) {
+            mThreads[0] = new thread(&GzReadAhead::zstdTask, this);
+            return;
+        }
+#endif
+        mThreads[0] = new thread(&GzReadAhead::inflateTask, this);
+    }
+}
+
+int64 GzReadAhead::read(uint8 *buf, uint64 len) {
+    if (!mStarted) {
+        start();
+    }
+    int64 got = 0;
+    while (len > 0) {
+        unique_lock<mutex> lock(mMtx);
+        while (mFilled == mDrained && !mDone) {
+            mCond.wait(lock);
+        }
+        if (mFilled == mDrained) {
+            if (mError) return -1;
+            break;
+        }
+        int slot = mDrained % mParts;
+        uint64 size = mSizes[slot];
+        lock.unlock();
+        //the inflate thread does not touch a filled slot before it is drained
+        uint64 n = min(size - mPos, len);
+        memcpy(buf, mBlocks[slot] + mPos, n);
+        buf += n;
+        len -= n;
+        got += n;
+        mPos += n;
+        if (mPos == size) {
+            lock.lock();
+            mDrained++;
+            mPos = 0;
+            lock.unlock();
+            mCond.notify_all();
+        }
+    }
+    return got;
+}
+
+bool GzReadAhead::waitSlot() {
+    unique_lock<mutex> lock(mMtx);
+    while (!mStop && mFilled - mDrained >= (uint64) mParts) {
+        mCond.wait(lock);
+    }
+    return !mStop;
+}
+
+void GzReadAhead::putBlock(int slot, uint64 size) {
+    {
+        lock_guard<mutex> lock(mMtx);
+        mSizes[slot] = size;
+        mFilled++;
+    }
+    mCond.notify_all();
+}
+
+bool GzReadAhead::push(const uint8 *data, uint64 len) {
+    while (len > 0) {
+        if (mFillPos == 0 && !waitSlot()) return false;
+        int slot = mFilled % mParts;
+        uint64 n = min(len, (uint64) GZ_READ_AHEAD_BLOCK - mFillPos);
+        memcpy(mBlocks[slot] + mFillPos, data, n);
+        data += n;
+        len -= n;
+        mFillPos += n;
+        if (mFillPos == GZ_READ_AHEAD_BLOCK) {
+            putBlock(slot, mFillPos);
+            mFillPos = 0;
+        }
+    }
+    return true;
+}
+
+bool GzReadAhead::deliver(const uint8 *data, uint64 len) {
+    uint64 n = min(mSkipBytes, len);
+    data += n;
+    len -= n;
+    mSkipBytes -= n;
+    while (mSkipLines > 0 && len > 0) {
+        const uint8 *nl = (const uint8 *) memchr(data, '\n', len);
+        if (nl == NULL) return true;
+        len -= nl + 1 - data;
+        data = nl + 1;
+        mSkipLines--;
+    }
+    if (mLineLimit != GZ_ALL_RECORDS) {
+        const uint8 *p = data;
+        const uint8 *end = data + len;
+        while (mLineLimit > 0 && p < end) {
+            const uint8 *nl = (const uint8 *) memchr(p, '\n', end - p);
+            if (nl == NULL) {
+                p = end;
+                break;
+            }
+            p = nl + 1;
+            mLineLimit--;
+        }
+        if (mLineLimit == 0) {
+            push(data, p - data);
+            return false;
+        }
+    }
+    return push(data, len);
+}
+
+void GzReadAhead::finish(bool error) {
+    {
+        lock_guard<mutex> lock(mMtx);
+        mDone = true;
+        mError = error;
+    }
+    mCond.notify_all();
+}
+
+uint64 GzReadAhead::copyWindow(uint8 *window, int slot, uint64 pos, uint64 totalOut) {
+    uint64 len = min(totalOut, (uint64) GZ_INDEX_WINDOW);
+    uint64 current = min(pos, len);
+    uint64 previous = len - current;
+    //blocks before the one being filled are full, the previous one is not refilled before this one
+    if (previous > 0) {
+        int prevSlot = (slot + mParts - 1) % mParts;
+        memcpy(window, mBlocks[prevSlot] + GZ_READ_AHEAD_BLOCK - previous, previous);
+    }
+    memcpy(window + previous, mBlocks[slot] + pos - current, current);
+    return len;
+}
+
+void GzReadAhead::inflateTask() {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    //15 + 32 detects the gzip header, each member is reset below
+    if (inflateInit2(&strm, 15 + 32) != Z_OK) {
+        cerr << "Error to init inflate for " << mFileName << endl;
+        finish(true);
+        return;
+    }
+    uint8 *in = new uint8[GZ_READ_AHEAD_IN];
+    //the index builder stops inflate at every deflate block to find checkpoints
+    bool building = mIndex != NULL;
+    uint8 *window = building ? new uint8[GZ_INDEX_WINDOW] : NULL;
+    uint64 consumed = 0;
+    uint64 totalOut = 0;
+    bool inMember = false;
+    bool anyMember = false;
+    bool eof = false;
+    bool error = false;
+    while (!eof && !error) {
+        if (!waitSlot()) break;
+        int slot = mFilled % mParts;
+        strm.next_out = mBlocks[slot];
+        strm.avail_out = GZ_READ_AHEAD_BLOCK;
+        while (strm.avail_out > 0) {
+            if (strm.avail_in == 0) {
+                size_t n = fread(in, 1, GZ_READ_AHEAD_IN, mFile);
+                if (n == 0) {
+                    //a member cut in the middle is an error, like gzread reports it
+                    error = ferror(mFile) || inMember;
+                    eof = true;
+                    break;
+                }
+                consumed += n;
+                strm.next_in = in;
+                strm.avail_in = n;
+            }
+            if (!inMember) {
+                if (strm.next_in[0] != 0x1f) {
+                    //trailing garbage after the last member is ignored as gzread does
+                    error = !anyMember;
+                    eof = true;
+                    break;
+                }
+                if (building && mIndex->due(totalOut)) {
+                    mIndex->add(consumed - strm.avail_in, 0, totalOut, true, NULL, 0);
+                }
+                inflateReset(&strm);
+                inMember = true;
+                anyMember = true;
+            }
+            uint8 *outStart = strm.next_out;
+            int ret = inflate(&strm, building ? Z_BLOCK : Z_NO_FLUSH);
+            if (building) {
+                mIndex->scan(outStart, strm.next_out - outStart);
+            }
+            totalOut += strm.next_out - outStart;
+            if (ret == Z_STREAM_END) {
+                inMember = false;
+            } else if (ret != Z_OK) {
+                error = true;
+                break;
+            } else if (building && (strm.data_type & 128) && !(strm.data_type & 64) && mIndex->due(totalOut)) {
+                uint64 windowLen = copyWindow(window, slot, strm.next_out - mBlocks[slot], totalOut);
+                mIndex->add(consumed - strm.avail_in, strm.data_type & 7, totalOut, false, window, windowLen);
+            }
+        }
+        uint64 size = GZ_READ_AHEAD_BLOCK - strm.avail_out;
+        if (size > 0 && !error) {
+            putBlock(slot, size);
+        }
+    }
+    if (error) {
+        cerr << "Error to read gzip file " << mFileName << endl;
+    }
+    bool complete = eof && !error;
+    finish(error);
+    inflateEnd(&strm);
+    delete[] in;
+    if (building) {
+        delete[] window;
+        if (complete) {
+            if (mIndex->write(mFileName)) {
+                loginfo("gz index written to " + GzIndex::sidecar(mFileName));
+            } else {
+                loginfo("can not write gz index " + GzIndex::sidecar(mFileName));
+            }
+        }
+    }
+}
+
+void GzReadAhead::segmentTask(int worker) {
+    FILE *file = fopen(mFileName.c_str(), "rb");
+    uint64 maxSize = 1;
+    for (int s = mFirstSegment + worker; s <= mLastSegment; s += mThreadNum) {
+        maxSize = max(maxSize, mIndex->segmentSize(s));
+    }
+    uint8 *buf = new uint8[maxSize];
+    for (int s = mFirstSegment + worker; s <= mLastSegment; s += mThreadNum) {
+        uint64 len = mIndex->segmentSize(s);
+        bool ok = file != NULL && mIndex->inflateSegment(file, s, buf, len);
+        {
+            //segments are handed on in file order
+            unique_lock<mutex> lock(mMtx);
+            while (!mStop && !mDone && mNextSegment != s) {
+                mCond.wait(lock);
+            }
+            if (mStop || mDone) break;
+        }
+        if (!ok) {
+            cerr << "Error to read gzip file " << mFileName << endl;
+            finish(true);
+            break;
+        }
+        bool more = deliver(buf, len);
+        if (!more || s == mLastSegment) {
+            if (mFillPos > 0 && !mStop) {
+                putBlock(mFilled % mParts, mFillPos);
+                mFillPos = 0;
+            }
+            finish(false);
+            break;
+        }
+        {
+            lock_guard<mutex> lock(mMtx);
+            mNextSegment++;
+        }
+        mCond.notify_all();
+    }
+    delete[] buf;
+    if (file != NULL) fclose(file);
+}
+
+void GzReadAhead::bgzfTask() {
+    //a block that did not fit the last batch starts the next one
+    uint8 *carry = new uint8[BGZF_MAX_BLOCK];
+    uint64 carryLen = 0;
+    uint64 carryOut = 0;
+    bool error = false;
+    while (!error) {
+        {
+            unique_lock<mutex> lock(mMtx);
+            while (!mStop && mDispatched - mDrained >= (uint64) mParts) {
+                mCond.wait(lock);
+            }
+            if (mStop) break;
+        }
+        int slot = mDispatched % mParts;
+        uint8 *packed = mPacked[slot];
+        uint64 len = 0;
+        uint64 out = 0;
+        if (carryLen > 0) {
+            memcpy(packed, carry, carryLen);
+            len = carryLen;
+            out = carryOut;
+            carryLen = 0;
+        }
+        bool eof = false;
+        while (true) {
+            uint8 *block = packed + len;
+            size_t n = fread(block, 1, 12, mFile);
+            if (n == 0) {
+                eof = true;
+                break;
+            }
+            uint32 xlen = n == 12 ? block[10] | (block[11] << 8) : 0;
+            if (n < 12 || block[0] != 0x1f || block[1] != 0x8b || !(block[3] & 4) ||
+                fread(block + 12, 1, xlen, mFile) != xlen) {
+                error = true;
+                break;
+            }
+            //the BC subfield holds the block size - 1
+            uint64 bsize = 0;
+            for (uint32 i = 0; i + 4 <= xlen;) {
+                uint32 slen = block[12 + i + 2] | (block[12 + i + 3] << 8);
+                if (block[12 + i] == 'B' && block[12 + i + 1] == 'C' && slen == 2 && i + 6 <= xlen) {
+                    bsize = (block[12 + i + 4] | (block[12 + i + 5] << 8)) + 1;
+                    break;
+                }
+                i += 4 + slen;
+            }
+            uint64 rest = bsize - 12 - xlen;
+            if (bsize < 12 + xlen + 8 || fread(block + 12 + xlen, 1, rest, mFile) != rest) {
+                error = true;
+                break;
+            }
+            uint8 *trailer = block + bsize - 4;
+            uint64 isize = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint64) trailer[3] << 24);
+            if (isize > BGZF_MAX_BLOCK) {
+                error = true;
+                break;
+            }
+            if (out + isize > GZ_READ_AHEAD_BLOCK || len + bsize > GZ_READ_AHEAD_BLOCK) {
+                memcpy(carry, block, bsize);
+                carryLen = bsize;
+                carryOut = isize;
+                break;
+            }
+            len += bsize;
+            out += isize;
+        }
+        if (error || len == 0) break;
+        {
+            lock_guard<mutex> lock(mMtx);
+            mPackedLen[slot] = len;
+            mReady[slot] = 0;
+            mWork.push_back(slot);
+            mDispatched++;
+        }
+        mCond.notify_all();
+        if (eof) break;
+    }
+    delete[] carry;
+    if (error) {
+        cerr << "Error to read bgzf file " << mFileName << endl;
+        finish(true);
+        return;
+    }
+    lock_guard<mutex> lock(mMtx);
+    mDispatchDone = true;
+    advanceBgzf();
+    mCond.notify_all();
+}
+
+void GzReadAhead::bgzfWorker() {
+    libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+    while (true) {
+        int slot;
+        {
+            unique_lock<mutex> lock(mMtx);
+            while (!mStop && !mDone && mWork.empty() && !mDispatchDone) {
+                mCond.wait(lock);
+            }
+            if (mStop || mDone || mWork.empty()) break;
+            slot = mWork.front();
+            mWork.pop_front();
+        }
+        bool ok = inflateBgzf(decompressor, slot);
+        {
+            lock_guard<mutex> lock(mMtx);
+            mReady[slot] = ok ? 1 : -1;
+            advanceBgzf();
+        }
+        mCond.notify_all();
+    }
+    libdeflate_free_decompressor(decompressor);
+}
+
+bool GzReadAhead::inflateBgzf(libdeflate_decompressor *decompressor, int slot) {
+    uint8 *packed = mPacked[slot];
+    uint64 len = mPackedLen[slot];
+    uint8 *out = mBlocks[slot];
+    uint64 pos = 0;
+    uint64 outPos = 0;
+    while (pos < len) {
+        uint8 *block = packed + pos;
+        uint32 xlen = block[10] | (block[11] << 8);
+        uint64 bsize = 0;
+        for (uint32 i = 0; i + 4 <= xlen;) {
+            uint32 slen = block[12 + i + 2] | (block[12 + i + 3] << 8);
+            if (block[12 + i] == 'B' && block[12 + i + 1] == 'C' && slen == 2) {
+                bsize = (block[12 + i + 4] | (block[12 + i + 5] << 8)) + 1;
+                break;
+            }
+            i += 4 + slen;
+        }
+        uint8 *trailer = block + bsize - 8;
+        uint32 crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32) trailer[3] << 24);
+        uint64 isize = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((uint64) trailer[7] << 24);
+        //a NULL actual size makes libdeflate insist on exactly isize bytes
+        if (libdeflate_deflate_decompress(decompressor, block + 12 + xlen, bsize - 12 - xlen - 8, out + outPos, isize,
+                                          NULL) != LIBDEFLATE_SUCCESS ||
+            libdeflate_crc32(0, out + outPos, isize) != crc) {
+            cerr << "Error to inflate bgzf block of " << mFileName << endl;
+            return false;
+        }
+        pos += bsize;
+        outPos += isize;
+    }
+    mSizes[slot] = outPos;
+    return true;
+}
+
+void GzReadAhead::advanceBgzf() {
+    while (mFilled < mDispatched && mReady[mFilled % mParts] != 0) {
+        if (mReady[mFilled % mParts] < 0) {
+            mDone = true;
+            mError = true;
+            return;
+        }
+        mReady[mFilled % mParts] = 0;
+        mFilled++;
+    }
+    if (mDispatchDone && mFilled == mDispatched) {
+        mDone = true;
+    }
+}
+
+#ifdef USE_ZSTD
+
+void GzReadAhead::zstdTask() {
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    ZSTD_initDStream(stream);
+    uint8 *in = new uint8[GZ_READ_AHEAD_IN];
+    ZSTD_inBuffer input = {in, 0, 0};
+    //0 once a frame is complete, concatenated frames are decoded one after the other
+    size_t frameLeft = 0;
+    bool eof = false;
+    bool error = false;
+    while (!eof && !error) {
+        if (!waitSlot()) break;
+        int slot = mFilled % mParts;
+        ZSTD_outBuffer output = {mBlocks[slot], GZ_READ_AHEAD_BLOCK, 0};
+        while (output.pos < output.size) {
+            if (input.pos == input.size) {
+                size_t n = fread(in, 1, GZ_READ_AHEAD_IN, mFile);
+                if (n == 0) {
+                    error = ferror(mFile) || frameLeft != 0;
+                    eof = true;
+                    break;
+                }
+                input.size = n;
+                input.pos = 0;
+            }
+            frameLeft = ZSTD_decompressStream(stream, &output, &input);
+            if (ZSTD_isError(frameLeft)) {
+                cerr << "Error to read zstd file " << mFileName << ": " << ZSTD_getErrorName(frameLeft) << endl;
+                error = true;
+                break;
+            }
+        }
+        if (output.pos > 0 && !error) {
+            putBlock(slot, output.pos);
+        }
+    }
+    finish(error);
+    ZSTD_freeDStream(stream);
+    delete[] in;
+}
+
+#endif
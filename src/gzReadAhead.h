@@ -0,0 +1,142 @@
+#ifndef GZREADAHEAD_H
+#define GZREADAHEAD_H
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <stdio.h>
+#include "common.h"
+#include "gzIndex.h"
+#include "inputFormat.h"
+
+using namespace std;
+
+//decoded blocks handed from the inflate thread to the reader
+#define GZ_READ_AHEAD_BLOCK (1 << 22)
+#define GZ_READ_AHEAD_PARTS 8
+//compressed bytes read from the file per fread
+#define GZ_READ_AHEAD_IN (1 << 20)
+//largest bgzf block, compressed or not
+#define BGZF_MAX_BLOCK 65536
+#define GZ_ALL_RECORDS (~0ull)
+
+//which part of a gz input is read and how
+struct GzReadRange {
+    //fastq records [first, end) through the .gzidx sidecar, the whole file without it
+    bool useIndex = false;
+    uint64 first = 0;
+    uint64 end = GZ_ALL_RECORDS;
+    //segments or bgzf blocks decoded at the same time
+    int threads = 1;
+    //write the sidecar after a sequential read of the whole file
+    bool buildIndex = false;
+};
+
+/*
+ * Sequential gz input for the non-pugz path. A thread inflates the file into a
+ * small pool of blocks ahead of the reader, so decompression runs beside chunk
+ * cutting and pair alignment instead of inside them. Concatenated members (pigz
+ * output) are decoded one after the other like gzread does. The thread starts on
+ * the first read, a reader that is opened but never read costs nothing.
+ * With a checkpoint index the segments between checkpoints are decoded by several
+ * threads and handed on in order, cut to the requested records.
+ * BGZF input is cut into batches of whole blocks, one batch per pool block, and the
+ * batches are inflated in parallel with libdeflate. zstd input (built with zstd=1)
+ * goes through the same pool from one streaming decoder.
+ */
+class GzReadAhead {
+public:
+    GzReadAhead(string fileName, InputFormat format = INPUT_GZIP, GzReadRange range = GzReadRange(),
+                int parts = GZ_READ_AHEAD_PARTS);
+
+    ~GzReadAhead();
+
+    //fills len bytes unless the file ends first, -1 on a broken file
+    int64 read(uint8 *buf, uint64 len);
+
+    const string &getFileName() const { return mFileName; }
+
+private:
+    void start();
+
+    void inflateTask();
+
+    void segmentTask(int worker);
+
+    //reads whole bgzf blocks into the batch of the next pool block
+    void bgzfTask();
+
+    void bgzfWorker();
+
+    //inflates the blocks of one batch, false on a broken block
+    bool inflateBgzf(struct libdeflate_decompressor *decompressor, int slot);
+
+    //hands decoded batches on in file order, called with mMtx held
+    void advanceBgzf();
+
+#ifdef USE_ZSTD
+
+    void zstdTask();
+
+#endif
+
+    //waits for a free block to fill, false when the reader went away
+    bool waitSlot();
+
+    void putBlock(int slot, uint64 size);
+
+    //copies decoded bytes into the blocks, false when the reader went away
+    bool push(const uint8 *data, uint64 len);
+
+    //trims a decoded segment to the records of the range, false once the last record is passed
+    bool deliver(const uint8 *data, uint64 len);
+
+    void finish(bool error);
+
+    //last 32KB of output in front of position pos of the block in slot
+    uint64 copyWindow(uint8 *window, int slot, uint64 pos, uint64 totalOut);
+
+private:
+    string mFileName;
+    FILE *mFile;
+    InputFormat mFormat;
+    GzReadRange mRange;
+    GzIndex *mIndex;
+    int mParts;
+    uint8 **mBlocks;
+    uint64 *mSizes;
+    //slots are filled and drained in order, filled - drained blocks are ready
+    uint64 mFilled;
+    uint64 mDrained;
+    //reader position inside the block mDrained
+    uint64 mPos;
+    //bytes in the block being filled by push
+    uint64 mFillPos;
+    bool mDone;
+    bool mError;
+    bool mStop;
+    bool mStarted;
+    //segments of an indexed read, the one at mNextSegment is handed on next
+    int mFirstSegment;
+    int mLastSegment;
+    int mNextSegment;
+    //bytes and lines in front of the first record, lines left to hand on
+    uint64 mSkipBytes;
+    uint64 mSkipLines;
+    uint64 mLineLimit;
+    //compressed bgzf batches, their sizes and decode state (0 waiting, 1 done, -1 broken)
+    uint8 **mPacked;
+    uint64 *mPackedLen;
+    int *mReady;
+    uint64 mDispatched;
+    bool mDispatchDone;
+    deque<int> mWork;
+    mutex mMtx;
+    condition_variable mCond;
+    thread **mThreads;
+    int mThreadNum;
+};
+
+#endif
@@ -0,0 +1,150 @@
+#include "hugePages.h"
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include "util.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+enum HugeKind {
+    HUGE_KIND_NORMAL = 0, HUGE_KIND_THP, HUGE_KIND_2M, HUGE_KIND_1G, HUGE_KIND_NUM
+};
+
+struct HugeMapping {
+    uint64 bytes;
+    uint64 mapped;
+    HugeKind kind;
+};
+
+static int hugeMode = HUGE_PAGES_AUTO;
+static mutex hugeMtx;
+static map<uint64, HugeMapping> hugeMappings;
+
+static uint64 roundUp(uint64 bytes, uint64 unit) {
+    return (bytes + unit - 1) / unit * unit;
+}
+
+static void *mapHugetlb(uint64 mapped, int sizeFlag) {
+    void *ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | sizeFlag, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+//2MB aligned so every whole 2MB of the array can become one transparent huge page
+static void *mapAligned(uint64 mapped, bool advise) {
+    uint64 extra = advise ? HUGE_PAGE_2M : 0;
+    void *raw = mmap(NULL, mapped + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    if (!advise) return raw;
+    uint64 start = roundUp((uint64) raw, HUGE_PAGE_2M);
+    uint64 head = start - (uint64) raw;
+    if (head > 0) munmap(raw, head);
+    if (extra - head > 0) munmap((void *) (start + mapped), extra - head);
+    madvise((void *) start, mapped, MADV_HUGEPAGE);
+    return (void *) start;
+}
+
+void HugePages::setMode(int mode) {
+    hugeMode = mode;
+}
+
+int HugePages::parseMode(string mode) {
+    if (mode == "off") return HUGE_PAGES_OFF;
+    if (mode == "thp") return HUGE_PAGES_THP;
+    if (mode == "auto") return HUGE_PAGES_AUTO;
+    error_exit("hugePages should be auto, thp or off: " + mode);
+    return HUGE_PAGES_OFF;
+}
+
+void *HugePages::alloc(uint64 bytes) {
+    bytes = max(bytes, (uint64) 1);
+    void *ptr = NULL;
+    HugeMapping mapping;
+    mapping.bytes = bytes;
+    //small arrays are not worth a huge page
+    bool huge = hugeMode != HUGE_PAGES_OFF && bytes >= HUGE_PAGE_2M;
+    if (huge && hugeMode == HUGE_PAGES_AUTO) {
+        //1GB pages when the array nearly fills whole ones, the pool is usually empty and this fails at once
+        uint64 waste = roundUp(bytes, HUGE_PAGE_1G) - bytes;
+        if (bytes >= HUGE_PAGE_1G && waste * 100 <= HUGE_PAGE_1G * HUGE_PAGE_1G_WASTE_PERCENT) {
+            mapping.mapped = bytes + waste;
+            mapping.kind = HUGE_KIND_1G;
+            ptr = mapHugetlb(mapping.mapped, MAP_HUGE_1GB);
+        }
+        if (ptr == NULL) {
+            mapping.mapped = roundUp(bytes, HUGE_PAGE_2M);
+            mapping.kind = HUGE_KIND_2M;
+            ptr = mapHugetlb(mapping.mapped, MAP_HUGE_2MB);
+        }
+    }
+    if (ptr == NULL) {
+        mapping.mapped = huge ? roundUp(bytes, HUGE_PAGE_2M) : roundUp(bytes, 4096);
+        mapping.kind = huge ? HUGE_KIND_THP : HUGE_KIND_NORMAL;
+        ptr = mapAligned(mapping.mapped, huge);
+    }
+    if (ptr == NULL) {
+        error_exit("can not allocate " + to_string(bytes >> 20) + "MB for the barcode index");
+    }
+    lock_guard<mutex> lock(hugeMtx);
+    hugeMappings[(uint64) ptr] = mapping;
+    return ptr;
+}
+
+void HugePages::free(void *ptr) {
+    if (ptr == NULL) return;
+    lock_guard<mutex> lock(hugeMtx);
+    map<uint64, HugeMapping>::iterator it = hugeMappings.find((uint64) ptr);
+    if (it == hugeMappings.end()) return;
+    munmap(ptr, it->second.mapped);
+    hugeMappings.erase(it);
+}
+
+string HugePages::report() {
+    lock_guard<mutex> lock(hugeMtx);
+    uint64 bytes[HUGE_KIND_NUM] = {0};
+    for (map<uint64, HugeMapping>::iterator it = hugeMappings.begin(); it != hugeMappings.end(); it++) {
+        bytes[it->second.kind] += it->second.mapped;
+    }
+    //the kernel decides which advised pages become huge, smaps tells how many did
+    uint64 thpGot = 0;
+    FILE *smaps = bytes[HUGE_KIND_THP] > 0 ? fopen("/proc/self/smaps", "r") : NULL;
+    if (smaps != NULL) {
+        char line[512];
+        uint64 start = 0, end = 0;
+        while (fgets(line, sizeof(line), smaps)) {
+            unsigned long long s, e, kb;
+            if (sscanf(line, "%llx-%llx ", &s, &e) == 2) {
+                start = s;
+                end = e;
+            } else if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1 && kb > 0) {
+                //a mapping can be merged with its neighbours, only the overlap with index arrays counts
+                uint64 overlap = 0;
+                for (map<uint64, HugeMapping>::iterator it = hugeMappings.begin(); it != hugeMappings.end(); it++) {
+                    if (it->second.kind != HUGE_KIND_THP) continue;
+                    uint64 a = max(start, it->first);
+                    uint64 b = min(end, it->first + it->second.mapped);
+                    if (a < b) overlap += b - a;
+                }
+                thpGot += min(overlap, (uint64) kb << 10);
+            }
+        }
+        fclose(smaps);
+    }
+    uint64 total = bytes[HUGE_KIND_NORMAL] + bytes[HUGE_KIND_THP] + bytes[HUGE_KIND_2M] + bytes[HUGE_KIND_1G];
+    stringstream ss;
+    ss << "index memory " << (total >> 20) << "MB: " << (bytes[HUGE_KIND_1G] >> 20) << "MB on 1GB pages, "
+       << (bytes[HUGE_KIND_2M] >> 20) << "MB on 2MB pages, " << (thpGot >> 20) << "MB of "
+       << (bytes[HUGE_KIND_THP] >> 20) << "MB advised on transparent huge pages, "
+       << (bytes[HUGE_KIND_NORMAL] >> 20) << "MB on small pages";
+    return ss.str();
+}
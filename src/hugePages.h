@@ -0,0 +1,45 @@
+#ifndef HUGEPAGES_H
+#define HUGEPAGES_H
+
+#include <string>
+#include "common.h"
+
+using namespace std;
+
+//how the big lookup arrays are mapped, --hugePages
+//plain pages
+#define HUGE_PAGES_OFF 0
+//transparent huge pages through madvise
+#define HUGE_PAGES_THP 1
+//reserved hugetlb pages (1GB, then 2MB) first, transparent huge pages when there are none
+#define HUGE_PAGES_AUTO 2
+
+#define HUGE_PAGE_2M (2ull << 20)
+#define HUGE_PAGE_1G (1ull << 30)
+//1GB pages are only taken when the rounded up tail wastes at most this percent of one, 2MB pages otherwise
+#define HUGE_PAGE_1G_WASTE_PERCENT 3
+
+/*
+ * Allocator of the barcode index arrays and the bloom filter tables. Lookups jump
+ * around gigabytes of them, with 4KB pages nearly every probe is a TLB miss.
+ * Arrays are mapped on their own so huge pages can back them, memory comes back
+ * zeroed like from mmap and pages are only placed on first touch (see --numa).
+ */
+class HugePages {
+public:
+    static void setMode(int mode);
+
+    static int parseMode(string mode);
+
+    static void *alloc(uint64 bytes);
+
+    static void free(void *ptr);
+
+    template<class T>
+    static T *allocArray(uint64 num) { return (T *) alloc(num * sizeof(T)); }
+
+    //what the live allocations got, transparent huge pages are counted from /proc/self/smaps
+    static string report();
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "inputFormat.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "zlib/zlib.h"
+
+//smallest member: 10 byte header, an empty final block and the 8 byte trailer
+#define MEMBER_MIN_SIZE 20
+#define MEMBER_PROBE_IN (64 << 10)
+#define MEMBER_PROBE_OUT (64 << 10)
+
+//header fields a real member has: deflate, no reserved flag bits, a known XFL and OS
+static bool plausibleHeader(const unsigned char *p, size_t avail) {
+    if (avail < 10 || p[2] != 8 || (p[3] & 0xe0) != 0) return false;
+    if (p[8] != 0 && p[8] != 2 && p[8] != 4) return false;
+    return p[9] <= 13 || p[9] == 255;
+}
+
+//magic bytes that turn up inside deflate data do not inflate, a real member does
+static bool inflatesAsMember(const unsigned char *p, size_t avail) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 15 + 16) != Z_OK) return false;
+    unsigned char *out = new unsigned char[MEMBER_PROBE_OUT];
+    strm.next_in = (unsigned char *) p;
+    strm.avail_in = min(avail, (size_t) MEMBER_PROBE_IN);
+    strm.next_out = out;
+    strm.avail_out = MEMBER_PROBE_OUT;
+    int ret = inflate(&strm, Z_SYNC_FLUSH);
+    bool member = (ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR) && strm.total_out > 0;
+    inflateEnd(&strm);
+    delete[] out;
+    return member;
+}
+
+//looks for a second member header behind the first one without inflating the file: the mapped
+//bytes are searched for the gzip magic and each hit is checked by inflating a few KB from it
+static InputFormat scanMembers(int fd, size_t size) {
+    if (size < 2 * MEMBER_MIN_SIZE) return INPUT_GZIP;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return INPUT_GZIP;
+    madvise(map, size, MADV_SEQUENTIAL);
+    const unsigned char *data = (const unsigned char *) map;
+    InputFormat format = INPUT_GZIP;
+    //8 bytes at a time: a zero byte in (bytes at pos ^ 1f..) | (bytes at pos + 1 ^ 8b..) marks a 1f 8b pair
+    const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    size_t last = size - MEMBER_MIN_SIZE;
+    for (size_t pos = MEMBER_MIN_SIZE; pos < last && format == INPUT_GZIP; pos += 8) {
+        uint64_t w, n;
+        memcpy(&w, data + pos, 8);
+        memcpy(&n, data + pos + 1, 8);
+        uint64_t v = (w ^ (0x1f * ones)) | (n ^ (0x8b * ones));
+        if (((v - ones) & ~v & highs) == 0) continue;
+        for (size_t i = pos; i < pos + 8 && i < last; i++) {
+            if (data[i] == 0x1f && data[i + 1] == 0x8b && plausibleHeader(data + i, size - i) &&
+                inflatesAsMember(data + i, size - i)) {
+                format = INPUT_GZIP_MULTI;
+                break;
+            }
+        }
+    }
+    munmap(map, size);
+    return format;
+}
+
+InputFormat detectInputFormat(const string &fileName, bool findMembers) {
+    FILE *file = fopen(fileName.c_str(), "rb");
+    if (file == NULL) return INPUT_PLAIN;
+    unsigned char head[18];
+    size_t n = fread(head, 1, sizeof(head), file);
+    InputFormat format = INPUT_GZIP;
+    if (n >= 4 && head[0] == 0x28 && head[1] == 0xb5 && head[2] == 0x2f && head[3] == 0xfd) {
+        format = INPUT_ZSTD;
+    } else if (n < 3 || head[0] != 0x1f || head[1] != 0x8b || head[2] != 8) {
+        format = INPUT_PLAIN;
+    } else if (n == sizeof(head) && (head[3] & 4) && head[10] == 6 && head[11] == 0 && head[12] == 'B' &&
+               head[13] == 'C' && head[14] == 2 && head[15] == 0) {
+        //FEXTRA with the 6 byte BC subfield that holds the block size
+        format = INPUT_BGZF;
+    } else if (findMembers) {
+        struct stat st;
+        if (fstat(fileno(file), &st) == 0) format = scanMembers(fileno(file), st.st_size);
+    }
+    fclose(file);
+    return format;
+}
+
+const char *inputFormatName(InputFormat format) {
+    switch (format) {
+        case INPUT_GZIP:
+            return "gzip";
+        case INPUT_BGZF:
+            return "bgzf";
+        case INPUT_ZSTD:
+            return "zstd";
+        case INPUT_GZIP_MULTI:
+            return "multi member gzip";
+        default:
+            return "plain";
+    }
+}
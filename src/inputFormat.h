@@ -0,0 +1,26 @@
+#ifndef INPUTFORMAT_H
+#define INPUTFORMAT_H
+
+#include <string>
+
+using namespace std;
+
+enum InputFormat {
+    INPUT_PLAIN = 0,
+    //gzip without block sizes, a single member unless the members were not scanned
+    INPUT_GZIP,
+    //gzip members of at most 64KB with their size in the BC extra field (bgzip, htslib)
+    INPUT_BGZF,
+    INPUT_ZSTD,
+    //gzip with more than one member (pigz, cat a.gz b.gz), pugz only decodes the first one
+    INPUT_GZIP_MULTI
+};
+
+//format of an input file from its first bytes, the file name is not looked at.
+//findMembers also searches the mapped file for the header of a second gzip member, that
+//reads the whole file once at memory speed but inflates only a few KB at each candidate
+InputFormat detectInputFormat(const string &fileName, bool findMembers = false);
+
+const char *inputFormatName(InputFormat format);
+
+#endif
@@ -7,9 +7,16 @@
 #include "options.h"
 #include "barcodeToPositionMulti.h"
 #include "barcodeToPositionMultiPE.h"
+#include "barcodeToPositionBatch.h"
+#include "mappingServer.h"
 #include "barcodeListMerge.h"
 #include "chipMaskFormatChange.h"
 #include "chipMaskMerge.h"
+#include "memoryBudget.h"
+#include "numaTopology.h"
+#include "hugePages.h"
+#include "barcodeIndex.h"
+#include "dnbCounter.h"
 #include <mutex>
 
 #include <sys/time.h>
@@ -44,8 +51,8 @@ int main(int argc, char *argv[]) {
     cmd.add<string>("in", 'i', "mask file of stereomics chip or input barcode_list file", "");
     cmd.add<string>("in1", 'I', "the second sequencing fastq file path of read1", false, "");
     cmd.add<string>("in2", 0, "the second sequencing fastq file path of read2", false, "");
-    cmd.add<string>("barcodeReadsCount", 0, "the mapped barcode list file with reads count per barcode.", false, "");
-    cmd.add<string>("out", 'O', "output file prefix or fastq output file of read1", true, "");
+    cmd.add<string>("barcodeReadsCount", 0, "the mapped barcode list file with reads count per barcode, .bin / .dnb (sorted compact list) / text.", false, "");
+    cmd.add<string>("out", 'O', "output file prefix or fastq output file of read1, not needed with laneList or serve", false, "");
     cmd.add<string>("out2", 0, "fastq output file of read2", false, "");
     cmd.add<string>("report", 0, "logging file path.", false, "");
     cmd.add("PEout", 0, "if this option was given, PE reads with barcode tag will be writen");
@@ -57,7 +64,7 @@ int main(int argc, char *argv[]) {
     cmd.add<string>("unmappedOut2", 0,
                     "output file path for barcode unmapped reads of read2, if this path isn't given, discard the reads.",
                     false, "");
-    cmd.add<uint32_t>("barcodeLen", 'l', "barcode length, default is 25", false, 25);
+    cmd.add<uint32_t>("barcodeLen", 'l', "barcode length, default is 25. up to 64, barcodes longer than 32 need a text mask", false, 25);
     cmd.add<int>("barcodeStart", 0, "barcode start position", false, 0);
     cmd.add<int>("umiRead", 0, "read1 or read2 contains the umi sequence.", false, 1);
     cmd.add<int>("barcodeRead", 0, "read1 or read2 contains the barcode sequence.", false, 1);
@@ -79,11 +86,47 @@ int main(int argc, char *argv[]) {
     cmd.add<int>("thread", 'w', "number of thread that will be used to run.", false, 2);
     cmd.add<int>("thread2", 0, "number of thread that will be used to run.", false, 2);
     cmd.add<int>("pugzThread", 0, "number of thread that will be used to pugz.", false, 1);
+    cmd.add<int>("decodeThread", 0,
+                 "number of thread that decode one bgzf or indexed gz input, 0 means pugzThread with usePugz and 2 without.",
+                 false, 0);
     cmd.add<int>("pigzThread", 0, "number of thread that will be used to pigz.", false, 1);
     cmd.add("verbose", 'V', "output verbose log information (i.e. when every 1M reads are processed).");
     cmd.add("usePugz", 0, "use pugz to decompress\n");
     cmd.add("usePigz", 0, "use pigz to decompress\n");
     cmd.add("outGzSpilt", 0, "");
+    cmd.add("asyncWrite", 0, "write output files asynchronously (io_uring if built with uring=1, else a pwrite pool).");
+    cmd.add<int>("ioDepth", 0, "number of 4MB output blocks in flight when asyncWrite is used.", false, 8);
+    cmd.add("directIO", 0, "open async output files with O_DIRECT.");
+    cmd.add("maskShuffle", 0, "add the hdf5 byte shuffle filter before deflate when writing h5 masks. builds that read h5 masks without unshuffling do not fail on such a mask but map no reads, so only use it when every reader of the mask is this version or newer.");
+    cmd.add<string>("profileOut", 0,
+                    "write per-stage timers and queue depths of the mapping run as json to this file (one file per mpi rank, with laneList or serve one per lane / job, .laneN / .jobN). --verbose also logs them every 10 seconds.",
+                    false, "");
+    cmd.add<string>("laneList", 0,
+                    "map many lanes against one loaded mask, one \"in1 in2 out [barcodeReadsCount]\" per line, --out is not used.",
+                    false, "");
+    cmd.add<int>("laneParallel", 0, "number of lanes mapped at the same time with laneList, they split the thread, pugzThread and decodeThread counts.", false, 1);
+    cmd.add<string>("serve", 0,
+                    "run as a mapping server on this unix socket (mode 0600, only this user can connect), jobs are lines of key=value (in1 in2 out [mask] ...).",
+                    false, "");
+    cmd.add<int>("maxResidentMasks", 0, "max number of mask indexes kept in memory by the server.", false, 1);
+    cmd.add<int>("serveJobs", 0, "number of mapping jobs the server runs at the same time, they split the thread, pugzThread and decodeThread counts.", false, 1);
+    cmd.add<string>("memLimit", 0,
+                    "memory limit of one node for mapping, e.g. 64G, shared by the mpi ranks on it. the barcode index, bloom filter, fastq pools and queues are shrunk to fit.",
+                    false, "");
+    cmd.add("gzIndex", 0,
+            "keep a .gzidx checkpoint index next to gz inputs. the first run builds it, later runs decode from it with decodeThread threads and every mpi rank only decodes its own reads.");
+    cmd.add<string>("numa", 0,
+                    "placement on multi socket nodes (built with numa=1): off, interleave spreads the barcode index over all nodes, replicate keeps a copy of it on every node. consumer, pugz and pigz threads are pinned to nodes in both modes. meant for one mpi rank per node.",
+                    false, "off");
+    cmd.add<string>("hugePages", 0,
+                    "pages of the barcode index and bloom filter: auto tries reserved hugetlb pages (1GB, 2MB) and falls back to transparent huge pages, thp only asks for transparent huge pages, off uses normal pages. what was obtained is logged after the index is loaded.",
+                    false, "auto");
+    cmd.add<string>("indexType", 0,
+                    "layout of the barcode index: compact packs the barcode remainder and x / y into one word per barcode (about 10 bytes per barcode), mphf looks barcodes up through a minimal perfect hash, one slot with the full barcode and x / y per barcode (about 16 bytes per barcode), list keeps the full records in hash chains (20 bytes per barcode plus 4 bytes per hash bucket).",
+                    false, "compact");
+    cmd.add<string>("dnbLayout", 0,
+                    "order of the dense reads count per DNB position: row keeps every x as one row of the whole chip height, tile stores the chip as 64 x 64 tiles so a region of the chip shares pages and cache lines. the barcodeReadsCount output is the same.",
+                    false, "row");
 
     cmd.parse_check(argc, argv);
 
@@ -107,6 +150,7 @@ int main(int argc, char *argv[]) {
     opt.thread = cmd.get<int>("thread");
     opt.thread2 = cmd.get<int>("thread2");
     opt.pugzThread = cmd.get<int>("pugzThread");
+    opt.decodeThread = cmd.get<int>("decodeThread");
     opt.pigzThread = cmd.get<int>("pigzThread");
     opt.report = cmd.get<string>("report");
     opt.barcodeSegment = cmd.get<int>("barcodeSegment");
@@ -128,6 +172,23 @@ int main(int argc, char *argv[]) {
     opt.transBarcodeToPos.fixedSequenceFile = cmd.get<string>("fixedSequenceFile");
     opt.transBarcodeToPos.PEout = cmd.exist("PEout");
     opt.outGzSpilt = cmd.exist("outGzSpilt");
+    opt.asyncWrite = cmd.exist("asyncWrite");
+    opt.ioDepth = cmd.get<int>("ioDepth");
+    opt.directIO = cmd.exist("directIO");
+    opt.maskShuffle = cmd.exist("maskShuffle");
+    opt.profileOut = cmd.get<string>("profileOut");
+    opt.laneList = cmd.get<string>("laneList");
+    opt.laneParallel = cmd.get<int>("laneParallel");
+    opt.serveSocket = cmd.get<string>("serve");
+    opt.maxResidentMasks = cmd.get<int>("maxResidentMasks");
+    opt.serveJobs = cmd.get<int>("serveJobs");
+    opt.memLimit = MemoryBudget::parseSize(cmd.get<string>("memLimit"));
+    opt.gzIndex = cmd.exist("gzIndex");
+    opt.numaMode = NumaTopology::parseMode(cmd.get<string>("numa"));
+    opt.hugePages = HugePages::parseMode(cmd.get<string>("hugePages"));
+    HugePages::setMode(opt.hugePages);
+    opt.indexType = BarcodeIndex::parseType(cmd.get<string>("indexType"));
+    opt.dnbLayout = DnbCounter::parseLayout(cmd.get<string>("dnbLayout"));
 
 
     opt.myRank = my_rank;
@@ -138,7 +199,7 @@ int main(int argc, char *argv[]) {
         opt.thread = opt.thread2;
 
     }
-    if (num_procs >= 2) {
+    if (num_procs >= 2 && !opt.out.empty()) {
         string out_name = opt.out;
         int pos = out_name.find(".fq");
         if (pos < 0 || pos > out_name.size()) {
@@ -178,9 +239,15 @@ int main(int argc, char *argv[]) {
     printf("now out name is %s\n", opt.transBarcodeToPos.out1.c_str());
 #endif
 
-    if (ends_with(opt.transBarcodeToPos.in1, ".gz") == 0) {
+    //pugz only takes one complete gzip member, other gzip, bgzf, zstd and plain input use their own readers
+    if (opt.usePugz && opt.laneList.empty() && opt.serveSocket.empty() &&
+        (detectInputFormat(opt.transBarcodeToPos.in1, true) != INPUT_GZIP ||
+         detectInputFormat(opt.transBarcodeToPos.in2, true) != INPUT_GZIP)) {
         opt.usePugz = 0;
     }
+    if (opt.decodeThread <= 0) {
+        opt.decodeThread = opt.usePugz ? max(1, opt.pugzThread) : 2;
+    }
 
     stringstream ss;
     for (int i = 0; i < argc; i++) {
@@ -191,10 +258,20 @@ int main(int argc, char *argv[]) {
     auto t1_my = MainGetTime();
     opt.init();
     opt.validate();
+    if (opt.actionInt == 1) {
+        MemoryBudget memoryBudget(&opt);
+        memoryBudget.plan();
+    }
 
 
     if (opt.actionInt == 1) {
-        if (opt.transBarcodeToPos.PEout) {
+        if (!opt.serveSocket.empty()) {
+            MappingServer mappingServer(&opt);
+            mappingServer.serve();
+        } else if (!opt.laneList.empty()) {
+            BarcodeToPositionBatch barcodeToPosBatch(&opt);
+            barcodeToPosBatch.process();
+        } else if (opt.transBarcodeToPos.PEout) {
             BarcodeToPositionMultiPE barcodeToPosMultiPE(&opt);
             barcodeToPosMultiPE.process();
         } else {
@@ -0,0 +1,382 @@
+#include "mappingServer.h"
+#include <sstream>
+#include <climits>
+#include <iterator>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
+double GetTime();
+
+//keys a job line may have, see mappingServer.h
+static const char *JOB_KEYS[] = {"in1", "in2", "out", "mask", "barcodeReadsCount", "unmappedOut", "thread", "mismatch"};
+
+static bool parseJobInt(const string &value, int minValue, int &result) {
+    char *end = NULL;
+    errno = 0;
+    long parsed = strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || errno != 0 || parsed < minValue || parsed > INT_MAX) return false;
+    result = (int) parsed;
+    return true;
+}
+
+static bool fileReadable(const string &path) {
+    return file_exists(path) && !is_directory(path) && access(path.c_str(), R_OK) == 0;
+}
+
+static bool fileWritable(const string &path) {
+    if (file_exists(path)) return !is_directory(path) && access(path.c_str(), W_OK) == 0;
+    return access(dirname(path).c_str(), W_OK) == 0;
+}
+
+MappingServer::MappingServer(Options *opt) {
+    mOptions = opt;
+    mSocketPath = opt->serveSocket;
+    mListenFd = -1;
+    mMaxResident = opt->maxResidentMasks < 1 ? 1 : opt->maxResidentMasks;
+    mJobSlots = 1;
+    mStop = false;
+    mTick = 0;
+    mJobsDone = 0;
+    mJobsStarted = 0;
+}
+
+MappingServer::~MappingServer() {
+    evictMasks(0);
+    if (mListenFd >= 0) {
+        close(mListenFd);
+        unlink(mSocketPath.c_str());
+    }
+}
+
+bool MappingServer::serve() {
+    if (mOptions->numPro > 1) {
+        error_exit("serve mode runs in a single process, please start it without mpirun -n > 1");
+    }
+    struct sockaddr_un addr;
+    if (mSocketPath.size() >= sizeof(addr.sun_path)) {
+        error_exit("socket path is too long: " + mSocketPath);
+    }
+    mListenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (mListenFd < 0) {
+        error_exit("can not create unix socket: " + string(strerror(errno)));
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, mSocketPath.c_str());
+    unlink(mSocketPath.c_str());
+    //jobs read and write files as this user, only this user may connect
+    mode_t oldMask = umask(0177);
+    int bound = bind(mListenFd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(oldMask);
+    if (bound < 0 || chmod(mSocketPath.c_str(), 0600) < 0 || listen(mListenFd, 64) < 0) {
+        error_exit("can not listen on " + mSocketPath + ": " + string(strerror(errno)));
+    }
+
+    //load the default mask before the first job comes
+    if (!mOptions->in.empty()) {
+        try {
+            ResidentMask *mask = acquireMask(mOptions->in);
+            releaseMask(mask);
+        } catch (exception &e) {
+            error_exit("can not load mask " + mOptions->in + ": " + e.what());
+        }
+    }
+
+    mJobSlots = mOptions->serveJobs < 1 ? 1 : mOptions->serveJobs;
+    //pigz keeps its state in globals, only one pigz instance can run at a time
+    if (mOptions->usePigz || mOptions->outGzSpilt) mJobSlots = 1;
+    vector<thread *> workers;
+    for (int i = 0; i < mJobSlots; i++) {
+        workers.push_back(new thread(bind(&MappingServer::jobTask, this)));
+    }
+    loginfo("mapping server listening on " + mSocketPath + ", " + to_string(mJobSlots) + " job slots");
+
+    while (!mStop) {
+        int fd = accept(mListenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (!mStop) loginfo("accept failed: " + string(strerror(errno)));
+            break;
+        }
+        unique_lock<mutex> lock(mClientMtx);
+        mClients.push_back(fd);
+        mClientCv.notify_one();
+    }
+
+    mStop = true;
+    mClientCv.notify_all();
+    for (int i = 0; i < workers.size(); i++) {
+        workers[i]->join();
+        delete workers[i];
+    }
+    loginfo("mapping server stopped, " + to_string(mJobsDone) + " jobs done");
+    return true;
+}
+
+void MappingServer::jobTask() {
+    //a broken job or mask is answered with ERR, it does not take the server down
+    errorExitThrows() = true;
+    while (true) {
+        unique_lock<mutex> lock(mClientMtx);
+        while (mClients.empty() && !mStop) mClientCv.wait(lock);
+        if (mClients.empty()) break;
+        int fd = mClients.front();
+        mClients.pop_front();
+        lock.unlock();
+        handleClient(fd);
+    }
+}
+
+void MappingServer::handleClient(int fd) {
+    string request;
+    char buf[4096];
+    while (request.find('\n') == string::npos && request.size() < (1 << 16)) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        request.append(buf, n);
+    }
+    request = request.substr(0, request.find('\n'));
+    if (!request.empty() && request[request.size() - 1] == '\r') request.erase(request.size() - 1);
+
+    string reply;
+    if (request == "shutdown") {
+        reply = "OK shutdown\n";
+        mStop = true;
+        //wake up accept in serve()
+        shutdown(mListenFd, SHUT_RDWR);
+    } else if (request == "status") {
+        reply = "OK " + status() + "\n";
+    } else {
+        map<string, string> job;
+        stringstream ss(request);
+        string item;
+        while (ss >> item) {
+            size_t pos = item.find('=');
+            if (pos == string::npos) continue;
+            job[item.substr(0, pos)] = item.substr(pos + 1);
+        }
+        loginfo("job: " + request);
+        reply = runJob(job);
+        mJobsDone++;
+    }
+    size_t sent = 0;
+    while (sent < reply.size()) {
+        ssize_t n = write(fd, reply.c_str() + sent, reply.size() - sent);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        sent += n;
+    }
+    close(fd);
+}
+
+string MappingServer::checkJob(map<string, string> &job) {
+    for (auto iter = job.begin(); iter != job.end(); iter++) {
+        if (find(begin(JOB_KEYS), end(JOB_KEYS), iter->first) == end(JOB_KEYS)) {
+            return "unknown job key: " + iter->first;
+        }
+    }
+    if (job["in1"].empty() || job["in2"].empty() || job["out"].empty()) {
+        return "in1, in2 and out are required";
+    }
+    if (!fileReadable(job["in1"]) || !fileReadable(job["in2"])) {
+        return "can not read fastq file: " + (fileReadable(job["in1"]) ? job["in2"] : job["in1"]);
+    }
+    string maskPath = job["mask"].empty() ? mOptions->in : job["mask"];
+    if (maskPath.empty() || !fileReadable(maskPath)) {
+        return "can not read mask file: " + maskPath;
+    }
+    const char *outKeys[] = {"out", "unmappedOut", "barcodeReadsCount"};
+    for (const char *key : outKeys) {
+        if (!job[key].empty() && !fileWritable(job[key])) {
+            return "can not write " + string(key) + " file: " + job[key];
+        }
+    }
+    int value;
+    if (!job["thread"].empty() && !parseJobInt(job["thread"], 1, value)) {
+        return "thread should be a positive number: " + job["thread"];
+    }
+    if (!job["mismatch"].empty() && !parseJobInt(job["mismatch"], 0, value)) {
+        return "mismatch should be a number >= 0: " + job["mismatch"];
+    }
+    return "";
+}
+
+string MappingServer::runJob(map<string, string> &job) {
+    string error = checkJob(job);
+    if (!error.empty()) {
+        return "ERR " + error + "\n";
+    }
+    string maskPath = job["mask"].empty() ? mOptions->in : job["mask"];
+
+    double t0 = GetTime();
+    ResidentMask *mask;
+    try {
+        mask = acquireMask(maskPath);
+    } catch (exception &e) {
+        return "ERR can not load mask " + maskPath + ": " + e.what() + "\n";
+    } catch (...) {
+        return "ERR can not load mask " + maskPath + "\n";
+    }
+
+    Options *jobOpt = new Options(*mOptions);
+    long jobId = mJobsStarted++;
+    if (!jobOpt->profileOut.empty()) {
+        jobOpt->profileOut += ".job" + to_string(jobId);
+    }
+    jobOpt->in = maskPath;
+    jobOpt->transBarcodeToPos.in = maskPath;
+    jobOpt->transBarcodeToPos.in1 = job["in1"];
+    jobOpt->transBarcodeToPos.in2 = job["in2"];
+    jobOpt->transBarcodeToPos.mappedDNBOutFile = job["barcodeReadsCount"];
+    jobOpt->transBarcodeToPos.unmappedOutFile = job["unmappedOut"];
+    //concurrent jobs split the threads of the server, a job can ask for fewer than its share
+    jobOpt->shareThreads(mJobSlots);
+    if (!job["thread"].empty()) jobOpt->thread = min(jobOpt->thread, atoi(job["thread"].c_str()));
+    if (!job["mismatch"].empty()) jobOpt->transBarcodeToPos.mismatch = atoi(job["mismatch"].c_str());
+    string out = job["out"];
+    if (jobOpt->usePigz) {
+        out = out.substr(0, out.find(".gz"));
+    }
+    jobOpt->out = out;
+    jobOpt->transBarcodeToPos.out1 = out;
+    if (jobOpt->usePugz && (detectInputFormat(jobOpt->transBarcodeToPos.in1, true) != INPUT_GZIP ||
+                            detectInputFormat(jobOpt->transBarcodeToPos.in2, true) != INPUT_GZIP)) {
+        jobOpt->usePugz = 0;
+    }
+
+    //the pipeline threads of the job record their first error here instead of exiting
+    JobError jobError;
+    jobOpt->jobError = &jobError;
+    jobErrorSink() = &jobError;
+    stringstream reply;
+    BarcodeToPositionMulti *barcodeToPosMulti = NULL;
+    try {
+        barcodeToPosMulti = new BarcodeToPositionMulti(jobOpt, mask->bpmap);
+        barcodeToPosMulti->process();
+    } catch (exception &e) {
+        jobError.set(e.what());
+    }
+    //process() has joined its stages when it returns or throws, the outputs are closed here
+    //and a failed close still counts for the reply
+    if (barcodeToPosMulti)
+        delete barcodeToPosMulti;
+    jobErrorSink() = NULL;
+    if (jobError.failed) {
+        reply << "ERR mapping failed: " << jobError.msg << "\n";
+    } else {
+        reply << "OK " << GetTime() - t0 << "\n";
+    }
+    delete jobOpt;
+
+    releaseMask(mask);
+    return reply.str();
+}
+
+ResidentMask *MappingServer::acquireMask(string &maskPath) {
+    unique_lock<mutex> lock(mMaskMtx);
+    while (true) {
+        auto iter = mMasks.find(maskPath);
+        if (iter != mMasks.end()) {
+            ResidentMask *mask = iter->second;
+            mask->users++;
+            mask->lastUsed = ++mTick;
+            while (!mask->ready) mMaskCv.wait(lock);
+            if (!mask->error.empty()) {
+                string error = mask->error;
+                dropFailedMask(mask);
+                throw runtime_error(error);
+            }
+            return mask;
+        }
+        //make room before loading, a mask index takes several GB, so with every resident mask
+        //in use the job waits for one to be released, another job may load this path meanwhile
+        if (evictMasks(mMaxResident - 1)) break;
+        mMaskCv.wait(lock);
+    }
+    ResidentMask *mask = new ResidentMask;
+    mask->opt = new Options(*mOptions);
+    mask->opt->in = maskPath;
+    mask->opt->transBarcodeToPos.in = maskPath;
+    mask->bpmap = NULL;
+    mask->users = 1;
+    mask->lastUsed = ++mTick;
+    mask->ready = false;
+    mMasks[maskPath] = mask;
+    lock.unlock();
+
+    double t0 = GetTime();
+    string error;
+    try {
+        mask->bpmap = new BarcodePositionMap(mask->opt);
+        loginfo("mask " + maskPath + " loaded, cost " + to_string(GetTime() - t0));
+    } catch (exception &e) {
+        error = e.what();
+    } catch (...) {
+        error = "unknown error";
+    }
+
+    lock.lock();
+    if (!error.empty()) {
+        //waiting jobs get the error too, the next job for this path loads it again
+        mMasks.erase(maskPath);
+        mask->error = error;
+        mask->ready = true;
+        mMaskCv.notify_all();
+        dropFailedMask(mask);
+        throw runtime_error(error);
+    }
+    mask->ready = true;
+    mMaskCv.notify_all();
+    return mask;
+}
+
+//called with mMaskMtx held by every job that waited on a mask that failed to load, the last one frees it
+void MappingServer::dropFailedMask(ResidentMask *mask) {
+    if (--mask->users > 0) return;
+    delete mask->opt;
+    delete mask;
+}
+
+void MappingServer::releaseMask(ResidentMask *mask) {
+    unique_lock<mutex> lock(mMaskMtx);
+    mask->users--;
+    evictMasks(mMaxResident);
+    //jobs waiting for room can evict this one now
+    mMaskCv.notify_all();
+}
+
+//drop least recently used idle masks until at most keep are resident, called with mMaskMtx held,
+//false when the masks left are all in use or loading
+bool MappingServer::evictMasks(int keep) {
+    while (mMasks.size() > keep) {
+        auto victim = mMasks.end();
+        for (auto iter = mMasks.begin(); iter != mMasks.end(); iter++) {
+            if (iter->second->users > 0 || !iter->second->ready) continue;
+            if (victim == mMasks.end() || iter->second->lastUsed < victim->second->lastUsed) {
+                victim = iter;
+            }
+        }
+        if (victim == mMasks.end()) return false;
+        loginfo("drop resident mask " + victim->first);
+        delete victim->second->bpmap;
+        delete victim->second->opt;
+        delete victim->second;
+        mMasks.erase(victim);
+    }
+    return true;
+}
+
+string MappingServer::status() {
+    unique_lock<mutex> lock(mMaskMtx);
+    stringstream ss;
+    ss << "jobs_done=" << mJobsDone << " resident_masks=" << mMasks.size();
+    for (auto iter = mMasks.begin(); iter != mMasks.end(); iter++) {
+        ss << " " << iter->first << ":" << (iter->second->ready ? "ready" : "loading") << ":" << iter->second->users;
+    }
+    return ss.str();
+}
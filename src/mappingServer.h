@@ -0,0 +1,95 @@
+#ifndef MAPPINGSERVER_H
+#define MAPPINGSERVER_H
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "options.h"
+#include "barcodePositionMap.h"
+#include "barcodeToPositionMulti.h"
+
+using namespace std;
+
+struct ResidentMask {
+    Options *opt;
+    BarcodePositionMap *bpmap;
+    int users;
+    long lastUsed;
+    bool ready;
+    //set when loading failed, the mask is no longer in the resident list
+    string error;
+};
+
+/*
+ * Long running mapping service (--serve <socket>).
+ * Mask indexes stay resident between jobs, at most --maxResidentMasks of them,
+ * the least recently used idle one is dropped first and a job that needs another mask
+ * while all of them are in use waits until one is released.
+ * A job is one line of key=value pairs sent over the unix socket:
+ *     in1=r1.fq.gz in2=r2.fq.gz out=out.fq.gz [mask=chip.h5] [barcodeReadsCount=f] [unmappedOut=f] [thread=n] [mismatch=n]
+ * mask defaults to --in. The server answers "OK <seconds>" or "ERR <message>", a job that fails to load its mask
+ * or to map is answered with ERR and the server keeps running.
+ * Jobs running at the same time split the --thread, --pugzThread and --decodeThread of the server,
+ * thread=n can only lower the share of a job.
+ * The lines "status" and "shutdown" are also accepted.
+ * The socket is created with mode 0600, only the user running the server can send jobs.
+ */
+class MappingServer {
+public:
+    MappingServer(Options *opt);
+
+    ~MappingServer();
+
+    bool serve();
+
+private:
+    void jobTask();
+
+    void handleClient(int fd);
+
+    //what is wrong with a job before any mask or file is touched, empty if it can run
+    string checkJob(map<string, string> &job);
+
+    string runJob(map<string, string> &job);
+
+    //throws when the mask can not be loaded
+    ResidentMask *acquireMask(string &maskPath);
+
+    void dropFailedMask(ResidentMask *mask);
+
+    void releaseMask(ResidentMask *mask);
+
+    bool evictMasks(int keep);
+
+    string status();
+
+private:
+    Options *mOptions;
+    string mSocketPath;
+    int mListenFd;
+    int mMaxResident;
+    //jobs run at the same time, they share the threads of the server
+    int mJobSlots;
+    atomic_bool mStop;
+
+    map<string, ResidentMask *> mMasks;
+    long mTick;
+    mutex mMaskMtx;
+    condition_variable mMaskCv;
+
+    deque<int> mClients;
+    mutex mClientMtx;
+    condition_variable mClientCv;
+    atomic_long mJobsDone;
+    //numbers the jobs, e.g. for their profile files
+    atomic_long mJobsStarted;
+};
+
+#endif
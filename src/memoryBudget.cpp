@@ -0,0 +1,176 @@
+#include "memoryBudget.h"
+#include <sys/stat.h>
+#include <sstream>
+#include "chipMaskHDF5.h"
+#include "FastqStream.h"
+#include "gzReadAhead.h"
+#include "numaTopology.h"
+#include "barcodeIndex.h"
+
+MemoryBudget::MemoryBudget(Options *opt) {
+    mOptions = opt;
+    mRecords = 0;
+    mIndexes = 1;
+    mPipelines = 1;
+    if (!opt->serveSocket.empty()) {
+        mIndexes = max(1, opt->maxResidentMasks);
+        mPipelines = max(1, opt->serveJobs);
+    } else if (!opt->laneList.empty()) {
+        mPipelines = max(1, opt->laneParallel);
+    }
+}
+
+long MemoryBudget::parseSize(string size) {
+    size = trim(size);
+    if (size.empty()) return 0;
+    char *end = NULL;
+    double value = strtod(size.c_str(), &end);
+    double unit = 1;
+    switch (toupper(*end)) {
+        case 'T':
+            unit *= 1024;
+            // fall through
+        case 'G':
+            unit *= 1024;
+            // fall through
+        case 'M':
+            unit *= 1024;
+            // fall through
+        case 'K':
+            unit *= 1024;
+            end++;
+            break;
+        default:
+            break;
+    }
+    if (toupper(*end) == 'B') end++;
+    if (end == size.c_str() || *end != '\0' || value < 0) {
+        error_exit("can not parse memory size: " + size);
+    }
+    return (long) (value * unit);
+}
+
+int MemoryBudget::localRanks() {
+    MPI_Comm nodeComm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, mOptions->myRank, MPI_INFO_NULL, &nodeComm);
+    int ranks = 1;
+    MPI_Comm_size(nodeComm, &ranks);
+    MPI_Comm_free(&nodeComm);
+    return max(1, ranks);
+}
+
+uint64 MemoryBudget::maskRecords(string &maskFile) {
+    struct stat st;
+    if (stat(maskFile.c_str(), &st) != 0) {
+        error_exit("mask file does not exist: " + maskFile);
+    }
+    if (ends_with(maskFile, ".bin")) {
+        return st.st_size / sizeof(bpmap_key_value);
+    }
+    if (ends_with(maskFile, "h5") || ends_with(maskFile, "hdf5")) {
+        ChipMaskHDF5 chipMaskH5(maskFile);
+        chipMaskH5.openFile();
+        hsize_t dims[RANK] = {0, 0, 1};
+        uint32 attributeValues[ATTRIBUTEDIM];
+        hid_t datasetID = chipMaskH5.openDataSet(dims, attributeValues);
+        H5Dclose(datasetID);
+        H5Fclose(chipMaskH5.fileID);
+        return (uint64) dims[0] * dims[1] * dims[2];
+    }
+    //text masks take about 32 bytes per line
+    return st.st_size / 32;
+}
+
+//bytes of one rank, streamStep indexes the BUDGET_STREAM_ tables
+long MemoryBudget::estimate(uint32 mapMod, int bloomBits, int streamStep) {
+    int keyBits = mOptions->barcodeLen * 2;
+    long lookup = BarcodeIndex::lookupBytes(mOptions->indexType, mRecords, mapMod, keyBits);
+    long index = lookup + 2 * ((1ll << bloomBits) >> 3) +
+                 BarcodeIndex::buildBytes(mOptions->indexType, mRecords, keyBits);
+    string maskFile = mOptions->transBarcodeToPos.in;
+    if (ends_with(maskFile, "h5") || ends_with(maskFile, "hdf5")) {
+        //decoded chunks in flight while loading
+        index += min((uint64) CHUNK_LOAD_WINDOW * CDIM0 * CDIM1, mRecords) * sizeof(uint64) * 2;
+    } else if (!ends_with(maskFile, ".bin")) {
+        //text records are parsed into per thread parts before they are copied into the index
+        index += mRecords * (keyBits > 64 ? sizeof(bpmap_wide_key_value) : sizeof(bpmap_key_value));
+    }
+    if (mOptions->numaMode == NUMA_REPLICATE) {
+        //a copy of the lookup arrays on every other node
+        index += (NumaTopology::nodes() - 1) * (lookup + 2 * ((1ll << bloomBits) >> 3));
+    }
+
+    long parts = BUDGET_STREAM_PARTS[streamStep];
+    long depth = BUDGET_STREAM_DEPTH[streamStep];
+    //read1 and read2 pools, the output queue and the pugz / pigz queues all hold chunk sized blocks
+    long queues = 1 + (mOptions->usePugz ? 2 : 0) + (mOptions->usePigz ? 1 : 0);
+    long pipeline = (2 * parts + queues * depth) * (long) SwapBufferSize;
+    if (mOptions->usePigz) pipeline += 1 << 24;
+    InputFormat format = detectInputFormat(mOptions->transBarcodeToPos.in1);
+    if ((!mOptions->usePugz || mOptions->gzIndex) && format != INPUT_PLAIN) {
+        //read1 and read2 decode ahead of the chunk reader
+        pipeline += 2 * ((long) GZ_READ_AHEAD_PARTS * GZ_READ_AHEAD_BLOCK + GZ_READ_AHEAD_IN);
+        if (format == INPUT_BGZF) {
+            //compressed batches next to the decoded ones
+            pipeline += 2 * (long) GZ_READ_AHEAD_PARTS * (GZ_READ_AHEAD_BLOCK + BGZF_MAX_BLOCK);
+        } else if (mOptions->gzIndex) {
+            //a segment buffer and the compressed members of a segment per decode thread,
+            //or the checkpoint windows while the index is built
+            pipeline += 2 * mOptions->decodeThread * (2 * GZ_INDEX_SPAN + GZ_INDEX_IN);
+        }
+    }
+    int threads = max(1, mOptions->thread) + (mOptions->usePugz ? 2 * mOptions->pugzThread : 2 * mOptions->decodeThread) +
+                  (mOptions->usePigz ? mOptions->pigzThread : 0);
+    pipeline += threads * BUDGET_THREAD_BYTES;
+    return mIndexes * index + mPipelines * pipeline;
+}
+
+void MemoryBudget::plan() {
+    if (mOptions->memLimit <= 0) return;
+    string maskFile = mOptions->transBarcodeToPos.in;
+    if (maskFile.find(',') != string::npos) {
+        maskFile = maskFile.substr(0, maskFile.find(','));
+    }
+    //a server started without a default mask can only budget its buffers
+    mRecords = maskFile.empty() ? 0 : maskRecords(maskFile);
+    int ranks = localRanks();
+    long budget = mOptions->memLimit / ranks;
+
+    int modStep = 0, bloomStep = 0, streamStep = 0;
+    //the default layout until half the stream steps, then bloom filter, buckets and the rest of the stream steps
+    while (estimate(BUDGET_MAP_MODS[modStep], BUDGET_BLOOM_BITS[bloomStep], streamStep) > budget) {
+        if (streamStep < 2) {
+            streamStep++;
+        } else if (bloomStep + 1 < BUDGET_BLOOM_NUM) {
+            bloomStep++;
+        } else if (mOptions->indexType == INDEX_LIST && modStep + 1 < BUDGET_MAP_MOD_NUM &&
+                   (uint64) BUDGET_MAP_MODS[modStep + 1] * BUDGET_MAX_CHAIN >= mRecords) {
+            modStep++;
+        } else if (streamStep + 1 < BUDGET_STREAM_NUM) {
+            streamStep++;
+        } else {
+            stringstream ss;
+            ss << "memLimit " << (mOptions->memLimit >> 20) << "MB is too small for " << ranks
+               << " rank(s) on this node, one rank needs at least "
+               << (estimate(BUDGET_MAP_MODS[modStep], BUDGET_BLOOM_BITS[bloomStep], streamStep) >> 20)
+               << "MB for " << mRecords << " mask records";
+            error_exit(ss.str());
+        }
+    }
+    mOptions->mapMod = BUDGET_MAP_MODS[modStep];
+    mOptions->bloomBits = BUDGET_BLOOM_BITS[bloomStep];
+    mOptions->fastqPoolParts = BUDGET_STREAM_PARTS[streamStep];
+    mOptions->queueDepth = BUDGET_STREAM_DEPTH[streamStep];
+    if (mOptions->myRank == 0) {
+        stringstream ss;
+        ss << "memory plan for " << (budget >> 20) << "MB per rank (" << ranks << " on this node): "
+           << "estimate " << (estimate(mOptions->mapMod, mOptions->bloomBits, streamStep) >> 20) << "MB, "
+           << mRecords << " mask records, "
+           << (mOptions->indexType == INDEX_LIST ? to_string(mOptions->mapMod) + " hash buckets"
+                                                 : mOptions->indexType == INDEX_COMPACT ? "compact index" : "mphf index")
+           << ", bloom 2^"
+           << mOptions->bloomBits << " bits, " << mOptions->fastqPoolParts << " fastq chunks, queue depth "
+           << mOptions->queueDepth;
+        loginfo(ss.str());
+    }
+}
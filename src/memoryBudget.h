@@ -0,0 +1,58 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <string>
+#include "options.h"
+
+using namespace std;
+
+//hash bucket numbers the index can step down to, MOD and primes just above 2^29 ... 2^24
+static const uint32 BUDGET_MAP_MODS[] = {MOD, 536870923, 268435459, 134217757, 67108879, 33554467, 16777259};
+static const int BUDGET_MAP_MOD_NUM = sizeof(BUDGET_MAP_MODS) / sizeof(BUDGET_MAP_MODS[0]);
+//fewer buckets are not used when the average chain would get longer than this
+#define BUDGET_MAX_CHAIN 4
+static const int BUDGET_BLOOM_BITS[] = {BLOOM_MAX_BITS, 30, 28, 26};
+static const int BUDGET_BLOOM_NUM = sizeof(BUDGET_BLOOM_BITS) / sizeof(BUDGET_BLOOM_BITS[0]);
+//fastq pool parts and queue depth of every streaming step
+static const int BUDGET_STREAM_PARTS[] = {128, 64, 32, 16, 8};
+static const int BUDGET_STREAM_DEPTH[] = {256, 128, 64, 32, 16};
+static const int BUDGET_STREAM_NUM = sizeof(BUDGET_STREAM_PARTS) / sizeof(BUDGET_STREAM_PARTS[0]);
+//reads, results and output strings held by one mapping thread
+#define BUDGET_THREAD_BYTES (32ll << 20)
+
+/*
+ * Sizes the mapping to --memLimit. The limit is for one node and is split evenly
+ * between the mpi ranks running on it. Before the mask is loaded the index and the
+ * streaming buffers are estimated from the mask file, then the plan steps down until
+ * it fits: shallower fastq pools and queues first, then a folded bloom filter, then
+ * fewer hash buckets, then the smallest queues. The result is written to the
+ * mapMod, bloomBits, fastqPoolParts and queueDepth fields of the options.
+ */
+class MemoryBudget {
+public:
+    MemoryBudget(Options *opt);
+
+    //exits when even the smallest plan does not fit
+    void plan();
+
+    //"64G", "512m", "1.5T" or a byte count, 0 for an empty string
+    static long parseSize(string size);
+
+private:
+    //number of mpi ranks sharing this node
+    int localRanks();
+
+    //index records of the mask, the h5 loader allocates one per matrix cell
+    uint64 maskRecords(string &maskFile);
+
+    long estimate(uint32 mapMod, int bloomBits, int streamStep);
+
+private:
+    Options *mOptions;
+    uint64 mRecords;
+    //mask indexes and mapping pipelines alive at the same time
+    int mIndexes;
+    int mPipelines;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#include "numaTopology.h"
+#include <unistd.h>
+#include "util.h"
+
+#ifdef USE_NUMA
+#include <numa.h>
+#include <numaif.h>
+#endif
+
+int NumaTopology::parseMode(string mode) {
+    if (mode == "off") return NUMA_OFF;
+    if (mode == "interleave") return NUMA_INTERLEAVE;
+    if (mode == "replicate") return NUMA_REPLICATE;
+    error_exit("numa should be off, interleave or replicate: " + mode);
+    return NUMA_OFF;
+}
+
+int NumaTopology::nodes() {
+#ifdef USE_NUMA
+    if (numa_available() >= 0) {
+        return max(1, numa_num_configured_nodes());
+    }
+#endif
+    return 1;
+}
+
+void NumaTopology::pinThread(int node) {
+#ifdef USE_NUMA
+    if (numa_available() < 0) return;
+    node %= nodes();
+    numa_run_on_node(node);
+    numa_set_preferred(node);
+#else
+    (void) node;
+#endif
+}
+
+void NumaTopology::interleave(void *addr, uint64 len) {
+#ifdef USE_NUMA
+    if (numa_available() < 0 || nodes() < 2 || len == 0) return;
+    //mbind works on whole pages, the pages around a small array are moved with it
+    uint64 page = sysconf(_SC_PAGESIZE);
+    uint64 start = (uint64) addr & ~(page - 1);
+    uint64 end = ((uint64) addr + len + page - 1) & ~(page - 1);
+    struct bitmask *all = numa_all_nodes_ptr;
+    if (mbind((void *) start, end - start, MPOL_INTERLEAVE, all->maskp, all->size + 1, MPOL_MF_MOVE) != 0) {
+        loginfo("can not interleave the index over the numa nodes");
+    }
+#else
+    (void) addr;
+    (void) len;
+#endif
+}
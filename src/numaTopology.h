@@ -0,0 +1,37 @@
+#ifndef NUMATOPOLOGY_H
+#define NUMATOPOLOGY_H
+
+#include <string>
+#include "common.h"
+
+using namespace std;
+
+//placement of the index and the stages on a multi socket node, --numa
+#define NUMA_OFF 0
+//index pages spread over all nodes
+#define NUMA_INTERLEAVE 1
+//one copy of the lookup arrays per node, each consumer reads the copy of its own node
+#define NUMA_REPLICATE 2
+
+/*
+ * Thin layer over libnuma (built with numa=1). Without it the machine is one node
+ * and every call does nothing, so callers do not need to check the build.
+ * Threads are pinned by node, not by core: threads they start later (pugz, pigz)
+ * stay on the same node.
+ */
+class NumaTopology {
+public:
+    //off, interleave or replicate
+    static int parseMode(string mode);
+
+    //memory nodes of this machine, 1 without numa support
+    static int nodes();
+
+    //runs the calling thread on node and allocates its new memory there
+    static void pinThread(int node);
+
+    //spreads [addr, addr + len) over all nodes, pages that are already touched are moved
+    static void interleave(void *addr, uint64 len);
+};
+
+#endif
@@ -11,12 +11,17 @@ void Options::init()
 
 bool Options::validate()
 {
-	if (in.empty() || out.empty()) {
+	//lanes and server jobs carry their own output files
+	if (in.empty() || (out.empty() && laneList.empty() && serveSocket.empty())) {
 		cerr << "please give input file and output file" << endl;
 		exit(-1);
 		//return false;
 	}
-	if (actionInt == 1) {
+	if (actionInt == 1 && !serveSocket.empty()) {
+		//fastq files come with every job
+	} else if (actionInt == 1 && !laneList.empty()) {
+		check_file_valid(laneList);
+	} else if (actionInt == 1) {
 		if (transBarcodeToPos.in1.empty() || transBarcodeToPos.in2.empty()) {
 			cerr << "please give fastq files";
 			exit(-1);
@@ -29,6 +34,16 @@ bool Options::validate()
 		check_file_valid(maskFile);
 	}
 
+	if (barcodeLen > MAX_BARCODE_LEN){
+		cerr << "barcodeLen should <= " << MAX_BARCODE_LEN << ", but get: " << barcodeLen << endl;
+		exit(-1);
+	}
+
+	//the async writer needs at least one block in flight
+	if (ioDepth < 1) {
+		error_exit("ioDepth should >= 1, but get: " + to_string(ioDepth));
+	}
+
 	if (barcodeSegment<=0){
 		cerr << "barcodeSegment should >0, but get: " << barcodeSegment << ". set to be the default value 1"<<endl;
 		barcodeSegment = 1;
@@ -62,6 +77,14 @@ bool Options::getIsSeq500(string& platform){
 	}
 }
 
+void Options::shareThreads(int runs){
+	//each run keeps at least one thread of every kind
+	if (runs <= 1) return;
+	thread = max(1, thread / runs);
+	pugzThread = max(1, pugzThread / runs);
+	decodeThread = max(1, decodeThread / runs);
+}
+
 void Options::setFovRange(string fovRange){
 	vector<string> ranges;
 	split(fovRange, ranges, "_");
@@ -126,6 +126,9 @@ public:
 
     void setFovRange(string fovRange);
 
+    //splits the mapping, pugz and decode threads of one run between runs mapped at the same time
+    void shareThreads(int runs);
+
 public:
     enum actions {
         map_barcode_to_slide = 1, merge_barcode_list = 2, mask_format_change = 3, mask_merge = 4
@@ -159,8 +162,14 @@ public:
     //h5 dims1 size
     int dims1Size;
 
-//    //test numa socket
-//    int numaId;
+    //NUMA_OFF, NUMA_INTERLEAVE or NUMA_REPLICATE of numaTopology.h
+    int numaMode = 0;
+    //HUGE_PAGES_OFF, HUGE_PAGES_THP or HUGE_PAGES_AUTO of hugePages.h
+    int hugePages = 2;
+    //INDEX_LIST, INDEX_COMPACT or INDEX_MPHF of barcodeIndex.h
+    int indexType = 1;
+    //DNB_LAYOUT_ROW or DNB_LAYOUT_TILE of dnbCounter.h
+    int dnbLayout = 0;
 
     //mpi id
     int myRank;
@@ -174,6 +183,48 @@ public:
     //out gz spilt
     bool outGzSpilt;
 
+    //write output files through the async writer (io_uring or pwrite pool)
+    bool asyncWrite = false;
+    //number of output blocks in flight for async write
+    int ioDepth = 8;
+    //open async output files with O_DIRECT
+    bool directIO = false;
+
+    //add the hdf5 shuffle filter in front of deflate when writing h5 masks
+    bool maskShuffle = false;
+
+    //json file for the stage timers and queue depths of a mapping run
+    string profileOut;
+
+    //lane list file for batch mapping, one "in1 in2 out [barcodeReadsCount]" per line
+    string laneList;
+    //number of lanes mapped at the same time in batch mode
+    int laneParallel = 1;
+
+    //unix socket path of the mapping server
+    string serveSocket;
+    //max number of mask indexes kept in memory by the mapping server
+    int maxResidentMasks = 1;
+    //number of mapping jobs the server runs at the same time
+    int serveJobs = 1;
+    //error of the server job this run belongs to, NULL outside of the server
+    JobError *jobError = NULL;
+    //memory limit of one node in bytes, shared by the mpi ranks on it, 0 means no limit
+    long memLimit = 0;
+    //the sizes below are planned by MemoryBudget when memLimit is given
+    //hash buckets of the barcode index, fewer buckets mean longer chains
+    uint32 mapMod = MOD;
+    //log2 bits of each bloom filter table
+    int bloomBits = BLOOM_MAX_BITS;
+    //fastq chunks in flight per input file
+    int fastqPoolParts = 128;
+    //depth of the pugz, pigz and output queues
+    int queueDepth = 256;
+    //build and use .gzidx checkpoint indexes of gz inputs
+    bool gzIndex = false;
+    //threads decoding one bgzf or indexed gz input
+    int decodeThread = 1;
+
     string rcString;
     int rc;
     DrawHeatMapOptions drawHeatMap;
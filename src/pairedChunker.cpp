@@ -0,0 +1,132 @@
+#include "pairedChunker.h"
+#include <string.h>
+#include <unistd.h>
+#include "util.h"
+
+PairedChunker::PairedChunker(dsrc::fq::FastqDataPool *leftPool, dsrc::fq::FastqDataPool *rightPool,
+                             PugzQueue *leftQueue, PugzQueue *rightQueue, atomic_int *leftDone,
+                             atomic_int *rightDone) {
+    mLeftPool = leftPool;
+    mRightPool = rightPool;
+    mLeft = MateStream();
+    mRight = MateStream();
+    mLeft.queue = leftQueue;
+    mLeft.done = leftDone;
+    mRight.queue = rightQueue;
+    mRight.done = rightDone;
+    mEof = false;
+}
+
+PairedChunker::~PairedChunker() {
+    //blocks behind a stop on uneven inputs are dropped here
+    MateStream *mates[2] = {&mLeft, &mRight};
+    for (int i = 0; i < 2; i++) {
+        if (mates[i]->block.first) delete[] mates[i]->block.first;
+        pair<char *, int> rest;
+        while (mates[i]->queue->try_dequeue(rest)) {
+            delete[] rest.first;
+        }
+    }
+}
+
+bool PairedChunker::fetch(MateStream &mate) {
+    if (mate.block.first != NULL && mate.pos < mate.block.second) return true;
+    if (mate.block.first != NULL) {
+        flush(mate);
+        delete[] mate.block.first;
+        mate.block.first = NULL;
+    }
+    while (true) {
+        pair<char *, int> now;
+        while (mate.queue->try_dequeue(now) == 0) {
+            if (mate.queue->size_approx() == 0 && *mate.done == 1) return false;
+            usleep(100);
+        }
+        if (now.second > 0) {
+            mate.block = now;
+            mate.copied = 0;
+            mate.pos = 0;
+            return true;
+        }
+        delete[] now.first;
+    }
+}
+
+void PairedChunker::flush(MateStream &mate) {
+    int n = mate.pos - mate.copied;
+    if (n > 0) {
+        memcpy(mate.dst + mate.size, mate.block.first + mate.copied, n);
+        mate.size += n;
+        mate.copied = mate.pos;
+    }
+}
+
+bool PairedChunker::nextRecord(MateStream &mate) {
+    int lines = 0;
+    bool any = false;
+    while (lines < 4) {
+        //a last record without its final newline still counts
+        if (!fetch(mate)) return any;
+        char *p = mate.block.first + mate.pos;
+        char *nl = (char *) memchr(p, '\n', mate.block.second - mate.pos);
+        int n = nl ? nl + 1 - p : mate.block.second - mate.pos;
+        //one byte is kept for the newline a last record may lack
+        if (filled(mate) + n >= mate.capacity) {
+            error_exit("a fastq record does not fit into a chunk of " + to_string(mate.capacity) + " bytes");
+        }
+        mate.pos += n;
+        any = true;
+        if (nl) lines++;
+    }
+    return true;
+}
+
+ChunkPair *PairedChunker::next() {
+    if (mEof) return NULL;
+    dsrc::fq::FastqDataChunk *leftPart = NULL;
+    mLeftPool->Acquire(leftPart);
+    dsrc::fq::FastqDataChunk *rightPart = NULL;
+    mRightPool->Acquire(rightPart);
+    mLeft.dst = leftPart->data.Pointer();
+    mLeft.size = 0;
+    mLeft.capacity = leftPart->data.Size();
+    mRight.dst = rightPart->data.Pointer();
+    mRight.size = 0;
+    mRight.capacity = rightPart->data.Size();
+    //same headroom for the last record as the chunk reader keeps
+    uint64 leftLimit = mLeft.capacity - tmpSwapBufferSize;
+    uint64 rightLimit = mRight.capacity - tmpSwapBufferSize;
+    uint64 leftBytes = 0;
+    uint64 rightBytes = 0;
+    while (leftBytes < leftLimit && rightBytes < rightLimit) {
+        bool left = nextRecord(mLeft);
+        bool right = nextRecord(mRight);
+        if (!left || !right) {
+            if (left != right) {
+                cerr << "read1 and read2 have different numbers of records, the rest of read"
+                     << (left ? 1 : 2) << " is skipped" << endl;
+            }
+            mEof = true;
+            break;
+        }
+        leftBytes = filled(mLeft);
+        rightBytes = filled(mRight);
+    }
+    if (mLeft.block.first) flush(mLeft);
+    if (mRight.block.first) flush(mRight);
+    if (leftBytes == 0) {
+        mLeftPool->Release(leftPart);
+        mRightPool->Release(rightPart);
+        return NULL;
+    }
+    //chunk sizes leave out the last newline like the chunk readers do, only a real newline is left out,
+    //a last record without one gets it here so its last byte stays in the chunk
+    if (mLeft.dst[leftBytes - 1] != '\n') mLeft.dst[leftBytes++] = '\n';
+    if (rightBytes > 0 && mRight.dst[rightBytes - 1] != '\n') mRight.dst[rightBytes++] = '\n';
+    leftPart->size = leftBytes - 1;
+    rightPart->size = rightBytes > 0 ? rightBytes - 1 : 0;
+    ChunkPair *chunkPair = new ChunkPair;
+    chunkPair->leftpart = leftPart;
+    chunkPair->rightpart = rightPart;
+    return chunkPair;
+}
@@ -0,0 +1,65 @@
+#ifndef PAIREDCHUNKER_H
+#define PAIREDCHUNKER_H
+
+#include <utility>
+#include "common.h"
+#include "FastqIo.h"
+#include "read.h"
+#include "readerwriterqueue.h"
+#include "atomicops.h"
+
+using namespace std;
+
+typedef moodycamel::ReaderWriterQueue<pair<char *, int>> PugzQueue;
+
+/*
+ * Cuts the pugz output of read1 and read2 into chunk pairs with the same records.
+ * Both streams are walked one record at a time in lock step, so a pair is closed at
+ * the same record count on both sides and needs no line counting or carry buffers
+ * afterwards. Decoded blocks are copied straight from the queue into the chunks, a
+ * block that spans two chunks is kept and continued by the next pair.
+ */
+class PairedChunker {
+public:
+    PairedChunker(dsrc::fq::FastqDataPool *leftPool, dsrc::fq::FastqDataPool *rightPool, PugzQueue *leftQueue,
+                  PugzQueue *rightQueue, atomic_int *leftDone, atomic_int *rightDone);
+
+    ~PairedChunker();
+
+    //NULL once one of the mates has no records left
+    ChunkPair *next();
+
+private:
+    struct MateStream {
+        PugzQueue *queue;
+        atomic_int *done;
+        //decoded block being cut, bytes before copied are in a chunk, bytes before pos are scanned
+        pair<char *, int> block;
+        int copied;
+        int pos;
+        //chunk being filled and its bytes, scanned bytes of the block not included
+        dsrc::uchar *dst;
+        uint64 size;
+        uint64 capacity;
+    };
+
+    //waits for the next block when the current one is cut, false at the end of the stream
+    bool fetch(MateStream &mate);
+
+    //moves the scanned bytes of the block into the chunk
+    void flush(MateStream &mate);
+
+    //scans one record, false when the stream ended before it
+    bool nextRecord(MateStream &mate);
+
+    uint64 filled(MateStream &mate) { return mate.size + mate.pos - mate.copied; }
+
+private:
+    dsrc::fq::FastqDataPool *mLeftPool;
+    dsrc::fq::FastqDataPool *mRightPool;
+    MateStream mLeft;
+    MateStream mRight;
+    bool mEof;
+};
+
+#endif
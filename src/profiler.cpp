@@ -0,0 +1,154 @@
+#include "profiler.h"
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <atomic>
+#include "util.h"
+
+static const char *PROFILE_STAGE_NAMES[PROFILE_STAGE_NUM] = {"read", "decompress", "wait", "parse", "lookup",
+                                                            "mismatch", "format", "compress", "write"};
+
+static atomic<uint64> gProfilerIds(0);
+
+//a thread gets a slot of its profiler on the first timed stage, the slots belong to the profiler
+struct ProfileSlotCache {
+    uint64 profilerId = 0;
+    ProfileSlot *slot = NULL;
+};
+
+static thread_local ProfileSlotCache tSlotCache;
+
+Profiler::Profiler(string outFile, int rank, bool verbose) {
+    mId = ++gProfilerIds;
+    mOutFile = outFile;
+    mRank = rank;
+    mVerbose = verbose;
+    mTime0 = chrono::steady_clock::now();
+    mTick0 = ticks();
+    mRunning = true;
+    mSampler = new thread(&Profiler::sampleTask, this);
+}
+
+Profiler::~Profiler() {
+    stop();
+    for (int i = 0; i < mSlots.size(); i++) {
+        delete mSlots[i];
+    }
+}
+
+void Profiler::stop() {
+    {
+        unique_lock<mutex> lock(mMtx);
+        if (!mRunning) return;
+        mRunning = false;
+        mCv.notify_all();
+    }
+    mSampler->join();
+    delete mSampler;
+    mSampler = NULL;
+    sample();
+    string report = snapshot();
+    if (!mOutFile.empty()) {
+        ofstream writer(mOutFile);
+        writer << report << endl;
+        writer.close();
+        if (writer.fail()) {
+            loginfo("can not write profile to " + mOutFile);
+        }
+    } else if (mVerbose) {
+        loginfo("profile " + report);
+    }
+    unique_lock<mutex> lock(mMtx);
+    mGauges.clear();
+}
+
+void Profiler::addGauge(string name, function<long()> depth) {
+    unique_lock<mutex> lock(mMtx);
+    ProfileGauge gauge;
+    gauge.name = name;
+    gauge.depth = depth;
+    gauge.samples = 0;
+    gauge.sum = 0;
+    gauge.max = 0;
+    gauge.last = 0;
+    mGauges.push_back(gauge);
+}
+
+//only the owning thread writes a slot, snapshots read it with relaxed loads
+void Profiler::record(ProfileStage stage, uint64 ticks, uint64 items) {
+    ProfileSlot *slot = tSlotCache.slot;
+    if (tSlotCache.profilerId != mId) {
+        slot = new ProfileSlot;
+        memset(slot, 0, sizeof(ProfileSlot));
+        unique_lock<mutex> lock(mMtx);
+        mSlots.push_back(slot);
+        tSlotCache.profilerId = mId;
+        tSlotCache.slot = slot;
+    }
+    __atomic_store_n(&slot->ticks[stage], slot->ticks[stage] + ticks, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->calls[stage], slot->calls[stage] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->items[stage], slot->items[stage] + items, __ATOMIC_RELAXED);
+}
+
+void Profiler::sample() {
+    unique_lock<mutex> lock(mMtx);
+    for (int i = 0; i < mGauges.size(); i++) {
+        ProfileGauge &gauge = mGauges[i];
+        long depth = gauge.depth();
+        gauge.samples++;
+        gauge.sum += depth;
+        gauge.max = max(gauge.max, depth);
+        gauge.last = depth;
+    }
+}
+
+void Profiler::sampleTask() {
+    auto lastReport = chrono::steady_clock::now();
+    while (true) {
+        {
+            unique_lock<mutex> lock(mMtx);
+            mCv.wait_for(lock, chrono::milliseconds(PROFILE_SAMPLE_MS));
+            if (!mRunning) break;
+        }
+        sample();
+        if (mVerbose && chrono::steady_clock::now() - lastReport >= chrono::seconds(PROFILE_REPORT_SEC)) {
+            lastReport = chrono::steady_clock::now();
+            loginfo("profile " + snapshot());
+        }
+    }
+}
+
+string Profiler::snapshot() {
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - mTime0).count();
+    uint64 tickSpan = ticks() - mTick0;
+    double secondsPerTick = tickSpan > 0 ? elapsed / tickSpan : 0;
+    ProfileSlot total;
+    unique_lock<mutex> lock(mMtx);
+    memset(&total, 0, sizeof(ProfileSlot));
+    for (int i = 0; i < mSlots.size(); i++) {
+        for (int s = 0; s < PROFILE_STAGE_NUM; s++) {
+            total.ticks[s] += __atomic_load_n(&mSlots[i]->ticks[s], __ATOMIC_RELAXED);
+            total.calls[s] += __atomic_load_n(&mSlots[i]->calls[s], __ATOMIC_RELAXED);
+            total.items[s] += __atomic_load_n(&mSlots[i]->items[s], __ATOMIC_RELAXED);
+        }
+    }
+    stringstream ss;
+    ss.precision(6);
+    ss << "{\"rank\":" << mRank << ",\"elapsed\":" << elapsed << ",\"stages\":{";
+    for (int s = 0; s < PROFILE_STAGE_NUM; s++) {
+        double seconds = total.ticks[s] * secondsPerTick;
+        //busy is the average number of threads in the stage, compare it with the threads the stage has
+        ss << (s ? "," : "") << "\"" << PROFILE_STAGE_NAMES[s] << "\":{\"seconds\":" << seconds << ",\"busy\":"
+           << (elapsed > 0 ? seconds / elapsed : 0) << ",\"calls\":" << total.calls[s] << ",\"items\":"
+           << total.items[s] << "}";
+    }
+    ss << "},\"queues\":{";
+    for (int i = 0; i < mGauges.size(); i++) {
+        ProfileGauge &gauge = mGauges[i];
+        ss << (i ? "," : "") << "\"" << gauge.name << "\":{\"avg\":"
+           << (gauge.samples ? gauge.sum / gauge.samples : 0) << ",\"max\":" << gauge.max << ",\"last\":"
+           << gauge.last << ",\"samples\":" << gauge.samples << "}";
+    }
+    ss << "}}";
+    return ss.str();
+}
@@ -0,0 +1,157 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "common.h"
+
+using namespace std;
+
+enum ProfileStage {
+    //fastq chunk reading, gzip decompression is part of it when pugz is off
+    PROFILE_READ = 0,
+    //pugz decompression threads
+    PROFILE_DECOMPRESS,
+    //mapping threads waiting for chunks
+    PROFILE_WAIT,
+    //fastq chunk parsing and read pair building
+    PROFILE_PARSE,
+    //exact barcode lookups
+    PROFILE_LOOKUP,
+    //mismatch search of barcodes without an exact hit
+    PROFILE_MISMATCH,
+    //output record formatting
+    PROFILE_FORMAT,
+    //pigz thread, including its waits for output buffers
+    PROFILE_COMPRESS,
+    //writer threads handing buffers to the file, pigz or rank 0
+    PROFILE_WRITE,
+    PROFILE_STAGE_NUM
+};
+
+//queue depths are sampled this often
+#define PROFILE_SAMPLE_MS 50
+//a snapshot is logged this often with --verbose
+#define PROFILE_REPORT_SEC 10
+
+struct ProfileSlot {
+    uint64 ticks[PROFILE_STAGE_NUM];
+    uint64 calls[PROFILE_STAGE_NUM];
+    uint64 items[PROFILE_STAGE_NUM];
+};
+
+struct ProfileGauge {
+    string name;
+    function<long()> depth;
+    uint64 samples;
+    double sum;
+    long max;
+    long last;
+};
+
+/*
+ * Stage timers and queue depth sampling of one mapping run.
+ * Each run has its own profiler, its stage threads bind to it with current(), so lanes and server
+ * jobs that run at the same time are counted apart. Threads that are not bound do not read the clock.
+ * Every thread accumulates into its own slot, so timing takes no lock. Ticks are rdtsc on x86 and
+ * are converted to seconds against steady_clock when a snapshot is taken.
+ * The report is json, written to --profileOut at the end of the run and logged periodically with --verbose.
+ */
+class Profiler {
+public:
+    Profiler(string outFile, int rank, bool verbose);
+
+    ~Profiler();
+
+    //writes or logs the report, the bound threads must be done by then
+    void stop();
+
+    //sampled until stop(), depth must stay callable until then
+    void addGauge(string name, function<long()> depth);
+
+    static inline uint64 ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    //ticks for the profiler of the calling thread, 0 without one
+    static inline uint64 now() {
+        return current() ? ticks() : 0;
+    }
+
+    //the profiler the calling thread records into, NULL when its run is not profiled
+    static inline Profiler *&current() {
+        static thread_local Profiler *profiler = NULL;
+        return profiler;
+    }
+
+    static inline void add(ProfileStage stage, uint64 ticks, uint64 items = 1) {
+        Profiler *profiler = current();
+        if (profiler) profiler->record(stage, ticks, items);
+    }
+
+    void record(ProfileStage stage, uint64 ticks, uint64 items);
+
+    string snapshot();
+
+private:
+    void sampleTask();
+
+    void sample();
+
+private:
+    //tells the slot a thread cached for an earlier profiler from the one of this profiler
+    uint64 mId;
+    bool mRunning;
+    mutex mMtx;
+    condition_variable mCv;
+    vector<ProfileSlot *> mSlots;
+    vector<ProfileGauge> mGauges;
+    thread *mSampler;
+    string mOutFile;
+    int mRank;
+    bool mVerbose;
+    uint64 mTick0;
+    chrono::steady_clock::time_point mTime0;
+};
+
+//times one stage from construction to stop() or destruction
+class ProfileTimer {
+public:
+    ProfileTimer(ProfileStage stage, uint64 items = 1) {
+        mProfiler = Profiler::current();
+        mStage = stage;
+        mItems = items;
+        mStart = mProfiler ? Profiler::ticks() : 0;
+    }
+
+    ~ProfileTimer() { stop(); }
+
+    inline void stop() {
+        if (mProfiler) {
+            mProfiler->record(mStage, Profiler::ticks() - mStart, mItems);
+            mProfiler = NULL;
+        }
+    }
+
+    inline void setItems(uint64 items) { mItems = items; }
+
+private:
+    Profiler *mProfiler;
+    ProfileStage mStage;
+    uint64 mItems;
+    uint64 mStart;
+};
+
+#endif
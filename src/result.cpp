@@ -64,7 +64,10 @@ Result *Result::merge(vector<Result *> &list) {
         result->mBarcodeProcessor->filterQuery += list[i]->mBarcodeProcessor->filterQuery;
 
 
-        if (!list[i]->mOptions->transBarcodeToPos.mappedDNBOutFile.empty()) {
+        if (list[i]->mBarcodeProcessor->mDnbCounter != NULL) {
+            //all threads counted into the same table, nothing to merge
+            result->mBarcodeProcessor->mDnbCounter = list[i]->mBarcodeProcessor->mDnbCounter;
+        } else if (!list[i]->mOptions->transBarcodeToPos.mappedDNBOutFile.empty()) {
             unordered_map<uint64, int>::iterator mergeIter;
             for (auto iter = list[i]->mBarcodeProcessor->mDNB.begin();
                  iter != list[i]->mBarcodeProcessor->mDNB.end(); iter++) {
@@ -159,10 +162,16 @@ void Result::setBarcodeProcessor(unordered_map<uint64, Position1> *bpmap) {
 //    mBarcodeProcessor = new BarcodeProcessor(mOptions, headNum, hashHead, hashMap, bloomFilter);
 //}
 
-void Result::setBarcodeProcessorHashTableOneArrayWithBloomFilter(int *bpmap_head, int *bpmap_nxt,
-                                                                 bpmap_key_value *position_all,
-                                                                 BloomFilter *bloomFilter) {
-    mBarcodeProcessor = new BarcodeProcessor(mOptions, bpmap_head, bpmap_nxt, position_all, bloomFilter);
+void Result::setBarcodeProcessorHashTableOneArrayWithBloomFilter(BarcodeIndex *barcodeIndex, BloomFilter *bloomFilter) {
+    mBarcodeProcessor = new BarcodeProcessor(mOptions, barcodeIndex, bloomFilter);
+}
+
+void Result::setBarcodeProcessorHashTableOneArrayWithBloomFilter(const NumaIndexCopy &index) {
+    if (index.wideIndex != NULL) {
+        mBarcodeProcessor = new BarcodeProcessor(mOptions, index.wideIndex, index.bloomFilter);
+    } else {
+        mBarcodeProcessor = new BarcodeProcessor(mOptions, index.index, index.bloomFilter);
+    }
 }
 
 void Result::setBarcodeProcessor() {
@@ -37,8 +37,10 @@ public:
 //    void setBarcodeProcessor(int headNum, int *hashHead, node *hashMap, uint64 *bloomFilter);
 
     void
-    setBarcodeProcessorHashTableOneArrayWithBloomFilter(int *bpmap_head, int *bpmap_nxt, bpmap_key_value *position_all,
-                                                        BloomFilter *bloomFilter);
+    setBarcodeProcessorHashTableOneArrayWithBloomFilter(BarcodeIndex *barcodeIndex, BloomFilter *bloomFilter);
+
+    //the wide index of the copy when the barcodes are longer than NARROW_BARCODE_LEN, the narrow one otherwise
+    void setBarcodeProcessorHashTableOneArrayWithBloomFilter(const NumaIndexCopy &index);
 
 
 private:
@@ -9,6 +9,8 @@
 #include <algorithm>
 #include <time.h>
 #include <mutex>
+#include <atomic>
+#include <stdexcept>
 #include "common.h"
 
 using namespace std;
@@ -60,7 +62,41 @@ inline int split(const string &str, vector<string> &ret_, string sep = ",") {
     return 0;
 }
 
+//a thread that sets this gets a runtime_error from error_exit instead of ending the process,
+//the mapping server answers the failed job and keeps running
+inline bool &errorExitThrows() {
+    static thread_local bool throws = false;
+    return throws;
+}
+
+//first error of one mapping server job, shared by all threads of the job
+struct JobError {
+    mutex mtx;
+    string msg;
+    atomic_bool failed{false};
+
+    void set(const string &error) {
+        lock_guard<mutex> lock(mtx);
+        if (failed) return;
+        msg = error;
+        failed = true;
+    }
+};
+
+//the job a pipeline thread works for, error_exit records into it and throws
+inline JobError *&jobErrorSink() {
+    static thread_local JobError *sink = NULL;
+    return sink;
+}
+
+//records an error the thread can go on from, e.g. a broken gz input that reads as eof
+inline void recordJobError(const string &msg) {
+    if (jobErrorSink()) jobErrorSink()->set(msg);
+}
+
 inline void error_exit(const string &msg) {
+    recordJobError(msg);
+    if (errorExitThrows() || jobErrorSink()) throw runtime_error(msg);
     cerr << "Error: " << msg << endl;
     exit(-1);
 }
@@ -188,13 +224,15 @@ inline string reverseComplement(const string &str) {
 	G		71	01000|11|1	3
 	T		84	01010|10|0	2
 */
-inline uint64 seqEncode(const char *sequence, const int &seqStart, const int &seqLen, bool isRC = false) {
-    uint64 n = 0;
-    uint64 k = 0;
+//2 bits per base, Key is uint64 up to NARROW_BARCODE_LEN bases and uint128 up to MAX_BARCODE_LEN
+template<class Key = uint64>
+inline Key seqEncode(const char *sequence, const int &seqStart, const int &seqLen, bool isRC = false) {
+    Key n = 0;
+    Key k = 0;
     for (int i = seqStart; i < seqLen; i++) {
         n = (sequence[i] & 6) >> 1; //6:  ob00000110
         if (isRC) {
-            n = RC_BASE[n];
+            n = RC_BASE[(int) n];
             k |= (n << ((seqLen - i - 1) * 2));
         } else {
             k |= (n << (i * 2));
@@ -203,7 +241,8 @@ inline uint64 seqEncode(const char *sequence, const int &seqStart, const int &se
     return k;
 }
 
-inline string seqDecode(const uint64 &seqInt, const int &seqLen) {
+template<class Key>
+inline string seqDecode(const Key &seqInt, const int &seqLen) {
     uint8_t tint;
     string seqs = "";
     for (int i = 0; i < seqLen; i++) {
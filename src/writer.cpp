@@ -3,16 +3,40 @@
 #include "fastqreader.h"
 #include <string.h>
 
+#define ASYNC_DEFLATE_BUF_SIZE (1 << 20)
+
 Writer::Writer(string filename, int compression) {
     mCompression = compression;
     mFilename = filename;
     mZipFile = NULL;
     mZipped = false;
     haveToClose = true;
+    mAsync = NULL;
+    mDeflate = NULL;
+    mDeflateBuf = NULL;
+    mIoDepth = 0;
+    mDirectIO = false;
+    init();
+}
+
+Writer::Writer(string filename, int compression, int ioDepth, bool directIO) {
+    mCompression = compression;
+    mFilename = filename;
+    mZipFile = NULL;
+    mZipped = false;
+    haveToClose = true;
+    mAsync = NULL;
+    mDeflate = NULL;
+    mDeflateBuf = NULL;
+    mIoDepth = ioDepth;
+    mDirectIO = directIO;
     init();
 }
 
 Writer::Writer(ofstream *stream) {
+    mAsync = NULL;
+    mDeflate = NULL;
+    mDeflateBuf = NULL;
     mZipFile = NULL;
     mZipped = false;
     mOutStream = stream;
@@ -20,6 +44,9 @@ Writer::Writer(ofstream *stream) {
 }
 
 Writer::Writer(gzFile gzfile) {
+    mAsync = NULL;
+    mDeflate = NULL;
+    mDeflateBuf = NULL;
     mOutStream = NULL;
     mZipFile = gzfile;
     mZipped = true;
@@ -37,6 +64,23 @@ string Writer::filename() {
 }
 
 void Writer::init() {
+    if (mIoDepth > 0) {
+        mOutStream = NULL;
+        mAsync = new AsyncFileWriter(mFilename, mIoDepth, mDirectIO);
+        if (ends_with(mFilename, ".gz")) {
+            mDeflate = new z_stream;
+            memset(mDeflate, 0, sizeof(z_stream));
+            //windowBits 15 + 16 gives a gzip wrapper, same as gzopen
+            if (deflateInit2(mDeflate, mCompression, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                error_exit("deflateInit2 failed for " + mFilename);
+            }
+            mDeflateBuf = new char[ASYNC_DEFLATE_BUF_SIZE];
+            mZipped = true;
+        } else {
+            mZipped = false;
+        }
+        return;
+    }
     if (ends_with(mFilename, ".gz")) {
         mZipFile = gzopen(mFilename.c_str(), "w");
         gzsetparams(mZipFile, mCompression, Z_DEFAULT_STRATEGY);
@@ -50,11 +94,33 @@ void Writer::init() {
     }
 }
 
+bool Writer::asyncWrite(const char *strdata, size_t size, int flush) {
+    if (mDeflate == NULL) {
+        return mAsync->write(strdata, size);
+    }
+    bool status = true;
+    mDeflate->next_in = (Bytef *) strdata;
+    mDeflate->avail_in = size;
+    do {
+        mDeflate->next_out = (Bytef *) mDeflateBuf;
+        mDeflate->avail_out = ASYNC_DEFLATE_BUF_SIZE;
+        int ret = deflate(mDeflate, flush);
+        if (ret == Z_STREAM_ERROR) return false;
+        size_t have = ASYNC_DEFLATE_BUF_SIZE - mDeflate->avail_out;
+        if (have > 0) status &= mAsync->write(mDeflateBuf, have);
+    } while (mDeflate->avail_out == 0);
+    return status;
+}
+
 bool Writer::writeLine(string &linestr) {
     const char *line = linestr.c_str();
     size_t size = linestr.length();
     size_t written;
     bool status;
+    if (mAsync) {
+        status = asyncWrite(line, size);
+        return asyncWrite("\n", 1) && status;
+    }
     if (mZipped) {
         written = gzwrite(mZipFile, line, size);
         gzputc(mZipFile, '\n');
@@ -73,6 +139,9 @@ bool Writer::writeString(string &str) {
     size_t size = str.length();
     size_t written;
     bool status;
+    if (mAsync) {
+        return asyncWrite(strdata, size);
+    }
     if (mZipped) {
         written = gzwrite(mZipFile, strdata, size);
         status = size == written;
@@ -87,6 +156,9 @@ bool Writer::writeString(string &str) {
 bool Writer::write(char *strdata, size_t size) {
     size_t written;
     bool status;
+    if (mAsync) {
+        return asyncWrite(strdata, size);
+    }
 
     if (mZipped) {
         written = gzwrite(mZipFile, strdata, size);
@@ -99,6 +171,24 @@ bool Writer::write(char *strdata, size_t size) {
 }
 
 void Writer::close() {
+    if (mAsync) {
+        if (mDeflate) {
+            asyncWrite(NULL, 0, Z_FINISH);
+            deflateEnd(mDeflate);
+            delete mDeflate;
+            mDeflate = NULL;
+            delete[] mDeflateBuf;
+            mDeflateBuf = NULL;
+        }
+        if (!mAsync->close()) {
+            //close also runs from destructors, so a server job gets the error without a throw
+            recordJobError("async output of " + mFilename + " is incomplete");
+            cerr << "Error: async output of " << mFilename << " is incomplete" << endl;
+        }
+        delete mAsync;
+        mAsync = NULL;
+        return;
+    }
     if (mZipped) {
         if (mZipFile) {
             gzflush(mZipFile, Z_FINISH);
@@ -106,13 +196,13 @@ void Writer::close() {
             mZipFile = NULL;
         }
     } else if (mOutStream) {
+        //only streams opened by init() get here, the file is closed so a long running process does not keep it
         if (mOutStream->is_open()) {
             mOutStream->flush();
-            //TODO: following two lines will cause crash
-            //mOutStream->close();
-            //delete mOutStream;
-            mOutStream = NULL;
+            mOutStream->close();
         }
+        delete mOutStream;
+        mOutStream = NULL;
     }
 }
 
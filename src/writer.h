@@ -9,6 +9,7 @@
   #include "zlib/zlib.h"
 #endif
 #include "common.h"
+#include "asyncWriter.h"
 #include <iostream>
 #include <fstream>
 
@@ -17,6 +18,7 @@ using namespace std;
 class Writer{
 public:
 	Writer(string filename, int compression = 3);
+	Writer(string filename, int compression, int ioDepth, bool directIO);
 	Writer(ofstream* stream);
 	Writer(gzFile gzfile);
 	~Writer();
@@ -32,6 +34,7 @@ public:
 private:
 	void init();
 	void close();
+	bool asyncWrite(const char* strdata, size_t size, int flush = Z_NO_FLUSH);
 
 private:
 	string mFilename;
@@ -40,6 +43,12 @@ private:
 	bool mZipped;
 	int mCompression;
 	bool haveToClose;
+	//async output, gzip stream is compressed here and handed over as plain bytes
+	AsyncFileWriter* mAsync;
+	z_stream* mDeflate;
+	char* mDeflateBuf;
+	int mIoDepth;
+	bool mDirectIO;
 };
 
 #endif
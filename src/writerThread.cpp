@@ -2,6 +2,7 @@
 
 WriterThread::WriterThread(string filename, int compressionLevel) {
     compression = compressionLevel;
+    mOptions = NULL;
 
     mWriter1 = NULL;
 
@@ -12,12 +13,7 @@ WriterThread::WriterThread(string filename, int compressionLevel) {
     wSum = 0;
     cSum = 0;
 
-    mRingBuffer = new char *[PACK_NUM_LIMIT];
-    memset(mRingBuffer, 0, sizeof(char *) * PACK_NUM_LIMIT);
-    mRingBufferSizes = new size_t[PACK_NUM_LIMIT];
-    mRingBufferTags = new int[PACK_NUM_LIMIT];
-    memset(mRingBufferSizes, 0, sizeof(size_t) * PACK_NUM_LIMIT);
-    memset(mRingBufferTags, 0, sizeof(int) * PACK_NUM_LIMIT);
+    initRing(256);
     initWriter(filename);
 }
 
@@ -34,18 +30,28 @@ WriterThread::WriterThread(string filename, Options *options, int compressionLev
     wSum = 0;
     cSum = 0;
 
-    mRingBuffer = new char *[PACK_NUM_LIMIT];
-    memset(mRingBuffer, 0, sizeof(char *) * PACK_NUM_LIMIT);
-    mRingBufferSizes = new size_t[PACK_NUM_LIMIT];
-    mRingBufferTags = new int[PACK_NUM_LIMIT];
-    memset(mRingBufferSizes, 0, sizeof(size_t) * PACK_NUM_LIMIT);
-    memset(mRingBufferTags, 0, sizeof(int) * PACK_NUM_LIMIT);
+    initRing(options != NULL ? options->queueDepth : 256);
     initWriter(filename);
 }
 
 WriterThread::~WriterThread() {
     cleanup();
-    delete mRingBuffer;
+    delete[] mRingBuffer;
+    delete[] mRingBufferSizes;
+    delete[] mRingBufferTags;
+}
+
+//input() blocks while depth buffers are queued, the ring only needs to hold that many
+void WriterThread::initRing(int depth) {
+    mDepth = max(1, depth);
+    mRingSize = 1;
+    while (mRingSize < mDepth) mRingSize <<= 1;
+    mRingBuffer = new char *[mRingSize];
+    memset(mRingBuffer, 0, sizeof(char *) * mRingSize);
+    mRingBufferSizes = new size_t[mRingSize];
+    mRingBufferTags = new int[mRingSize];
+    memset(mRingBufferSizes, 0, sizeof(size_t) * mRingSize);
+    memset(mRingBufferTags, 0, sizeof(int) * mRingSize);
 }
 
 bool WriterThread::isCompleted() {
@@ -62,11 +68,13 @@ void WriterThread::output() {
         usleep(100);
     }
     while (mOutputCounter < mInputCounter) {
-        mWriter1->write(mRingBuffer[mOutputCounter], mRingBufferSizes[mOutputCounter]);
-        delete mRingBuffer[mOutputCounter];
-        wSum += mRingBufferSizes[mOutputCounter];
+        long slot = mOutputCounter & (mRingSize - 1);
+        ProfileTimer writeTimer(PROFILE_WRITE, mRingBufferSizes[slot]);
+        mWriter1->write(mRingBuffer[slot], mRingBufferSizes[slot]);
+        delete mRingBuffer[slot];
+        wSum += mRingBufferSizes[slot];
         cSum++;
-        mRingBuffer[mOutputCounter] = NULL;
+        mRingBuffer[slot] = NULL;
         mOutputCounter++;
         //cout << "Writer thread: " <<  mFilename <<  " mOutputCounter: " << mOutputCounter << " mInputCounter: " << mInputCounter << endl;
     }
@@ -77,13 +85,14 @@ void WriterThread::output(MPI_Comm communicator) {
         usleep(100);
     }
     while (mOutputCounter < mInputCounter) {
-
-        int tmpSize = mRingBufferSizes[mOutputCounter];
+        long slot = mOutputCounter & (mRingSize - 1);
+        ProfileTimer writeTimer(PROFILE_WRITE, mRingBufferSizes[slot]);
+        int tmpSize = mRingBufferSizes[slot];
         MPI_Send(&(tmpSize), 1, MPI_INT, 0, 0, MPI_COMM_WORLD);
-        MPI_Send(mRingBuffer[mOutputCounter], tmpSize, MPI_CHAR, 0, 1, MPI_COMM_WORLD);
+        MPI_Send(mRingBuffer[slot], tmpSize, MPI_CHAR, 0, 1, MPI_COMM_WORLD);
 
-        delete mRingBuffer[mOutputCounter];
-        mRingBuffer[mOutputCounter] = NULL;
+        delete mRingBuffer[slot];
+        mRingBuffer[slot] = NULL;
         mOutputCounter++;
     }
 }
@@ -94,47 +103,62 @@ void WriterThread::output(moodycamel::ReaderWriterQueue<std::pair<int, std::pair
         usleep(100);
     }
     while (mOutputCounter < mInputCounter) {
-//        mWriter1->write(mRingBuffer[mOutputCounter], mRingBufferSizes[mOutputCounter]);
-//        delete mRingBuffer[mOutputCounter];
+        long slot = mOutputCounter & (mRingSize - 1);
+        ProfileTimer writeTimer(PROFILE_WRITE, mRingBufferSizes[slot]);
+//        mWriter1->write(mRingBuffer[slot], mRingBufferSizes[slot]);
+//        delete mRingBuffer[slot];
 
-        auto pos = mRingBuffer[mOutputCounter];
-        auto size = mRingBufferSizes[mOutputCounter];
-        auto tag = mRingBufferTags[mOutputCounter];
+        auto pos = mRingBuffer[slot];
+        auto size = mRingBufferSizes[slot];
+        auto tag = mRingBufferTags[slot];
 
-        while (Q->try_enqueue({tag, {mRingBuffer[mOutputCounter], mRingBufferSizes[mOutputCounter]}}) == 0) {
+        while (Q->try_enqueue({tag, {mRingBuffer[slot], mRingBufferSizes[slot]}}) == 0) {
            // printf("waiting to push a chunk to pigz queue\n");
             usleep(100);
         }
-        wSum += mRingBufferSizes[mOutputCounter];
+        wSum += mRingBufferSizes[slot];
         cSum++;
 //        printf("push a chunk to pigz queue, queue size %d\n", Q->size_approx());
-        mRingBuffer[mOutputCounter] = NULL;
+        mRingBuffer[slot] = NULL;
         mOutputCounter++;
         //cout << "Writer thread: " <<  mFilename <<  " mOutputCounter: " << mOutputCounter << " mInputCounter: " << mInputCounter << endl;
     }
 }
 
+void WriterThread::discard() {
+    if (mOutputCounter >= mInputCounter) {
+        usleep(100);
+    }
+    while (mOutputCounter < mInputCounter) {
+        long slot = mOutputCounter & (mRingSize - 1);
+        delete mRingBuffer[slot];
+        mRingBuffer[slot] = NULL;
+        mOutputCounter++;
+    }
+}
 
 void WriterThread::inputFromMerge(char *data, size_t size) {
-    while(mInputCounter - mOutputCounter >= 256){
+    while(mInputCounter - mOutputCounter >= mDepth){
         usleep(100);
     }
 //    mtx.lock();
-    mRingBuffer[mInputCounter] = data;
-    mRingBufferSizes[mInputCounter] = size;
-    mRingBufferTags[mInputCounter] = 2;
+    long slot = mInputCounter & (mRingSize - 1);
+    mRingBuffer[slot] = data;
+    mRingBufferSizes[slot] = size;
+    mRingBufferTags[slot] = 2;
     mInputCounter++;
 //    mtx.unlock();
 }
 
 void WriterThread::input(char *data, size_t size) {
-    while(mInputCounter - mOutputCounter >= 256){
+    while(mInputCounter - mOutputCounter >= mDepth){
         usleep(100);
     }
 //    mtx.lock();
-    mRingBuffer[mInputCounter] = data;
-    mRingBufferSizes[mInputCounter] = size;
-    mRingBufferTags[mInputCounter] = 1;
+    long slot = mInputCounter & (mRingSize - 1);
+    mRingBuffer[slot] = data;
+    mRingBufferSizes[slot] = size;
+    mRingBufferTags[slot] = 1;
     mInputCounter++;
 //    mtx.unlock();
 }
@@ -152,7 +176,11 @@ void WriterThread::deleteWriter() {
 
 void WriterThread::initWriter(string filename1) {
     deleteWriter();
-    mWriter1 = new Writer(filename1, compression);
+    if (mOptions != NULL && mOptions->asyncWrite) {
+        mWriter1 = new Writer(filename1, compression, mOptions->ioDepth, mOptions->directIO);
+    } else {
+        mWriter1 = new Writer(filename1, compression);
+    }
 }
 
 void WriterThread::initWriter(ofstream *stream) {
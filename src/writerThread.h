@@ -13,6 +13,7 @@
 #include "readerwriterqueue.h"
 #include "util.h"
 #include "options.h"
+#include "profiler.h"
 
 using namespace std;
 
@@ -40,6 +41,9 @@ public:
 
     void output(moodycamel::ReaderWriterQueue<pair<int, pair<char *, int>>> *Q);
 
+    //drops the queued buffers, keeps the producers of a failed job from blocking
+    void discard();
+
     void input(char *data, size_t size);
 
     void inputFromMerge(char *data, size_t size);
@@ -54,6 +58,8 @@ public:
 private:
     void deleteWriter();
 
+    void initRing(int depth);
+
 private:
     Writer *mWriter1;
     int compression;
@@ -65,9 +71,13 @@ private:
     bool mInputCompleted;
     atomic_long mInputCounter;
     atomic_long mOutputCounter;
+    //ring of the queued output buffers, indexed by counter & (mRingSize - 1)
     char **mRingBuffer;
     size_t *mRingBufferSizes;
     int *mRingBufferTags;
+    long mRingSize;
+    //max number of queued buffers before input() blocks
+    int mDepth;
 public:
     const atomic_long &GetMInputCounter() const;
 